@@ -73,6 +73,11 @@ printf("stdout='%s'\n", stdout);
 printf("stderr='%s'\n", stderr);
 printf("local=%d remote=%d command=%d\n\n", local, remote, command)
 
+# We can process the output of a command as it arrives
+printf("\nlocal, remote, command = $target.test_and_stream_results('ls -l /etc') { |chunk| ... }\n")
+local, remote, command = $target.test_and_stream_results('ls -l /etc') { |chunk| printf("chunk of %d bytes\n", chunk.length) }
+printf("local=%d remote=%d command=%d\n\n", local, remote, command)
+
 # We can inject a local file into the remote system
 printf("\nlocal, remote = $target.inject_file('/etc/services', 'test.txt')\n")
 local, remote = $target.inject_file('/etc/services', 'test.txt')
@@ -0,0 +1,422 @@
+/*
+ * Microbenchmarks for the buffer, framing and dissect code paths.
+ *
+ * These run in-process, without any transport. Each benchmark executes
+ * a fixed number of iterations, and we report the time and the number
+ * of CPU cycles spent per iteration.
+ *
+ * Copyright (C) 2014-2015 SUSE
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <x86intrin.h>
+#endif
+
+#include "twopence.h"
+#include "protocol.h"
+#include "socket.h"
+
+struct bench {
+	const char *	name;
+	unsigned long	iterations;
+	unsigned int	bytes_per_op;	/* for computing throughput; 0 if not meaningful */
+
+	void		(*setup)(void);
+	void		(*run)(unsigned long iterations);
+	void		(*cleanup)(void);
+};
+
+/* Results are accumulated here so that the compiler cannot
+ * optimize away the work we're trying to time */
+static volatile unsigned long	bench_sink;
+
+static twopence_buf_t *		bench_buf;
+static twopence_sock_t *	bench_sock;
+static twopence_command_t	bench_cmd;
+static twopence_protocol_state_t bench_ps = { .cid = 1, .xid = 42 };
+
+static inline unsigned long long
+bench_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static inline double
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+/*
+ * Build a data packet the way the transaction code does
+ */
+static twopence_buf_t *
+bench_data_packet_new(unsigned int payload_len)
+{
+	twopence_buf_t *bp;
+
+	bp = twopence_buf_new(TWOPENCE_PROTO_MAX_PACKET);
+	twopence_buf_reserve_head(bp, TWOPENCE_PROTO_HEADER_SIZE + 2);
+	twopence_buf_advance_tail(bp, payload_len);
+	twopence_protocol_build_data_header(bp, &bench_ps, 1);
+	return bp;
+}
+
+static void
+bench_free_buffer(void)
+{
+	twopence_buf_free(bench_buf);
+	bench_buf = NULL;
+}
+
+/*
+ * twopence_buf_append: append small chunks to a large buffer
+ */
+static void
+bench_buf_append_setup(void)
+{
+	bench_buf = twopence_buf_new(65536);
+}
+
+static void
+bench_buf_append(unsigned long iterations)
+{
+	static const char chunk[64];
+	unsigned long i;
+
+	for (i = 0; i < iterations; ++i) {
+		if (twopence_buf_tailroom(bench_buf) < sizeof(chunk)) {
+			twopence_buf_truncate(bench_buf, 0);
+			twopence_buf_reset(bench_buf);
+		}
+		twopence_buf_append(bench_buf, chunk, sizeof(chunk));
+	}
+	bench_sink += twopence_buf_count(bench_buf);
+}
+
+/*
+ * twopence_buf_pull: consume a full buffer in small pieces
+ */
+static void
+bench_buf_pull(unsigned long iterations)
+{
+	unsigned long i;
+
+	for (i = 0; i < iterations; ++i) {
+		const char *p;
+
+		if ((p = twopence_buf_pull(bench_buf, 16)) == NULL) {
+			twopence_buf_reset(bench_buf);
+			twopence_buf_advance_tail(bench_buf, twopence_buf_tailroom(bench_buf));
+			p = twopence_buf_pull(bench_buf, 16);
+		}
+		bench_sink += p[0];
+	}
+}
+
+/*
+ * twopence_buf_compact: move the pending data to the start of the buffer,
+ * like we do on a receive buffer that has a partial packet left in it.
+ */
+static void
+bench_buf_compact_setup(void)
+{
+	bench_buf = twopence_buf_new(65536);
+	twopence_buf_advance_tail(bench_buf, 1024);
+}
+
+static void
+bench_buf_compact(unsigned long iterations)
+{
+	unsigned long i;
+
+	for (i = 0; i < iterations; ++i) {
+		twopence_buf_advance_tail(bench_buf, 64);
+		twopence_buf_advance_head(bench_buf, 64);
+		twopence_buf_compact(bench_buf);
+	}
+	bench_sink += twopence_buf_count(bench_buf);
+}
+
+/*
+ * twopence_buf_index: search for a string at the end of a buffer,
+ * like chat_expect does.
+ */
+static void
+bench_buf_index_setup(void)
+{
+	bench_buf = twopence_buf_new(4096);
+	memset(twopence_buf_tail(bench_buf), 'a', 4096);
+	twopence_buf_advance_tail(bench_buf, 4096 - 8);
+	twopence_buf_append(bench_buf, "password", 8);
+}
+
+static void
+bench_buf_index(unsigned long iterations)
+{
+	unsigned long i;
+
+	for (i = 0; i < iterations; ++i)
+		bench_sink += twopence_buf_index(bench_buf, "password");
+}
+
+/*
+ * twopence_protocol_build_data_header: frame 1K of command output
+ */
+static void
+bench_build_data_header_setup(void)
+{
+	bench_buf = twopence_buf_new(TWOPENCE_PROTO_MAX_PACKET);
+}
+
+static void
+bench_build_data_header(unsigned long iterations)
+{
+	unsigned long i;
+
+	for (i = 0; i < iterations; ++i) {
+		twopence_buf_truncate(bench_buf, 0);
+		twopence_buf_reset(bench_buf);
+		twopence_buf_reserve_head(bench_buf, TWOPENCE_PROTO_HEADER_SIZE + 2);
+		twopence_buf_advance_tail(bench_buf, 1024);
+		twopence_protocol_build_data_header(bench_buf, &bench_ps, 1);
+	}
+	bench_sink += twopence_buf_count(bench_buf);
+}
+
+/*
+ * A receive buffer holding lots of data packets back to back
+ */
+#define BENCH_NUM_PACKETS	64
+#define BENCH_PACKET_PAYLOAD	256
+
+static void
+bench_packets_setup(void)
+{
+	unsigned int i;
+
+	bench_buf = twopence_buf_new(BENCH_NUM_PACKETS * (TWOPENCE_PROTO_HEADER_SIZE + 2 + BENCH_PACKET_PAYLOAD));
+	for (i = 0; i < BENCH_NUM_PACKETS; ++i) {
+		twopence_buf_t *bp;
+
+		bp = bench_data_packet_new(BENCH_PACKET_PAYLOAD);
+		twopence_buf_append(bench_buf, twopence_buf_head(bp), twopence_buf_count(bp));
+		twopence_buf_free(bp);
+	}
+}
+
+static void
+bench_dissect_ps(unsigned long iterations)
+{
+	unsigned long i;
+
+	for (i = 0; i < iterations; ++i) {
+		const twopence_hdr_t *hdr;
+		twopence_protocol_state_t ps;
+		twopence_buf_t payload;
+
+		if (twopence_buf_count(bench_buf) == 0)
+			bench_buf->head = 0;
+
+		hdr = twopence_protocol_dissect_ps(bench_buf, &payload, &ps);
+		bench_sink += hdr->type + ps.xid;
+	}
+}
+
+static void
+bench_buffer_complete(unsigned long iterations)
+{
+	unsigned long i;
+
+	for (i = 0; i < iterations; ++i)
+		bench_sink += twopence_protocol_buffer_complete(bench_buf);
+}
+
+/*
+ * twopence_protocol_build_command_packet: serialize a command with
+ * a typical environment
+ */
+static void
+bench_command_packet_setup(void)
+{
+	unsigned int i;
+
+	twopence_command_init(&bench_cmd, "/usr/bin/some-test --with-argument");
+	bench_cmd.user = "root";
+	bench_cmd.timeout = 60;
+	for (i = 0; i < 20; ++i) {
+		char name[32], value[64];
+
+		snprintf(name, sizeof(name), "TEST_VARIABLE_%u", i);
+		snprintf(value, sizeof(value), "/some/path/value/for/variable/%u", i);
+		twopence_command_setenv(&bench_cmd, name, value);
+	}
+}
+
+static void
+bench_command_packet(unsigned long iterations)
+{
+	unsigned long i;
+
+	for (i = 0; i < iterations; ++i) {
+		twopence_buf_t *bp;
+
+		bp = twopence_protocol_build_command_packet(&bench_ps, &bench_cmd);
+		bench_sink += twopence_buf_count(bp);
+		twopence_buf_free(bp);
+	}
+}
+
+static void
+bench_command_packet_cleanup(void)
+{
+	twopence_command_destroy(&bench_cmd);
+}
+
+/*
+ * Socket xmit queue: queue packets and drain them again.
+ * The socket writes to /dev/null, so this includes the cost of
+ * one write() per packet.
+ */
+#define BENCH_QUEUE_DEPTH	32
+
+static void
+bench_xmit_queue_setup(void)
+{
+	int fd;
+
+	fd = open("/dev/null", O_WRONLY);
+	bench_sock = twopence_sock_new(fd);
+
+	bench_buf = bench_data_packet_new(1024);
+}
+
+static void
+bench_xmit_queue(unsigned long iterations)
+{
+	unsigned long i;
+
+	for (i = 0; i < iterations; ++i) {
+		twopence_sock_xmit_shared(bench_sock, bench_buf);
+
+		if ((i % BENCH_QUEUE_DEPTH) == BENCH_QUEUE_DEPTH - 1) {
+			while (twopence_sock_xmit_queue_bytes(bench_sock))
+				twopence_sock_send_queued(bench_sock);
+		}
+	}
+
+	while (twopence_sock_xmit_queue_bytes(bench_sock))
+		twopence_sock_send_queued(bench_sock);
+}
+
+static void
+bench_xmit_queue_cleanup(void)
+{
+	twopence_sock_free(bench_sock);
+	bench_sock = NULL;
+	bench_free_buffer();
+}
+
+static struct bench	bench_table[] = {
+	{ "buf_append(64)",	10000000, 64,	bench_buf_append_setup, bench_buf_append, bench_free_buffer },
+	{ "buf_pull(16)",	10000000, 16,	bench_buf_append_setup, bench_buf_pull, bench_free_buffer },
+	{ "buf_compact(1K)",	1000000, 1024,	bench_buf_compact_setup, bench_buf_compact, bench_free_buffer },
+	{ "buf_index(4K)",	100000,	4096,	bench_buf_index_setup, bench_buf_index, bench_free_buffer },
+	{ "build_data_header",	10000000, 0,	bench_build_data_header_setup, bench_build_data_header, bench_free_buffer },
+	{ "dissect_ps",		10000000, 0,	bench_packets_setup, bench_dissect_ps, bench_free_buffer },
+	{ "buffer_complete",	10000000, 0,	bench_packets_setup, bench_buffer_complete, bench_free_buffer },
+	{ "build_command_packet", 100000, 0,	bench_command_packet_setup, bench_command_packet, bench_command_packet_cleanup },
+	{ "sock_xmit_queue(1K)", 1000000, 1024,	bench_xmit_queue_setup, bench_xmit_queue, bench_xmit_queue_cleanup },
+
+	{ NULL }
+};
+
+static void
+bench_run(struct bench *b, double scale)
+{
+	unsigned long long c0, c1;
+	unsigned long iterations;
+	double t0, t1, elapsed;
+
+	iterations = b->iterations * scale;
+	if (iterations == 0)
+		iterations = 1;
+
+	if (b->setup)
+		b->setup();
+
+	/* Warm up caches and the allocator */
+	b->run(iterations / 10 + 1);
+
+	t0 = bench_now();
+	c0 = bench_cycles();
+	b->run(iterations);
+	c1 = bench_cycles();
+	t1 = bench_now();
+
+	if (b->cleanup)
+		b->cleanup();
+
+	elapsed = t1 - t0;
+	printf("%-24s %10lu %10.1f %10.1f", b->name, iterations,
+			1e9 * elapsed / iterations,
+			(double) (c1 - c0) / iterations);
+	if (b->bytes_per_op && elapsed > 0)
+		printf(" %10.1f", (double) b->bytes_per_op * iterations / elapsed / (1024 * 1024));
+	printf("\n");
+}
+
+int
+main(int argc, char **argv)
+{
+	struct bench *b;
+	double scale = 1.0;
+	int i;
+
+	/* Usage: twopence-bench [scale [name-prefix ...]]
+	 * The scale factor is applied to the number of iterations, eg 0.1 for
+	 * a quick run. */
+	if (argc > 1 && argv[1][0] != '\0' && strtod(argv[1], NULL) > 0)
+		scale = strtod(argv[1], NULL);
+
+	printf("%-24s %10s %10s %10s %10s\n", "benchmark", "iterations", "ns/op", "cycles/op", "MB/s");
+	for (b = bench_table; b->name; ++b) {
+		bool selected = (argc <= 2);
+
+		for (i = 2; i < argc; ++i) {
+			if (!strncmp(argv[i], b->name, strlen(argv[i])))
+				selected = true;
+		}
+		if (selected)
+			bench_run(b, scale);
+	}
+
+	return 0;
+}
@@ -18,10 +18,13 @@
  */
 
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <ctype.h>
+#include <limits.h>
+#include <unistd.h>
 #include <assert.h>
 
 #include "twopence.h"
@@ -42,10 +45,77 @@ twopence_buf_init_static(twopence_buf_t *bp, void *data, size_t len)
 	bp->tail = len;
 }
 
+static inline size_t
+twopence_buf_pagealign(size_t size)
+{
+	size_t pagesize = sysconf(_SC_PAGESIZE);
+
+	return (size + pagesize - 1) & ~(pagesize - 1);
+}
+
+/*
+ * Back the buffer with an anonymous mapping rather than the heap.
+ * Pages are only populated as they are written to, so this can be used to
+ * reserve room for large amounts of output up front. Growing the buffer
+ * later on remaps the pages instead of copying them.
+ */
+bool
+twopence_buf_init_mapped(twopence_buf_t *bp, size_t size)
+{
+	void *base;
+
+	memset(bp, 0, sizeof(*bp));
+
+	size = twopence_buf_pagealign(size);
+	if (size == 0 || size > UINT_MAX)
+		return false;
+
+	base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (base == MAP_FAILED)
+		return false;
+
+	bp->base = base;
+	bp->size = size;
+	bp->mapped = 1;
+	return true;
+}
+
+/*
+ * Buffers that can carry a reference to data which goes out on the wire
+ * after the buffer's contents, but is not copied into it, such as a slice
+ * of a mapped file. The reference is released when the buffer is destroyed.
+ *
+ * The reference lives in a wrapper rather than in twopence_buf_t itself,
+ * so that the layout of the public struct does not change.
+ */
+typedef struct twopence_refbuf {
+	twopence_buf_t		buf;
+	struct {
+		const char *	data;
+		unsigned int	len;
+		void		(*release)(void *);
+		void *		cookie;
+	} ref;
+} twopence_refbuf_t;
+
+static inline twopence_refbuf_t *
+twopence_buf_to_refbuf(const twopence_buf_t *bp)
+{
+	if (!bp->has_ref)
+		return NULL;
+	return (twopence_refbuf_t *) bp;
+}
+
 void
 twopence_buf_destroy(twopence_buf_t *bp)
 {
-	if (bp->dynamic)
+	twopence_refbuf_t *rbp = twopence_buf_to_refbuf(bp);
+
+	if (rbp && rbp->ref.release)
+		rbp->ref.release(rbp->ref.cookie);
+	if (bp->mapped)
+		munmap(bp->base, bp->size);
+	else if (bp->dynamic)
 		free(bp->base);
 	twopence_buf_init(bp);
 }
@@ -61,14 +131,33 @@ twopence_buf_new(size_t size)
 	return bp;
 }
 
+/*
+ * Allocate a buffer that can have data attached by reference
+ */
+twopence_buf_t *
+twopence_buf_new_ref(size_t size)
+{
+	twopence_refbuf_t *rbp;
+
+	rbp = twopence_calloc(1, sizeof(*rbp) + size);
+	rbp->buf.base = (char *)(rbp + 1);
+	rbp->buf.size = size;
+	rbp->buf.has_ref = 1;
+	return &rbp->buf;
+}
+
 twopence_buf_t *
 twopence_buf_clone(twopence_buf_t *bp)
 {
+	twopence_refbuf_t *rbp = twopence_buf_to_refbuf(bp);
 	unsigned int count = bp->tail - bp->head;
 	twopence_buf_t *clone;
 
-	clone = twopence_buf_new(count);
+	/* Referenced data is copied into the clone */
+	clone = twopence_buf_new(twopence_buf_count_total(bp));
 	twopence_buf_append(clone, bp->base + bp->head, count);
+	if (rbp && rbp->ref.len)
+		twopence_buf_append(clone, rbp->ref.data, rbp->ref.len);
 	return clone;
 }
 
@@ -109,6 +198,63 @@ twopence_buf_count(const twopence_buf_t *bp)
 	return bp->tail - bp->head;
 }
 
+/*
+ * Count the buffer's contents plus any referenced data
+ */
+unsigned int
+twopence_buf_count_total(const twopence_buf_t *bp)
+{
+	twopence_refbuf_t *rbp = twopence_buf_to_refbuf(bp);
+
+	return bp->tail - bp->head + (rbp? rbp->ref.len : 0);
+}
+
+/*
+ * Attach data that should follow the buffer's contents without copying
+ * it. The release function is called with the cookie when the buffer is
+ * destroyed. Only valid for buffers from twopence_buf_new_ref().
+ */
+void
+twopence_buf_attach_ref(twopence_buf_t *bp, const void *data, unsigned int len, void (*release)(void *), void *cookie)
+{
+	twopence_refbuf_t *rbp = twopence_buf_to_refbuf(bp);
+
+	assert(rbp && rbp->ref.data == NULL && rbp->ref.release == NULL);
+	rbp->ref.data = data;
+	rbp->ref.len = len;
+	rbp->ref.release = release;
+	rbp->ref.cookie = cookie;
+}
+
+/*
+ * Return the referenced data that has not been consumed yet
+ */
+const void *
+twopence_buf_ref_data(const twopence_buf_t *bp, unsigned int *lenp)
+{
+	twopence_refbuf_t *rbp = twopence_buf_to_refbuf(bp);
+
+	if (rbp == NULL || rbp->ref.len == 0) {
+		*lenp = 0;
+		return NULL;
+	}
+	*lenp = rbp->ref.len;
+	return rbp->ref.data;
+}
+
+/*
+ * Consume referenced data, once the buffer's own contents are gone
+ */
+void
+twopence_buf_advance_ref(twopence_buf_t *bp, unsigned int len)
+{
+	twopence_refbuf_t *rbp = twopence_buf_to_refbuf(bp);
+
+	assert(rbp && twopence_buf_count(bp) == 0 && len <= rbp->ref.len);
+	rbp->ref.data += len;
+	rbp->ref.len -= len;
+}
+
 void *
 twopence_buf_pull(twopence_buf_t *bp, unsigned int len)
 {
@@ -147,11 +293,33 @@ twopence_buf_resize(twopence_buf_t *bp, unsigned int want_size)
 		for (new_size = BUFFER_MIN_SIZE; new_size < want_size; new_size *= 2)
 			;
 	} else {
-		new_size = want_size;
+		/* Grow big buffers by half their size at least, so that
+		 * capturing large amounts of output does not end up
+		 * reallocating and copying for every packet received. */
+		new_size = bp->size + bp->size / 2;
+		if (new_size < want_size || new_size < bp->size)
+			new_size = want_size;
 	}
 
 	assert(want_size <= new_size);
 
+	if (bp->mapped) {
+		size_t map_size;
+		void *new_base;
+
+		/* Rounding up to a page boundary must not wrap around */
+		map_size = twopence_buf_pagealign(new_size);
+		if (map_size < new_size || map_size > UINT_MAX)
+			return false;
+
+		new_base = mremap(bp->base, bp->size, map_size, MREMAP_MAYMOVE);
+		if (new_base == MAP_FAILED)
+			return false;
+		bp->base = new_base;
+		bp->size = map_size;
+		return true;
+	}
+
 	/* twopence_{m,re}alloc never return a NULL pointer */
 	if (bp->base == NULL || bp->dynamic) {
 		bp->base = twopence_realloc(bp->base, new_size);
@@ -181,7 +349,7 @@ twopence_buf_ensure_tailroom(twopence_buf_t *bp, unsigned int want_tailroom)
 void
 twopence_buf_reserve_head(twopence_buf_t *bp, unsigned int amount)
 {
-	assert(bp->head == bp->tail && bp->size > amount);
+	assert(bp->head == bp->tail && bp->size >= amount);
 	bp->head = bp->tail = amount;
 }
 
@@ -357,3 +525,169 @@ twopence_buf_dump(const twopence_buf_t *bp, unsigned int debuglevel)
 {
 	__twopence_buf_dump(bp, __twopence_buf_dump_print, &debuglevel);
 }
+
+/*
+ * Segmented buffers.
+ *
+ * When capturing lots of command output, growing a contiguous buffer means
+ * copying everything we've received so far each time we run out of room.
+ * A rope instead keeps a chain of chunks, and only copies data when the
+ * caller asks for it in one piece.
+ */
+struct twopence_rope_chunk {
+	twopence_rope_chunk_t *	next;
+	size_t			head;
+	size_t			tail;
+	size_t			size;
+	char			data[];
+};
+
+static twopence_rope_chunk_t *
+twopence_rope_chunk_new(size_t size)
+{
+	twopence_rope_chunk_t *chunk;
+
+	chunk = twopence_malloc(sizeof(*chunk) + size);
+	chunk->next = NULL;
+	chunk->head = chunk->tail = 0;
+	chunk->size = size;
+	return chunk;
+}
+
+void
+twopence_rope_init(twopence_rope_t *rope)
+{
+	memset(rope, 0, sizeof(*rope));
+}
+
+void
+twopence_rope_destroy(twopence_rope_t *rope)
+{
+	twopence_rope_chunk_t *chunk;
+
+	while ((chunk = rope->head) != NULL) {
+		rope->head = chunk->next;
+		free(chunk);
+	}
+	twopence_rope_init(rope);
+}
+
+uint64_t
+twopence_rope_count(const twopence_rope_t *rope)
+{
+	return rope->count;
+}
+
+void
+twopence_rope_append(twopence_rope_t *rope, const void *data, size_t len)
+{
+	twopence_rope_chunk_t *last;
+
+	rope->count += len;
+	while (len) {
+		size_t copy;
+
+		if ((last = rope->last) == NULL || last->tail == last->size) {
+			size_t size;
+
+			/* Start out small, so that capturing a line or two of output
+			 * does not pin a full chunk; then double up to the chunk size. */
+			size = last? 2 * last->size : TWOPENCE_ROPE_MIN_CHUNK;
+			if (size > TWOPENCE_ROPE_CHUNK_SIZE)
+				size = TWOPENCE_ROPE_CHUNK_SIZE;
+
+			last = twopence_rope_chunk_new(size);
+			if (rope->last)
+				rope->last->next = last;
+			else
+				rope->head = last;
+			rope->last = last;
+		}
+
+		copy = last->size - last->tail;
+		if (copy > len)
+			copy = len;
+		memcpy(last->data + last->tail, data, copy);
+		last->tail += copy;
+
+		data = (const char *) data + copy;
+		len -= copy;
+	}
+}
+
+/*
+ * Consume up to len bytes from the front of the rope
+ */
+size_t
+twopence_rope_read(twopence_rope_t *rope, void *data, size_t len)
+{
+	twopence_rope_chunk_t *chunk;
+	size_t total = 0;
+
+	while (len && (chunk = rope->head) != NULL) {
+		size_t copy = chunk->tail - chunk->head;
+
+		if (copy > len)
+			copy = len;
+		memcpy(data, chunk->data + chunk->head, copy);
+		chunk->head += copy;
+
+		data = (char *) data + copy;
+		len -= copy;
+		total += copy;
+
+		if (chunk->head == chunk->tail) {
+			if ((rope->head = chunk->next) == NULL)
+				rope->last = NULL;
+			free(chunk);
+		}
+	}
+
+	rope->count -= total;
+	return total;
+}
+
+/*
+ * Copy the entire contents of the rope to a flat buffer of at least
+ * twopence_rope_count() bytes, without modifying the rope.
+ */
+void
+twopence_rope_copy(const twopence_rope_t *rope, void *data)
+{
+	const twopence_rope_chunk_t *chunk;
+
+	for (chunk = rope->head; chunk; chunk = chunk->next) {
+		memcpy(data, chunk->data + chunk->head, chunk->tail - chunk->head);
+		data = (char *) data + (chunk->tail - chunk->head);
+	}
+}
+
+/*
+ * Return the contents of the rope as one contiguous piece of memory.
+ * This merges all chunks into one; the pointer remains valid until the
+ * rope is modified or destroyed.
+ * Returns NULL if the rope is too large to be mapped in one piece.
+ */
+const void *
+twopence_rope_flatten(twopence_rope_t *rope)
+{
+	twopence_rope_chunk_t *flat;
+
+	if (rope->head == NULL)
+		return "";
+
+	if (rope->head->next != NULL) {
+		if (rope->count > SIZE_MAX - sizeof(*flat))
+			return NULL;
+
+		flat = twopence_rope_chunk_new(rope->count);
+		twopence_rope_copy(rope, flat->data);
+		flat->tail = rope->count;
+
+		twopence_rope_destroy(rope);
+		rope->head = rope->last = flat;
+		rope->count = flat->tail;
+	}
+
+	return rope->head->data + rope->head->head;
+}
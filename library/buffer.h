@@ -23,6 +23,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 typedef struct twopence_buf twopence_buf_t;
 
@@ -31,11 +32,14 @@ struct twopence_buf {
 	unsigned int	head;
 	unsigned int	tail;
 	unsigned int	size;
-	unsigned int	dynamic : 1;
+	unsigned int	dynamic : 1,
+			mapped : 1,
+			has_ref : 1;
 };
 
 extern void		twopence_buf_init(twopence_buf_t *bp);
 extern void		twopence_buf_init_static(twopence_buf_t *bp, void *data, size_t len);
+extern bool		twopence_buf_init_mapped(twopence_buf_t *bp, size_t size);
 extern void		twopence_buf_destroy(twopence_buf_t *bp);
 extern twopence_buf_t *	twopence_buf_new(size_t max_size);
 extern twopence_buf_t *	twopence_buf_clone(twopence_buf_t *bp);
@@ -63,4 +67,28 @@ extern void		twopence_buf_compact(twopence_buf_t *bp);
 extern int		twopence_buf_index(const twopence_buf_t *bp, const char *string);
 extern void		twopence_buf_dump(const twopence_buf_t *bp, unsigned int debuglevel);
 
+/*
+ * A rope is a chain of buffer chunks, used for capturing output of
+ * arbitrary size without having to reallocate and copy.
+ */
+#define TWOPENCE_ROPE_MIN_CHUNK		4096
+#define TWOPENCE_ROPE_CHUNK_SIZE	65536
+
+typedef struct twopence_rope_chunk twopence_rope_chunk_t;
+typedef struct twopence_rope twopence_rope_t;
+
+struct twopence_rope {
+	twopence_rope_chunk_t *	head;
+	twopence_rope_chunk_t *	last;
+	uint64_t		count;
+};
+
+extern void		twopence_rope_init(twopence_rope_t *);
+extern void		twopence_rope_destroy(twopence_rope_t *);
+extern uint64_t		twopence_rope_count(const twopence_rope_t *);
+extern void		twopence_rope_append(twopence_rope_t *, const void *data, size_t len);
+extern size_t		twopence_rope_read(twopence_rope_t *, void *data, size_t len);
+extern void		twopence_rope_copy(const twopence_rope_t *, void *data);
+extern const void *	twopence_rope_flatten(twopence_rope_t *);
+
 #endif /* TWOPENCE_BUFFER_H */
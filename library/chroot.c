@@ -88,7 +88,7 @@ __twopence_chroot_open(struct twopence_pipe_target *pipe_handle)
 
   sigemptyset(&mask);
   sigaddset(&mask, SIGCHLD);
-  sigprocmask(SIG_BLOCK, &mask, &omask);
+  pthread_sigmask(SIG_BLOCK, &mask, &omask);
 
   pid = fork();
   if (pid < 0) {
@@ -133,12 +133,13 @@ __twopence_chroot_open(struct twopence_pipe_target *pipe_handle)
   ret_socket = twopence_sock_new(fd[0]);
 
 out_reset_mask:
-  sigprocmask(SIG_SETMASK, &omask, NULL);
+  pthread_sigmask(SIG_SETMASK, &omask, NULL);
   return ret_socket;
 }
 
 const struct twopence_pipe_ops twopence_chroot_link_ops = {
   .open = __twopence_chroot_open,
+  .multi_link = true,
 };
 
 
@@ -206,7 +207,13 @@ const struct twopence_plugin twopence_chroot_ops = {
 	.interrupt_command = twopence_pipe_interrupt_command,
 	.cancel_transactions = twopence_pipe_cancel_transactions,
 	.disconnect = twopence_pipe_disconnect,
+	.get_server_metrics = twopence_pipe_get_server_metrics,
+	.serve_mux = twopence_pipe_serve_mux,
 	.end = twopence_pipe_end,
+	.count_pollfds = twopence_pipe_count_pollfds,
+	.fill_poll = twopence_pipe_fill_poll,
+	.doio = twopence_pipe_doio,
+	.reap = twopence_pipe_reap,
 };
 
 const struct twopence_plugin twopence_local_ops = {
@@ -224,5 +231,11 @@ const struct twopence_plugin twopence_local_ops = {
 	.interrupt_command = twopence_pipe_interrupt_command,
 	.cancel_transactions = twopence_pipe_cancel_transactions,
 	.disconnect = twopence_pipe_disconnect,
+	.get_server_metrics = twopence_pipe_get_server_metrics,
+	.serve_mux = twopence_pipe_serve_mux,
 	.end = twopence_pipe_end,
+	.count_pollfds = twopence_pipe_count_pollfds,
+	.fill_poll = twopence_pipe_fill_poll,
+	.doio = twopence_pipe_doio,
+	.reap = twopence_pipe_reap,
 };
@@ -64,9 +64,18 @@ struct twopence_connection {
 		struct timeval		recv_deadline;
 	} keepalive;
 
+	/* Optional protocol features negotiated in the HELLO exchange */
+	unsigned int			features;
+
 	/* We may want to have concurrent transactions later on */
 	twopence_transaction_list_t	transactions;
 	twopence_transaction_list_t	done_transactions;
+
+	/* The transaction the send scheduler will look at first */
+	unsigned int			xmit_next_xid;
+
+	/* Set when the connection is part of a pool */
+	twopence_conn_metrics_t *	metrics;
 };
 
 /* When keepalives are enabled, we will shut down the link
@@ -74,6 +83,17 @@ struct twopence_connection {
 #define TWOPENCE_KEEPALIVE_RECV_TIMEOUT	TWOPENCE_PROTO_DEFAULT_KEEPALIVE
 #define TWOPENCE_KEEPALIVE_SEND_TIMEOUT	(TWOPENCE_KEEPALIVE_RECV_TIMEOUT / 4)
 
+/* The send scheduler keeps the socket's queue short, so that control
+ * packets (status, keepalives, interrupts) do not have to wait behind
+ * lots of data */
+#define TWOPENCE_CONN_XMIT_LOWAT	(2 * TWOPENCE_PROTO_MAX_PACKET)
+
+/* Per-round quantum of the send scheduler for each priority class */
+static const unsigned int	twopence_conn_xmit_quantum[__TWOPENCE_TRANSACTION_PRIO_MAX] = {
+	[TWOPENCE_TRANSACTION_PRIO_BULK]	= TWOPENCE_PROTO_MAX_PACKET,
+	[TWOPENCE_TRANSACTION_PRIO_INTERACTIVE]	= 4 * TWOPENCE_PROTO_MAX_PACKET,
+};
+
 static void
 twopence_conn_list_insert(twopence_conn_list_t *list, twopence_conn_t *conn)
 {
@@ -95,9 +115,18 @@ twopence_conn_new(twopence_conn_semantics_t *semantics, twopence_sock_t *client_
 	conn->client_sock = client_sock;
 	conn->client_id = client_id;
 
+	if (client_sock)
+		twopence_sock_enable_packet_trace(client_sock);
+
 	return conn;
 }
 
+void
+twopence_conn_set_features(twopence_conn_t *conn, unsigned int features)
+{
+	conn->features = features & TWOPENCE_PROTO_FEATURES_SUPPORTED;
+}
+
 void
 twopence_conn_set_keepalive(twopence_conn_t *conn, int keepalive)
 {
@@ -209,6 +238,110 @@ twopence_conn_accept(twopence_conn_t *conn)
 	return twopence_sock_accept(conn->client_sock);
 }
 
+/*
+ * Move data queued by the transactions to the socket.
+ * This is a deficit round robin scheduler: in each round, every transaction
+ * with pending data is credited a quantum depending on its priority class,
+ * and may send packets as long as it has credit left.
+ * We stop as soon as the socket has enough data to chew on, and remember
+ * where to pick up next time.
+ */
+static void
+twopence_conn_schedule_xmit(twopence_conn_t *conn)
+{
+	twopence_sock_t *sock = conn->client_sock;
+	twopence_transaction_t *trans;
+	bool pending = true;
+
+	if (sock == NULL || !twopence_sock_xmit_queue_allowed(sock))
+		return;
+
+	if ((trans = twopence_conn_find_transaction(conn, conn->xmit_next_xid)) == NULL)
+		trans = conn->transactions.head;
+
+	while (pending) {
+		pending = false;
+
+		for (; trans; trans = trans->next) {
+			unsigned int count;
+
+			if (trans->xmit.head == NULL) {
+				trans->xmit.deficit = 0;
+				continue;
+			}
+
+			if (twopence_sock_xmit_queue_bytes(sock) >= TWOPENCE_CONN_XMIT_LOWAT) {
+				conn->xmit_next_xid = trans->id;
+				return;
+			}
+
+			trans->xmit.deficit += twopence_conn_xmit_quantum[trans->xmit.prio];
+			while ((count = twopence_transaction_xmit_head_bytes(trans)) != 0
+			    && count <= trans->xmit.deficit) {
+				trans->xmit.deficit -= count;
+				twopence_sock_queue_xmit(sock, twopence_transaction_xmit_dequeue(trans));
+			}
+
+			if (trans->xmit.head != NULL)
+				pending = true;
+			else
+				trans->xmit.deficit = 0;
+		}
+
+		trans = conn->transactions.head;
+	}
+
+	conn->xmit_next_xid = 0;
+}
+
+/*
+ * Hand all data queued by a transaction to the socket, bypassing the
+ * scheduler. This is used when the transaction is done.
+ */
+static void
+twopence_conn_flush_transaction(twopence_conn_t *conn, twopence_transaction_t *trans)
+{
+	twopence_buf_t *bp;
+
+	if (conn->client_sock == NULL)
+		return;
+
+	while ((bp = twopence_transaction_xmit_dequeue(trans)) != NULL)
+		twopence_sock_queue_xmit(conn->client_sock, bp);
+}
+
+static bool
+twopence_conn_xmit_pending(const twopence_conn_t *conn)
+{
+	twopence_transaction_t *trans;
+
+	if (conn->client_sock && twopence_sock_xmit_queue_bytes(conn->client_sock))
+		return true;
+
+	for (trans = conn->transactions.head; trans; trans = trans->next) {
+		if (trans->xmit.head != NULL)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Return the number of pollfds this connection may need at most
+ */
+unsigned int
+twopence_conn_count_pollfds(const twopence_conn_t *conn)
+{
+	twopence_transaction_t *trans;
+	unsigned int count = 1;	/* One socket for the client */
+
+	for (trans = conn->transactions.head; trans; trans = trans->next) {
+		count += twopence_transaction_num_channels(trans);
+		if (trans->pidfd >= 0)
+			count++;
+	}
+	return count;
+}
+
 unsigned int
 twopence_conn_fill_poll(twopence_conn_t *conn, twopence_pollinfo_t *pinfo)
 {
@@ -232,6 +365,8 @@ twopence_conn_fill_poll(twopence_conn_t *conn, twopence_pollinfo_t *pinfo)
 		}
 	}
 
+	twopence_conn_schedule_xmit(conn);
+
 	if ((sock = conn->client_sock) != NULL) {
 		twopence_sock_prepare_poll(sock);
 
@@ -278,15 +413,44 @@ twopence_conn_add_transaction_done(twopence_conn_t *conn, twopence_transaction_t
 twopence_transaction_t *
 twopence_conn_reap_transaction(twopence_conn_t *conn, int wait_for_xid)
 {
-	twopence_transaction_t *rover;
+	twopence_transaction_t *trans;
 
-	for (rover = conn->done_transactions.head; rover != NULL; rover = rover->next) {
-		if (wait_for_xid == 0 || rover->id == wait_for_xid) {
-			twopence_transaction_unlink(rover);
-			return rover;
-		}
-	}
-	return NULL;
+	if (wait_for_xid == 0)
+		trans = conn->done_transactions.head;
+	else
+		trans = twopence_transaction_list_find(&conn->done_transactions, wait_for_xid);
+
+	if (trans != NULL)
+		twopence_transaction_unlink(trans);
+	return trans;
+}
+
+/*
+ * Report how much memory is tied up in buffers on behalf of this connection,
+ * both on the client socket and on the local channels of its transactions.
+ */
+unsigned long
+twopence_conn_buffered_bytes(const twopence_conn_t *conn)
+{
+	const twopence_transaction_t *trans;
+	unsigned long bytes = 0;
+
+	if (conn->client_sock)
+		bytes += twopence_sock_buffered_bytes(conn->client_sock);
+	for (trans = conn->transactions.head; trans; trans = trans->next)
+		bytes += twopence_transaction_buffered_bytes(trans);
+	return bytes;
+}
+
+/*
+ * Check whether an xid is still in use, either by a pending transaction
+ * or by one that has not been reaped yet.
+ */
+bool
+twopence_conn_xid_in_use(const twopence_conn_t *conn, uint16_t xid)
+{
+	return twopence_transaction_list_find(&conn->transactions, xid) != NULL
+	    || twopence_transaction_list_find(&conn->done_transactions, xid) != NULL;
 }
 
 bool
@@ -299,6 +463,13 @@ static void
 twopence_conn_transaction_complete(twopence_conn_t *conn, twopence_transaction_t *trans)
 {
 	twopence_transaction_unlink(trans);
+	twopence_conn_flush_transaction(conn, trans);
+	gettimeofday(&trans->stats.completed, NULL);
+
+	twopence_debug("%s: sent %u bytes in %u packets, at most %u bytes queued",
+			twopence_transaction_describe(trans),
+			trans->stats.nbytes_sent, trans->stats.npackets_sent,
+			trans->stats.max_bytes_queued);
 
 	/* In the server, we're no longer interested in the transaction once
 	 * we're finished with it. On the client side, we do not dispose of it
@@ -335,20 +506,29 @@ twopence_conn_cancel_transactions(twopence_conn_t *conn, int error)
 twopence_transaction_t *
 twopence_conn_find_transaction(twopence_conn_t *conn, uint16_t xid)
 {
-	twopence_transaction_t *trans;
-
-	for (trans = conn->transactions.head; trans; trans = trans->next) {
-		if (trans->id == xid)
-			return trans;
-	}
-
-	return NULL;
+	return twopence_transaction_list_find(&conn->transactions, xid);
 }
 
 twopence_transaction_t *
 twopence_conn_transaction_new(twopence_conn_t *conn, unsigned int type, const twopence_protocol_state_t *ps)
 {
-	return twopence_transaction_new(conn->client_sock, type, ps);
+	twopence_transaction_t *trans;
+
+	trans = twopence_transaction_new(conn->client_sock, type, ps);
+	if (conn->metrics)
+		conn->metrics->transactions_total++;
+	if (conn->features & TWOPENCE_PROTO_FEATURE_CREDIT)
+		twopence_transaction_enable_flow_control(trans);
+	if (conn->features & TWOPENCE_PROTO_FEATURE_STATS)
+		trans->report_stats = true;
+	if (conn->features & TWOPENCE_PROTO_FEATURE_COMPLETE)
+		trans->send_complete = true;
+	if ((conn->features & TWOPENCE_PROTO_FEATURE_INLINE)
+	 && (conn->features & TWOPENCE_PROTO_FEATURE_COMPLETE))
+		trans->inline_xfer = true;
+	if (conn->features & TWOPENCE_PROTO_FEATURE_EARLY_DATA)
+		trans->early_data = true;
+	return trans;
 }
 
 static bool
@@ -357,15 +537,17 @@ twopence_conn_process_hello(twopence_conn_t *conn, const twopence_hdr_t *hdr,
 {
 	unsigned char client_version[2];
 	unsigned int his_keepalive, my_keepalive;
+	unsigned int his_features;
 
-	if (!twopence_protocol_dissect_hello_packet(payload, client_version, &his_keepalive)) {
+	if (!twopence_protocol_dissect_hello_packet(payload, client_version, &his_keepalive, &his_features)) {
 		twopence_debug("bad HELLO packet from client");
 		client_version[0] = client_version[1] = 0;
 		his_keepalive = 0;
+		his_features = 0;
 	}
 
-	twopence_debug("hello/%u received from client (version %u.%u, keepalive=%u)",
-			ps->xid, client_version[0], client_version[1], his_keepalive);
+	twopence_debug("hello/%u received from client (version %u.%u, keepalive=%u, features=0x%x)",
+			ps->xid, client_version[0], client_version[1], his_keepalive, his_features);
 
 	if (his_keepalive == 0xFFFF)
 		his_keepalive = TWOPENCE_PROTO_DEFAULT_KEEPALIVE;
@@ -377,8 +559,11 @@ twopence_conn_process_hello(twopence_conn_t *conn, const twopence_hdr_t *hdr,
 		my_keepalive = his_keepalive;
 	twopence_conn_set_keepalive(conn, my_keepalive);
 
+	/* Use only those features both of us know about */
+	twopence_conn_set_features(conn, his_features);
+
 	twopence_sock_queue_xmit(conn->client_sock,
-			twopence_protocol_build_hello_packet(conn->client_id, my_keepalive));
+			twopence_protocol_build_hello_packet(conn->client_id, my_keepalive, conn->features));
 	return true;
 }
 
@@ -391,7 +576,7 @@ twopence_conn_process_request(twopence_conn_t *conn, const twopence_hdr_t *hdr,
 	if (!conn->semantics || !conn->semantics->process_request)
 		return false;
 
-	trans = twopence_transaction_new(conn->client_sock, hdr->type, ps);
+	trans = twopence_conn_transaction_new(conn, hdr->type, ps);
 	if (!conn->semantics->process_request(trans, payload)) {
 #if 0
 		twopence_debug("bad %s packet in incoming request",
@@ -407,6 +592,7 @@ twopence_conn_process_request(twopence_conn_t *conn, const twopence_hdr_t *hdr,
 	if (!trans->done) {
 		twopence_conn_add_transaction(conn, trans);
 	} else {
+		twopence_conn_flush_transaction(conn, trans);
 		twopence_transaction_free(trans);
 	}
 	return true;
@@ -423,6 +609,10 @@ twopence_conn_process_packet(twopence_conn_t *conn, twopence_buf_t *bp)
 		twopence_protocol_state_t ps;
 		twopence_buf_t payload;
 
+		if (conn->metrics)
+			twopence_protocol_count_packet(&conn->metrics->packets_in, bp);
+		twopence_protocol_trace_packet(TWOPENCE_TRACE_PACKET_IN, bp);
+
 		hdr = twopence_protocol_dissect_ps(bp, &payload, &ps);
 		if (hdr == NULL) {
 			twopence_log_error("%s: received invalid packet\n", __func__);
@@ -457,9 +647,11 @@ twopence_conn_process_packet(twopence_conn_t *conn, twopence_buf_t *bp)
 			case TWOPENCE_PROTO_TYPE_CHAN_DATA:
 			case TWOPENCE_PROTO_TYPE_CHAN_EOF:
 			case TWOPENCE_PROTO_TYPE_INTR:
+			case TWOPENCE_PROTO_TYPE_CHAN_CREDIT:
 				/* Due to bad timing, we may receive the stdin EOF indication from the
 				 * client after the process as exited. In this case, the transaction
-				 * may no longer exist.
+				 * may no longer exist. The same goes for credit the client grants
+				 * while it is still writing out the last chunk of an extracted file.
 				 * However, we do not want to send a duplicate status response,
 				 * so skip the EPROTO thing a few lines down. */
 				break;
@@ -533,7 +725,7 @@ twopence_conn_doio(twopence_conn_t *conn)
 			 * Otherwise, we are really done with this socket and
 			 * can close it.
 			 */
-			if (twopence_sock_xmit_queue_bytes(sock) == 0)
+			if (!twopence_conn_xmit_pending(conn))
 				twopence_sock_mark_dead(sock);
 		}
 
@@ -558,6 +750,8 @@ twopence_conn_doio(twopence_conn_t *conn)
 		}
 	}
 
+	twopence_conn_schedule_xmit(conn);
+
 	/* If anything has been sent down the socket, update our keepalive xmit timer */
 	twopence_conn_update_send_keepalive(conn);
 
@@ -567,6 +761,8 @@ twopence_conn_doio(twopence_conn_t *conn)
 struct twopence_connection_pool {
 	twopence_conn_list_t	connections;
 
+	twopence_conn_metrics_t	metrics;
+
 	struct {
 		void		(*close_connection)(twopence_conn_t *);
 	} callbacks;
@@ -579,9 +775,23 @@ twopence_conn_pool_new(void)
 
 	pool = twopence_calloc(1, sizeof(*pool));
 	pool->callbacks.close_connection = twopence_conn_free;
+	gettimeofday(&pool->metrics.started, NULL);
 	return pool;
 }
 
+void
+twopence_conn_pool_free(twopence_conn_pool_t *pool)
+{
+	twopence_conn_t *conn;
+
+	while ((conn = pool->connections.head) != NULL) {
+		twopence_conn_unlink(conn);
+		if (pool->callbacks.close_connection)
+			pool->callbacks.close_connection(conn);
+	}
+	free(pool);
+}
+
 void
 twopence_conn_pool_set_callback_close_connection(twopence_conn_pool_t *pool, void (*cb)(twopence_conn_t *))
 {
@@ -592,6 +802,32 @@ void
 twopence_conn_pool_add_connection(twopence_conn_pool_t *pool, twopence_conn_t *conn)
 {
 	twopence_conn_list_insert(&pool->connections, conn);
+
+	/* Listening sockets do not count as connections */
+	if (conn->semantics && conn->semantics->doio)
+		return;
+
+	conn->metrics = &pool->metrics;
+	pool->metrics.connections_total++;
+	if (conn->client_sock)
+		twopence_sock_set_xmit_counters(conn->client_sock, &pool->metrics.packets_out);
+}
+
+void
+twopence_conn_pool_get_metrics(const twopence_conn_pool_t *pool, twopence_conn_metrics_t *metrics)
+{
+	const twopence_conn_t *conn;
+	const twopence_transaction_t *trans;
+
+	*metrics = pool->metrics;
+	for (conn = pool->connections.head; conn; conn = conn->next) {
+		if (conn->metrics == NULL)
+			continue;
+		metrics->connections++;
+		for (trans = conn->transactions.head; trans; trans = trans->next)
+			metrics->transactions++;
+		metrics->buffered_bytes += twopence_conn_buffered_bytes(conn);
+	}
 }
 
 bool
@@ -601,17 +837,13 @@ twopence_conn_pool_poll(twopence_conn_pool_t *pool)
 	twopence_conn_t *conn, *next;
 	unsigned int maxfds = 0;
 	sigset_t mask;
+	int nready;
 
 	if (pool->connections.head == NULL)
 		return false;
 
-	for (conn = pool->connections.head; conn; conn = conn->next) {
-		twopence_transaction_t *trans;
-
-		maxfds ++;	/* One socket for the client */
-		for (trans = conn->transactions.head; trans; trans = trans->next)
-			maxfds += twopence_transaction_num_channels(trans);
-	}
+	for (conn = pool->connections.head; conn; conn = conn->next)
+		maxfds += twopence_conn_count_pollfds(conn);
 
 	twopence_pollinfo_init(&poll_info, alloca(maxfds * sizeof(struct pollfd)), maxfds);
 
@@ -634,6 +866,13 @@ twopence_conn_pool_poll(twopence_conn_pool_t *pool)
 			}
 			twopence_debug("connection doesn't wait for anything?!\n");
 		}
+
+		if (conn->client_sock) {
+			unsigned int queued = twopence_sock_xmit_queue_bytes(conn->client_sock);
+
+			if (queued > pool->metrics.xmit_queue_hiwat)
+				pool->metrics.xmit_queue_hiwat = queued;
+		}
 	}
 
 	if (pool->connections.head == NULL) {
@@ -641,11 +880,15 @@ twopence_conn_pool_poll(twopence_conn_pool_t *pool)
 		return false;
 	}
 
-	/* Query the current sigprocmask, and allow SIGCHLD while we're polling */
-	sigprocmask(SIG_BLOCK, NULL, &mask);
+	/* Query the current signal mask, and allow SIGCHLD while we're polling */
+	pthread_sigmask(SIG_BLOCK, NULL, &mask);
 	sigdelset(&mask, SIGCHLD);
 
-	(void) twopence_pollinfo_ppoll(&poll_info, &mask);
+	nready = twopence_pollinfo_ppoll(&poll_info, &mask);
+
+	pool->metrics.poll_iterations++;
+	if (nready == 0)
+		pool->metrics.poll_idle_wakeups++;
 
 	for (conn = pool->connections.head; conn; conn = conn->next) {
 		int rc;
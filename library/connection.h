@@ -21,6 +21,7 @@
 #ifndef CONNECTION_H
 #define CONNECTION_H
 
+#include <sys/time.h>
 #include <stdint.h>
 #include "protocol.h"
 #include "socket.h"
@@ -36,9 +37,34 @@ struct semantics {
 	void		(*end_transaction)(twopence_conn_t *, twopence_transaction_t *);
 };
 
+/*
+ * Counters kept by a connection pool, for all of its connections
+ */
+typedef struct twopence_conn_metrics {
+	struct timeval		started;
+
+	/* These are filled in by twopence_conn_pool_get_metrics() */
+	unsigned int		connections;
+	unsigned int		transactions;
+	unsigned long		buffered_bytes;
+
+	unsigned long		connections_total;
+	unsigned long		transactions_total;
+
+	twopence_packet_counters_t packets_in;
+	twopence_packet_counters_t packets_out;
+
+	unsigned int		xmit_queue_hiwat;
+
+	unsigned long		poll_iterations;
+	unsigned long		poll_idle_wakeups;
+} twopence_conn_metrics_t;
+
 extern twopence_conn_t *	twopence_conn_new(twopence_conn_semantics_t *semantics, twopence_sock_t *sock, unsigned int client_id);
 extern void			twopence_conn_set_keepalive(twopence_conn_t *, int);
+extern void			twopence_conn_set_features(twopence_conn_t *, unsigned int);
 extern void			twopence_conn_free(twopence_conn_t *conn);
+extern unsigned int		twopence_conn_count_pollfds(const twopence_conn_t *conn);
 extern unsigned int		twopence_conn_fill_poll(twopence_conn_t *conn, twopence_pollinfo_t *pinfo);
 extern int			twopence_conn_doio(twopence_conn_t *conn);
 extern bool			twopence_conn_process_packet(twopence_conn_t *conn, twopence_buf_t *bp);
@@ -55,12 +81,16 @@ extern void			twopence_conn_add_transaction(twopence_conn_t *conn, twopence_tran
 extern void			twopence_conn_add_transaction_done(twopence_conn_t *conn, twopence_transaction_t *trans);
 extern twopence_transaction_t *	twopence_conn_reap_transaction(twopence_conn_t *conn, int wait_for);
 extern twopence_transaction_t *	twopence_conn_find_transaction(twopence_conn_t *conn, uint16_t xid);
+extern bool			twopence_conn_xid_in_use(const twopence_conn_t *conn, uint16_t xid);
+extern unsigned long		twopence_conn_buffered_bytes(const twopence_conn_t *conn);
 extern bool			twopence_conn_has_pending_transactions(const twopence_conn_t *conn);
 extern void			twopence_conn_cancel_transactions(twopence_conn_t *conn, int error);
 
 extern twopence_conn_pool_t *	twopence_conn_pool_new(void);
+extern void			twopence_conn_pool_free(twopence_conn_pool_t *pool);
 extern void			twopence_conn_pool_add_connection(twopence_conn_pool_t *pool, twopence_conn_t *conn);
 extern bool			twopence_conn_pool_poll(twopence_conn_pool_t *pool);
 extern void			twopence_conn_pool_set_callback_close_connection(twopence_conn_pool_t *pool, void (*cb)(twopence_conn_t *));
+extern void			twopence_conn_pool_get_metrics(const twopence_conn_pool_t *pool, twopence_conn_metrics_t *);
 
 #endif /* CONNECTION_H */
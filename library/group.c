@@ -0,0 +1,289 @@
+/*
+ * Target groups - run a command on many targets at once
+ *
+ * Copyright (C) 2016 SUSE
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <alloca.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "twopence.h"
+#include "utils.h"
+
+
+typedef struct twopence_group_member twopence_group_member_t;
+struct twopence_group_member {
+	twopence_group_result_t	result;
+
+	twopence_command_t	cmd;
+
+	/* Transaction id of the command while it is running */
+	int			pid;
+};
+
+struct twopence_group {
+	unsigned int		count;
+	twopence_group_member_t **member;
+};
+
+twopence_group_t *
+twopence_group_new(void)
+{
+	return twopence_calloc(1, sizeof(twopence_group_t));
+}
+
+static void
+twopence_group_member_reset(twopence_group_member_t *m)
+{
+	unsigned int i;
+
+	twopence_command_destroy(&m->cmd);
+	for (i = 0; i < __TWOPENCE_IO_MAX; ++i)
+		twopence_buf_destroy(&m->result.buffer[i]);
+
+	memset(&m->result.status, 0, sizeof(m->result.status));
+	m->result.rc = 0;
+	m->pid = 0;
+}
+
+void
+twopence_group_free(twopence_group_t *group)
+{
+	unsigned int i;
+
+	for (i = 0; i < group->count; ++i) {
+		twopence_group_member_t *m = group->member[i];
+
+		/* If the target still has our transaction pending, we must not
+		 * free the buffers it writes to. */
+		if (m->pid)
+			twopence_cancel_transactions(m->result.target);
+		twopence_group_member_reset(m);
+		free(m);
+	}
+	free(group->member);
+	free(group);
+}
+
+/*
+ * Add a target to the group.
+ * The group does not take ownership of the target; the caller has to
+ * make sure it stays around for as long as the group exists.
+ */
+int
+twopence_group_add_target(twopence_group_t *group, twopence_target_t *target)
+{
+	const struct twopence_plugin *ops = target->ops;
+	twopence_group_member_t *m;
+	unsigned int i;
+
+	if (ops->count_pollfds == NULL || ops->fill_poll == NULL
+	 || ops->doio == NULL || ops->reap == NULL)
+		return TWOPENCE_UNSUPPORTED_FUNCTION_ERROR;
+
+	/* We cannot poll the same target twice */
+	for (i = 0; i < group->count; ++i) {
+		if (group->member[i]->result.target == target)
+			return TWOPENCE_PARAMETER_ERROR;
+	}
+
+	m = twopence_calloc(1, sizeof(*m));
+	m->result.target = target;
+
+	group->member = twopence_realloc(group->member, (group->count + 1) * sizeof(group->member[0]));
+	group->member[group->count++] = m;
+	return 0;
+}
+
+unsigned int
+twopence_group_count(const twopence_group_t *group)
+{
+	return group->count;
+}
+
+const twopence_group_result_t *
+twopence_group_result(const twopence_group_t *group, unsigned int index)
+{
+	if (index >= group->count)
+		return NULL;
+	return &group->member[index]->result;
+}
+
+/*
+ * Build the per-target copy of the command.
+ * Output is always captured in the member's result buffers.
+ */
+static void
+twopence_group_command_init(twopence_group_member_t *m, const twopence_command_t *tmpl)
+{
+	twopence_command_t *cmd = &m->cmd;
+	unsigned int i;
+
+	twopence_command_init(cmd, tmpl->command);
+	cmd->user = tmpl->user;
+	cmd->timeout = tmpl->timeout;
+	cmd->request_tty = tmpl->request_tty;
+	cmd->background = true;
+	twopence_env_copy(&cmd->env, &tmpl->env);
+
+	twopence_command_ostreams_reset(cmd);
+	for (i = TWOPENCE_STDOUT; i <= TWOPENCE_STDERR; ++i)
+		twopence_iostream_add_substream(&cmd->iostream[i],
+				twopence_substream_new_buffer(&m->result.buffer[i], true));
+}
+
+/*
+ * Reap all commands that have completed.
+ * Returns the number of commands that are still pending.
+ */
+static unsigned int
+twopence_group_reap(twopence_group_t *group)
+{
+	unsigned int i, npending = 0;
+
+	for (i = 0; i < group->count; ++i) {
+		twopence_group_member_t *m = group->member[i];
+		twopence_target_t *target = m->result.target;
+		int rc;
+
+		if (m->pid == 0)
+			continue;
+
+		rc = target->ops->reap(target, m->pid, &m->result.status);
+		if (rc == 0) {
+			npending++;
+			continue;
+		}
+
+		twopence_debug("%s: command %d completed, rc=%d", target->ops->name, m->pid, rc);
+		if (rc < 0)
+			m->result.rc = rc;
+		m->pid = 0;
+	}
+
+	return npending;
+}
+
+/*
+ * One iteration of the event loop. We collect the fds of all targets
+ * with pending commands, poll them in one go, and let each target
+ * process whatever is ready.
+ */
+static int
+twopence_group_poll(twopence_group_t *group)
+{
+	twopence_pollinfo_t poll_info;
+	unsigned int i, maxfds = 0;
+	sigset_t mask;
+
+	for (i = 0; i < group->count; ++i) {
+		twopence_group_member_t *m = group->member[i];
+
+		if (m->pid)
+			maxfds += m->result.target->ops->count_pollfds(m->result.target);
+	}
+
+	twopence_pollinfo_init(&poll_info, alloca(maxfds * sizeof(struct pollfd)), maxfds);
+	twopence_timers_update_timeout(&poll_info.timeout);
+
+	for (i = 0; i < group->count; ++i) {
+		twopence_group_member_t *m = group->member[i];
+
+		if (m->pid)
+			m->result.target->ops->fill_poll(m->result.target, &poll_info);
+	}
+
+	/* Query the current signal mask, and allow SIGCHLD while we're polling */
+	pthread_sigmask(SIG_BLOCK, NULL, &mask);
+	sigdelset(&mask, SIGCHLD);
+
+	if (twopence_pollinfo_ppoll(&poll_info, &mask) < 0 && errno != EINTR) {
+		twopence_log_error("%s: poll failed: %m", __func__);
+		return TWOPENCE_INTERNAL_ERROR;
+	}
+
+	for (i = 0; i < group->count; ++i) {
+		twopence_group_member_t *m = group->member[i];
+		twopence_target_t *target = m->result.target;
+		int rc;
+
+		if (m->pid == 0)
+			continue;
+
+		if ((rc = target->ops->doio(target)) < 0) {
+			twopence_log_error("%s: error when processing IO: %s", target->ops->name, twopence_strerror(rc));
+			twopence_cancel_transactions(target);
+		}
+	}
+
+	twopence_timers_run();
+	return 0;
+}
+
+int
+twopence_group_run(twopence_group_t *group, const twopence_command_t *tmpl)
+{
+	unsigned int i, nfailed = 0;
+	int rc;
+
+	if (tmpl->command == NULL || *tmpl->command == '\0')
+		return TWOPENCE_PARAMETER_ERROR;
+
+	/* Start the command on all targets */
+	for (i = 0; i < group->count; ++i) {
+		twopence_group_member_t *m = group->member[i];
+
+		if (m->pid) {
+			twopence_log_error("%s: group is already running a command", __func__);
+			return TWOPENCE_PARAMETER_ERROR;
+		}
+
+		twopence_group_member_reset(m);
+		twopence_group_command_init(m, tmpl);
+
+		rc = twopence_run_test(m->result.target, &m->cmd, &m->result.status);
+		if (rc < 0)
+			m->result.rc = rc;
+		else if (rc == 0)
+			m->result.rc = TWOPENCE_SEND_COMMAND_ERROR;
+		else
+			m->pid = rc;
+	}
+
+	while (twopence_group_reap(group) != 0) {
+		if ((rc = twopence_group_poll(group)) < 0) {
+			for (i = 0; i < group->count; ++i) {
+				if (group->member[i]->pid)
+					twopence_cancel_transactions(group->member[i]->result.target);
+			}
+		}
+	}
+
+	for (i = 0; i < group->count; ++i) {
+		twopence_group_result_t *res = &group->member[i]->result;
+
+		if (res->rc < 0 || res->status.major || res->status.minor)
+			nfailed++;
+	}
+
+	return nfailed;
+}
@@ -18,16 +18,25 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 */
 
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <stdio.h>
 #include <string.h>
 #include <malloc.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "twopence.h"
 #include "utils.h"
 
+typedef struct twopence_file_map twopence_file_map_t;
+
+/* Files smaller than this are read, not mapped */
+#define TWOPENCE_IOSTREAM_MMAP_MIN		(64 * 1024)
+/* How far ahead of the send position we ask the kernel to read */
+#define TWOPENCE_IOSTREAM_MMAP_READAHEAD	(2 * 1024 * 1024)
+
 
 typedef struct twopence_io_ops twopence_io_ops_t;
 struct twopence_io_ops {
@@ -37,6 +46,7 @@ struct twopence_io_ops {
 	int			(*set_blocking)(twopence_substream_t *, bool);
 	int			(*getfd)(twopence_substream_t *);
 	long			(*filesize)(twopence_substream_t *);
+	int			(*read_ref)(twopence_substream_t *, twopence_buf_t *, size_t);
 };
 
 struct twopence_substream {
@@ -50,6 +60,16 @@ struct twopence_substream {
 	        int		fd;
 		bool		close;
 	    };
+	    struct {
+		twopence_output_fn_t *callback;
+		void *		user_data;
+	    };
+	    twopence_rope_t *	rope;
+	    struct {
+		twopence_file_map_t *map;
+		size_t		pos;
+		size_t		readahead;
+	    };
 	};
 };
 
@@ -93,6 +113,34 @@ twopence_iostream_open_file(const char *filename, twopence_iostream_t **ret)
 	return __twopence_iostream_open_file(filename, O_RDONLY, 0, ret);
 }
 
+/*
+ * Like twopence_iostream_open_file, but map large files so that their
+ * pages can be sent without copying them. Only use this for files that
+ * nobody truncates while they are being sent; a truncation is noticed
+ * before each chunk and makes the read fail, but one that races with
+ * the send itself still results in SIGBUS.
+ */
+int
+twopence_iostream_open_mapped(const char *filename, twopence_iostream_t **ret)
+{
+  twopence_substream_t *substream;
+  int fd;
+
+  fd = open(filename, O_RDONLY);
+  if (fd == -1)
+    return errno == ENAMETOOLONG?  TWOPENCE_PARAMETER_ERROR: TWOPENCE_LOCAL_FILE_ERROR;
+
+  if ((substream = twopence_substream_new_mmap(fd)) != NULL)
+    close(fd);
+  else
+    substream = twopence_substream_new_fd(fd, true);
+
+  *ret = twopence_iostream_new();
+  twopence_iostream_add_substream(*ret, substream);
+
+  return 0;
+}
+
 int
 twopence_iostream_create_file(const char *filename, unsigned int permissions, twopence_iostream_t **ret)
 {
@@ -115,6 +163,14 @@ twopence_iostream_wrap_buffer(twopence_buf_t *bp, bool resizable, twopence_iostr
   return 0;
 }
 
+int
+twopence_iostream_wrap_rope(twopence_rope_t *rope, twopence_iostream_t **ret)
+{
+  *ret = twopence_iostream_new();
+  twopence_iostream_add_substream(*ret, twopence_substream_new_rope(rope));
+  return 0;
+}
+
 void
 twopence_iostream_add_substream(twopence_iostream_t *stream, twopence_substream_t *substream)
 {
@@ -328,6 +384,62 @@ twopence_iostream_read(twopence_iostream_t *stream, char *data, size_t len)
   return 0;
 }
 
+/*
+ * Check whether we can read from the stream by reference
+ */
+bool
+twopence_iostream_can_read_ref(const twopence_iostream_t *stream)
+{
+  unsigned int i;
+
+  if (stream->eof)
+    return false;
+
+  for (i = 0; i < stream->count; ++i) {
+    twopence_substream_t *substream = stream->substream[i];
+
+    if (substream->ops == NULL || substream->ops->read == NULL)
+      continue;
+    return substream->ops->read_ref != NULL;
+  }
+  return false;
+}
+
+/*
+ * Instead of copying up to len bytes of data, attach a reference to
+ * it to the buffer. Only valid if twopence_iostream_can_read_ref()
+ * returned true.
+ */
+int
+twopence_iostream_read_ref(twopence_iostream_t *stream, twopence_buf_t *bp, size_t len)
+{
+  unsigned int i;
+
+  if (stream->eof || stream->count == 0)
+    return 0;
+
+  for (i = 0; i < stream->count; ++i) {
+    twopence_substream_t *substream = stream->substream[i];
+    int n;
+
+    if (substream->ops == NULL || substream->ops->read == NULL)
+      continue;
+
+    if (substream->ops->read_ref == NULL)
+      return -1;
+
+    n = substream->ops->read_ref(substream, bp, len);
+    if (n != 0)
+      return n;
+
+    // This substream is at its EOF
+    twopence_substream_close(substream);
+  }
+
+  stream->eof = true;
+  return 0;
+}
+
 twopence_buf_t *
 twopence_iostream_read_all(twopence_iostream_t *stream)
 {
@@ -493,6 +605,329 @@ twopence_substream_new_buffer(twopence_buf_t *bp, bool resizable)
   return io;
 }
 
+/*
+ * Pushback substreams are buffer substreams that own their buffer
+ */
+static void
+twopence_substream_pushback_close(twopence_substream_t *substream)
+{
+  if (substream->buffer) {
+    twopence_buf_free(substream->buffer);
+    substream->buffer = NULL;
+  }
+}
+
+static twopence_io_ops_t twopence_pushback_io = {
+	.close		= twopence_substream_pushback_close,
+	.read		= twopence_substream_buffer_read,
+	.set_blocking	= twopence_substream_buffer_set_blocking,
+	.filesize	= twopence_substream_buffer_size,
+};
+
+/*
+ * Put data that was read from the stream back in front of it.
+ * The stream takes ownership of the buffer.
+ */
+int
+twopence_iostream_unread(twopence_iostream_t *stream, twopence_buf_t *bp)
+{
+  if (stream->count >= TWOPENCE_IOSTREAM_MAX_SUBSTREAMS)
+    return -1;
+
+  memmove(stream->substream + 1, stream->substream, stream->count * sizeof(stream->substream[0]));
+  stream->substream[0] = __twopence_substream_new(&twopence_pushback_io);
+  stream->substream[0]->buffer = bp;
+  stream->count++;
+  stream->eof = false;
+  return 0;
+}
+
+/*
+ * Rope substreams.
+ * Unlike buffer substreams, these accept any amount of data without
+ * copying what has been captured already.
+ */
+static int
+twopence_substream_rope_write(twopence_substream_t *sink, const void *data, size_t len)
+{
+  twopence_rope_append(sink->rope, data, len);
+  return len;
+}
+
+static int
+twopence_substream_rope_read(twopence_substream_t *src, void *data, size_t len)
+{
+  return twopence_rope_read(src->rope, data, len);
+}
+
+static long
+twopence_substream_rope_size(twopence_substream_t *src)
+{
+  return twopence_rope_count(src->rope);
+}
+
+static twopence_io_ops_t twopence_rope_io = {
+	.read		= twopence_substream_rope_read,
+	.write		= twopence_substream_rope_write,
+	.set_blocking	= twopence_substream_buffer_set_blocking,
+	.filesize	= twopence_substream_rope_size,
+};
+
+twopence_substream_t *
+twopence_substream_new_rope(twopence_rope_t *rope)
+{
+  twopence_substream_t *io;
+
+  io = __twopence_substream_new(&twopence_rope_io);
+  io->rope = rope;
+  return io;
+}
+
+/*
+ * Mapped file substreams.
+ * Data read from these can be sent by reference rather than being
+ * copied into packet buffers.
+ *
+ * Mappings are shared; if the same file is injected to several targets
+ * at the same time, all of them will send from the same pages. Each
+ * packet that references a mapping holds a reference on it.
+ */
+struct twopence_file_map {
+	twopence_file_map_t *	next;
+	unsigned int		refcount;
+
+	dev_t			dev;
+	ino_t			ino;
+	off_t			size;
+	struct timespec		mtime;
+
+	void *			base;
+	int			fd;	/* to notice truncation */
+};
+
+static twopence_file_map_t *	twopence_file_maps;
+static pthread_mutex_t		twopence_file_maps_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static twopence_file_map_t *
+twopence_file_map_get(int fd, const struct stat *stb)
+{
+  twopence_file_map_t *map;
+
+  pthread_mutex_lock(&twopence_file_maps_lock);
+  for (map = twopence_file_maps; map; map = map->next) {
+    if (map->dev == stb->st_dev && map->ino == stb->st_ino
+     && map->size == stb->st_size
+     && map->mtime.tv_sec == stb->st_mtim.tv_sec
+     && map->mtime.tv_nsec == stb->st_mtim.tv_nsec)
+      break;
+  }
+
+  if (map == NULL) {
+    void *base;
+
+    base = mmap(NULL, stb->st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (base != MAP_FAILED && (fd = dup(fd)) < 0) {
+      munmap(base, stb->st_size);
+      base = MAP_FAILED;
+    }
+    if (base != MAP_FAILED) {
+      madvise(base, stb->st_size, MADV_SEQUENTIAL);
+
+      map = twopence_calloc(1, sizeof(*map));
+      map->dev = stb->st_dev;
+      map->ino = stb->st_ino;
+      map->size = stb->st_size;
+      map->mtime = stb->st_mtim;
+      map->base = base;
+      map->fd = fd;
+
+      map->next = twopence_file_maps;
+      twopence_file_maps = map;
+    }
+  }
+
+  if (map)
+    map->refcount++;
+  pthread_mutex_unlock(&twopence_file_maps_lock);
+  return map;
+}
+
+static void
+twopence_file_map_hold(twopence_file_map_t *map)
+{
+  pthread_mutex_lock(&twopence_file_maps_lock);
+  map->refcount++;
+  pthread_mutex_unlock(&twopence_file_maps_lock);
+}
+
+static void
+twopence_file_map_release(void *cookie)
+{
+  twopence_file_map_t *map = cookie, **pos;
+
+  pthread_mutex_lock(&twopence_file_maps_lock);
+  if (--(map->refcount) == 0) {
+    for (pos = &twopence_file_maps; *pos; pos = &(*pos)->next) {
+      if (*pos == map) {
+        *pos = map->next;
+        break;
+      }
+    }
+    munmap(map->base, map->size);
+    close(map->fd);
+    free(map);
+  }
+  pthread_mutex_unlock(&twopence_file_maps_lock);
+}
+
+static void
+twopence_substream_mmap_close(twopence_substream_t *substream)
+{
+  if (substream->map) {
+    twopence_file_map_release(substream->map);
+    substream->map = NULL;
+  }
+}
+
+// Ask the kernel to read ahead of the position we're sending from
+static void
+twopence_substream_mmap_readahead(twopence_substream_t *src)
+{
+  twopence_file_map_t *map = src->map;
+  size_t size = map->size;
+
+  while (src->readahead < size && src->readahead < src->pos + TWOPENCE_IOSTREAM_MMAP_READAHEAD / 2) {
+    size_t len = TWOPENCE_IOSTREAM_MMAP_READAHEAD;
+
+    if (len > size - src->readahead)
+      len = size - src->readahead;
+    madvise((char *) map->base + src->readahead, len, MADV_WILLNEED);
+    src->readahead += len;
+  }
+}
+
+// Returns how much of len we can read, or -1 if the file was truncated
+// underneath us. Touching the pages beyond its new end would get us SIGBUS.
+static int
+twopence_substream_mmap_avail(twopence_substream_t *src, size_t len)
+{
+  twopence_file_map_t *map = src->map;
+  struct stat stb;
+
+  if (map == NULL)
+    return 0;
+
+  if (len > map->size - src->pos)
+    len = map->size - src->pos;
+
+  if (len && (fstat(map->fd, &stb) < 0 || stb.st_size < (off_t) (src->pos + len))) {
+    twopence_log_error("%s: file was truncated while being sent\n", __func__);
+    errno = EIO;
+    return -1;
+  }
+  return len;
+}
+
+static int
+twopence_substream_mmap_read(twopence_substream_t *src, void *data, size_t len)
+{
+  int n;
+
+  n = twopence_substream_mmap_avail(src, len);
+  if (n > 0) {
+    twopence_substream_mmap_readahead(src);
+    memcpy(data, (char *) src->map->base + src->pos, n);
+    src->pos += n;
+  }
+  return n;
+}
+
+static int
+twopence_substream_mmap_read_ref(twopence_substream_t *src, twopence_buf_t *bp, size_t len)
+{
+  int n;
+
+  n = twopence_substream_mmap_avail(src, len);
+  if (n > 0) {
+    twopence_substream_mmap_readahead(src);
+    twopence_file_map_hold(src->map);
+    twopence_buf_attach_ref(bp, (char *) src->map->base + src->pos, n,
+		    twopence_file_map_release, src->map);
+    src->pos += n;
+  }
+  return n;
+}
+
+static long
+twopence_substream_mmap_size(twopence_substream_t *src)
+{
+  if (src->map == NULL)
+    return -1;
+  return src->map->size;
+}
+
+static twopence_io_ops_t twopence_mmap_io = {
+	.close		= twopence_substream_mmap_close,
+	.read		= twopence_substream_mmap_read,
+	.read_ref	= twopence_substream_mmap_read_ref,
+	.set_blocking	= twopence_substream_buffer_set_blocking,
+	.filesize	= twopence_substream_mmap_size,
+};
+
+/*
+ * Map the file open on fd. Returns NULL if the file is not a regular
+ * file, or too small to be worth it. The caller can close the fd
+ * afterwards.
+ */
+twopence_substream_t *
+twopence_substream_new_mmap(int fd)
+{
+  twopence_substream_t *io;
+  twopence_file_map_t *map;
+  struct stat stb;
+
+  if (fstat(fd, &stb) < 0 || !S_ISREG(stb.st_mode)
+   || stb.st_size < TWOPENCE_IOSTREAM_MMAP_MIN
+   || (unsigned long long) stb.st_size > SIZE_MAX)
+    return NULL;
+
+  if ((map = twopence_file_map_get(fd, &stb)) == NULL)
+    return NULL;
+
+  io = __twopence_substream_new(&twopence_mmap_io);
+  io->map = map;
+  return io;
+}
+
+/*
+ * Callback substreams.
+ * These hand every chunk of data to the caller as it arrives, rather than
+ * accumulating it. Note that the callback is invoked from within the
+ * library's I/O loop; nothing else is received from the target while it
+ * runs.
+ */
+static int
+twopence_substream_callback_write(twopence_substream_t *sink, const void *data, size_t len)
+{
+  sink->callback(data, len, sink->user_data);
+  return len;
+}
+
+static twopence_io_ops_t twopence_callback_io = {
+	.write		= twopence_substream_callback_write,
+};
+
+twopence_substream_t *
+twopence_substream_new_callback(twopence_output_fn_t *callback, void *user_data)
+{
+  twopence_substream_t *io;
+
+  io = __twopence_substream_new(&twopence_callback_io);
+  io->callback = callback;
+  io->user_data = user_data;
+  return io;
+}
+
 /*
  * fd based substreams
  */
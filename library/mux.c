@@ -0,0 +1,632 @@
+/*
+ * Connection multiplexer for targets using the twopence protocol.
+ *
+ * The multiplexer holds one link to the test server, and accepts any
+ * number of clients on a UNIX domain socket. Clients speak the regular
+ * protocol to us (they use the virtio plugin to connect), and we relay
+ * their packets over the shared link, translating client and
+ * transaction IDs in both directions.
+ *
+ * Copyright (C) 2014-2016 SUSE
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+
+#include "twopence.h"
+#include "protocol.h"
+#include "socket.h"
+#include "pipe.h"
+#include "utils.h"
+
+#define TWOPENCE_MUX_MAX_XID	65536
+
+typedef struct twopence_mux_client twopence_mux_client_t;
+typedef struct twopence_mux_trans twopence_mux_trans_t;
+
+/*
+ * A transaction relayed on behalf of a client
+ */
+struct twopence_mux_trans {
+	twopence_mux_trans_t *	next;
+	twopence_mux_client_t *	client;
+	unsigned char		type;
+	uint16_t		client_xid;
+	uint16_t		server_xid;
+};
+
+struct twopence_mux_client {
+	twopence_mux_client_t *	next;
+	twopence_sock_t *	sock;
+	uint16_t		cid;
+	twopence_mux_trans_t *	transactions;
+};
+
+typedef struct twopence_mux {
+	twopence_sock_t *	listener;
+
+	twopence_sock_t *	server;
+	uint16_t		server_cid;
+	unsigned int		features;
+
+	uint16_t		next_cid;
+	uint16_t		next_xid;
+
+	twopence_mux_client_t *	clients;
+
+	/* Indexed by the XID we use on the server link */
+	twopence_mux_trans_t **	xid_map;
+} twopence_mux_t;
+
+/*
+ * Build the default socket path for a target.
+ * Everything but a few harmless characters is percent-encoded, so that
+ * different target specs never map to the same socket.
+ */
+char *
+twopence_mux_socket_path(const char *target_spec)
+{
+	struct sockaddr_un sun;
+	char dirbuf[PATH_MAX], *path, *s;
+	const char *dir, *p;
+
+	if ((dir = getenv("TWOPENCE_MUX_DIR")) == NULL || *dir == '\0') {
+		const char *rundir = getenv("XDG_RUNTIME_DIR");
+
+		if (rundir && rundir[0] == '/')
+			snprintf(dirbuf, sizeof(dirbuf), "%s/twopence-mux", rundir);
+		else
+			snprintf(dirbuf, sizeof(dirbuf), "/tmp/twopence-mux-%u", (unsigned int) getuid());
+		dir = dirbuf;
+	}
+
+	path = twopence_malloc(strlen(dir) + 3 * strlen(target_spec) + 2);
+	s = path + sprintf(path, "%s/", dir);
+	for (p = target_spec; *p; ++p) {
+		if (isalnum((unsigned char) *p) || *p == '.' || *p == '-' || *p == '_')
+			*s++ = *p;
+		else
+			s += sprintf(s, "%%%02X", (unsigned char) *p);
+	}
+	*s = '\0';
+
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		twopence_debug("%s: socket path for %s is too long", __func__, target_spec);
+		free(path);
+		return NULL;
+	}
+	return path;
+}
+
+/*
+ * The directory holding the socket must belong to us, and nobody else
+ * may have access to it. Otherwise, another user could create it first
+ * and impersonate the target.
+ */
+static bool
+__twopence_mux_dir_is_safe(const char *path)
+{
+	struct stat stb;
+	char *dir, *slash;
+	bool safe = false;
+
+	dir = twopence_strdup(path);
+	if ((slash = strrchr(dir, '/')) != NULL && slash != dir)
+		*slash = '\0';
+
+	if (lstat(dir, &stb) < 0) {
+		twopence_debug("%s: %m", dir);
+	} else
+	if (!S_ISDIR(stb.st_mode) || stb.st_uid != getuid() || (stb.st_mode & 077)) {
+		twopence_log_error("%s: not a private directory owned by uid %u, refusing to use it",
+				dir, (unsigned int) getuid());
+	} else {
+		safe = true;
+	}
+
+	free(dir);
+	return safe;
+}
+
+static int
+__twopence_mux_socket(const char *path, struct sockaddr_un *sun)
+{
+	int fd;
+
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_LOCAL;
+	if (strlen(path) >= sizeof(sun->sun_path))
+		return -1;
+	strcpy(sun->sun_path, path);
+
+	fd = socket(PF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		twopence_log_error("unable to create socket: %m");
+	return fd;
+}
+
+/*
+ * Check whether a multiplexer is listening on the given socket
+ */
+bool
+twopence_mux_is_running(const char *path)
+{
+	struct sockaddr_un sun;
+	bool running;
+	int fd;
+
+	if ((fd = __twopence_mux_socket(path, &sun)) < 0)
+		return false;
+
+	running = connect(fd, (struct sockaddr *) &sun, sizeof(sun)) == 0;
+	close(fd);
+	return running;
+}
+
+int
+twopence_target_new_mux(const char *target_spec, twopence_target_t **ret)
+{
+	char *path, *mux_spec;
+	int rc;
+
+	path = twopence_mux_socket_path(target_spec);
+	if (path == NULL || access(path, F_OK) < 0
+	 || !__twopence_mux_dir_is_safe(path)
+	 || !twopence_mux_is_running(path)) {
+		free(path);
+		return twopence_target_new(target_spec, ret);
+	}
+
+	twopence_debug("using multiplexer at %s for %s", path, target_spec);
+	mux_spec = twopence_malloc(strlen(path) + sizeof("virtio:"));
+	sprintf(mux_spec, "virtio:%s", path);
+	rc = twopence_target_new(mux_spec, ret);
+
+	free(mux_spec);
+	free(path);
+	return rc;
+}
+
+int
+twopence_mux_serve(twopence_target_t *target, const char *socket_path)
+{
+	if (target->ops->serve_mux == NULL)
+		return TWOPENCE_UNSUPPORTED_FUNCTION_ERROR;
+
+	return target->ops->serve_mux(target, socket_path);
+}
+
+/*
+ * Create the listening socket. If there's a stale socket left behind
+ * by a multiplexer that died, replace it.
+ */
+static twopence_sock_t *
+__twopence_mux_listen(const char *path)
+{
+	struct sockaddr_un sun;
+	char *dir, *slash;
+	int fd;
+
+	dir = twopence_strdup(path);
+	if ((slash = strrchr(dir, '/')) != NULL && slash != dir) {
+		*slash = '\0';
+		if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+			twopence_log_error("unable to create %s: %m", dir);
+	}
+	free(dir);
+
+	if (!__twopence_mux_dir_is_safe(path))
+		return NULL;
+
+	if (twopence_mux_is_running(path)) {
+		twopence_log_error("%s: a multiplexer is already running", path);
+		return NULL;
+	}
+	unlink(path);
+
+	if ((fd = __twopence_mux_socket(path, &sun)) < 0)
+		return NULL;
+
+	if (bind(fd, (struct sockaddr *) &sun, sizeof(sun)) < 0
+	 || chmod(path, 0600) < 0
+	 || listen(fd, 64) < 0) {
+		twopence_log_error("unable to listen on %s: %m", path);
+		close(fd);
+		return NULL;
+	}
+
+	return twopence_sock_new(fd);
+}
+
+static void
+__twopence_mux_trans_free(twopence_mux_t *mux, twopence_mux_trans_t *mt)
+{
+	twopence_mux_client_t *client = mt->client;
+	twopence_mux_trans_t **pos;
+
+	for (pos = &client->transactions; *pos; pos = &(*pos)->next) {
+		if (*pos == mt) {
+			*pos = mt->next;
+			break;
+		}
+	}
+
+	mux->xid_map[mt->server_xid] = NULL;
+	free(mt);
+}
+
+static twopence_mux_trans_t *
+__twopence_mux_trans_new(twopence_mux_t *mux, twopence_mux_client_t *client, unsigned char type, uint16_t client_xid)
+{
+	twopence_mux_trans_t *mt;
+	unsigned int n;
+
+	/* Find an unused XID. 0 is reserved for packets that do not
+	 * belong to any transaction. */
+	for (n = 0; n < TWOPENCE_MUX_MAX_XID; ++n) {
+		if (++(mux->next_xid) == 0)
+			mux->next_xid = 1;
+		if (mux->xid_map[mux->next_xid] == NULL)
+			break;
+	}
+	if (n >= TWOPENCE_MUX_MAX_XID) {
+		twopence_log_error("multiplexer: too many pending transactions");
+		return NULL;
+	}
+
+	mt = twopence_calloc(1, sizeof(*mt));
+	mt->client = client;
+	mt->type = type;
+	mt->client_xid = client_xid;
+	mt->server_xid = mux->next_xid;
+
+	mt->next = client->transactions;
+	client->transactions = mt;
+	mux->xid_map[mt->server_xid] = mt;
+	return mt;
+}
+
+static twopence_mux_trans_t *
+__twopence_mux_trans_find(twopence_mux_client_t *client, uint16_t client_xid)
+{
+	twopence_mux_trans_t *mt;
+
+	for (mt = client->transactions; mt; mt = mt->next) {
+		if (mt->client_xid == client_xid)
+			return mt;
+	}
+	return NULL;
+}
+
+static void
+__twopence_mux_relay(twopence_sock_t *sock, const twopence_hdr_t *hdr, const twopence_buf_t *payload,
+			unsigned int cid, unsigned int xid)
+{
+	twopence_protocol_state_t ps = { .cid = cid, .xid = xid };
+
+	twopence_sock_queue_xmit(sock, twopence_protocol_build_relay_packet(hdr, payload, &ps));
+}
+
+/*
+ * Handle a packet from one of our clients.
+ * Returns false if the client should be disconnected.
+ */
+static bool
+__twopence_mux_client_packet(twopence_mux_t *mux, twopence_mux_client_t *client,
+			const twopence_hdr_t *hdr, twopence_buf_t *payload, const twopence_protocol_state_t *ps)
+{
+	twopence_mux_trans_t *mt;
+
+	if (hdr->type == TWOPENCE_PROTO_TYPE_HELLO && ps->cid == 0) {
+		unsigned char version[2];
+		unsigned int keepalive, features;
+
+		if (!twopence_protocol_dissect_hello_packet(payload, version, &keepalive, &features))
+			features = 0;
+
+		/* The server applies the features it negotiated with us to
+		 * all transactions on the shared link. A client that lacks
+		 * any of them would stall, or misparse what we relay. */
+		if ((features & mux->features) != mux->features) {
+			twopence_log_error("multiplexer: client %u does not support protocol features 0x%x, refusing it",
+					client->cid, mux->features & ~features);
+			return false;
+		}
+
+		/* We do not do keepalives with our clients; they're local */
+		twopence_sock_queue_xmit(client->sock,
+				twopence_protocol_build_hello_packet(client->cid, 0, mux->features));
+		return true;
+	}
+
+	if (ps->cid != client->cid) {
+		twopence_debug("multiplexer: ignoring packet with mismatched client id");
+		return true;
+	}
+
+	if (hdr->type == TWOPENCE_PROTO_TYPE_KEEPALIVE)
+		return true;
+
+	if ((mt = __twopence_mux_trans_find(client, ps->xid)) == NULL) {
+		switch (hdr->type) {
+		case TWOPENCE_PROTO_TYPE_CHAN_DATA:
+		case TWOPENCE_PROTO_TYPE_CHAN_EOF:
+		case TWOPENCE_PROTO_TYPE_INTR:
+		case TWOPENCE_PROTO_TYPE_CHAN_CREDIT:
+			/* Late packets for a transaction that has completed */
+			return true;
+		}
+
+		if ((mt = __twopence_mux_trans_new(mux, client, hdr->type, ps->xid)) == NULL)
+			return true;
+	}
+
+	__twopence_mux_relay(mux->server, hdr, payload, mux->server_cid, mt->server_xid);
+	return true;
+}
+
+/*
+ * Handle a packet from the server
+ */
+static void
+__twopence_mux_server_packet(twopence_mux_t *mux, const twopence_hdr_t *hdr, twopence_buf_t *payload,
+			const twopence_protocol_state_t *ps)
+{
+	twopence_mux_trans_t *mt;
+	bool done = false;
+	int status;
+
+	if (ps->cid != mux->server_cid || ps->xid == 0)
+		return;
+
+	if ((mt = mux->xid_map[ps->xid]) == NULL)
+		return;
+
+	__twopence_mux_relay(mt->client->sock, hdr, payload, mt->client->cid, mt->client_xid);
+
+	/* Forget about the transaction once the server has completed it */
+	switch (hdr->type) {
+	case TWOPENCE_PROTO_TYPE_MINOR:
+	case TWOPENCE_PROTO_TYPE_COMPLETE:
+	case TWOPENCE_PROTO_TYPE_TIMEOUT:
+		done = true;
+		break;
+
+	case TWOPENCE_PROTO_TYPE_CHAN_EOF:
+		done = (mt->type == TWOPENCE_PROTO_TYPE_EXTRACT);
+		break;
+
+	case TWOPENCE_PROTO_TYPE_MAJOR:
+		/* A non-zero major status on its own ends a transaction. The
+		 * exception are commands, which always get a minor status
+		 * as well. */
+		if (mt->type == TWOPENCE_PROTO_TYPE_EXTRACT)
+			done = true;
+		else if (mt->type != TWOPENCE_PROTO_TYPE_COMMAND)
+			done = twopence_protocol_dissect_major_packet(payload, &status) && status != 0;
+		break;
+	}
+
+	if (done)
+		__twopence_mux_trans_free(mux, mt);
+}
+
+/*
+ * Process all complete packets in a socket's receive buffer
+ */
+static bool
+__twopence_mux_process_incoming(twopence_mux_t *mux, twopence_sock_t *sock, twopence_mux_client_t *client)
+{
+	twopence_buf_t *bp;
+
+	if ((bp = twopence_sock_get_recvbuf(sock)) == NULL)
+		return true;
+
+	while (twopence_protocol_buffer_complete(bp)) {
+		const twopence_hdr_t *hdr;
+		twopence_protocol_state_t ps;
+		twopence_buf_t payload;
+
+		if ((hdr = twopence_protocol_dissect_ps(bp, &payload, &ps)) == NULL) {
+			twopence_log_error("multiplexer: received invalid packet");
+			return false;
+		}
+
+		if (client) {
+			if (!__twopence_mux_client_packet(mux, client, hdr, &payload, &ps))
+				return false;
+		} else
+			__twopence_mux_server_packet(mux, hdr, &payload, &ps);
+	}
+
+	if (twopence_buf_count(bp) == 0)
+		twopence_buf_reset(bp);
+	else if (twopence_buf_tailroom_max(bp) < TWOPENCE_PROTO_MAX_PACKET)
+		twopence_buf_compact(bp);
+
+	return true;
+}
+
+/*
+ * A client went away. Interrupt whatever commands and file transfers
+ * it left behind, so that they do not linger on the server.
+ */
+static void
+__twopence_mux_client_free(twopence_mux_t *mux, twopence_mux_client_t *client)
+{
+	twopence_mux_trans_t *mt;
+
+	twopence_debug("multiplexer: client %u disconnected", client->cid);
+	while ((mt = client->transactions) != NULL) {
+		if (mux->server) {
+			twopence_protocol_state_t ps = { .cid = mux->server_cid, .xid = mt->server_xid };
+
+			twopence_sock_queue_xmit(mux->server,
+					twopence_protocol_build_simple_packet_ps(&ps, TWOPENCE_PROTO_TYPE_INTR));
+		}
+		__twopence_mux_trans_free(mux, mt);
+	}
+
+	twopence_sock_free(client->sock);
+	free(client);
+}
+
+static void
+__twopence_mux_accept(twopence_mux_t *mux)
+{
+	twopence_mux_client_t *client;
+	twopence_sock_t *sock;
+
+	while ((sock = twopence_sock_accept(mux->listener)) != NULL) {
+		client = twopence_calloc(1, sizeof(*client));
+		client->sock = sock;
+
+		/* Client IDs only need to be unique among our clients */
+		if (++(mux->next_cid) == 0)
+			mux->next_cid = 1;
+		client->cid = mux->next_cid;
+
+		client->next = mux->clients;
+		mux->clients = client;
+		twopence_debug("multiplexer: accepted client %u", client->cid);
+	}
+}
+
+/*
+ * Fill the poll info for a socket. Returns false if the socket is dead.
+ */
+static bool
+__twopence_mux_sock_fill_poll(twopence_sock_t *sock, twopence_pollinfo_t *pinfo)
+{
+	if (twopence_sock_is_read_eof(sock) && twopence_sock_xmit_queue_bytes(sock) == 0)
+		twopence_sock_mark_dead(sock);
+	if (twopence_sock_is_dead(sock))
+		return false;
+
+	twopence_sock_prepare_poll(sock);
+	twopence_sock_post_recvbuf_if_needed(sock, 4 * TWOPENCE_PROTO_MAX_PACKET);
+	twopence_sock_fill_poll(sock, pinfo);
+	return true;
+}
+
+static void
+__twopence_mux_destroy(twopence_mux_t *mux)
+{
+	twopence_mux_client_t *client;
+
+	while ((client = mux->clients) != NULL) {
+		mux->clients = client->next;
+		__twopence_mux_client_free(mux, client);
+	}
+	if (mux->server)
+		twopence_sock_free(mux->server);
+	if (mux->listener)
+		twopence_sock_free(mux->listener);
+	free(mux->xid_map);
+}
+
+int
+twopence_pipe_serve_mux(twopence_target_t *opaque_handle, const char *socket_path)
+{
+	struct twopence_pipe_target *handle = (struct twopence_pipe_target *) opaque_handle;
+	unsigned int server_cid;
+	twopence_mux_t mux;
+	int rc = 0;
+
+	memset(&mux, 0, sizeof(mux));
+	mux.xid_map = twopence_calloc(TWOPENCE_MUX_MAX_XID, sizeof(mux.xid_map[0]));
+
+	mux.server = twopence_pipe_open_raw_link(handle, &server_cid, &mux.features);
+	if (mux.server == NULL) {
+		rc = TWOPENCE_OPEN_SESSION_ERROR;
+		goto out;
+	}
+	mux.server_cid = server_cid;
+
+	if ((mux.listener = __twopence_mux_listen(socket_path)) == NULL) {
+		rc = TWOPENCE_OPEN_SESSION_ERROR;
+		goto out;
+	}
+
+	while (true) {
+		twopence_mux_client_t *client, **pos;
+		twopence_pollinfo_t pinfo;
+		unsigned int maxfds = 2;
+
+		for (client = mux.clients; client; client = client->next)
+			maxfds++;
+
+		twopence_pollinfo_init(&pinfo, alloca(maxfds * sizeof(struct pollfd)), maxfds);
+
+		if (!__twopence_mux_sock_fill_poll(mux.server, &pinfo)) {
+			twopence_debug("multiplexer: server closed the link");
+			break;
+		}
+
+		twopence_sock_prepare_poll(mux.listener);
+		twopence_sock_post_recvbuf_if_needed(mux.listener, 1);
+		twopence_sock_fill_poll(mux.listener, &pinfo);
+
+		for (pos = &mux.clients; (client = *pos) != NULL; ) {
+			if (!__twopence_mux_sock_fill_poll(client->sock, &pinfo)) {
+				*pos = client->next;
+				__twopence_mux_client_free(&mux, client);
+				continue;
+			}
+			pos = &client->next;
+		}
+
+		if (twopence_pollinfo_poll(&pinfo) < 0) {
+			if (errno == EINTR)
+				continue;
+			twopence_log_error("multiplexer: poll failed: %m");
+			rc = TWOPENCE_INTERNAL_ERROR;
+			break;
+		}
+
+		if (twopence_sock_doio(mux.server) < 0)
+			twopence_sock_mark_dead(mux.server);
+		if (!__twopence_mux_process_incoming(&mux, mux.server, NULL)) {
+			rc = TWOPENCE_PROTOCOL_ERROR;
+			break;
+		}
+
+		for (client = mux.clients; client; client = client->next) {
+			if (twopence_sock_doio(client->sock) < 0
+			 || !__twopence_mux_process_incoming(&mux, client->sock, client))
+				twopence_sock_mark_dead(client->sock);
+		}
+
+		__twopence_mux_accept(&mux);
+	}
+
+out:
+	if (mux.listener)
+		unlink(socket_path);
+	__twopence_mux_destroy(&mux);
+	return rc;
+}
@@ -29,11 +29,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "pipe.h"
 #include "utils.h"
 
-static int				__twopence_pipe_handshake(twopence_sock_t *sock, unsigned int *client_id, unsigned int *keepalive);
+static int				__twopence_pipe_handshake(twopence_sock_t *sock, unsigned int *client_id, unsigned int *keepalive, unsigned int *features);
 static void				__twopence_pipe_end_transaction(twopence_conn_t *, twopence_transaction_t *);
 
-static twopence_conn_pool_t *		twopence_pipe_connection_pool;
-
 static twopence_conn_semantics_t	twopence_client_semantics = {
 	.end_transaction	= __twopence_pipe_end_transaction,
 };
@@ -76,6 +74,79 @@ _twopence_invalid_username(const char *username)
 /*
  * Wrap the link functions
  */
+static twopence_conn_t *
+__twopence_pipe_connect(struct twopence_pipe_target *handle, unsigned int *client_id)
+{
+  unsigned int keepalive = 0;
+  unsigned int features = TWOPENCE_PROTO_FEATURES_SUPPORTED;
+  twopence_conn_t *conn;
+  twopence_sock_t *sock;
+
+  /* The socket we are given should be set up for blocking I/O */
+  sock = handle->link_ops->open(handle);
+  if (sock == NULL)
+    return NULL;
+
+  if (handle->keepalive < 0)
+    keepalive = 0xFFFF;		/* request keepalive but accept server's pick */
+  else
+    keepalive = handle->keepalive;
+  twopence_debug("using keepalive=%u", (int) keepalive);
+
+  *client_id = 0;
+  if (__twopence_pipe_handshake(sock, client_id, &keepalive, &features) < 0) {
+    twopence_sock_free(sock);
+    return NULL;
+  }
+
+  twopence_debug("handshake complete, my client id is %d, keepalive is %u, features 0x%x", *client_id, keepalive, features);
+  conn = twopence_conn_new(&twopence_client_semantics, sock, *client_id);
+  twopence_conn_set_features(conn, features);
+
+  /* If keepalive is -2, ignore the result of the keepalive negotiation and
+   * force them to off.
+   * This only exists so that we can test that keepalives work */
+  if (handle->keepalive == -2)
+    keepalive = 0;
+
+  twopence_conn_set_keepalive(conn, keepalive);
+
+  if (handle->connection_pool == NULL) {
+    handle->connection_pool = twopence_conn_pool_new();
+    twopence_conn_pool_set_callback_close_connection(handle->connection_pool, NULL);
+  }
+
+  twopence_conn_pool_add_connection(handle->connection_pool, conn);
+  return conn;
+}
+
+/*
+ * Open a link to the server and perform the handshake, but do not wrap
+ * it in a connection. This is for the multiplexer, which relays packets
+ * rather than running transactions of its own.
+ * We disable keepalives, because we cannot tell when our clients go idle.
+ */
+twopence_sock_t *
+twopence_pipe_open_raw_link(struct twopence_pipe_target *handle, unsigned int *client_id, unsigned int *features)
+{
+  unsigned int keepalive = 0;
+  twopence_sock_t *sock;
+
+  sock = handle->link_ops->open(handle);
+  if (sock == NULL)
+    return NULL;
+
+  *client_id = 0;
+  *features = TWOPENCE_PROTO_FEATURES_SUPPORTED;
+  if (__twopence_pipe_handshake(sock, client_id, &keepalive, features) < 0) {
+    twopence_sock_free(sock);
+    return NULL;
+  }
+
+  twopence_debug("raw link established, client id is %u, features 0x%x", *client_id, *features);
+  return sock;
+}
+
 static int
 __twopence_pipe_open_link(struct twopence_pipe_target *handle)
 {
@@ -83,48 +154,55 @@ __twopence_pipe_open_link(struct twopence_pipe_target *handle)
     return TWOPENCE_TRANSPORT_ERROR;
 
   if (handle->connection == NULL) {
-    unsigned int client_id = 0;
-    unsigned int keepalive = 0;
-    twopence_sock_t *sock;
-
-    /* The socket we are given should be set up for blocking I/O */
-    sock = handle->link_ops->open(handle);
-    if (sock == NULL)
-      return TWOPENCE_OPEN_SESSION_ERROR;
+    unsigned int client_id;
 
-    if (handle->keepalive < 0)
-      keepalive = 0xFFFF;		/* request keepalive but accept server's pick */
-    else
-      keepalive = handle->keepalive;
-    twopence_debug("using keepalive=%u", (int) keepalive);
-
-    if (__twopence_pipe_handshake(sock, &client_id, &keepalive) < 0) {
-      twopence_sock_free(sock);
+    handle->connection = __twopence_pipe_connect(handle, &client_id);
+    if (handle->connection == NULL)
       return TWOPENCE_OPEN_SESSION_ERROR;
-    }
 
-    twopence_debug("handshake complete, my client id is %d, keepalive is %u", client_id, keepalive);
-    handle->connection = twopence_conn_new(&twopence_client_semantics, sock, client_id);
     handle->ps.cid = client_id;
     handle->ps.xid = 1;
+  }
+
+  return 0;
+}
 
-    /* If keepalive is -2, ignore the result of the keepalive negotiation and
-     * force them to off.
-     * This only exists so that we can test that keepalives work */
-    if (handle->keepalive == -2)
-      keepalive = 0;
+/*
+ * Return the connection to use for file transfers.
+ * If requested, this is a link of its own, so that bulk transfers do not
+ * hold up commands and chats queued behind them on the main link.
+ */
+static twopence_conn_t *
+__twopence_pipe_open_bulk_link(struct twopence_pipe_target *handle)
+{
+  if (__twopence_pipe_open_link(handle) < 0)
+    return NULL;
 
-    twopence_conn_set_keepalive(handle->connection, keepalive);
+  if (!handle->use_bulk_link)
+    return handle->connection;
 
-    if (twopence_pipe_connection_pool == NULL) {
-      twopence_pipe_connection_pool = twopence_conn_pool_new();
-      twopence_conn_pool_set_callback_close_connection(twopence_pipe_connection_pool, NULL);
-    }
+  /* The bulk link may have been closed by the other end. It holds no
+   * state we care about, so once nothing runs on it any more, replace
+   * it with a fresh one. */
+  if (handle->bulk_connection && twopence_conn_is_closed(handle->bulk_connection)) {
+    if (twopence_conn_has_pending_transactions(handle->bulk_connection))
+      return NULL;
 
-    twopence_conn_pool_add_connection(twopence_pipe_connection_pool, handle->connection);
+    twopence_debug("bulk link was closed, reconnecting");
+    twopence_conn_free(handle->bulk_connection);
+    handle->bulk_connection = NULL;
   }
 
-  return 0;
+  if (handle->bulk_connection == NULL) {
+    handle->bulk_connection = __twopence_pipe_connect(handle, &handle->bulk_client_id);
+    if (handle->bulk_connection == NULL) {
+      twopence_log_warning("%s: unable to open bulk link, sending files over the main link", handle->base.ops->name);
+      handle->use_bulk_link = false;
+      return handle->connection;
+    }
+  }
+
+  return handle->bulk_connection;
 }
 
 /*
@@ -186,17 +264,17 @@ __twopence_pipe_read_packet(twopence_sock_t *sock)
  * Perform the initial exchange of HELLO packets
  */
 static int
-__twopence_pipe_handshake(twopence_sock_t *sock, unsigned int *client_id, unsigned int *line_timeout)
+__twopence_pipe_handshake(twopence_sock_t *sock, unsigned int *client_id, unsigned int *line_timeout, unsigned int *features)
 {
   twopence_buf_t *bp, payload;
   const twopence_hdr_t *hdr;
   twopence_protocol_state_t ps;
   unsigned char server_version[2];
-  unsigned int server_keepalive;
+  unsigned int server_keepalive, server_features;
   int rc = 0;
 
   /* Transmit and free the buffer */
-  rc = twopence_sock_xmit(sock, twopence_protocol_build_hello_packet(0, *line_timeout));
+  rc = twopence_sock_xmit(sock, twopence_protocol_build_hello_packet(0, *line_timeout, *features));
   if (rc < 0)
     return rc;
 
@@ -208,9 +286,9 @@ __twopence_pipe_handshake(twopence_sock_t *sock, unsigned int *client_id, unsign
   memset(&ps, 0, sizeof(ps));
   if ((hdr = twopence_protocol_dissect_ps(bp, &payload, &ps)) != NULL
    && hdr->type == TWOPENCE_PROTO_TYPE_HELLO
-   && twopence_protocol_dissect_hello_packet(&payload, server_version, &server_keepalive)) {
-    twopence_debug("received server HELLO reply: version %u.%u, keepalive=%u",
-		    server_version[0], server_version[1], server_keepalive);
+   && twopence_protocol_dissect_hello_packet(&payload, server_version, &server_keepalive, &server_features)) {
+    twopence_debug("received server HELLO reply: version %u.%u, keepalive=%u, features=0x%x",
+		    server_version[0], server_version[1], server_keepalive, server_features);
     if (server_version[0] != TWOPENCE_PROTOCOL_VERSMAJOR
      || server_version[1] < TWOPENCE_PROTOCOL_VERSMINOR) {
       twopence_log_error("Protocol version not compatible. We use %u.%u, server uses %u.%u",
@@ -220,6 +298,8 @@ __twopence_pipe_handshake(twopence_sock_t *sock, unsigned int *client_id, unsign
     *client_id = ps.cid;
     if (*line_timeout == 0 || server_keepalive < *line_timeout)
       *line_timeout = server_keepalive;
+    /* The server tells us which of our features it is going to use */
+    *features &= server_features;
     rc = 0;
   } else {
     rc = TWOPENCE_PROTOCOL_ERROR;
@@ -228,18 +308,46 @@ __twopence_pipe_handshake(twopence_sock_t *sock, unsigned int *client_id, unsign
   return rc;
 }
 
+static bool
+twopence_pipe_xid_in_use(const struct twopence_pipe_target *handle, uint16_t xid)
+{
+  if (xid == 0)
+    return true;
+  if (handle->connection && twopence_conn_xid_in_use(handle->connection, xid))
+    return true;
+  if (handle->bulk_connection && twopence_conn_xid_in_use(handle->bulk_connection, xid))
+    return true;
+  return false;
+}
+
 /*
  * Wrap command transaction state into a struct.
  * We may want to reuse the server side transaction code here, at some point.
  */
 static twopence_transaction_t *
-twopence_pipe_transaction_new(struct twopence_pipe_target *handle, unsigned int type)
+twopence_pipe_transaction_new(struct twopence_pipe_target *handle, twopence_conn_t *conn, unsigned int type)
 {
+  twopence_protocol_state_t ps;
   twopence_transaction_t *trans;
+  unsigned int tries;
+
+  /* The XIDs are shared by all links, so that they identify a
+   * transaction uniquely. The xid is 16 bits wide, so once we wrap
+   * around, skip 0 and anything that is still in flight or has not
+   * been reaped yet. */
+  for (tries = 0; twopence_pipe_xid_in_use(handle, handle->ps.xid); ++tries) {
+    if (tries >= 65536)
+      return NULL;
+    handle->ps.xid++;
+  }
+
+  ps = handle->ps;
+  if (conn == handle->bulk_connection)
+    ps.cid = handle->bulk_client_id;
 
-  trans = twopence_conn_transaction_new(handle->connection, type, &handle->ps);
+  trans = twopence_conn_transaction_new(conn, type, &ps);
   if (trans)
-	  handle->ps.xid++;
+    handle->ps.xid++;
   return trans;
 }
 
@@ -250,14 +358,10 @@ static void
 __twopence_pipe_local_source_eof(twopence_transaction_t *trans, twopence_trans_channel_t *source)
 {
   uint16_t channel_id = twopence_transaction_channel_id(source);
-  twopence_buf_t *bp;
-  int rc;
 
-  bp = twopence_protocol_build_eof_packet(&trans->ps, channel_id);
-  if ((rc = twopence_sock_xmit(trans->socket, bp)) < 0) {
-    twopence_transaction_set_error(trans, rc);
-    twopence_buf_free(bp);
-  }
+  /* This must not overtake any data still queued to the transaction */
+  twopence_transaction_send_client(trans,
+		  twopence_protocol_build_eof_packet(&trans->ps, channel_id));
 }
 
 
@@ -315,9 +419,9 @@ __twopence_pipe_end_transaction(twopence_conn_t *conn, twopence_transaction_t *t
 }
 
 static void
-__twopence_pipe_transaction_add_running(struct twopence_pipe_target *handle, twopence_transaction_t *trans)
+__twopence_pipe_transaction_add_running(twopence_conn_t *conn, twopence_transaction_t *trans)
 {
-  twopence_conn_add_transaction(handle->connection, trans);
+  twopence_conn_add_transaction(conn, trans);
 }
 
 static twopence_transaction_t *
@@ -326,33 +430,61 @@ __twopence_pipe_get_completed_transaction(struct twopence_pipe_target *handle, i
   return twopence_conn_reap_transaction(handle->connection, xid);
 }
 
+/*
+ * Perform I/O on all links of this target, and report whether
+ * the connection we're waiting on is still alive.
+ */
 int
-__twopence_pipe_doio(struct twopence_pipe_target *handle)
+__twopence_pipe_doio(struct twopence_pipe_target *handle, twopence_conn_t *conn)
 {
-  twopence_conn_pool_poll(twopence_pipe_connection_pool);
-  if (twopence_conn_is_closed(handle->connection))
+  twopence_conn_pool_poll(handle->connection_pool);
+  if (twopence_conn_is_closed(conn))
     return TWOPENCE_TRANSPORT_ERROR;
 
   return 0;
 }
 
+/*
+ * Copy the status of a completed transaction to the caller's status
+ * struct, and dispose of the transaction.
+ */
+static int
+__twopence_pipe_return_status(twopence_transaction_t *trans, twopence_status_t *status)
+{
+  int rc;
+
+  twopence_debug("returning status for transaction %s", twopence_transaction_describe(trans));
+  if (trans->client.exception < 0) {
+    rc = trans->client.exception;
+  } else {
+    status->major = trans->client.status_ret.major;
+    status->minor = trans->client.status_ret.minor;
+    rc = trans->id;
+  }
+
+  status->pid = trans->id;
+  twopence_transaction_get_stats(trans, &status->stats);
+  twopence_transaction_free(trans);
+  return rc;
+}
+
 static int
-__twopence_transaction_run(struct twopence_pipe_target *handle, twopence_transaction_t *trans, twopence_status_t *status)
+__twopence_transaction_run(struct twopence_pipe_target *handle, twopence_conn_t *conn, twopence_transaction_t *trans, twopence_status_t *status)
 {
   int xid = trans->id;
   int rc;
 
   while (true) {
-    if (handle->connection == NULL)
+    if (conn == NULL)
       return TWOPENCE_TRANSPORT_ERROR; /* shouldn't happen */
 
-    if (twopence_conn_reap_transaction(handle->connection, xid) != NULL)
+    if (twopence_conn_reap_transaction(conn, xid) != NULL)
       break;
 
-    if ((rc = __twopence_pipe_doio(handle)) < 0) {
+    if ((rc = __twopence_pipe_doio(handle, conn)) < 0) {
       /* Oops, transport error.
        * Cancel all transaction and mark them as failed */
-      twopence_conn_cancel_transactions(handle->connection, rc);
+      twopence_conn_cancel_transactions(conn, rc);
       continue;
     }
   }
@@ -360,6 +492,7 @@ __twopence_transaction_run(struct twopence_pipe_target *handle, twopence_transac
   status->pid = trans->id;
   status->major = trans->client.status_ret.major;
   status->minor = trans->client.status_ret.minor;
+  twopence_transaction_get_stats(trans, &status->stats);
 
   if (trans->client.exception < 0)
     return trans->client.exception;
@@ -491,7 +624,9 @@ __twopence_pipe_command(struct twopence_pipe_target *handle, twopence_command_t
   if (__twopence_pipe_open_link(handle) < 0)
     return TWOPENCE_OPEN_SESSION_ERROR;
 
-  trans = twopence_pipe_transaction_new(handle, TWOPENCE_PROTO_TYPE_COMMAND);
+  trans = twopence_pipe_transaction_new(handle, handle->connection, TWOPENCE_PROTO_TYPE_COMMAND);
+  if (trans == NULL)
+    return TWOPENCE_OPEN_SESSION_ERROR;
   trans->recv = __twopence_pipe_command_recv;
 
   // Send command packet
@@ -505,7 +640,7 @@ __twopence_pipe_command(struct twopence_pipe_target *handle, twopence_command_t
   twopence_pipe_transaction_attach_stdout(trans, cmd);
   twopence_pipe_transaction_attach_stderr(trans, cmd);
 
-  __twopence_pipe_transaction_add_running(handle, trans);
+  __twopence_pipe_transaction_add_running(handle->connection, trans);
 
   /* If we've been asked to run the command in the background,
    * return its XID now. */
@@ -516,7 +651,7 @@ __twopence_pipe_command(struct twopence_pipe_target *handle, twopence_command_t
   }
 
   handle->current_transaction = trans;
-  rc = __twopence_transaction_run(handle, trans, status_ret);
+  rc = __twopence_transaction_run(handle, handle->connection, trans, status_ret);
   handle->current_transaction = NULL;
 
 out:
@@ -567,8 +702,12 @@ twopence_pipe_chat_recv(twopence_target_t *opaque_handle, int xid, const struct
     return TWOPENCE_TRANSPORT_ERROR;
 
   trans = twopence_conn_find_transaction(handle->connection, xid);
-  if (trans == NULL)
+  if (trans == NULL) {
+    /* A command that has completed but was not reaped yet has no more output */
+    if (twopence_conn_xid_in_use(handle->connection, xid))
+      return 0;
     return TWOPENCE_INVALID_TRANSACTION;
+  }
 
   nreceived = trans->stats.nbytes_received;
   while (!trans->done && nreceived == trans->stats.nbytes_received && trans->local_sink != 0) {
@@ -578,7 +717,7 @@ twopence_pipe_chat_recv(twopence_target_t *opaque_handle, int xid, const struct
       break;
 
     trans->client.chat_deadline = deadline;
-    rc = __twopence_pipe_doio(handle);
+    rc = __twopence_pipe_doio(handle, handle->connection);
     trans->client.chat_deadline = NULL;
 
     if (rc < 0)
@@ -596,6 +735,8 @@ __twopence_pipe_inject_file(struct twopence_pipe_target *handle, twopence_file_x
 {
   twopence_transaction_t *trans;
   twopence_trans_channel_t *channel;
+  twopence_conn_t *conn;
+  long size;
   int rc;
 
   // Check that the username is valid
@@ -605,27 +746,46 @@ __twopence_pipe_inject_file(struct twopence_pipe_target *handle, twopence_file_x
     return TWOPENCE_PARAMETER_ERROR;
 
   // Open communication link
-  if (__twopence_pipe_open_link(handle) < 0)
+  if ((conn = __twopence_pipe_open_bulk_link(handle)) == NULL)
     return TWOPENCE_OPEN_SESSION_ERROR;
 
-  trans = twopence_pipe_transaction_new(handle, TWOPENCE_PROTO_TYPE_INJECT);
+  trans = twopence_pipe_transaction_new(handle, conn, TWOPENCE_PROTO_TYPE_INJECT);
+  if (trans == NULL)
+    return TWOPENCE_OPEN_SESSION_ERROR;
   trans->recv = __twopence_pipe_inject_recv;
 
-  // Send inject command packet
-  if ((rc = twopence_transaction_send_inject(trans, xfer)) < 0)
-    goto out;
+  // Small files are sent along with the request, if the server supports it
+  size = twopence_iostream_filesize(xfer->local_stream);
+  rc = 1;
+  if (trans->inline_xfer && size >= 0 && size <= TWOPENCE_PROTO_INLINE_MAX) {
+    if ((rc = twopence_transaction_send_inject_inline(trans, xfer)) < 0)
+      goto out;
+  }
 
-  channel = twopence_transaction_attach_local_source_stream(trans, 0, xfer->local_stream);
-  if (channel) {
-    twopence_transaction_channel_set_callback_read_eof(channel, __twopence_pipe_local_source_eof);
-    twopence_transaction_channel_set_plugged(channel, true);
+  // Otherwise, or if the file grew in the meantime, send it the regular way
+  if (rc > 0) {
+    // Send inject command packet
+    if ((rc = twopence_transaction_send_inject(trans, xfer)) < 0)
+      goto out;
 
-    trans->client.print_dots = xfer->print_dots;
+    channel = twopence_transaction_attach_local_source_stream(trans, 0, xfer->local_stream);
+    if (channel) {
+      twopence_transaction_channel_set_callback_read_eof(channel, __twopence_pipe_local_source_eof);
+
+      twopence_transaction_channel_set_plugged(channel, true);
+
+      /* If the server allows it, do not wait for it to open the file before
+       * we start sending, but do not send too much either in case it fails */
+      if (trans->early_data)
+        twopence_transaction_channel_set_plug_window(channel, TWOPENCE_TRANSACTION_INJECT_WINDOW);
+
+      trans->client.print_dots = xfer->print_dots;
+    }
   }
 
-  __twopence_pipe_transaction_add_running(handle, trans);
+  __twopence_pipe_transaction_add_running(conn, trans);
 
-  rc = __twopence_transaction_run(handle, trans, status);
+  rc = __twopence_transaction_run(handle, conn, trans, status);
 
 out:
   twopence_transaction_free(trans);
@@ -641,6 +801,7 @@ __twopence_pipe_extract_file(struct twopence_pipe_target *handle, twopence_file_
 {
   twopence_transaction_t *trans;
   twopence_trans_channel_t *sink;
+  twopence_conn_t *conn;
   int rc;
 
   // Check that the username is valid
@@ -650,10 +811,12 @@ __twopence_pipe_extract_file(struct twopence_pipe_target *handle, twopence_file_
     return TWOPENCE_PARAMETER_ERROR;
 
   // Open link for transmitting the command
-  if (__twopence_pipe_open_link(handle) < 0)
+  if ((conn = __twopence_pipe_open_bulk_link(handle)) == NULL)
     return TWOPENCE_OPEN_SESSION_ERROR;
 
-  trans = twopence_pipe_transaction_new(handle, TWOPENCE_PROTO_TYPE_EXTRACT);
+  trans = twopence_pipe_transaction_new(handle, conn, TWOPENCE_PROTO_TYPE_EXTRACT);
+  if (trans == NULL)
+    return TWOPENCE_OPEN_SESSION_ERROR;
   trans->recv = __twopence_pipe_extract_recv;
 
   // Send command packet
@@ -667,12 +830,81 @@ __twopence_pipe_extract_file(struct twopence_pipe_target *handle, twopence_file_
     trans->client.print_dots = xfer->print_dots;
   }
 
-  __twopence_pipe_transaction_add_running(handle, trans);
+  __twopence_pipe_transaction_add_running(conn, trans);
+
+  rc = __twopence_transaction_run(handle, conn, trans, status);
+
+out:
+  twopence_transaction_free(trans);
+  return rc;
+}
+
+/*
+ * Callback function that handles incoming packets for a metrics transaction.
+ */
+static bool
+__twopence_pipe_metrics_recv(twopence_transaction_t *trans, const twopence_hdr_t *hdr, twopence_buf_t *payload)
+{
+  switch (hdr->type) {
+  case TWOPENCE_PROTO_TYPE_MAJOR:
+    /* Servers that do not know about metrics reject the request */
+    (void) twopence_protocol_dissect_major_packet(payload, &trans->client.status_ret.major);
+    twopence_transaction_set_error(trans, TWOPENCE_UNSUPPORTED_FUNCTION_ERROR);
+    break;
+
+  case TWOPENCE_PROTO_TYPE_MINOR:
+    if (!twopence_protocol_dissect_minor_packet(payload, &trans->client.status_ret.minor))
+      goto recv_metrics_error;
+    trans->done = true;
+    break;
+
+  default:
+    goto recv_metrics_error;
+  }
+  return true;
+
+recv_metrics_error:
+  twopence_transaction_set_error(trans, TWOPENCE_RECEIVE_RESULTS_ERROR);
+  return true;
+}
+
+// Retrieve the server's metrics report
+//
+// Returns 0 if everything went fine, or a negative error code if failed
+static int
+__twopence_pipe_get_server_metrics(struct twopence_pipe_target *handle, twopence_buf_t *report)
+{
+  twopence_transaction_t *trans;
+  twopence_iostream_t *stream = NULL;
+  twopence_status_t status;
+  int rc;
+
+  if (__twopence_pipe_open_link(handle) < 0)
+    return TWOPENCE_OPEN_SESSION_ERROR;
+
+  if (twopence_iostream_wrap_buffer(report, true, &stream) < 0)
+    return TWOPENCE_LOCAL_FILE_ERROR;
+
+  trans = twopence_pipe_transaction_new(handle, handle->connection, TWOPENCE_PROTO_TYPE_METRICS);
+  if (trans == NULL) {
+    twopence_iostream_free(stream);
+    return TWOPENCE_OPEN_SESSION_ERROR;
+  }
+  trans->recv = __twopence_pipe_metrics_recv;
+
+  if ((rc = twopence_transaction_send_metrics(trans)) < 0)
+    goto out;
 
-  rc = __twopence_transaction_run(handle, trans, status);
+  twopence_transaction_attach_local_sink_stream(trans, 0, stream);
+
+  __twopence_pipe_transaction_add_running(handle->connection, trans);
+
+  memset(&status, 0, sizeof(status));
+  rc = __twopence_transaction_run(handle, handle->connection, trans, &status);
 
 out:
   twopence_transaction_free(trans);
+  twopence_iostream_free(stream);
   return rc;
 }
 
@@ -684,6 +916,10 @@ __twopence_pipe_disconnect(struct twopence_pipe_target *handle)
     twopence_conn_close(handle->connection);
     twopence_conn_cancel_transactions(handle->connection, TWOPENCE_TRANSPORT_ERROR);
   }
+  if (handle->bulk_connection) {
+    twopence_conn_close(handle->bulk_connection);
+    twopence_conn_cancel_transactions(handle->bulk_connection, TWOPENCE_TRANSPORT_ERROR);
+  }
   return 0;
 }
 
@@ -692,6 +928,8 @@ __twopence_pipe_cancel_transactions(struct twopence_pipe_target *handle)
 {
   if (handle->connection)
     twopence_conn_cancel_transactions(handle->connection, TWOPENCE_COMMAND_CANCELED_ERROR);
+  if (handle->bulk_connection)
+    twopence_conn_cancel_transactions(handle->bulk_connection, TWOPENCE_COMMAND_CANCELED_ERROR);
   return 0;
 }
 
@@ -750,6 +988,17 @@ twopence_pipe_set_option(struct twopence_target *opaque_handle, int option, cons
     handle->keepalive = *(const int *) value_p;
     break;
 
+  case TWOPENCE_TARGET_OPTION_BULK_LINK:
+    if (!handle->link_ops->multi_link)
+      return TWOPENCE_UNSUPPORTED_FUNCTION_ERROR;
+    if (handle->bulk_connection != NULL) {
+      twopence_log_error("%s: cannot change bulk link option; link already established", handle->base.ops->name);
+      return TWOPENCE_UNSUPPORTED_FUNCTION_ERROR;
+    }
+
+    handle->use_bulk_link = !!*(const int *) value_p;
+    break;
+
   default:
     return TWOPENCE_UNSUPPORTED_FUNCTION_ERROR;
 
@@ -793,7 +1042,7 @@ twopence_pipe_wait(struct twopence_target *opaque_handle, int want_pid, twopence
     if (!twopence_conn_has_pending_transactions(handle->connection))
       break;
 
-    rc = __twopence_pipe_doio(handle);
+    rc = __twopence_pipe_doio(handle, handle->connection);
     if (rc < 0)
       return rc;
   }
@@ -801,20 +1050,82 @@ twopence_pipe_wait(struct twopence_target *opaque_handle, int want_pid, twopence
   if (trans == NULL)
     return 0;
 
-  status->pid = trans->id;
+  return __twopence_pipe_return_status(trans, status);
+}
 
-  twopence_debug("%s: returning status for transaction %s", __func__, twopence_transaction_describe(trans));
-  if (trans->client.exception < 0) {
-    rc = trans->client.exception;
-  } else {
-    status->major = trans->client.status_ret.major;
-    status->minor = trans->client.status_ret.minor;
-    rc = trans->id;
+/*
+ * Event loop integration.
+ * These functions allow the caller to drive the I/O of this target from
+ * its own poll loop, together with other targets.
+ */
+unsigned int
+twopence_pipe_count_pollfds(twopence_target_t *opaque_handle)
+{
+  struct twopence_pipe_target *handle = (struct twopence_pipe_target *) opaque_handle;
+  unsigned int count = 0;
+
+  if (handle->connection)
+    count += twopence_conn_count_pollfds(handle->connection);
+  if (handle->bulk_connection)
+    count += twopence_conn_count_pollfds(handle->bulk_connection);
+  return count;
+}
+
+int
+twopence_pipe_fill_poll(twopence_target_t *opaque_handle, struct twopence_pollinfo *pinfo)
+{
+  struct twopence_pipe_target *handle = (struct twopence_pipe_target *) opaque_handle;
+  int count = 0;
+
+  if (handle->connection)
+    count += twopence_conn_fill_poll(handle->connection, pinfo);
+  if (handle->bulk_connection)
+    count += twopence_conn_fill_poll(handle->bulk_connection, pinfo);
+  return count;
+}
+
+static void
+__twopence_pipe_conn_doio(twopence_conn_t *conn)
+{
+  int rc;
+
+  if (!twopence_conn_is_closed(conn) && (rc = twopence_conn_doio(conn)) < 0) {
+    twopence_log_error("%s: error when processing IO, closing connection: %s", __func__, twopence_strerror(rc));
+    twopence_conn_close(conn);
   }
 
-  status->pid = trans->id;
-  twopence_transaction_free(trans);
-  return rc;
+  /* If the link went away, fail all pending transactions */
+  if (twopence_conn_is_closed(conn))
+    twopence_conn_cancel_transactions(conn, TWOPENCE_TRANSPORT_ERROR);
+}
+
+int
+twopence_pipe_doio(twopence_target_t *opaque_handle)
+{
+  struct twopence_pipe_target *handle = (struct twopence_pipe_target *) opaque_handle;
+
+  if (handle->connection)
+    __twopence_pipe_conn_doio(handle->connection);
+  if (handle->bulk_connection)
+    __twopence_pipe_conn_doio(handle->bulk_connection);
+
+  return 0;
+}
+
+int
+twopence_pipe_reap(twopence_target_t *opaque_handle, int want_pid, twopence_status_t *status)
+{
+  struct twopence_pipe_target *handle = (struct twopence_pipe_target *) opaque_handle;
+  twopence_transaction_t *trans;
+
+  if (handle->connection == NULL)
+    return 0;
+
+  trans = __twopence_pipe_get_completed_transaction(handle, want_pid);
+  if (trans == NULL)
+    return 0;
+
+  return __twopence_pipe_return_status(trans, status);
 }
 
 /*
@@ -876,6 +1187,17 @@ twopence_pipe_cancel_transactions(twopence_target_t *opaque_handle)
   return __twopence_pipe_cancel_transactions(handle);
 }
 
+/*
+ * Ask the server for its metrics
+ */
+int
+twopence_pipe_get_server_metrics(twopence_target_t *opaque_handle, twopence_buf_t *report)
+{
+  struct twopence_pipe_target *handle = (struct twopence_pipe_target *) opaque_handle;
+
+  return __twopence_pipe_get_server_metrics(handle, report);
+}
+
 /*
  * Disconnect from the SUT
  */
@@ -906,12 +1228,20 @@ twopence_pipe_end(struct twopence_target *opaque_handle)
 
   twopence_debug("%s()", __func__);
   if (handle->connection != NULL) {
-    /* The connection may still be attached to twopence_pipe_connection_pool,
+    /* The connection may still be attached to our connection pool,
      * but fortunately, twopence_conn_free() takes care of this.
      */
     twopence_conn_free(handle->connection);
     handle->connection = NULL;
   }
+  if (handle->bulk_connection != NULL) {
+    twopence_conn_free(handle->bulk_connection);
+    handle->bulk_connection = NULL;
+  }
+  if (handle->connection_pool != NULL) {
+    twopence_conn_pool_free(handle->connection_pool);
+    handle->connection_pool = NULL;
+  }
 
   free(handle);
 }
@@ -38,6 +38,17 @@ struct twopence_pipe_target {
    * communicate with the server. */
   twopence_conn_t *		connection;
 
+  /* If requested, file transfers are routed over a second link,
+   * so that they do not hold up command and chat traffic */
+  bool				use_bulk_link;
+  twopence_conn_t *		bulk_connection;
+  unsigned int			bulk_client_id;
+
+  /* The pool we poll when waiting for this target's connection.
+   * Each target has its own, so that different targets can be
+   * used from different threads. */
+  twopence_conn_pool_t *	connection_pool;
+
   twopence_protocol_state_t	ps;
 
   /* "foreground" transaction. This is the transaction that gets
@@ -48,11 +59,18 @@ struct twopence_pipe_target {
 
 struct twopence_pipe_ops {
   twopence_sock_t *		(*open)(struct twopence_pipe_target *);
+
+  /* Set if open() can be called several times to establish
+   * additional links to the same server */
+  bool				multi_link;
 };
 
 extern void	twopence_pipe_target_init(struct twopence_pipe_target *, int plugin_type, const struct twopence_plugin *,
 			const struct twopence_pipe_ops *);
 
+extern twopence_sock_t *twopence_pipe_open_raw_link(struct twopence_pipe_target *, unsigned int *client_id, unsigned int *features);
+extern int	twopence_pipe_serve_mux(twopence_target_t *, const char *socket_path);
+
 extern int	twopence_pipe_set_option(struct twopence_target *target, int option, const void *value_p);
 extern int	twopence_pipe_run_test(struct twopence_target *, twopence_command_t *, twopence_status_t *);
 extern int	twopence_pipe_wait(struct twopence_target *, int, twopence_status_t *);
@@ -64,6 +82,11 @@ extern int	twopence_pipe_interrupt_command(struct twopence_target *);
 extern int	twopence_pipe_exit_remote(struct twopence_target *);
 extern int	twopence_pipe_disconnect(twopence_target_t *);
 extern int	twopence_pipe_cancel_transactions(twopence_target_t *);
+extern int	twopence_pipe_get_server_metrics(twopence_target_t *, twopence_buf_t *);
 extern void	twopence_pipe_end(struct twopence_target *);
+extern unsigned int twopence_pipe_count_pollfds(twopence_target_t *);
+extern int	twopence_pipe_fill_poll(twopence_target_t *, struct twopence_pollinfo *);
+extern int	twopence_pipe_doio(twopence_target_t *);
+extern int	twopence_pipe_reap(twopence_target_t *, int, twopence_status_t *);
 
 #endif /* PIPE_H */
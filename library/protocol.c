@@ -81,6 +81,14 @@ twopence_protocol_packet_type_to_string(unsigned int type)
 		return "timeout";
 	case TWOPENCE_PROTO_TYPE_KEEPALIVE:
 		return "keepalive";
+	case TWOPENCE_PROTO_TYPE_CHAN_CREDIT:
+		return "credit";
+	case TWOPENCE_PROTO_TYPE_STATS:
+		return "stats";
+	case TWOPENCE_PROTO_TYPE_METRICS:
+		return "metrics";
+	case TWOPENCE_PROTO_TYPE_COMPLETE:
+		return "complete";
 	default:
 		snprintf(descbuf, sizeof(descbuf), "trans-type-%d", type);
 		return descbuf;
@@ -90,7 +98,7 @@ twopence_protocol_packet_type_to_string(unsigned int type)
 void
 __twopence_protocol_build_header(twopence_buf_t *bp, unsigned char type, unsigned int cid, unsigned int xid)
 {
-	unsigned int len = twopence_buf_count(bp);
+	unsigned int len = twopence_buf_count_total(bp);
 	twopence_hdr_t hdr;
 
 	assert(len < 65536);
@@ -200,6 +208,24 @@ __decode_u32(twopence_buf_t *bp, uint32_t *word)
 	return true;
 }
 
+static inline bool
+__encode_u64(twopence_buf_t *bp, uint64_t word)
+{
+	return __encode_u32(bp, word >> 32)
+	    && __encode_u32(bp, word & 0xFFFFFFFF);
+}
+
+static inline bool
+__decode_u64(twopence_buf_t *bp, uint64_t *word)
+{
+	uint32_t hi, lo;
+
+	if (!__decode_u32(bp, &hi) || !__decode_u32(bp, &lo))
+		return false;
+	*word = ((uint64_t) hi << 32) | lo;
+	return true;
+}
+
 static inline bool
 __encode_string(twopence_buf_t *bp, const char *s)
 {
@@ -307,6 +333,186 @@ twopence_protocol_dissect_eof_packet(twopence_buf_t *bp, uint16_t *channel_ret)
 	return __decode_u16(bp, channel_ret);
 }
 
+twopence_buf_t *
+twopence_protocol_build_credit_packet(const twopence_protocol_state_t *ps, uint16_t channel, unsigned int credit)
+{
+	twopence_buf_t *bp;
+
+	bp = twopence_protocol_command_buffer_new();
+	__encode_u16(bp, channel);
+	__encode_u32(bp, credit);
+	twopence_protocol_push_header_ps(bp, ps, TWOPENCE_PROTO_TYPE_CHAN_CREDIT);
+	return bp;
+}
+
+/*
+ * The STATS packet carries a list of (uint16 key, uint64 value) pairs
+ */
+static bool
+__encode_stats(twopence_buf_t *bp, const twopence_stats_t *stats)
+{
+	return __encode_u16(bp, TWOPENCE_PROTO_STATS_SPAWN_TIME)
+	    && __encode_u64(bp, stats->server_spawn_time)
+	    && __encode_u16(bp, TWOPENCE_PROTO_STATS_RUN_TIME)
+	    && __encode_u64(bp, stats->server_run_time);
+}
+
+twopence_buf_t *
+twopence_protocol_build_stats_packet(const twopence_protocol_state_t *ps, const twopence_stats_t *stats)
+{
+	twopence_buf_t *bp;
+
+	bp = twopence_protocol_command_buffer_new();
+	if (!__encode_stats(bp, stats)) {
+		twopence_buf_free(bp);
+		return NULL;
+	}
+
+	twopence_protocol_push_header_ps(bp, ps, TWOPENCE_PROTO_TYPE_STATS);
+	return bp;
+}
+
+bool
+twopence_protocol_dissect_stats_packet(twopence_buf_t *payload, twopence_stats_t *stats)
+{
+	while (twopence_buf_count(payload)) {
+		uint16_t key;
+		uint64_t value;
+
+		if (!__decode_u16(payload, &key)
+		 || !__decode_u64(payload, &value))
+			return false;
+
+		switch (key) {
+		case TWOPENCE_PROTO_STATS_SPAWN_TIME:
+			stats->server_spawn_time = value;
+			break;
+		case TWOPENCE_PROTO_STATS_RUN_TIME:
+			stats->server_run_time = value;
+			break;
+		}
+	}
+	return true;
+}
+
+/*
+ * The COMPLETE packet:
+ *	uint16 flags
+ *	uint32 major status (if flagged)
+ *	uint32 minor status (if flagged)
+ *	uint16 channel, uint32 length and the data (if flagged)
+ *	uint16 number of channels, followed by the IDs of the channels at EOF
+ *	optional statistics, encoded as in a STATS packet
+ */
+twopence_buf_t *
+twopence_protocol_build_complete_packet(const twopence_protocol_state_t *ps, const twopence_protocol_complete_t *complete)
+{
+	twopence_buf_t *bp;
+	unsigned int flags = 0, i;
+
+	if (complete->have_major)
+		flags |= TWOPENCE_PROTO_COMPLETE_MAJOR;
+	if (complete->have_minor)
+		flags |= TWOPENCE_PROTO_COMPLETE_MINOR;
+	if (complete->have_data)
+		flags |= TWOPENCE_PROTO_COMPLETE_DATA;
+
+	bp = twopence_protocol_command_buffer_new();
+	if (!__encode_u16(bp, flags)
+	 || (complete->have_major && !__encode_u32(bp, complete->major))
+	 || (complete->have_minor && !__encode_u32(bp, complete->minor)))
+		goto failed;
+
+	if (complete->have_data) {
+		if (!__encode_u16(bp, complete->data_channel)
+		 || !__encode_u32(bp, complete->data_len)
+		 || !twopence_buf_append(bp, complete->data, complete->data_len))
+			goto failed;
+	}
+
+	if (!__encode_u16(bp, complete->neof))
+		goto failed;
+
+	for (i = 0; i < complete->neof; ++i) {
+		if (!__encode_u16(bp, complete->eof[i]))
+			goto failed;
+	}
+
+	if (complete->have_stats && !__encode_stats(bp, &complete->stats))
+		goto failed;
+
+	twopence_protocol_push_header_ps(bp, ps, TWOPENCE_PROTO_TYPE_COMPLETE);
+	return bp;
+
+failed:
+	twopence_buf_free(bp);
+	return NULL;
+}
+
+bool
+twopence_protocol_dissect_complete_packet(twopence_buf_t *payload, twopence_protocol_complete_t *complete)
+{
+	uint16_t flags, neof, channel;
+	uint32_t status;
+	unsigned int i;
+
+	memset(complete, 0, sizeof(*complete));
+	if (!__decode_u16(payload, &flags))
+		return false;
+
+	if (flags & TWOPENCE_PROTO_COMPLETE_MAJOR) {
+		if (!__decode_u32(payload, &status))
+			return false;
+		complete->have_major = true;
+		complete->major = status;
+	}
+	if (flags & TWOPENCE_PROTO_COMPLETE_MINOR) {
+		if (!__decode_u32(payload, &status))
+			return false;
+		complete->have_minor = true;
+		complete->minor = status;
+	}
+	if (flags & TWOPENCE_PROTO_COMPLETE_DATA) {
+		uint32_t len;
+
+		if (!__decode_u16(payload, &complete->data_channel)
+		 || !__decode_u32(payload, &len)
+		 || twopence_buf_count(payload) < len)
+			return false;
+		complete->have_data = true;
+		complete->data = twopence_buf_head(payload);
+		complete->data_len = len;
+		twopence_buf_advance_head(payload, len);
+	}
+
+	if (!__decode_u16(payload, &neof) || neof > TWOPENCE_PROTO_COMPLETE_MAX_EOF)
+		return false;
+	for (i = 0; i < neof; ++i) {
+		if (!__decode_u16(payload, &channel))
+			return false;
+		complete->eof[complete->neof++] = channel;
+	}
+
+	if (twopence_buf_count(payload)) {
+		if (!twopence_protocol_dissect_stats_packet(payload, &complete->stats))
+			return false;
+		complete->have_stats = true;
+	}
+	return true;
+}
+
+bool
+twopence_protocol_dissect_credit_packet(twopence_buf_t *payload, uint16_t *channel_ret, unsigned int *credit_ret)
+{
+	uint32_t credit;
+
+	if (!__decode_u16(payload, channel_ret)
+	 || !__decode_u32(payload, &credit))
+		return false;
+	*credit_ret = credit;
+	return true;
+}
+
 twopence_buf_t *
 twopence_protocol_build_uint_packet(unsigned char type, unsigned int value)
 {
@@ -337,8 +543,23 @@ twopence_protocol_build_uint_packet_ps(const twopence_protocol_state_t *ps, unsi
 	return bp;
 }
 
+/*
+ * Copy a packet we received, giving it a different client and transaction ID.
+ * This is used when relaying packets between two links.
+ */
+twopence_buf_t *
+twopence_protocol_build_relay_packet(const twopence_hdr_t *hdr, const twopence_buf_t *payload, const twopence_protocol_state_t *ps)
+{
+	twopence_buf_t *bp;
+
+	bp = twopence_protocol_command_buffer_new();
+	twopence_buf_append(bp, twopence_buf_head(payload), twopence_buf_count(payload));
+	twopence_protocol_push_header_ps(bp, ps, hdr->type);
+	return bp;
+}
+
 twopence_buf_t *
-twopence_protocol_build_hello_packet(unsigned int cid, unsigned int keepalive_timeout)
+twopence_protocol_build_hello_packet(unsigned int cid, unsigned int keepalive_timeout, unsigned int features)
 {
 	struct twopence_protocol_hello_pkt data;
 	twopence_buf_t *bp;
@@ -352,6 +573,7 @@ twopence_protocol_build_hello_packet(unsigned int cid, unsigned int keepalive_ti
 	data.keepalive = htons(keepalive_timeout);
 
 	twopence_buf_append(bp, &data, sizeof(data));
+	__encode_u32(bp, features);
 
 	/* Finalize the header */
 	__twopence_protocol_push_header(bp, TWOPENCE_PROTO_TYPE_HELLO, cid, 0);
@@ -359,9 +581,10 @@ twopence_protocol_build_hello_packet(unsigned int cid, unsigned int keepalive_ti
 }
 
 bool
-twopence_protocol_dissect_hello_packet(twopence_buf_t *payload, unsigned char *version, unsigned int *keepalive)
+twopence_protocol_dissect_hello_packet(twopence_buf_t *payload, unsigned char *version, unsigned int *keepalive, unsigned int *features)
 {
 	struct twopence_protocol_hello_pkt data;
+	uint32_t mask;
 
 	if (!twopence_buf_get(payload, &data, sizeof(data)))
 		return false;
@@ -369,6 +592,11 @@ twopence_protocol_dissect_hello_packet(twopence_buf_t *payload, unsigned char *v
 	version[0] = data.vers_major;
 	version[1] = data.vers_minor;
 	*keepalive = ntohs(data.keepalive);
+
+	/* Older peers do not send a feature mask */
+	if (!__decode_u32(payload, &mask))
+		mask = 0;
+	*features = mask;
 	return true;
 }
 
@@ -392,20 +620,52 @@ twopence_protocol_build_inject_packet(const twopence_protocol_state_t *ps, const
 	return bp;
 }
 
+/*
+ * Build an INJECT packet that carries the entire (small) file.
+ */
+twopence_buf_t *
+twopence_protocol_build_inject_inline_packet(const twopence_protocol_state_t *ps, const twopence_file_xfer_t *xfer,
+				const twopence_buf_t *data)
+{
+	twopence_buf_t *bp;
+
+	bp = twopence_protocol_command_buffer_new();
+
+	if (!__encode_string(bp, xfer->user)
+	 || !__encode_string(bp, xfer->remote.name)
+	 || !__encode_u32(bp, xfer->remote.mode)
+	 || !__encode_u32(bp, TWOPENCE_PROTO_INJECT_INLINE)
+	 || !twopence_buf_append(bp, twopence_buf_head(data), twopence_buf_count(data))) {
+		twopence_buf_free(bp);
+		return NULL;
+	}
+
+	twopence_protocol_push_header_ps(bp, ps, TWOPENCE_PROTO_TYPE_INJECT);
+	return bp;
+}
+
+/*
+ * If the file contents were sent inline, *inline_ret is set and they
+ * are left in the payload buffer.
+ */
 bool
-twopence_protocol_dissect_inject_packet(twopence_buf_t *payload, twopence_file_xfer_t *xfer)
+twopence_protocol_dissect_inject_packet(twopence_buf_t *payload, twopence_file_xfer_t *xfer, bool *inline_ret)
 {
 	const char *user, *file;
-	uint32_t mode;
+	uint32_t mode, flags = 0;
 
 	if (!(user = __decode_string(payload))
 	 || !(file = __decode_string(payload))
 	 || !__decode_u32(payload, &mode))
 		return false;
 
+	if (twopence_buf_count(payload) && !__decode_u32(payload, &flags))
+		return false;
+
 	xfer->user = user;
 	xfer->remote.name = file;
 	xfer->remote.mode = mode;
+	*inline_ret = !!(flags & TWOPENCE_PROTO_INJECT_INLINE);
 	return true;
 }
 
@@ -422,9 +682,9 @@ twopence_protocol_build_command_packet(const twopence_protocol_state_t *ps, cons
 	 || !__encode_string(bp, cmd->command)
 	 || !__encode_u32(bp, cmd->timeout)
 	 || !__encode_u32(bp, cmd->request_tty)
-	 /* reserve two words for future extensions */
-	 || !__encode_u32(bp, 0)
-	 || !__encode_u32(bp, 0))
+	 /* These used to be reserved, and older servers ignore them */
+	 || !__encode_u32(bp, cmd->batch.max_bytes)
+	 || !__encode_u32(bp, cmd->batch.max_delay))
 		goto failed;
 
 	for (i = 0; i < cmd->env.count; ++i) {
@@ -445,17 +705,17 @@ failed:
 }
 
 bool
-twopence_protocol_dissect_command_packet(twopence_buf_t *payload, twopence_command_t *cmd)
+twopence_protocol_dissect_command_packet(twopence_buf_t *payload, twopence_command_t *cmd, twopence_arena_env_t *env)
 {
 	const char *user, *command, *envar;
-	uint32_t timeout, request_tty, reserved;
+	uint32_t timeout, request_tty, batch_bytes, batch_delay;
 
 	if (!(user = __decode_string(payload))
 	 || !(command = __decode_string(payload))
 	 || !__decode_u32(payload, &timeout)
 	 || !__decode_u32(payload, &request_tty)
-	 || !__decode_u32(payload, &reserved)
-	 || !__decode_u32(payload, &reserved))
+	 || !__decode_u32(payload, &batch_bytes)
+	 || !__decode_u32(payload, &batch_delay))
 		return false;
 
 	while ((envar = __decode_string(payload)) != NULL) {
@@ -465,14 +725,24 @@ twopence_protocol_dissect_command_packet(twopence_buf_t *payload, twopence_comma
 			twopence_log_error("ignoring invalid environment variable \"%s\"", envar);
 			continue;
 		}
-		*value++ = '\0';
-		twopence_command_setenv(cmd, envar, value);
+
+		if (env != NULL) {
+			/* Refer to the string in the payload rather than
+			 * copying it; it lives as long as the command does.
+			 * Later definitions replace earlier ones. */
+			twopence_arena_env_set_ref(env, (char *) envar);
+		} else {
+			*value++ = '\0';
+			twopence_command_setenv(cmd, envar, value);
+		}
 	}
 
 	cmd->user = user;
 	cmd->command = command;
 	cmd->timeout = timeout;
 	cmd->request_tty = !!request_tty;
+	cmd->batch.max_bytes = batch_bytes;
+	cmd->batch.max_delay = batch_delay;
 	return true;
 }
 
@@ -547,6 +817,40 @@ twopence_protocol_buffer_complete(const twopence_buf_t *bp)
 	return twopence_protocol_buffer_need_to_recv(bp) == 0;
 }
 
+/*
+ * Account for the packet at the head of the buffer
+ */
+void
+twopence_protocol_count_packet(twopence_packet_counters_t *counters, const twopence_buf_t *bp)
+{
+	const twopence_hdr_t *hdr;
+
+	if (twopence_buf_count(bp) < TWOPENCE_PROTO_HEADER_SIZE)
+		return;
+
+	hdr = (const twopence_hdr_t *) twopence_buf_head(bp);
+	if (hdr->type >= TWOPENCE_PROTO_TYPE_MAX)
+		return;
+
+	counters->packets[hdr->type]++;
+	counters->bytes[hdr->type] += ntohs(hdr->len);
+}
+
+/*
+ * Record the packet at the head of the buffer in the trace ring
+ */
+void
+__twopence_protocol_trace_packet(unsigned int event, const twopence_buf_t *bp)
+{
+	const twopence_hdr_t *hdr;
+
+	if (twopence_buf_count(bp) < TWOPENCE_PROTO_HEADER_SIZE)
+		return;
+
+	hdr = (const twopence_hdr_t *) twopence_buf_head(bp);
+	__twopence_trace_ring_event(event, ntohs(hdr->xid), hdr->type, ntohs(hdr->len));
+}
+
 const twopence_hdr_t *
 twopence_protocol_dissect(twopence_buf_t *bp, twopence_buf_t *payload)
 {
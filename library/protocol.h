@@ -24,6 +24,7 @@
 
 #include <stdint.h>
 #include "twopence.h"
+#include "utils.h"
 
 /*
  * Increase the major number whenever old clients
@@ -60,6 +61,10 @@ struct header {
 #define TWOPENCE_PROTO_TYPE_MINOR	'm'
 #define TWOPENCE_PROTO_TYPE_TIMEOUT	'T'
 #define TWOPENCE_PROTO_TYPE_KEEPALIVE	'K'
+#define TWOPENCE_PROTO_TYPE_CHAN_CREDIT	'W'
+#define TWOPENCE_PROTO_TYPE_STATS	'S'
+#define TWOPENCE_PROTO_TYPE_METRICS	'r'
+#define TWOPENCE_PROTO_TYPE_COMPLETE	'F'
 
 typedef struct twopence_protocol_state {
 	uint16_t	cid;
@@ -74,6 +79,75 @@ struct twopence_protocol_hello_pkt {
 	uint16_t	keepalive;
 } __attribute((packed));
 
+/*
+ * Optional protocol features. Each side appends a uint32 feature mask
+ * to its HELLO packet; the server replies with the subset it is willing
+ * to use. Peers that do not know about features simply ignore the
+ * trailing bytes, and never send any.
+ */
+#define TWOPENCE_PROTO_FEATURE_CREDIT	0x0001	/* per-channel flow control */
+#define TWOPENCE_PROTO_FEATURE_STATS	0x0002	/* server sends STATS before the final status */
+#define TWOPENCE_PROTO_FEATURE_COMPLETE	0x0004	/* server completes transactions with a single COMPLETE */
+#define TWOPENCE_PROTO_FEATURE_INLINE	0x0008	/* small files travel inside the request or the COMPLETE */
+#define TWOPENCE_PROTO_FEATURE_EARLY_DATA 0x0010	/* inject data may precede the server's major status */
+
+#define TWOPENCE_PROTO_FEATURES_SUPPORTED (TWOPENCE_PROTO_FEATURE_CREDIT | TWOPENCE_PROTO_FEATURE_STATS | \
+					   TWOPENCE_PROTO_FEATURE_COMPLETE | TWOPENCE_PROTO_FEATURE_INLINE | \
+					   TWOPENCE_PROTO_FEATURE_EARLY_DATA)
+
+/* Files up to this size are transferred inline, if negotiated */
+#define TWOPENCE_PROTO_INLINE_MAX	16384
+
+/* Flags following the file mode of an INJECT packet */
+#define TWOPENCE_PROTO_INJECT_INLINE	0x0001	/* the file contents follow */
+
+/* Keys used in STATS packets. Receivers ignore keys they do not know. */
+enum {
+	TWOPENCE_PROTO_STATS_SPAWN_TIME = 1,
+	TWOPENCE_PROTO_STATS_RUN_TIME = 2,
+};
+
+/*
+ * The COMPLETE packet replaces the trailing sequence of chan_eof, major,
+ * stats and minor packets that finishes a transaction.
+ */
+#define TWOPENCE_PROTO_COMPLETE_MAJOR	0x0001
+#define TWOPENCE_PROTO_COMPLETE_MINOR	0x0002
+#define TWOPENCE_PROTO_COMPLETE_DATA	0x0004
+
+#define TWOPENCE_PROTO_COMPLETE_MAX_EOF	4
+
+typedef struct twopence_protocol_complete {
+	bool		have_major;
+	bool		have_minor;
+	bool		have_stats;
+	int		major;
+	int		minor;
+
+	/* The last chunk of data on a channel (inline extract) */
+	bool		have_data;
+	uint16_t	data_channel;
+	const void *	data;
+	unsigned int	data_len;
+
+	unsigned int	neof;
+	uint16_t	eof[TWOPENCE_PROTO_COMPLETE_MAX_EOF];
+
+	twopence_stats_t stats;
+} twopence_protocol_complete_t;
+
+/* Per packet type counters, used for the server metrics */
+#define TWOPENCE_PROTO_TYPE_MAX		128
+
+typedef struct twopence_packet_counters {
+	unsigned long	packets[TWOPENCE_PROTO_TYPE_MAX];
+	unsigned long	bytes[TWOPENCE_PROTO_TYPE_MAX];
+} twopence_packet_counters_t;
+
+/* With flow control, this is how much data each side may send on a
+ * channel before it has to wait for the peer to grant more credit */
+#define TWOPENCE_PROTO_CHANNEL_WINDOW	(8 * TWOPENCE_PROTO_MAX_PACKET)
+
 extern const char *	twopence_protocol_packet_type_to_string(unsigned int type);
 extern void		twopence_protocol_build_header(twopence_buf_t *bp, unsigned char type);
 extern void		twopence_protocol_push_header(twopence_buf_t *bp, unsigned char type);
@@ -83,22 +157,40 @@ extern twopence_buf_t *	twopence_protocol_build_simple_packet(unsigned char type
 extern twopence_buf_t *	twopence_protocol_build_simple_packet_ps(twopence_protocol_state_t *, unsigned char);
 extern twopence_buf_t *	twopence_protocol_build_major_packet(twopence_protocol_state_t *ps, int status);
 extern twopence_buf_t *	twopence_protocol_build_minor_packet(twopence_protocol_state_t *ps, int status);
-extern twopence_buf_t *	twopence_protocol_build_hello_packet(unsigned int cid, unsigned int keepalive_interval);
+extern twopence_buf_t *	twopence_protocol_build_relay_packet(const twopence_hdr_t *, const twopence_buf_t *, const twopence_protocol_state_t *);
+extern twopence_buf_t *	twopence_protocol_build_hello_packet(unsigned int cid, unsigned int keepalive_interval, unsigned int features);
 extern twopence_buf_t *	twopence_protocol_build_data_header(twopence_buf_t *, twopence_protocol_state_t *, uint16_t);
 extern twopence_buf_t *	twopence_protocol_build_eof_packet(twopence_protocol_state_t *, uint16_t);
+extern twopence_buf_t *	twopence_protocol_build_credit_packet(const twopence_protocol_state_t *, uint16_t, unsigned int);
+extern twopence_buf_t *	twopence_protocol_build_stats_packet(const twopence_protocol_state_t *, const twopence_stats_t *);
+extern twopence_buf_t *	twopence_protocol_build_complete_packet(const twopence_protocol_state_t *, const twopence_protocol_complete_t *);
 extern twopence_buf_t *	twopence_protocol_build_inject_packet(const twopence_protocol_state_t *ps, const twopence_file_xfer_t *);
+extern twopence_buf_t *	twopence_protocol_build_inject_inline_packet(const twopence_protocol_state_t *ps, const twopence_file_xfer_t *,
+				const twopence_buf_t *data);
 extern twopence_buf_t *	twopence_protocol_build_extract_packet(const twopence_protocol_state_t *ps, const twopence_file_xfer_t *);
 extern twopence_buf_t *	twopence_protocol_build_command_packet(const twopence_protocol_state_t *ps, const twopence_command_t *);
 extern twopence_buf_t *	twopence_protocol_recv_buffer_new(void);
 extern int		twopence_protocol_buffer_need_to_recv(const twopence_buf_t *bp);
+extern void		twopence_protocol_count_packet(twopence_packet_counters_t *, const twopence_buf_t *bp);
+extern void		__twopence_protocol_trace_packet(unsigned int event, const twopence_buf_t *bp);
+
+#define twopence_protocol_trace_packet(event, bp) \
+			do { \
+				if (twopence_trace_ring_active) \
+					__twopence_protocol_trace_packet(event, bp); \
+			} while (0)
 extern bool		twopence_protocol_buffer_complete(const twopence_buf_t *bp);
 extern const twopence_hdr_t *twopence_protocol_dissect(twopence_buf_t *bp, twopence_buf_t *payload);
 extern const twopence_hdr_t *twopence_protocol_dissect_ps(twopence_buf_t *bp, twopence_buf_t *payload, twopence_protocol_state_t *ps);
 extern bool		twopence_protocol_dissect_major_packet(twopence_buf_t *payload, int *status_ret);
 extern bool		twopence_protocol_dissect_minor_packet(twopence_buf_t *payload, int *status_ret);
-extern bool		twopence_protocol_dissect_hello_packet(twopence_buf_t *payload, unsigned char version[2], unsigned int *keepalive);
-extern bool		twopence_protocol_dissect_inject_packet(twopence_buf_t *payload, twopence_file_xfer_t *xfer);
+extern bool		twopence_protocol_dissect_hello_packet(twopence_buf_t *payload, unsigned char version[2], unsigned int *keepalive, unsigned int *features);
+extern bool		twopence_protocol_dissect_credit_packet(twopence_buf_t *payload, uint16_t *channel_id, unsigned int *credit);
+extern bool		twopence_protocol_dissect_stats_packet(twopence_buf_t *payload, twopence_stats_t *stats);
+extern bool		twopence_protocol_dissect_complete_packet(twopence_buf_t *payload, twopence_protocol_complete_t *);
+extern bool		twopence_protocol_dissect_inject_packet(twopence_buf_t *payload, twopence_file_xfer_t *xfer, bool *inline_ret);
 extern bool		twopence_protocol_dissect_extract_packet(twopence_buf_t *payload, twopence_file_xfer_t *xfer);
-extern bool		twopence_protocol_dissect_command_packet(twopence_buf_t *payload, twopence_command_t *cmd);
+extern bool		twopence_protocol_dissect_command_packet(twopence_buf_t *payload, twopence_command_t *cmd,
+				twopence_arena_env_t *env);
 
 #endif /* PROTOCOL_H */
@@ -19,6 +19,8 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <sys/time.h>
 
@@ -62,8 +64,23 @@ struct twopence_socket {
 		struct timeval	when;	/* time stamp of last xmit */
 	} xmit_ts;
 
+	/* If set, every packet queued to this socket is counted here */
+	twopence_packet_counters_t *xmit_counters;
+
+	/* Set for sockets that carry the twopence protocol */
+	bool			trace_packets;
+
 	twopence_buf_t *	recv_buf;
 
+	/* Instead of posting a receive buffer up front, the owner can
+	 * ask us to allocate one when there is something to read. */
+	struct {
+		bool		armed;
+		unsigned int	headroom;
+		unsigned int	min_size;
+		unsigned int	max_size;
+	} recv_lazy;
+
 	bool			read_eof;
 	unsigned char		write_eof;
 
@@ -88,7 +105,7 @@ twopence_packet_new(twopence_buf_t *bp)
 
 	pkt = twopence_calloc(1, sizeof(*pkt));
 	pkt->buffer = bp;
-	pkt->bytes = twopence_buf_count(bp);
+	pkt->bytes = twopence_buf_count_total(bp);
 	return pkt;
 }
 
@@ -309,6 +326,66 @@ twopence_sock_post_recvbuf(twopence_sock_t *sock, twopence_buf_t *bp)
 		twopence_buf_free(sock->recv_buf);
 	}
 	sock->recv_buf = bp;
+	sock->recv_lazy.armed = false;
+}
+
+/*
+ * Ask for a receive buffer to be allocated once poll says that the
+ * socket is readable. The buffer will have headroom bytes reserved
+ * at the head, and room for at least min_size and at most max_size
+ * bytes of data, depending on how much the kernel has queued for us.
+ *
+ * This keeps idle sockets (e.g. the output of background commands
+ * that rarely print anything) from pinning a full sized buffer each.
+ */
+void
+twopence_sock_post_recvbuf_lazy(twopence_sock_t *sock, unsigned int headroom, unsigned int min_size, unsigned int max_size)
+{
+	if (sock->read_eof || sock->recv_buf != NULL)
+		return;
+
+	if (min_size > max_size)
+		min_size = max_size;
+	sock->recv_lazy.headroom = headroom;
+	sock->recv_lazy.min_size = min_size;
+	sock->recv_lazy.max_size = max_size;
+	sock->recv_lazy.armed = true;
+}
+
+static void
+__twopence_sock_alloc_lazy_recvbuf(twopence_sock_t *sock)
+{
+	unsigned int size = sock->recv_lazy.max_size;
+	int avail = 0;
+
+	/* FIONREAD works for pipes, sockets and ttys. If it fails,
+	 * just go for the maximum. If there's nothing pending, we
+	 * are most likely looking at EOF; a small buffer will do. */
+	if (ioctl(sock->fd, FIONREAD, &avail) == 0 && avail >= 0) {
+		if ((unsigned int) avail < sock->recv_lazy.min_size)
+			avail = sock->recv_lazy.min_size;
+		if (avail == 0)
+			avail = 1;
+		if ((unsigned int) avail < size)
+			size = avail;
+	}
+
+	sock->recv_buf = twopence_buf_new(sock->recv_lazy.headroom + size);
+	twopence_buf_reserve_head(sock->recv_buf, sock->recv_lazy.headroom);
+	sock->recv_lazy.armed = false;
+}
+
+/*
+ * Report how much memory is tied up in this socket's buffers
+ */
+unsigned int
+twopence_sock_buffered_bytes(const twopence_sock_t *sock)
+{
+	unsigned int bytes = sock->xmit_queue.bytes;
+
+	if (sock->recv_buf)
+		bytes += sock->recv_buf->size;
+	return bytes;
 }
 
 twopence_buf_t *
@@ -345,16 +422,56 @@ twopence_sock_write(twopence_sock_t *sock, twopence_buf_t *bp, unsigned int coun
 	return n;
 }
 
+/*
+ * Send a buffer that references data it does not contain, in one go
+ */
+static int
+__twopence_sock_send_buffer_ref(twopence_sock_t *sock, twopence_buf_t *bp)
+{
+	unsigned int count = twopence_buf_count(bp);
+	unsigned int ref_len;
+	struct iovec iov[2];
+	int n, k = 0;
+
+	if (count) {
+		iov[k].iov_base = (void *) twopence_buf_head(bp);
+		iov[k].iov_len = count;
+		k++;
+	}
+	iov[k].iov_base = (void *) twopence_buf_ref_data(bp, &ref_len);
+	iov[k].iov_len = ref_len;
+	k++;
+
+	n = writev(sock->fd, iov, k);
+	if (n > 0) {
+		if (sock->xmit_ts.enabled)
+			gettimeofday(&sock->xmit_ts.when, NULL);
+		sock->bytes_sent += n;
+
+		if ((unsigned int) n <= count) {
+			twopence_buf_advance_head(bp, n);
+		} else {
+			twopence_buf_advance_head(bp, count);
+			twopence_buf_advance_ref(bp, n - count);
+		}
+	}
+	return n;
+}
+
 int
 twopence_sock_send_buffer(twopence_sock_t *sock, twopence_buf_t *bp)
 {
 	int n;
 
-	n = twopence_sock_write(sock, bp, twopence_buf_count(bp));
-	if (n > 0) {
-		twopence_debug2("%s(%d): wrote %u bytes\n", __func__, sock->fd, n);
-		twopence_buf_advance_head(bp, n);
+	if (twopence_buf_count_total(bp) != twopence_buf_count(bp)) {
+		n = __twopence_sock_send_buffer_ref(sock, bp);
+	} else {
+		n = twopence_sock_write(sock, bp, twopence_buf_count(bp));
+		if (n > 0)
+			twopence_buf_advance_head(bp, n);
 	}
+	if (n > 0)
+		twopence_debug2("%s(%d): wrote %u bytes\n", __func__, sock->fd, n);
 	return n;
 }
 
@@ -394,6 +511,11 @@ __socket_queue_xmit(twopence_sock_t *sock, twopence_buf_t *bp, int flags)
 {
 	int n = 0, f;
 
+	if (sock->xmit_counters)
+		twopence_protocol_count_packet(sock->xmit_counters, bp);
+	if (sock->trace_packets)
+		twopence_protocol_trace_packet(TWOPENCE_TRACE_PACKET_OUT, bp);
+
 	f = fcntl(sock->fd, F_GETFL);
 	if (flags & TWOPENCE_SOCK_XMIT_SYNCHRONOUS)
 		fcntl(sock->fd, F_SETFL, f & ~O_NONBLOCK);
@@ -417,7 +539,7 @@ __socket_queue_xmit(twopence_sock_t *sock, twopence_buf_t *bp, int flags)
 	if (twopence_queue_empty(&sock->xmit_queue)) {
 		if (flags & TWOPENCE_SOCK_XMIT_SYNCHRONOUS) {
 			/* fully synchronous */
-			while (twopence_buf_count(bp) != 0) {
+			while (twopence_buf_count_total(bp) != 0) {
 				n = twopence_sock_send_buffer(sock, bp);
 				if (n < 0)
 					goto out_drop_buffer;
@@ -430,7 +552,7 @@ __socket_queue_xmit(twopence_sock_t *sock, twopence_buf_t *bp, int flags)
 	}
 
 	/* If there's data left in this buffer, queue it to the socket */
-	if (twopence_buf_count(bp) != 0) {
+	if (twopence_buf_count_total(bp) != 0) {
 		if (flags & TWOPENCE_SOCK_XMIT_CLONEBUF)
 			bp = twopence_buf_clone(bp);
 		twopence_queue_append(&sock->xmit_queue, twopence_packet_new(bp));
@@ -474,7 +596,7 @@ twopence_sock_send_queued(twopence_sock_t *sock)
 		return 0;
 
 	n = twopence_sock_send_buffer(sock, pkt->buffer);
-	if (twopence_buf_count(pkt->buffer) == 0) {
+	if (twopence_buf_count_total(pkt->buffer) == 0) {
 		/* Sent the complete buffer */
 		twopence_queue_dequeue(&sock->xmit_queue);
 		twopence_packet_free(pkt);
@@ -593,6 +715,18 @@ twopence_sock_get_xmit_ts(const twopence_sock_t *sock, struct timeval *tv)
 	return tv->tv_sec != 0;
 }
 
+void
+twopence_sock_set_xmit_counters(twopence_sock_t *sock, twopence_packet_counters_t *counters)
+{
+	sock->xmit_counters = counters;
+}
+
+void
+twopence_sock_enable_packet_trace(twopence_sock_t *sock)
+{
+	sock->trace_packets = true;
+}
+
 const char *
 twopence_sock_state_desc(const twopence_sock_t *sock)
 {
@@ -673,6 +807,10 @@ void
 twopence_sock_prepare_poll(twopence_sock_t *sock)
 {
 	sock->poll_data = NULL;
+
+	/* Lazy receive buffers need to be re-armed for every poll cycle,
+	 * as the owner's flow control state may have changed. */
+	sock->recv_lazy.armed = false;
 }
 
 bool
@@ -692,6 +830,8 @@ twopence_sock_fill_poll(twopence_sock_t *sock, twopence_pollinfo_t *pinfo)
 	if (!sock->read_eof) {
 		if (sock->recv_buf != NULL && twopence_buf_tailroom_max(sock->recv_buf) != 0)
 			events |= POLLIN | POLLHUP;
+		else if (sock->recv_buf == NULL && sock->recv_lazy.armed)
+			events |= POLLIN | POLLHUP;
 	}
 
 	if (events == 0)
@@ -734,6 +874,8 @@ twopence_sock_doio(twopence_sock_t *sock)
 	if (pfd->revents & (POLLIN | POLLHUP)) {
 		unsigned int tailroom = 0;
 
+		if (sock->recv_buf == NULL && sock->recv_lazy.armed)
+			__twopence_sock_alloc_lazy_recvbuf(sock);
 		if (sock->recv_buf)
 			tailroom = twopence_buf_tailroom(sock->recv_buf);
 		if (tailroom != 0) {
@@ -26,6 +26,7 @@
 #include "utils.h"
 
 typedef struct twopence_socket twopence_sock_t;
+struct twopence_packet_counters;
 
 extern twopence_sock_t *twopence_sock_new(int fd);
 extern twopence_sock_t *twopence_sock_new_flags(int fd, int oflags);
@@ -54,11 +55,16 @@ extern bool		twopence_sock_fill_poll(twopence_sock_t *sock, twopence_pollinfo_t
 extern int		twopence_sock_doio(twopence_sock_t *sock);
 extern twopence_buf_t *	twopence_sock_post_recvbuf_if_needed(twopence_sock_t *sock, unsigned int size);
 extern void		twopence_sock_post_recvbuf(twopence_sock_t *sock, twopence_buf_t *bp);
+extern void		twopence_sock_post_recvbuf_lazy(twopence_sock_t *sock, unsigned int headroom,
+					unsigned int min_size, unsigned int max_size);
+extern unsigned int	twopence_sock_buffered_bytes(const twopence_sock_t *sock);
 extern twopence_buf_t *	twopence_sock_take_recvbuf(twopence_sock_t *);
 extern twopence_buf_t *	twopence_sock_get_recvbuf(twopence_sock_t *);
 
 extern void		twopence_sock_enable_xmit_ts(twopence_sock_t *);
 extern bool		twopence_sock_get_xmit_ts(const twopence_sock_t *, struct timeval *);
+extern void		twopence_sock_set_xmit_counters(twopence_sock_t *, struct twopence_packet_counters *);
+extern void		twopence_sock_enable_packet_trace(twopence_sock_t *);
 
 extern const char *	twopence_sock_state_desc(const twopence_sock_t *sock);
 
@@ -35,6 +35,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <malloc.h>
 #include <signal.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include "twopence.h"
 #include "utils.h"
@@ -66,6 +67,9 @@ struct twopence_ssh_target
 
     unsigned int next_pid;
   } transactions;
+
+  /* Set by the interrupt code, which may run in a signal handler */
+  volatile bool interrupted;
 };
 
 struct twopence_ssh_transaction {
@@ -105,6 +109,13 @@ struct twopence_ssh_transaction {
     bool		eof;
     bool		propagate_eof;
     int			was_blocking;
+
+    /* Data we have read from the stream, but could not write to the
+     * channel yet because the remote window was exhausted. While this
+     * is the case, we stop polling the stream for more input. */
+    bool		blocked;
+    unsigned int	pending_pos, pending_len;
+    char		pending[BUFFER_SIZE];
   } stdin;
 
   struct twopence_ssh_output {
@@ -148,10 +159,9 @@ struct twopence_scp_transaction {
 
 extern const struct twopence_plugin twopence_ssh_ops;
 
-static bool		__twopence_ssh_interrupted;
-
 static ssh_session	__twopence_ssh_open_session(const struct twopence_ssh_target *, const char *);
 static void		__twopence_ssh_transaction_detach_stdin(twopence_ssh_transaction_t *trans);
+static int		__twopence_ssh_stdin_cb(socket_t fd, int revents, void *userdata);
 static int		__twopence_ssh_interrupt_ssh(struct twopence_ssh_target *);
 
 ///////////////////////////// Lower layer ///////////////////////////////////////
@@ -203,7 +213,8 @@ __twopence_ssh_transaction_close_channel(twopence_ssh_transaction_t *trans)
     if (trans->session)
       ssh_event_remove_session(trans->event, trans->session);
     if (trans->stdin.fd >= 0) {
-      ssh_event_remove_fd(trans->event, trans->stdin.fd);
+      if (!trans->stdin.blocked)
+        ssh_event_remove_fd(trans->event, trans->stdin.fd);
       trans->stdin.fd = -1;
     }
     trans->event = NULL;
@@ -550,9 +561,39 @@ static void
 __twopence_ssh_transaction_detach_stdin(twopence_ssh_transaction_t *trans)
 {
   if (trans->stdin.fd >= 0) {
-    ssh_event_remove_fd(trans->handle->event, trans->stdin.fd);
+    if (!trans->stdin.blocked)
+      ssh_event_remove_fd(trans->handle->event, trans->stdin.fd);
     trans->stdin.fd = -1;
   }
+  trans->stdin.blocked = false;
+}
+
+/*
+ * The remote window is closed. Stop polling the local stream until
+ * the remote has consumed some of the data we sent it.
+ */
+static void
+__twopence_ssh_transaction_pause_stdin(twopence_ssh_transaction_t *trans)
+{
+  if (trans->stdin.blocked)
+    return;
+
+  twopence_debug("%s: remote window is closed, pausing stdin\n", __func__);
+  trans->stdin.blocked = true;
+  if (trans->stdin.fd >= 0 && trans->event)
+    ssh_event_remove_fd(trans->event, trans->stdin.fd);
+}
+
+static void
+__twopence_ssh_transaction_resume_stdin(twopence_ssh_transaction_t *trans)
+{
+  if (!trans->stdin.blocked)
+    return;
+
+  twopence_debug("%s: remote window is open again, resuming stdin\n", __func__);
+  trans->stdin.blocked = false;
+  if (trans->stdin.fd >= 0 && trans->event)
+    ssh_event_add_fd(trans->event, trans->stdin.fd, POLLIN, __twopence_ssh_stdin_cb, trans);
 }
 
 static int
@@ -576,54 +617,90 @@ __twopence_ssh_transaction_mark_stdin_eof(twopence_ssh_transaction_t *trans)
 }
 
 /*
- * Read data from stdin and forward it to the remote command
+ * Read data from stdin and forward it to the remote command.
+ *
+ * We never write more than the channel window allows, because
+ * ssh_channel_write() would block until the remote adjusts its window,
+ * stalling all other transactions. Whatever does not fit is kept in
+ * trans->stdin.pending, and is pushed by __twopence_ssh_transaction_pump_stdin()
+ * once the event loop has seen the window adjust.
  */
 static int
 __twopence_ssh_transaction_forward_stdin(twopence_ssh_transaction_t *trans)
 {
   twopence_iostream_t *stream;
-  char buffer[BUFFER_SIZE];
+  unsigned int window;
   int size, written;
 
-  if (trans->stdin.eof)
-    return 0;
+  while (true) {
+    if (trans->stdin.pending_len == 0) {
+      if (trans->stdin.eof)
+        return 0;
 
-  stream = trans->stdin.stream;
-  if (stream == NULL || twopence_iostream_eof(stream))
-    return __twopence_ssh_transaction_mark_stdin_eof(trans);
+      stream = trans->stdin.stream;
+      if (stream == NULL || twopence_iostream_eof(stream))
+        return __twopence_ssh_transaction_mark_stdin_eof(trans);
 
-  // Read from stdin
-  size = twopence_iostream_read(stream, buffer, BUFFER_SIZE);
-  if (size < 0) {
-    if (errno != EAGAIN)               // Error
+      // Read from stdin
+      size = twopence_iostream_read(stream, trans->stdin.pending, BUFFER_SIZE);
+      if (size < 0) {
+        if (errno != EAGAIN)               // Error
+          return -1;
+        return 0;
+      }
+      if (size == 0) {
+        /* EOF from local file */
+        return __twopence_ssh_transaction_mark_stdin_eof(trans);
+      }
+
+      trans->stdin.pending_pos = 0;
+      trans->stdin.pending_len = size;
+    }
+
+    window = ssh_channel_window_size(trans->channel);
+    if (window == 0) {
+      __twopence_ssh_transaction_pause_stdin(trans);
+      return 0;
+    }
+    __twopence_ssh_transaction_resume_stdin(trans);
+
+    size = trans->stdin.pending_len;
+    if ((unsigned int) size > window)
+      size = window;
+
+    twopence_debug("%s: writing %d bytes to command (window %u)\n", __func__, size, window);
+    written = ssh_channel_write(trans->channel, trans->stdin.pending + trans->stdin.pending_pos, size);
+    if (written < 0)
       return -1;
-    return 0;
-  }
-  if (size == 0) {
-    /* EOF from local file */
-    return __twopence_ssh_transaction_mark_stdin_eof(trans);
-  }
 
-  twopence_debug("%s: writing %d bytes to command\n", __func__, size);
-  written = ssh_channel_write(trans->channel, buffer, size);
-  if (written != size)
-    return -1;
-  return 0;
+    trans->stdin.pending_pos += written;
+    trans->stdin.pending_len -= written;
+    if (written < size) {
+      __twopence_ssh_transaction_pause_stdin(trans);
+      return 0;
+    }
+  }
 }
 
 /*
- * Write all data pending on stdin to the remote.
- * This function is only called when stdin is connected to a buffer
- * or similar.
+ * Push data that is waiting for the remote window to open, and data from
+ * streams that cannot be polled (such as buffers). This is called from the
+ * event loop after processing incoming packets, which is where we learn
+ * about window adjustments.
  */
 static int
-__twopence_ssh_transaction_drain_stdin(twopence_ssh_transaction_t *trans)
+__twopence_ssh_transaction_pump_stdin(twopence_ssh_transaction_t *trans)
 {
-  while (!trans->stdin.eof) {
-    if (__twopence_ssh_transaction_forward_stdin(trans) < 0) {
-      __twopence_ssh_transaction_fail(trans, TWOPENCE_FORWARD_INPUT_ERROR);
-      return -1;
-    }
+  if (trans->done || trans->channel == NULL)
+    return 0;
+
+  if (trans->stdin.pending_len == 0
+   && (trans->stdin.fd >= 0 || trans->stdin.stream == NULL || trans->stdin.eof))
+    return 0;
+
+  if (__twopence_ssh_transaction_forward_stdin(trans) < 0) {
+    __twopence_ssh_transaction_fail(trans, TWOPENCE_FORWARD_INPUT_ERROR);
+    return -1;
   }
 
   return 0;
@@ -653,8 +730,8 @@ __twopence_ssh_transaction_enable_poll(ssh_event event, twopence_ssh_transaction
   if ((stream = trans->stdin.stream) != NULL && !twopence_iostream_eof(stream)) {
     trans->stdin.fd = twopence_iostream_getfd(stream);
     if (trans->stdin.fd < 0) {
-      twopence_debug("%s: writing stdin synchronously to peer\n", __func__);
-      if (__twopence_ssh_transaction_drain_stdin(trans) < 0)
+      twopence_debug("%s: stdin cannot be polled, writing as much as the window allows\n", __func__);
+      if (__twopence_ssh_transaction_pump_stdin(trans) < 0)
 	return -1;
     } else {
       ssh_event_add_fd(event, trans->stdin.fd, POLLIN, __twopence_ssh_stdin_cb, trans);
@@ -683,6 +760,9 @@ __twopence_ssh_poll(struct twopence_ssh_target *handle)
       if (trans->eof_seen && trans->have_exit_status)
         trans->done = true;
 
+      /* Resume stdin if the remote has opened its window */
+      (void) __twopence_ssh_transaction_pump_stdin(trans);
+
       if (trans->done) {
 	/* FIXME: this is blocking, which is bad. A program may close its standard
 	 * I/O channels and still keep on running for a long time.
@@ -718,9 +798,9 @@ __twopence_ssh_poll(struct twopence_ssh_target *handle)
     twopence_debug("polling for events; timeout=%ld\n", twopence_timeout_msec(&timeout));
     rc = ssh_event_dopoll(event, twopence_timeout_msec(&timeout));
 
-    if (__twopence_ssh_interrupted) {
+    if (handle->interrupted) {
       twopence_debug("ssh_event_dopoll() interrupted by signal");
-      __twopence_ssh_interrupted = false;
+      handle->interrupted = false;
       continue;
     }
 
@@ -1223,7 +1303,7 @@ __twopence_ssh_interrupt_ssh(struct twopence_ssh_target *handle)
    * Nevertheless, work around that by telling __twopence_ssh_poll to ignore
    * that error.
    */
-  __twopence_ssh_interrupted = true;
+  handle->interrupted = true;
   return 0;
 }
 
@@ -1235,12 +1315,25 @@ __twopence_ssh_interrupt_ssh(struct twopence_ssh_target *handle)
 //
 // Returns a "handle" that must be passed to subsequent function calls,
 // or NULL in case of a problem
+static pthread_once_t	__twopence_ssh_once = PTHREAD_ONCE_INIT;
+
+// libssh initializes its global state lazily, which is not safe
+// when several threads connect at the same time
+static void
+__twopence_ssh_global_init(void)
+{
+  if (ssh_init() < 0)
+    twopence_log_error("ssh_init() failed");
+}
+
 static struct twopence_target *
 __twopence_ssh_init(const char *hostname, unsigned int port)
 {
   struct twopence_ssh_target *handle;
   ssh_session template;
 
+  pthread_once(&__twopence_ssh_once, __twopence_ssh_global_init);
+
   // Allocate the opaque handle
   handle = twopence_calloc(1, sizeof(struct twopence_ssh_target));
   if (handle == NULL) return NULL;
@@ -1344,6 +1437,30 @@ twopence_ssh_run_test
   return __twopence_ssh_command_ssh(handle, cmd, status_ret);
 }
 
+/*
+ * Copy the status of a completed transaction to the caller's status
+ * struct, and dispose of the transaction.
+ */
+static int
+__twopence_ssh_return_status(twopence_ssh_transaction_t *trans, twopence_status_t *status)
+{
+  int rc;
+
+  assert(trans->done);
+
+  status->pid = trans->pid;
+  if (trans->exception < 0) {
+    rc = trans->exception;
+  } else {
+    status->major = trans->status.major;
+    status->minor = trans->status.minor;
+    rc = trans->pid;
+  }
+
+  __twopence_ssh_transaction_free(trans);
+  return rc;
+}
+
 /*
  * Wait for a remote command to finish
  */
@@ -1374,19 +1491,7 @@ twopence_ssh_wait(struct twopence_target *opaque_handle, int want_pid, twopence_
   if (trans == NULL)
     return 0;
 
-  assert(trans->done);
-
-  status->pid = trans->pid;
-  if (trans->exception < 0) {
-    rc = trans->exception;
-  } else {
-    status->major = trans->status.major;
-    status->minor = trans->status.minor;
-    rc = trans->pid;
-  }
-
-  __twopence_ssh_transaction_free(trans);
-  return rc;
+  return __twopence_ssh_return_status(trans, status);
 }
 
 static int
@@ -1402,11 +1507,10 @@ twopence_ssh_chat_send(twopence_target_t *opaque_handle, int pid, twopence_iostr
   __twopence_ssh_transaction_detach_stdin(trans);
   __twopence_ssh_transaction_setup_stdin(trans, stream, false);
 
-  /* Push data to server */
-  if (trans->stdin.fd < 0 && !trans->stdin.eof) {
-    if (__twopence_ssh_transaction_drain_stdin(trans) < 0)
-      return -1;
-  }
+  /* Push data to server. Whatever does not fit into the remote
+   * window is sent from the event loop later on. */
+  if (__twopence_ssh_transaction_pump_stdin(trans) < 0)
+    return -1;
 
   return 0;
 }
@@ -1422,11 +1526,9 @@ twopence_ssh_chat_recv(twopence_target_t *opaque_handle, int pid, const struct t
   if (trans == NULL)
     return TWOPENCE_INVALID_TRANSACTION;
 
-  /* The caller may have added some more data to the write buffer. Drain it now */
-  if (trans->stdin.fd < 0 && !trans->stdin.eof) {
-    if (__twopence_ssh_transaction_drain_stdin(trans) < 0)
-      return -1;
-  }
+  /* The caller may have added some more data to the write buffer. Send it now */
+  if (__twopence_ssh_transaction_pump_stdin(trans) < 0)
+    return -1;
 
   trans->chat.nreceived = 0;
   while (!trans->done && !trans->chat.nreceived && !trans->eof_seen) {
@@ -1588,6 +1690,92 @@ twopence_ssh_exit_remote(struct twopence_target *opaque_handle)
   return -1;                           // Makes no sense with SSH
 }
 
+/*
+ * Event loop integration.
+ * These allow the caller to poll the sessions of all running transactions
+ * together with other targets, and have us process whatever became ready.
+ */
+static unsigned int
+twopence_ssh_count_pollfds(twopence_target_t *opaque_handle)
+{
+  struct twopence_ssh_target *handle = (struct twopence_ssh_target *) opaque_handle;
+  twopence_ssh_transaction_t *trans;
+  unsigned int count = 0;
+
+  /* One for the session, and one for stdin */
+  for (trans = handle->transactions.running; trans; trans = trans->next)
+    count += 2;
+  return count;
+}
+
+static int
+twopence_ssh_fill_poll(twopence_target_t *opaque_handle, struct twopence_pollinfo *pinfo)
+{
+  struct twopence_ssh_target *handle = (struct twopence_ssh_target *) opaque_handle;
+  twopence_ssh_transaction_t *trans;
+  unsigned int count = 0;
+
+  for (trans = handle->transactions.running; trans; trans = trans->next) {
+    if (trans->done || trans->session == NULL)
+      continue;
+
+    if (twopence_pollinfo_update(pinfo, ssh_get_fd(trans->session), POLLIN, &trans->command_timeout))
+      count++;
+    if (trans->stdin.fd >= 0 && !trans->stdin.blocked
+     && twopence_pollinfo_update(pinfo, trans->stdin.fd, POLLIN, NULL))
+      count++;
+  }
+
+  return count;
+}
+
+static int
+twopence_ssh_doio(twopence_target_t *opaque_handle)
+{
+  struct twopence_ssh_target *handle = (struct twopence_ssh_target *) opaque_handle;
+  twopence_ssh_transaction_t *trans;
+  struct timeval now;
+
+  if (handle->transactions.running == NULL)
+    return 0;
+
+  /* The caller has already polled for us, so this will not block. */
+  if (ssh_event_dopoll(handle->event, 0) == SSH_ERROR && !handle->interrupted) {
+    twopence_debug("ssh_event_dopoll() returns error");
+    return TWOPENCE_INTERNAL_ERROR;
+  }
+  handle->interrupted = false;
+
+  gettimeofday(&now, NULL);
+  for (trans = handle->transactions.running; trans; trans = trans->next) {
+    if (trans->eof_seen && trans->have_exit_status)
+      trans->done = true;
+
+    (void) __twopence_ssh_transaction_pump_stdin(trans);
+
+    if (!trans->done && timercmp(&trans->command_timeout, &now, <))
+      __twopence_ssh_transaction_fail(trans, TWOPENCE_COMMAND_TIMEOUT_ERROR);
+    else if (trans->done && !trans->exception)
+      (void) __twopence_ssh_transaction_get_exit_status(trans);
+  }
+
+  (void) __twopence_ssh_reap_completed(handle);
+  return 0;
+}
+
+static int
+twopence_ssh_reap(twopence_target_t *opaque_handle, int want_pid, twopence_status_t *status)
+{
+  struct twopence_ssh_target *handle = (struct twopence_ssh_target *) opaque_handle;
+  twopence_ssh_transaction_t *trans;
+
+  trans = __twopence_ssh_get_completed_transaction(handle, want_pid);
+  if (trans == NULL)
+    return 0;
+
+  return __twopence_ssh_return_status(trans, status);
+}
+
 // Close the library
 static void
 twopence_ssh_end(struct twopence_target *opaque_handle)
@@ -1618,4 +1806,8 @@ const struct twopence_plugin twopence_ssh_ops = {
 	.cancel_transactions = twopence_ssh_cancel_transactions,
 	.disconnect = twopence_ssh_disconnect,
 	.end = twopence_ssh_end,
+	.count_pollfds = twopence_ssh_count_pollfds,
+	.fill_poll = twopence_ssh_fill_poll,
+	.doio = twopence_ssh_doio,
+	.reap = twopence_ssh_reap,
 };
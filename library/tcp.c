@@ -131,6 +131,7 @@ __twopence_tcp_open(struct twopence_pipe_target *pipe_handle)
 
 const struct twopence_pipe_ops twopence_tcp_link_ops = {
   .open = __twopence_tcp_open,
+  .multi_link = true,
 };
 
 ///////////////////////////// Public interface //////////////////////////////////
@@ -178,5 +179,11 @@ const struct twopence_plugin twopence_tcp_ops = {
 	.interrupt_command = twopence_pipe_interrupt_command,
 	.cancel_transactions = twopence_pipe_cancel_transactions,
 	.disconnect = twopence_pipe_disconnect,
+	.get_server_metrics = twopence_pipe_get_server_metrics,
+	.serve_mux = twopence_pipe_serve_mux,
 	.end = twopence_pipe_end,
+	.count_pollfds = twopence_pipe_count_pollfds,
+	.fill_poll = twopence_pipe_fill_poll,
+	.doio = twopence_pipe_doio,
+	.reap = twopence_pipe_reap,
 };
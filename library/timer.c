@@ -29,6 +29,7 @@
 #include <string.h>
 #include <stdint.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include "utils.h"
 #include "twopence.h"
@@ -36,6 +37,25 @@
 static unsigned int		__global_timer_id = 1;
 static twopence_timer_list_t	__global_timer_list;
 
+/*
+ * The global timer list may be manipulated from several threads,
+ * each driving its own target. All public timer functions take this lock;
+ * timer callbacks are always invoked without holding it.
+ */
+static pthread_mutex_t		__global_timer_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline void
+__twopence_timers_lock(void)
+{
+	pthread_mutex_lock(&__global_timer_lock);
+}
+
+static inline void
+__twopence_timers_unlock(void)
+{
+	pthread_mutex_unlock(&__global_timer_lock);
+}
+
 /*
  * List helper functions
  */
@@ -72,7 +92,6 @@ twopence_timer_create(unsigned long timeout_ms, twopence_timer_t **timer_ret)
 
 	timer = twopence_calloc(1, sizeof(*timer));
 	timer->refcount = 1;
-	timer->id = __global_timer_id++;
 
 	gettimeofday(&now, NULL);
 	timer->runtime.tv_sec = timeout_ms / 1000;
@@ -80,7 +99,11 @@ twopence_timer_create(unsigned long timeout_ms, twopence_timer_t **timer_ret)
 	timeradd(&now, &timer->runtime, &timer->expires);
 
 	timer->state = TWOPENCE_TIMER_STATE_ACTIVE;
+
+	__twopence_timers_lock();
+	timer->id = __global_timer_id++;
 	twopence_timer_list_insert(&__global_timer_list, timer);
+	__twopence_timers_unlock();
 
 	twopence_debug("Created timer %u", timer->id);
 	*timer_ret = timer;
@@ -102,39 +125,49 @@ __twopence_timer_free(twopence_timer_t *timer)
 	free(timer);
 }
 
+static void
+__twopence_timer_release(twopence_timer_t *timer)
+{
+	assert(timer->refcount);
+	if (--(timer->refcount) == 0)
+		__twopence_timer_free(timer);
+}
+
 void
 twopence_timer_hold(twopence_timer_t *timer)
 {
+	__twopence_timers_lock();
 	assert(timer->refcount);
 	timer->refcount ++;
+	__twopence_timers_unlock();
 }
 
 void
 twopence_timer_release(twopence_timer_t *timer)
 {
-	assert(timer->refcount);
-	if (--(timer->refcount) == 0)
-		__twopence_timer_free(timer);
+	__twopence_timers_lock();
+	__twopence_timer_release(timer);
+	__twopence_timers_unlock();
 }
 
 void
 twopence_timer_cancel(twopence_timer_t *timer)
 {
+	__twopence_timers_lock();
 	if (timer->state == TWOPENCE_TIMER_STATE_ACTIVE
 	 || timer->state == TWOPENCE_TIMER_STATE_PAUSED
 	 || timer->state == TWOPENCE_TIMER_STATE_CANCELLED) {
 		timer->state = TWOPENCE_TIMER_STATE_CANCELLED;
 		__twopence_timer_unlink(timer);
 	}
+	__twopence_timers_unlock();
 }
 
 void
 twopence_timer_pause(twopence_timer_t *timer)
 {
 	/* silently ignore duplicate calls to pause a timer */
-	if (timer->state == TWOPENCE_TIMER_STATE_PAUSED)
-		return;
-
+	__twopence_timers_lock();
 	if (timer->state == TWOPENCE_TIMER_STATE_ACTIVE) {
 		struct timeval now;
 
@@ -147,11 +180,13 @@ twopence_timer_pause(twopence_timer_t *timer)
 
 		timer->state = TWOPENCE_TIMER_STATE_PAUSED;
 	}
+	__twopence_timers_unlock();
 }
 
 void
 twopence_timer_unpause(twopence_timer_t *timer)
 {
+	__twopence_timers_lock();
 	if (timer->state == TWOPENCE_TIMER_STATE_PAUSED) {
 		struct timeval now;
 
@@ -159,6 +194,7 @@ twopence_timer_unpause(twopence_timer_t *timer)
 		timeradd(&timer->runtime, &now, &timer->expires);
 		timer->state = TWOPENCE_TIMER_STATE_ACTIVE;
 	}
+	__twopence_timers_unlock();
 }
 
 long
@@ -188,7 +224,7 @@ twopence_timer_kill(twopence_timer_t *timer)
 	timer->callback = NULL;
 
 	__twopence_timer_unlink(timer);
-	twopence_timer_release(timer);
+	__twopence_timer_release(timer);
 }
 
 static void
@@ -294,7 +330,9 @@ twopence_timer_list_destroy(twopence_timer_list_t *list)
 void
 twopence_timers_update_timeout(twopence_timeout_t *tmo)
 {
+	__twopence_timers_lock();
 	twopence_timer_list_update_timeout(&__global_timer_list, tmo);
+	__twopence_timers_unlock();
 }
 
 void
@@ -302,6 +340,7 @@ twopence_timers_run(void)
 {
 	twopence_timer_list_t expired = { .head = NULL };
 	twopence_timeout_t timeout;
+	twopence_timer_t *t;
 
 	/* Do another pass over the list, and catch timers that have
 	 * expired since the last inspection.
@@ -315,10 +354,29 @@ twopence_timers_run(void)
 	 * So we have to account for the fact that we spent some time
 	 * inside poll()
 	 */
+	__twopence_timers_lock();
 	twopence_timeout_init(&timeout);
 	twopence_timer_list_update_timeout(&__global_timer_list, &timeout);
-
 	twopence_timer_list_reap(&__global_timer_list, &expired);
-	twopence_timer_list_invoke(&expired);
-	twopence_timer_list_destroy(&expired);
+
+	/* Invoke the callbacks one by one, dropping the lock around each call.
+	 * Callbacks may well create or cancel timers themselves. */
+	while ((t = expired.head) != NULL) {
+		void (*callback)(twopence_timer_t *, void *) = NULL;
+
+		__twopence_timer_unlink(t);
+		if (t->state == TWOPENCE_TIMER_STATE_EXPIRED)
+			callback = t->callback;
+
+		if (callback) {
+			twopence_debug("Invoking timer %u", t->id);
+			twopence_trace_event(TWOPENCE_TRACE_TIMER_FIRE, 0, t->id, 0);
+			__twopence_timers_unlock();
+			callback(t, t->user_data);
+			__twopence_timers_lock();
+		}
+
+		twopence_timer_kill(t);
+	}
+	__twopence_timers_unlock();
 }
@@ -0,0 +1,254 @@
+/*
+ * Binary trace ring buffer
+ *
+ * Copyright (C) 2014-2016 SUSE
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "twopence.h"
+#include "protocol.h"
+#include "utils.h"
+
+/*
+ * Writers reserve a slot by incrementing the head index atomically,
+ * so several threads can record events concurrently. A slot's seq
+ * is cleared while the event is being filled in, and set last; the
+ * decoder ignores slots with a seq of 0.
+ *
+ * Dumping only uses write(2), so that it can be done from a signal
+ * handler. Events that are being recorded while we dump may be lost.
+ */
+static struct {
+	twopence_trace_event_t *events;
+	unsigned int		size;		/* always a power of 2 */
+	uint32_t		head;
+	char *			dump_path;
+	pid_t			owner;
+} twopence_trace_ring;
+
+bool		twopence_trace_ring_active;
+
+static void	twopence_trace_ring_dump_at_exit(void);
+
+bool
+twopence_trace_ring_enable(const char *dump_path, unsigned int size)
+{
+	unsigned int n = 1;
+
+	if (twopence_trace_ring.events != NULL)
+		return true;
+
+	if (size == 0)
+		size = TWOPENCE_TRACE_RING_DEFAULT_SIZE;
+	while (n < size)
+		n <<= 1;
+
+	twopence_trace_ring.events = calloc(n, sizeof(twopence_trace_event_t));
+	if (twopence_trace_ring.events == NULL) {
+		twopence_log_error("Unable to allocate trace ring with %u events", n);
+		return false;
+	}
+	twopence_trace_ring.size = n;
+
+	if (dump_path) {
+		char cwd[PATH_MAX];
+
+		/* We may chdir later on, e.g. when daemonizing */
+		if (dump_path[0] != '/' && getcwd(cwd, sizeof(cwd)) != NULL) {
+			twopence_trace_ring.dump_path = twopence_malloc(strlen(cwd) + strlen(dump_path) + 2);
+			sprintf(twopence_trace_ring.dump_path, "%s/%s", cwd, dump_path);
+		} else {
+			twopence_trace_ring.dump_path = twopence_strdup(dump_path);
+		}
+		twopence_trace_ring.owner = getpid();
+		atexit(twopence_trace_ring_dump_at_exit);
+	}
+
+	twopence_trace_ring_active = true;
+	return true;
+}
+
+/*
+ * Enable the trace ring if TWOPENCE_TRACE_RING is set in the environment.
+ */
+bool
+twopence_trace_ring_enable_from_env(void)
+{
+	const char *path;
+
+	if ((path = getenv("TWOPENCE_TRACE_RING")) == NULL || *path == '\0')
+		return false;
+	return twopence_trace_ring_enable(path, 0);
+}
+
+void
+__twopence_trace_ring_event(unsigned int type, unsigned int xid, unsigned int arg0, unsigned int arg1)
+{
+	twopence_trace_event_t *ev;
+	struct timespec now;
+	uint32_t seq;
+
+	seq = __atomic_fetch_add(&twopence_trace_ring.head, 1, __ATOMIC_RELAXED);
+	ev = &twopence_trace_ring.events[seq & (twopence_trace_ring.size - 1)];
+
+	__atomic_store_n(&ev->seq, 0, __ATOMIC_RELAXED);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ev->timestamp = now.tv_sec * 1000000000ULL + now.tv_nsec;
+	ev->type = type;
+	ev->xid = xid;
+	ev->arg[0] = arg0;
+	ev->arg[1] = arg1;
+
+	/* seq 0 marks an empty slot, so start counting at 1 */
+	__atomic_store_n(&ev->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+static int
+__twopence_trace_ring_write(int fd, const void *data, size_t len)
+{
+	const char *p = data;
+
+	while (len) {
+		ssize_t n = write(fd, p, len);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * Write the ring to the given file descriptor.
+ * This is async signal safe.
+ */
+int
+twopence_trace_ring_dump(int fd)
+{
+	twopence_trace_ring_header_t hdr;
+
+	if (twopence_trace_ring.events == NULL)
+		return -1;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, TWOPENCE_TRACE_RING_MAGIC, sizeof(hdr.magic));
+	hdr.version = TWOPENCE_TRACE_RING_VERSION;
+	hdr.pid = getpid();
+	hdr.size = twopence_trace_ring.size;
+	hdr.head = __atomic_load_n(&twopence_trace_ring.head, __ATOMIC_ACQUIRE);
+
+	if (__twopence_trace_ring_write(fd, &hdr, sizeof(hdr)) < 0
+	 || __twopence_trace_ring_write(fd, twopence_trace_ring.events, hdr.size * sizeof(twopence_trace_event_t)) < 0)
+		return -1;
+	return 0;
+}
+
+static void
+__twopence_trace_ring_dump_file(void)
+{
+	int fd, saved_errno = errno;
+
+	/* Do not let forked children that exit before exec'ing
+	 * anything overwrite the parent's trace */
+	if (twopence_trace_ring.dump_path == NULL || getpid() != twopence_trace_ring.owner)
+		return;
+
+	fd = open(twopence_trace_ring.dump_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd >= 0) {
+		(void) twopence_trace_ring_dump(fd);
+		close(fd);
+	}
+	errno = saved_errno;
+}
+
+static void
+twopence_trace_ring_dump_at_exit(void)
+{
+	__twopence_trace_ring_dump_file();
+}
+
+static void
+twopence_trace_ring_signal_handler(int signo)
+{
+	__twopence_trace_ring_dump_file();
+}
+
+void
+twopence_trace_ring_dump_on_signal(int signo)
+{
+	struct sigaction sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = twopence_trace_ring_signal_handler;
+	sa.sa_flags = SA_RESTART;
+	sigaction(signo, &sa, NULL);
+}
+
+/*
+ * Format an event for humans
+ */
+const char *
+twopence_trace_ring_describe(const twopence_trace_event_t *ev, char *buf, size_t size)
+{
+	switch (ev->type) {
+	case TWOPENCE_TRACE_PACKET_IN:
+	case TWOPENCE_TRACE_PACKET_OUT:
+		snprintf(buf, size, "%-12s xid=%-5u %s len=%u",
+				ev->type == TWOPENCE_TRACE_PACKET_IN? "packet-in" : "packet-out",
+				ev->xid, twopence_protocol_packet_type_to_string(ev->arg[0]), ev->arg[1]);
+		break;
+	case TWOPENCE_TRACE_TRANS_NEW:
+		snprintf(buf, size, "%-12s xid=%-5u %s", "trans-new",
+				ev->xid, twopence_protocol_packet_type_to_string(ev->arg[0]));
+		break;
+	case TWOPENCE_TRACE_TRANS_ERROR:
+		snprintf(buf, size, "%-12s xid=%-5u %s", "trans-error",
+				ev->xid, twopence_strerror(-(int) ev->arg[0]));
+		break;
+	case TWOPENCE_TRACE_TRANS_FREE:
+		snprintf(buf, size, "%-12s xid=%-5u status=%d/%d", "trans-free",
+				ev->xid, (int) ev->arg[0], (int) ev->arg[1]);
+		break;
+	case TWOPENCE_TRACE_POLL_WAKEUP:
+		snprintf(buf, size, "%-12s ready=%d nfds=%u", "poll-wakeup",
+				(int) ev->arg[0], ev->arg[1]);
+		break;
+	case TWOPENCE_TRACE_TIMER_FIRE:
+		snprintf(buf, size, "%-12s timer=%u", "timer-fire", ev->arg[0]);
+		break;
+	default:
+		snprintf(buf, size, "event-%u xid=%u %u %u",
+				ev->type, ev->xid, ev->arg[0], ev->arg[1]);
+		break;
+	}
+	return buf;
+}
@@ -61,8 +61,28 @@ struct twopence_trans_channel {
 	 * the server that it was able to open the destination file.
 	 * So even though we're adding the local sink channel early, we do not allow
 	 * to transmit from right away. So initially, the channel is "plugged", and
-	 * only when we receive a major status of 0, we will "unplug" it. */
+	 * only when we receive a major status of 0, we will "unplug" it.
+	 *
+	 * To save the round trip, a plugged channel may still send up to
+	 * plug_window bytes optimistically. If the server fails to open the
+	 * file, it simply discards them. */
 	bool			plugged;
+	unsigned int		plug_window;
+
+	/* When output batching is enabled, this is the time by which
+	 * data held back in the receive buffer must be sent */
+	struct timeval		batch_deadline;
+
+	/* Per-channel flow control. On a source channel, credit is the
+	 * amount of data the peer is still willing to accept from us.
+	 * On a sink, we grant credit back to the peer as the data we
+	 * received has been written out. */
+	struct {
+		bool		enabled;
+		unsigned int	credit;
+		unsigned int	received;
+		unsigned int	granted;
+	} flow;
 
 	struct {
 	    void		(*read_eof)(twopence_transaction_t *, twopence_trans_channel_t *);
@@ -70,31 +90,55 @@ struct twopence_trans_channel {
 	} callbacks;
 };
 
+struct twopence_trans_packet {
+	twopence_trans_packet_t *next;
+	twopence_buf_t *	buffer;
+};
+
 static void	twopence_transaction_channel_trace_io_eof(twopence_transaction_t *trans);
+static void	twopence_transaction_queue_xmit(twopence_transaction_t *trans, twopence_buf_t *bp);
+static void	twopence_transaction_channel_init_flow(twopence_transaction_t *trans, twopence_trans_channel_t *channel);
 
 /*
  * Transaction channel primitives
+ *
+ * Channels live in the transaction's arena. Closed channels are kept on a
+ * free list and reused, so that a transaction that keeps attaching and
+ * closing channels does not keep growing.
  */
 static twopence_trans_channel_t *
-twopence_transaction_channel_from_fd(int fd, int flags)
+twopence_transaction_channel_alloc(twopence_transaction_t *trans)
+{
+	twopence_trans_channel_t *channel;
+
+	if ((channel = trans->free_channels) != NULL) {
+		trans->free_channels = channel->next;
+		memset(channel, 0, sizeof(*channel));
+		return channel;
+	}
+	return twopence_arena_alloc(&trans->arena, sizeof(*channel));
+}
+
+static twopence_trans_channel_t *
+twopence_transaction_channel_from_fd(twopence_transaction_t *trans, int fd, int flags)
 {
 	twopence_trans_channel_t *sink;
 	twopence_sock_t *sock;
 
 	sock = twopence_sock_new_flags(fd, flags);
 
-	sink = twopence_calloc(1, sizeof(*sink));
+	sink = twopence_transaction_channel_alloc(trans);
 	sink->socket = sock;
 
 	return sink;
 }
 
 static twopence_trans_channel_t *
-twopence_transaction_channel_from_stream(twopence_iostream_t *stream, int flags)
+twopence_transaction_channel_from_stream(twopence_transaction_t *trans, twopence_iostream_t *stream, int flags)
 {
 	twopence_trans_channel_t *sink;
 
-	sink = twopence_calloc(1, sizeof(*sink));
+	sink = twopence_transaction_channel_alloc(trans);
 	sink->stream = stream;
 
 	return sink;
@@ -128,7 +172,7 @@ twopence_transaction_channel_name(const twopence_trans_channel_t *channel)
 }
 
 static void
-twopence_transaction_channel_free(twopence_trans_channel_t *sink)
+twopence_transaction_channel_free(twopence_transaction_t *trans, twopence_trans_channel_t *sink)
 {
 	twopence_debug("%s(%s)", __func__, twopence_transaction_channel_name(sink));
 	if (sink->socket)
@@ -137,7 +181,8 @@ twopence_transaction_channel_free(twopence_trans_channel_t *sink)
 
 	/* Do NOT free the iostream */
 
-	free(sink);
+	sink->next = trans->free_channels;
+	trans->free_channels = sink;
 }
 
 bool
@@ -158,6 +203,12 @@ twopence_transaction_channel_set_plugged(twopence_trans_channel_t *channel, bool
 	channel->plugged = plugged;
 }
 
+void
+twopence_transaction_channel_set_plug_window(twopence_trans_channel_t *channel, unsigned int window)
+{
+	channel->plug_window = window;
+}
+
 void
 twopence_transaction_channel_set_callback_read_eof(twopence_trans_channel_t *channel, void (*fn)(twopence_transaction_t *, twopence_trans_channel_t *))
 {
@@ -171,14 +222,14 @@ twopence_transaction_channel_set_callback_write_eof(twopence_trans_channel_t *ch
 }
 
 static void
-twopence_transaction_channel_list_purge(twopence_trans_channel_t **list)
+twopence_transaction_channel_list_purge(twopence_transaction_t *trans, twopence_trans_channel_t **list)
 {
 	twopence_trans_channel_t *channel;
 
 	while ((channel = *list) != NULL) {
 		if (channel->socket && twopence_sock_is_dead(channel->socket)) {
 			*list = channel->next;
-			twopence_transaction_channel_free(channel);
+			twopence_transaction_channel_free(trans, channel);
 		} else {
 			list = &channel->next;
 		}
@@ -186,14 +237,14 @@ twopence_transaction_channel_list_purge(twopence_trans_channel_t **list)
 }
 
 static void
-twopence_transaction_channel_list_close(twopence_trans_channel_t **list, uint16_t id)
+twopence_transaction_channel_list_close(twopence_transaction_t *trans, twopence_trans_channel_t **list, uint16_t id)
 {
 	twopence_trans_channel_t *channel;
 
 	while ((channel = *list) != NULL) {
 		if (id == TWOPENCE_TRANSACTION_CHANNEL_ID_ALL || channel->id == id) {
 			*list = channel->next;
-			twopence_transaction_channel_free(channel);
+			twopence_transaction_channel_free(trans, channel);
 		} else {
 			list = &channel->next;
 		}
@@ -213,6 +264,16 @@ twopence_transaction_new(twopence_sock_t *transport, unsigned int type, const tw
 	trans->id = ps->xid;
 	trans->type = type;
 	trans->socket = transport;
+	trans->pidfd = -1;
+	twopence_arena_init(&trans->arena);
+	twopence_trace_event(TWOPENCE_TRACE_TRANS_NEW, ps->xid, type, 0);
+	gettimeofday(&trans->stats.created, NULL);
+
+	trans->xmit.tail = &trans->xmit.head;
+	if (type == TWOPENCE_PROTO_TYPE_INJECT || type == TWOPENCE_PROTO_TYPE_EXTRACT)
+		trans->xmit.prio = TWOPENCE_TRANSACTION_PRIO_BULK;
+	else
+		trans->xmit.prio = TWOPENCE_TRANSACTION_PRIO_INTERACTIVE;
 
 	twopence_debug("%s: created new transaction", twopence_transaction_describe(trans));
 	return trans;
@@ -221,14 +282,26 @@ twopence_transaction_new(twopence_sock_t *transport, unsigned int type, const tw
 void
 twopence_transaction_free(twopence_transaction_t *trans)
 {
+	twopence_buf_t *bp;
+
 	assert(trans->prev == NULL);
 
+	twopence_trace_event(TWOPENCE_TRACE_TRANS_FREE, trans->id,
+			trans->client.status_ret.major, trans->client.status_ret.minor);
 	twopence_transaction_channel_trace_io_eof(trans);
 
 	/* Do not free trans->socket, we don't own it */
 
-	twopence_transaction_channel_list_close(&trans->local_sink, TWOPENCE_TRANSACTION_CHANNEL_ID_ALL);
-	twopence_transaction_channel_list_close(&trans->local_source, TWOPENCE_TRANSACTION_CHANNEL_ID_ALL);
+	/* Anything still queued at this point cannot be sent anymore */
+	while ((bp = twopence_transaction_xmit_dequeue(trans)) != NULL)
+		twopence_buf_free(bp);
+
+	if (trans->pidfd >= 0)
+		close(trans->pidfd);
+
+	twopence_transaction_channel_list_close(trans, &trans->local_sink, TWOPENCE_TRANSACTION_CHANNEL_ID_ALL);
+	twopence_transaction_channel_list_close(trans, &trans->local_source, TWOPENCE_TRANSACTION_CHANNEL_ID_ALL);
+	twopence_arena_destroy(&trans->arena);
 
 	memset(trans, 0, sizeof(*trans));
 	free(trans);
@@ -244,6 +317,113 @@ twopence_transaction_describe(const twopence_transaction_t *trans)
 	return descbuf;
 }
 
+/*
+ * Have source channels coalesce their output into fewer, larger packets.
+ * Data is held back until max_bytes have accumulated, or until max_delay
+ * microseconds have passed since the first byte arrived.
+ */
+void
+twopence_transaction_set_batching(twopence_transaction_t *trans, unsigned int max_bytes, unsigned int max_delay)
+{
+	if (max_bytes == 0 || max_delay == 0) {
+		max_bytes = 0;
+		max_delay = 0;
+	}
+	if (max_delay > TWOPENCE_TRANSACTION_MAX_BATCH_DELAY)
+		max_delay = TWOPENCE_TRANSACTION_MAX_BATCH_DELAY;
+
+	trans->batch.max_bytes = max_bytes;
+	trans->batch.max_delay = max_delay;
+}
+
+/*
+ * Limit the amount of data in flight on each channel of this transaction.
+ * This is only done if both ends of the connection have agreed on it.
+ */
+void
+twopence_transaction_enable_flow_control(twopence_transaction_t *trans)
+{
+	twopence_trans_channel_t *channel;
+
+	trans->flow_control = true;
+	for (channel = trans->local_sink; channel; channel = channel->next)
+		twopence_transaction_channel_init_flow(trans, channel);
+	for (channel = trans->local_source; channel; channel = channel->next)
+		twopence_transaction_channel_init_flow(trans, channel);
+}
+
+/*
+ * Time between two events, in usec. Returns 0 if either has not happened.
+ */
+unsigned long
+twopence_transaction_usec_between(const struct timeval *from, const struct timeval *to)
+{
+	struct timeval delta;
+
+	if (!timerisset(from) || !timerisset(to) || timercmp(to, from, <))
+		return 0;
+
+	timersub(to, from, &delta);
+	return delta.tv_sec * 1000000UL + delta.tv_usec;
+}
+
+/*
+ * Server side: report our timing to the client.
+ * This needs to go out before the packet that completes the transaction
+ * on the client side.
+ */
+void
+twopence_transaction_send_stats(twopence_transaction_t *trans)
+{
+	twopence_stats_t stats;
+	struct timeval now;
+	twopence_buf_t *bp;
+
+	if (!trans->report_stats || trans->stats_sent)
+		return;
+
+	gettimeofday(&now, NULL);
+
+	memset(&stats, 0, sizeof(stats));
+	stats.server_spawn_time = twopence_transaction_usec_between(&trans->stats.created, &trans->stats.spawned);
+	stats.server_run_time = twopence_transaction_usec_between(&trans->stats.created, &now);
+
+	if ((bp = twopence_protocol_build_stats_packet(&trans->ps, &stats)) != NULL)
+		twopence_transaction_send_client(trans, bp);
+	trans->stats_sent = true;
+}
+
+/*
+ * Client side: copy the statistics of a completed transaction
+ */
+void
+twopence_transaction_get_stats(const twopence_transaction_t *trans, twopence_stats_t *stats)
+{
+	struct timeval now;
+	const struct timeval *completed;
+	unsigned int i;
+
+	memset(stats, 0, sizeof(*stats));
+	for (i = 0; i < TWOPENCE_STATS_MAX_CHANNELS; ++i) {
+		stats->bytes_sent[i] = trans->stats.channel_bytes_sent[i];
+		stats->bytes_received[i] = trans->stats.channel_bytes_received[i];
+	}
+	stats->packets_sent = trans->stats.npackets_sent;
+	stats->max_bytes_queued = trans->stats.max_bytes_queued;
+
+	completed = &trans->stats.completed;
+	if (!timerisset(completed)) {
+		gettimeofday(&now, NULL);
+		completed = &now;
+	}
+
+	stats->queue_time = twopence_transaction_usec_between(&trans->stats.created, &trans->stats.request_sent);
+	stats->first_byte_time = twopence_transaction_usec_between(&trans->stats.request_sent, &trans->stats.first_reply);
+	stats->wall_time = twopence_transaction_usec_between(&trans->stats.created, completed);
+	stats->server_spawn_time = trans->stats.server_spawn_time;
+	stats->server_run_time = trans->stats.server_run_time;
+}
+
 void
 twopence_transaction_set_timeout(twopence_transaction_t *trans, long timeout)
 {
@@ -285,6 +465,7 @@ void
 twopence_transaction_set_error(twopence_transaction_t *trans, int rc)
 {
 	twopence_debug("%s: set client side error to %d", twopence_transaction_describe(trans), rc);
+	twopence_trace_event(TWOPENCE_TRACE_TRANS_ERROR, trans->id, -rc, 0);
 	trans->client.exception = rc;
 	trans->done = true;
 }
@@ -302,37 +483,115 @@ twopence_transaction_num_channels(const twopence_transaction_t *trans)
 	return count;
 }
 
-int
-twopence_transaction_send_extract(twopence_transaction_t *trans, const twopence_file_xfer_t *xfer)
+/*
+ * Count the memory held in the receive buffers and xmit queues of
+ * this transaction's local channels.
+ */
+unsigned int
+twopence_transaction_buffered_bytes(const twopence_transaction_t *trans)
 {
-	twopence_buf_t *bp;
+	twopence_trans_channel_t *channel;
+	unsigned int bytes = 0;
+
+	for (channel = trans->local_sink; channel; channel = channel->next) {
+		if (channel->socket)
+			bytes += twopence_sock_buffered_bytes(channel->socket);
+	}
+	for (channel = trans->local_source; channel; channel = channel->next) {
+		if (channel->socket)
+			bytes += twopence_sock_buffered_bytes(channel->socket);
+	}
+	return bytes;
+}
+
+/*
+ * Send the request that starts a transaction, and note when it went out
+ */
+static int
+twopence_transaction_send_request(twopence_transaction_t *trans, twopence_buf_t *bp)
+{
+	unsigned int count = twopence_buf_count(bp);
 
-	bp = twopence_protocol_build_extract_packet(&trans->ps, xfer);
 	if (twopence_sock_xmit(trans->socket, bp) < 0)
 		return TWOPENCE_SEND_COMMAND_ERROR;
+
+	gettimeofday(&trans->stats.request_sent, NULL);
+	trans->stats.nbytes_sent += count;
+	trans->stats.npackets_sent++;
 	return 0;
 }
 
+int
+twopence_transaction_send_extract(twopence_transaction_t *trans, const twopence_file_xfer_t *xfer)
+{
+	return twopence_transaction_send_request(trans,
+			twopence_protocol_build_extract_packet(&trans->ps, xfer));
+}
+
 int
 twopence_transaction_send_inject(twopence_transaction_t *trans, const twopence_file_xfer_t *xfer)
 {
-	twopence_buf_t *bp;
+	return twopence_transaction_send_request(trans,
+			twopence_protocol_build_inject_packet(&trans->ps, xfer));
+}
 
-	bp = twopence_protocol_build_inject_packet(&trans->ps, xfer);
-	if (twopence_sock_xmit(trans->socket, bp) < 0)
-		return TWOPENCE_SEND_COMMAND_ERROR;
-	return 0;
+/*
+ * Send the request along with the entire contents of the local file.
+ * If the file has grown too big since its size was checked, what was
+ * read is put back into the stream and 1 is returned; the caller has to
+ * send a regular INJECT instead.
+ */
+int
+twopence_transaction_send_inject_inline(twopence_transaction_t *trans, const twopence_file_xfer_t *xfer)
+{
+	twopence_iostream_t *stream = xfer->local_stream;
+	twopence_buf_t *data, *bp;
+	unsigned int count;
+	int n;
+
+	/* Read one byte more than fits, so that we notice if the file grew */
+	data = twopence_buf_new(TWOPENCE_PROTO_INLINE_MAX + 1);
+	do {
+		n = twopence_iostream_read(stream, twopence_buf_tail(data), twopence_buf_tailroom(data));
+		if (n > 0)
+			twopence_buf_advance_tail(data, n);
+	} while (twopence_buf_tailroom(data) && (n > 0 || (n < 0 && errno == EINTR)));
+
+	if (n < 0) {
+		twopence_buf_free(data);
+		return TWOPENCE_LOCAL_FILE_ERROR;
+	}
+
+	count = twopence_buf_count(data);
+	if (count > TWOPENCE_PROTO_INLINE_MAX) {
+		if (twopence_iostream_unread(stream, data) < 0) {
+			twopence_buf_free(data);
+			return TWOPENCE_LOCAL_FILE_ERROR;
+		}
+		return 1;
+	}
+
+	bp = twopence_protocol_build_inject_inline_packet(&trans->ps, xfer, data);
+	twopence_buf_free(data);
+	if (bp == NULL)
+		return TWOPENCE_LOCAL_FILE_ERROR;
+
+	trans->stats.channel_bytes_sent[0] += count;
+	return twopence_transaction_send_request(trans, bp);
 }
 
 int
 twopence_transaction_send_command(twopence_transaction_t *trans, const twopence_command_t *cmd)
 {
-	twopence_buf_t *bp;
+	return twopence_transaction_send_request(trans,
+			twopence_protocol_build_command_packet(&trans->ps, cmd));
+}
 
-	bp = twopence_protocol_build_command_packet(&trans->ps, cmd);
-	if (twopence_sock_xmit(trans->socket, bp) < 0)
-		return TWOPENCE_SEND_COMMAND_ERROR;
-	return 0;
+int
+twopence_transaction_send_metrics(twopence_transaction_t *trans)
+{
+	return twopence_transaction_send_request(trans,
+			twopence_protocol_build_simple_packet_ps(&trans->ps, TWOPENCE_PROTO_TYPE_METRICS));
 }
 
 int
@@ -354,8 +613,9 @@ twopence_transaction_attach_local_sink(twopence_transaction_t *trans, uint16_t i
 	/* Make I/O to this file descriptor non-blocking */
 	fcntl(fd, F_SETFL, O_NONBLOCK);
 
-	sink = twopence_transaction_channel_from_fd(fd, O_WRONLY);
+	sink = twopence_transaction_channel_from_fd(trans, fd, O_WRONLY);
 	sink->id = id;
+	twopence_transaction_channel_init_flow(trans, sink);
 
 	sink->next = trans->local_sink;
 	trans->local_sink = sink;
@@ -375,8 +635,9 @@ twopence_transaction_attach_local_sink_stream(twopence_transaction_t *trans, uin
 		return sink;
 	}
 
-	sink = twopence_transaction_channel_from_stream(stream, O_WRONLY);
+	sink = twopence_transaction_channel_from_stream(trans, stream, O_WRONLY);
 	sink->id = id;
+	twopence_transaction_channel_init_flow(trans, sink);
 
 	sink->next = trans->local_sink;
 	trans->local_sink = sink;
@@ -387,7 +648,7 @@ void
 twopence_transaction_close_sink(twopence_transaction_t *trans, uint16_t id)
 {
 	twopence_debug("%s: close sink %s\n", twopence_transaction_describe(trans), __twopence_transaction_channel_name(id));
-	twopence_transaction_channel_list_close(&trans->local_sink, id);
+	twopence_transaction_channel_list_close(trans, &trans->local_sink, id);
 }
 
 twopence_trans_channel_t *
@@ -398,8 +659,9 @@ twopence_transaction_attach_local_source(twopence_transaction_t *trans, uint16_t
 	/* Make I/O to this file descriptor non-blocking */
 	fcntl(fd, F_SETFL, O_NONBLOCK);
 
-	source = twopence_transaction_channel_from_fd(fd, O_RDONLY);
+	source = twopence_transaction_channel_from_fd(trans, fd, O_RDONLY);
 	source->id = channel_id;
+	twopence_transaction_channel_init_flow(trans, source);
 
 	source->next = trans->local_source;
 	trans->local_source = source;
@@ -419,8 +681,9 @@ twopence_transaction_attach_local_source_stream(twopence_transaction_t *trans, u
 		return source;
 	}
 
-	source = twopence_transaction_channel_from_stream(stream, O_RDONLY);
+	source = twopence_transaction_channel_from_stream(trans, stream, O_RDONLY);
 	source->id = id;
+	twopence_transaction_channel_init_flow(trans, source);
 
 	source->next = trans->local_source;
 	trans->local_source = source;
@@ -431,7 +694,7 @@ void
 twopence_transaction_close_source(twopence_transaction_t *trans, uint16_t id)
 {
 	twopence_debug("%s: close source %s\n", twopence_transaction_describe(trans), __twopence_transaction_channel_name(id));
-	twopence_transaction_channel_list_close(&trans->local_source, id);
+	twopence_transaction_channel_list_close(trans, &trans->local_source, id);
 }
 
 /*
@@ -457,10 +720,90 @@ twopence_transaction_channel_write_data(twopence_transaction_t *trans, twopence_
 		twopence_buf_advance_head(payload, count);
 	}
 
+	sink->flow.received += count;
+
 	twopence_transaction_channel_trace_io_data(trans);
 	return true;
 }
 
+static inline void
+twopence_transaction_channel_account_sent(twopence_transaction_t *trans, twopence_trans_channel_t *channel, unsigned int count)
+{
+	if (channel->id < TWOPENCE_STATS_MAX_CHANNELS)
+		trans->stats.channel_bytes_sent[channel->id] += count;
+}
+
+static void
+twopence_transaction_channel_init_flow(twopence_transaction_t *trans, twopence_trans_channel_t *channel)
+{
+	if (!trans->flow_control || channel->flow.enabled)
+		return;
+
+	channel->flow.enabled = true;
+	channel->flow.credit = TWOPENCE_PROTO_CHANNEL_WINDOW;
+}
+
+/*
+ * How much data we may send from this source channel right now
+ */
+static unsigned int
+twopence_transaction_channel_credit(const twopence_trans_channel_t *channel)
+{
+	unsigned int credit = ~0U;
+
+	if (channel->flow.enabled)
+		credit = channel->flow.credit;
+	if (channel->plugged && credit > channel->plug_window)
+		credit = channel->plug_window;
+	return credit;
+}
+
+static void
+twopence_transaction_channel_consume_credit(twopence_trans_channel_t *channel, unsigned int count)
+{
+	if (channel->plugged)
+		channel->plug_window -= (count < channel->plug_window)? count : channel->plug_window;
+
+	if (!channel->flow.enabled)
+		return;
+
+	if (count > channel->flow.credit)
+		count = channel->flow.credit;
+	channel->flow.credit -= count;
+}
+
+/*
+ * Once a good part of the data we received on a sink has been written
+ * out, tell the peer that it may send more. Waiting for a quarter of the
+ * window to drain avoids sending a credit packet for every little write.
+ */
+static void
+twopence_transaction_channel_grant_credit(twopence_transaction_t *trans, twopence_trans_channel_t *sink)
+{
+	unsigned int consumed, grant;
+
+	/* Nothing more will arrive for a completed transaction */
+	if (!sink->flow.enabled || trans->done)
+		return;
+
+	consumed = sink->flow.received;
+	if (sink->socket)
+		consumed -= twopence_sock_xmit_queue_bytes(sink->socket);
+
+	grant = consumed - sink->flow.granted;
+	if (grant < TWOPENCE_PROTO_CHANNEL_WINDOW / 4)
+		return;
+
+	twopence_debug2("%s: granting %u bytes of credit on channel %s", twopence_transaction_describe(trans),
+			grant, twopence_transaction_channel_name(sink));
+
+	/* Credit packets do not need to wait for any data queued to the
+	 * transaction; they concern the opposite direction. */
+	twopence_sock_queue_xmit(trans->socket,
+			twopence_protocol_build_credit_packet(&trans->ps, sink->id, grant));
+	sink->flow.granted += grant;
+}
+
 int
 twopence_transaction_channel_flush(twopence_trans_channel_t *sink)
 {
@@ -493,32 +836,40 @@ twopence_transaction_channel_write_eof(twopence_trans_channel_t *sink)
 }
 
 int
-twopence_transaction_channel_poll(twopence_trans_channel_t *channel, twopence_pollinfo_t *pinfo)
+twopence_transaction_channel_poll(twopence_transaction_t *trans, twopence_trans_channel_t *channel, twopence_pollinfo_t *pinfo)
 {
 	twopence_sock_t *sock = channel->socket;
 
 	if (sock && !twopence_sock_is_dead(sock)) {
-		twopence_buf_t *bp;
-
 		twopence_sock_prepare_poll(sock);
 
-		/* If needed, post a new receive buffer to the socket.
+		/* If needed, ask for a receive buffer to be allocated once
+		 * there's data to read. We do not post one right away, as
+		 * there may be lots of idle channels (think of background
+		 * commands that hardly ever print anything).
+		 *
 		 * Note: this is a NOP for sink channels, as their socket
 		 * already has read_eof set, so that a recvbuf is never
 		 * posted to it.
 		 */
-		if (!channel->plugged
-		 && !twopence_sock_is_read_eof(sock)
-		 && (bp = twopence_sock_get_recvbuf(sock)) == NULL) {
+		if (!twopence_sock_is_read_eof(sock)
+		 && twopence_transaction_channel_credit(channel) != 0
+		 && twopence_sock_get_recvbuf(sock) == NULL) {
+			unsigned int size = TWOPENCE_PROTO_MAX_PAYLOAD - 2;
+
+			/* Do not read more than the peer is willing to accept */
+			if (twopence_transaction_channel_credit(channel) < size)
+				size = twopence_transaction_channel_credit(channel);
+
 			/* When we receive data from a command's output stream, or from
 			 * a file that is being extracted, we do not want to copy
 			 * the entire packet - instead, we reserve some room for the
 			 * protocol header, which we just tack on once we have the data.
+			 *
+			 * If we're batching output, make room for a full batch.
 			 */
-			bp = twopence_buf_new(TWOPENCE_PROTO_MAX_PACKET);
-			twopence_buf_reserve_head(bp, TWOPENCE_PROTO_HEADER_SIZE + 2);
-
-			twopence_sock_post_recvbuf(sock, bp);
+			twopence_sock_post_recvbuf_lazy(sock, TWOPENCE_PROTO_HEADER_SIZE + 2,
+					trans->batch.max_bytes, size);
 		}
 
 		if (twopence_sock_fill_poll(sock, pinfo))
@@ -534,23 +885,39 @@ twopence_transaction_channel_forward(twopence_transaction_t *trans, twopence_tra
 {
 	twopence_iostream_t *stream = channel->stream;
 
-	if (!channel->plugged && stream != NULL) {
-		while (twopence_sock_xmit_queue_allowed(trans->socket) && !twopence_iostream_eof(stream)) {
+	if (twopence_transaction_channel_credit(channel) != 0 && stream != NULL) {
+		while (twopence_transaction_xmit_allowed(trans)
+		    && twopence_transaction_channel_credit(channel) != 0
+		    && !twopence_iostream_eof(stream)) {
+			unsigned int room;
 			twopence_buf_t *bp;
 			int count;
 
-			bp = twopence_protocol_command_buffer_new();
-			twopence_buf_reserve_head(bp, TWOPENCE_PROTO_HEADER_SIZE + 2); /* ugly */
-			do {
-				count = twopence_iostream_read(stream,
-						twopence_buf_tail(bp),
-						twopence_buf_tailroom(bp));
-			} while (count < 0 && errno == EINTR);
+			room = TWOPENCE_PROTO_MAX_PAYLOAD - 2;
+			if (room > twopence_transaction_channel_credit(channel))
+				room = twopence_transaction_channel_credit(channel);
+
+			if (twopence_iostream_can_read_ref(stream)) {
+				/* The stream is backed by a mapped file; rather than
+				 * copying the data, make the packet refer to it. */
+				bp = twopence_buf_new_ref(TWOPENCE_PROTO_HEADER_SIZE + 2);
+				twopence_buf_reserve_head(bp, TWOPENCE_PROTO_HEADER_SIZE + 2);
+				count = twopence_iostream_read_ref(stream, bp, room);
+			} else {
+				bp = twopence_protocol_command_buffer_new();
+				twopence_buf_reserve_head(bp, TWOPENCE_PROTO_HEADER_SIZE + 2); /* ugly */
+				do {
+					count = twopence_iostream_read(stream, twopence_buf_tail(bp), room);
+				} while (count < 0 && errno == EINTR);
+				if (count > 0)
+					twopence_buf_advance_tail(bp, count);
+			}
 
 			if (count > 0) {
-				twopence_buf_advance_tail(bp, count);
+				twopence_transaction_channel_consume_credit(channel, count);
+				twopence_transaction_channel_account_sent(trans, channel, count);
 				twopence_protocol_build_data_header(bp, &trans->ps, channel->id);
-				twopence_transaction_send_client(trans, bp);
+				twopence_transaction_queue_xmit(trans, bp);
 
 				twopence_transaction_channel_trace_io_data(trans);
 				continue;
@@ -581,6 +948,41 @@ twopence_transaction_channel_forward(twopence_transaction_t *trans, twopence_tra
 	}
 }
 
+/*
+ * Decide whether the output pending in the channel's receive buffer should
+ * be held back, in the hope of sending it along with more data later.
+ * We never hold back output once the buffer is full or we have seen EOF.
+ */
+static bool
+twopence_transaction_channel_hold_output(twopence_transaction_t *trans, twopence_trans_channel_t *channel)
+{
+	twopence_sock_t *sock = channel->socket;
+	twopence_buf_t *bp;
+	struct timeval now;
+
+	if (trans->batch.max_bytes == 0)
+		return false;
+
+	if ((bp = twopence_sock_get_recvbuf(sock)) == NULL
+	 || twopence_buf_count(bp) == 0
+	 || twopence_buf_count(bp) >= trans->batch.max_bytes
+	 || twopence_buf_tailroom(bp) == 0
+	 || twopence_sock_is_read_eof(sock))
+		return false;
+
+	gettimeofday(&now, NULL);
+	if (!timerisset(&channel->batch_deadline)) {
+		struct timeval delay;
+
+		delay.tv_sec = trans->batch.max_delay / 1000000;
+		delay.tv_usec = trans->batch.max_delay % 1000000;
+		timeradd(&now, &delay, &channel->batch_deadline);
+		return true;
+	}
+
+	return timercmp(&now, &channel->batch_deadline, <);
+}
+
 static void
 twopence_transaction_channel_doio(twopence_transaction_t *trans, twopence_trans_channel_t *channel)
 {
@@ -597,14 +999,20 @@ twopence_transaction_channel_doio(twopence_transaction_t *trans, twopence_trans_
 
 		/* Only source channels will even have a recv buffer posted
 		 * to them. If that is non-empty, queue it to the transport
-		 * socket. */
+		 * socket - unless we're batching, and want to wait for more. */
+		if (twopence_transaction_channel_hold_output(trans, channel))
+			return;
+
 		if ((bp = twopence_sock_take_recvbuf(sock)) != NULL) {
 			twopence_debug2("%s: %u bytes from local source %s", twopence_transaction_describe(trans),
 					twopence_buf_count(bp), twopence_transaction_channel_name(channel));
+			twopence_transaction_channel_consume_credit(channel, twopence_buf_count(bp));
+			twopence_transaction_channel_account_sent(trans, channel, twopence_buf_count(bp));
 			twopence_protocol_build_data_header(bp, &trans->ps, channel->id);
-			twopence_sock_queue_xmit(trans->socket, bp);
+			twopence_transaction_queue_xmit(trans, bp);
 
 			twopence_transaction_channel_trace_io_data(trans);
+			timerclear(&channel->batch_deadline);
 		}
 
 		/* For file extractions, we want to send an EOF packet
@@ -622,28 +1030,42 @@ twopence_transaction_channel_doio(twopence_transaction_t *trans, twopence_trans_
 int
 twopence_transaction_fill_poll(twopence_transaction_t *trans, twopence_pollinfo_t *pinfo)
 {
+	trans->pidfd_poll = NULL;
+
 	if (!twopence_timeout_update(&pinfo->timeout, &trans->client.deadline))
 		return TWOPENCE_COMMAND_TIMEOUT_ERROR;
 
+	if (trans->pid && trans->pidfd >= 0)
+		trans->pidfd_poll = twopence_pollinfo_update(pinfo, trans->pidfd, POLLIN, NULL);
+
 	if (trans->local_sink != NULL) {
 		twopence_trans_channel_t *sink;
 
 		for (sink = trans->local_sink; sink; sink = sink->next)
-			twopence_transaction_channel_poll(sink, pinfo);
+			twopence_transaction_channel_poll(trans, sink, pinfo);
 	}
 
-	/* If the client socket's write queue is already bursting with data,
-	 * refrain from queuing more until some of it has been drained */
-	if (twopence_sock_xmit_queue_allowed(trans->socket)) {
+	/* If we have lots of data waiting to be sent already, refrain
+	 * from queuing more until some of it has been drained */
+	if (twopence_transaction_xmit_allowed(trans)) {
 		twopence_trans_channel_t *source;
 
 		for (source = trans->local_source; source; source = source->next) {
-			if (!twopence_transaction_channel_poll(source, pinfo)) {
+			/* Make sure we wake up in time to flush held back output */
+			if (timerisset(&source->batch_deadline))
+				twopence_timeout_update(&pinfo->timeout, &source->batch_deadline);
+
+			if (!twopence_transaction_channel_poll(trans, source, pinfo)) {
 				/* This is a source not backed by a file descriptor but
 				 * something else (such as a buffer).
 				 * This means we cannot poll, so we just forward all data
 				 * we have. */
 				twopence_transaction_channel_forward(trans, source);
+
+				/* If that failed, make sure we do not sleep in poll()
+				 * before the caller gets to see the transaction is done. */
+				if (trans->done)
+					twopence_timeout_update(&pinfo->timeout, &pinfo->timeout.now);
 			}
 		}
 	}
@@ -651,15 +1073,36 @@ twopence_transaction_fill_poll(twopence_transaction_t *trans, twopence_pollinfo_
 	return 0;
 }
 
+/*
+ * Check whether the child process of a command transaction may have exited.
+ * Without a pidfd, we cannot tell, and the caller has to try waitpid()
+ */
+bool
+twopence_transaction_child_exited(const twopence_transaction_t *trans)
+{
+	struct pollfd *pfd;
+
+	if (trans->pidfd < 0)
+		return true;
+
+	if ((pfd = trans->pidfd_poll) == NULL)
+		return false;
+
+	assert(pfd->fd == trans->pidfd);
+	return !!(pfd->revents & (POLLIN | POLLHUP | POLLNVAL));
+}
+
 void
 twopence_transaction_doio(twopence_transaction_t *trans)
 {
 	twopence_trans_channel_t *channel;
 
 	twopence_debug2("%s: twopence_transaction_doio()\n", twopence_transaction_describe(trans));
-	for (channel = trans->local_sink; channel; channel = channel->next)
+	for (channel = trans->local_sink; channel; channel = channel->next) {
 		twopence_transaction_channel_doio(trans, channel);
-	twopence_transaction_channel_list_purge(&trans->local_sink);
+		twopence_transaction_channel_grant_credit(trans, channel);
+	}
+	twopence_transaction_channel_list_purge(trans, &trans->local_sink);
 
 	for (channel = trans->local_source; channel; channel = channel->next)
 		twopence_transaction_channel_doio(trans, channel);
@@ -673,7 +1116,123 @@ twopence_transaction_doio(twopence_transaction_t *trans)
 	 * the EOF condition on the source file and send an EOF packet.
 	 * Once we wrap this inside the twopence_trans_channel handling,
 	 * then this requirement goes away. */
-	twopence_transaction_channel_list_purge(&trans->local_source);
+	twopence_transaction_channel_list_purge(trans, &trans->local_source);
+}
+
+/*
+ * Write data received on a channel to its sink.
+ * Returns the sink if the data was written successfully, and NULL otherwise.
+ */
+static twopence_trans_channel_t *
+twopence_transaction_recv_data(twopence_transaction_t *trans, uint16_t channel_id, twopence_buf_t *payload)
+{
+	twopence_trans_channel_t *sink;
+
+	sink = twopence_transaction_find_sink(trans, channel_id);
+	if (sink == NULL) {
+		twopence_debug("%s: received %u bytes of data on unknown channel %u\n",
+				twopence_transaction_describe(trans), twopence_buf_count(payload),
+				channel_id);
+		return NULL;
+	}
+
+	twopence_debug("%s: received %u bytes of data on channel %s\n",
+			twopence_transaction_describe(trans), twopence_buf_count(payload),
+			twopence_transaction_channel_name(sink));
+
+	trans->stats.nbytes_received += twopence_buf_count(payload);
+	if (channel_id < TWOPENCE_STATS_MAX_CHANNELS)
+		trans->stats.channel_bytes_received[channel_id] += twopence_buf_count(payload);
+	if (!twopence_transaction_channel_write_data(trans, sink, payload)) {
+		twopence_transaction_fail(trans, errno);
+		return NULL;
+	}
+	return sink;
+}
+
+static void
+twopence_transaction_recv_eof(twopence_transaction_t *trans, uint16_t channel_id)
+{
+	twopence_trans_channel_t *sink;
+
+	sink = twopence_transaction_find_sink(trans, channel_id);
+	if (sink == NULL) {
+		twopence_debug("%s: received EOF on unknown channel %u\n",
+				twopence_transaction_describe(trans), channel_id);
+		return;
+	}
+
+	twopence_debug("%s: received EOF on channel %s\n",
+			twopence_transaction_describe(trans),
+			twopence_transaction_channel_name(sink));
+
+	twopence_transaction_channel_trace_io_eof(trans);
+	twopence_transaction_channel_write_eof(sink);
+	if (sink->callbacks.write_eof) {
+		sink->callbacks.write_eof(trans, sink);
+		sink->callbacks.write_eof = NULL;
+	}
+
+	/* Do NOT close the sink yet; it may have data queued to it.
+	 * Strictly speaking, we also should not send a success notification
+	 * to the client yet. */
+}
+
+static void
+twopence_transaction_recv_stats(twopence_transaction_t *trans, const twopence_stats_t *stats)
+{
+	trans->stats.server_spawn_time = stats->server_spawn_time;
+	trans->stats.server_run_time = stats->server_run_time;
+}
+
+/*
+ * Hand a status that arrived as part of a COMPLETE packet to the
+ * transaction's receive function, as if it had been sent on its own
+ */
+static void
+twopence_transaction_recv_status(twopence_transaction_t *trans, unsigned char type, int status)
+{
+	twopence_hdr_t hdr;
+	twopence_buf_t payload;
+	uint32_t word = htonl(status);
+
+	if (trans->done || trans->recv == NULL)
+		return;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.type = type;
+	twopence_buf_init_static(&payload, &word, sizeof(word));
+	trans->recv(trans, &hdr, &payload);
+}
+
+static void
+twopence_transaction_recv_complete(twopence_transaction_t *trans, twopence_buf_t *payload)
+{
+	twopence_protocol_complete_t complete;
+	unsigned int i;
+
+	if (!twopence_protocol_dissect_complete_packet(payload, &complete)) {
+		twopence_log_error("%s: bad COMPLETE packet\n", twopence_transaction_describe(trans));
+		twopence_transaction_set_error(trans, TWOPENCE_PROTOCOL_ERROR);
+		return;
+	}
+
+	/* Same order as the individual packets would arrive in */
+	if (complete.have_stats)
+		twopence_transaction_recv_stats(trans, &complete.stats);
+	if (complete.have_major)
+		twopence_transaction_recv_status(trans, TWOPENCE_PROTO_TYPE_MAJOR, complete.major);
+	if (complete.have_data && !trans->done) {
+		twopence_buf_t data;
+
+		/* No credit to grant; the server is done sending */
+		twopence_buf_init_static(&data, (void *) complete.data, complete.data_len);
+		twopence_transaction_recv_data(trans, complete.data_channel, &data);
+	}
+	for (i = 0; i < complete.neof && !trans->done; ++i)
+		twopence_transaction_recv_eof(trans, complete.eof[i]);
+	if (complete.have_minor)
+		twopence_transaction_recv_status(trans, TWOPENCE_PROTO_TYPE_MINOR, complete.minor);
 }
 
 /*
@@ -683,36 +1242,33 @@ twopence_transaction_doio(twopence_transaction_t *trans)
 void
 twopence_transaction_recv_packet(twopence_transaction_t *trans, const twopence_hdr_t *hdr, twopence_buf_t *payload)
 {
-	twopence_trans_channel_t *sink;
-
 	if (trans->done) {
 		/* Coming late to the party, huh? */
 		return;
 	}
 
+	/* Only count what the server actually sends in reply to the request;
+	 * it may start granting credit before that */
+	switch (hdr->type) {
+	case TWOPENCE_PROTO_TYPE_CHAN_DATA:
+	case TWOPENCE_PROTO_TYPE_MAJOR:
+	case TWOPENCE_PROTO_TYPE_MINOR:
+	case TWOPENCE_PROTO_TYPE_COMPLETE:
+		if (!timerisset(&trans->stats.first_reply))
+			gettimeofday(&trans->stats.first_reply, NULL);
+		break;
+	}
+
 	if (hdr->type == TWOPENCE_PROTO_TYPE_CHAN_DATA) {
+		twopence_trans_channel_t *sink;
 		uint16_t channel_id;
 
 		/* This should go to protocol.c */
 		if (!twopence_buf_get(payload, &channel_id, sizeof(channel_id)))
 			return;
 
-		channel_id = ntohs(channel_id);
-		sink = twopence_transaction_find_sink(trans, channel_id);
-		if (sink != NULL) {
-			twopence_debug("%s: received %u bytes of data on channel %s\n",
-					twopence_transaction_describe(trans), twopence_buf_count(payload),
-					twopence_transaction_channel_name(sink));
-
-			trans->stats.nbytes_received += twopence_buf_count(payload);
-			if (!twopence_transaction_channel_write_data(trans, sink, payload))
-				twopence_transaction_fail(trans, errno);
-			return;
-		}
-
-		twopence_debug("%s: received %u bytes of data on unknown channel %u\n",
-				twopence_transaction_describe(trans), twopence_buf_count(payload),
-				channel_id);
+		if ((sink = twopence_transaction_recv_data(trans, ntohs(channel_id), payload)) != NULL)
+			twopence_transaction_channel_grant_credit(trans, sink);
 		return;
 	}
 
@@ -723,29 +1279,43 @@ twopence_transaction_recv_packet(twopence_transaction_t *trans, const twopence_h
 		if (!twopence_buf_get(payload, &channel_id, sizeof(channel_id)))
 			return;
 
-		channel_id = ntohs(channel_id);
-		sink = twopence_transaction_find_sink(trans, channel_id);
-		if (sink == NULL) {
-			twopence_debug("%s: received %u bytes of data on unknown channel %u\n",
-					twopence_transaction_describe(trans), twopence_buf_count(payload),
-					channel_id);
+		twopence_transaction_recv_eof(trans, ntohs(channel_id));
+		return;
+	}
+
+	if (hdr->type == TWOPENCE_PROTO_TYPE_CHAN_CREDIT) {
+		twopence_trans_channel_t *source;
+		unsigned int credit;
+		uint16_t channel_id;
+
+		if (!twopence_protocol_dissect_credit_packet(payload, &channel_id, &credit))
+			return;
+
+		/* The source may be gone already, which is fine */
+		source = twopence_transaction_find_source(trans, channel_id);
+		if (source == NULL || !source->flow.enabled)
 			return;
-		}
 
-		twopence_debug("%s: received EOF on channel %s\n",
-				twopence_transaction_describe(trans),
-				twopence_transaction_channel_name(sink));
+		twopence_debug2("%s: received %u bytes of credit on channel %s",
+				twopence_transaction_describe(trans), credit,
+				twopence_transaction_channel_name(source));
+		source->flow.credit += credit;
+		return;
+	}
 
-		twopence_transaction_channel_trace_io_eof(trans);
-		twopence_transaction_channel_write_eof(sink);
-		if (sink->callbacks.write_eof) {
-			sink->callbacks.write_eof(trans, sink);
-			sink->callbacks.write_eof = NULL;
-		}
+	if (hdr->type == TWOPENCE_PROTO_TYPE_STATS) {
+		twopence_stats_t stats;
 
-		/* Do NOT close the sink yet; it may have data queued to it.
-		 * Strictly speaking, we also should not send a success notification
-		 * to the client yet. */
+		memset(&stats, 0, sizeof(stats));
+		if (!twopence_protocol_dissect_stats_packet(payload, &stats))
+			return;
+
+		twopence_transaction_recv_stats(trans, &stats);
+		return;
+	}
+
+	if (hdr->type == TWOPENCE_PROTO_TYPE_COMPLETE) {
+		twopence_transaction_recv_complete(trans, payload);
 		return;
 	}
 
@@ -771,7 +1341,70 @@ twopence_transaction_send_client(twopence_transaction_t *trans, twopence_buf_t *
 	twopence_debug("%s: sending packet type=%s, payload=%u\n", twopence_transaction_describe(trans),
 			twopence_protocol_packet_type_to_string(h->type),
 			ntohs(h->len) - TWOPENCE_PROTO_HEADER_SIZE);
-	twopence_sock_queue_xmit(trans->socket, bp);
+
+	/* Control packets go out right away, unless they would overtake
+	 * data of this transaction that is still waiting to be sent */
+	if (trans->xmit.head != NULL)
+		twopence_transaction_queue_xmit(trans, bp);
+	else
+		twopence_sock_queue_xmit(trans->socket, bp);
+}
+
+/*
+ * Queue a packet for transmission. It will be moved to the transport
+ * socket by the connection's send scheduler.
+ */
+static void
+twopence_transaction_queue_xmit(twopence_transaction_t *trans, twopence_buf_t *bp)
+{
+	twopence_trans_packet_t *pkt;
+
+	pkt = twopence_calloc(1, sizeof(*pkt));
+	pkt->buffer = bp;
+
+	*trans->xmit.tail = pkt;
+	trans->xmit.tail = &pkt->next;
+	trans->xmit.bytes += twopence_buf_count_total(bp);
+
+	if (trans->xmit.bytes > trans->stats.max_bytes_queued)
+		trans->stats.max_bytes_queued = trans->xmit.bytes;
+}
+
+bool
+twopence_transaction_xmit_allowed(const twopence_transaction_t *trans)
+{
+	if (trans->xmit.bytes >= TWOPENCE_TRANSACTION_MAX_QUEUED)
+		return false;
+	return twopence_sock_xmit_queue_allowed(trans->socket);
+}
+
+unsigned int
+twopence_transaction_xmit_head_bytes(const twopence_transaction_t *trans)
+{
+	if (trans->xmit.head == NULL)
+		return 0;
+	return twopence_buf_count_total(trans->xmit.head->buffer);
+}
+
+twopence_buf_t *
+twopence_transaction_xmit_dequeue(twopence_transaction_t *trans)
+{
+	twopence_trans_packet_t *pkt;
+	twopence_buf_t *bp;
+
+	if ((pkt = trans->xmit.head) == NULL)
+		return NULL;
+
+	if ((trans->xmit.head = pkt->next) == NULL)
+		trans->xmit.tail = &trans->xmit.head;
+
+	bp = pkt->buffer;
+	free(pkt);
+
+	trans->xmit.bytes -= twopence_buf_count_total(bp);
+	trans->stats.nbytes_sent += twopence_buf_count_total(bp);
+	trans->stats.npackets_sent++;
+	return bp;
 }
 
 void
@@ -788,10 +1421,103 @@ twopence_transaction_send_minor(twopence_transaction_t *trans, unsigned int code
 {
 	twopence_debug("%s: send status.minor=%u", twopence_transaction_describe(trans), code);
 	assert(!trans->minor_sent);
+	twopence_transaction_send_stats(trans);
 	twopence_transaction_send_client(trans, twopence_protocol_build_minor_packet(&trans->ps, code));
 	trans->minor_sent = true;
 }
 
+/*
+ * Server side: finish the transaction. This sends the major status (if
+ * major >= 0), the given data and the EOF on the given channel (if
+ * eof_channel >= 0), the stats and the minor status - in a single
+ * COMPLETE packet if the client supports it.
+ */
+static void
+__twopence_transaction_send_complete(twopence_transaction_t *trans, int major, int minor, int eof_channel,
+				const void *data, unsigned int len)
+{
+	twopence_protocol_complete_t complete;
+	struct timeval now;
+	twopence_buf_t *bp;
+
+	assert(!trans->minor_sent);
+	assert(major < 0 || !trans->major_sent);
+
+	if (eof_channel >= 0 && eof_channel < TWOPENCE_STATS_MAX_CHANNELS)
+		trans->stats.channel_bytes_sent[eof_channel] += len;
+
+	if (!trans->send_complete) {
+		if (major >= 0)
+			twopence_transaction_send_major(trans, major);
+		if (data != NULL) {
+			bp = twopence_protocol_command_buffer_new();
+			twopence_buf_reserve_head(bp, TWOPENCE_PROTO_HEADER_SIZE + 2);
+			twopence_buf_append(bp, data, len);
+			twopence_protocol_build_data_header(bp, &trans->ps, eof_channel);
+			twopence_transaction_send_client(trans, bp);
+		}
+		if (eof_channel >= 0) {
+			/* The client considers an extract complete when it sees
+			 * the EOF, so the stats have to go out before it */
+			twopence_transaction_send_stats(trans);
+			twopence_transaction_send_client(trans,
+					twopence_protocol_build_eof_packet(&trans->ps, eof_channel));
+		}
+		twopence_transaction_send_minor(trans, minor);
+		return;
+	}
+
+	twopence_debug("%s: send completion, status=%d/%d", twopence_transaction_describe(trans), major, minor);
+
+	memset(&complete, 0, sizeof(complete));
+	if (major >= 0) {
+		complete.have_major = true;
+		complete.major = major;
+	}
+	complete.have_minor = true;
+	complete.minor = minor;
+
+	if (data != NULL) {
+		complete.have_data = true;
+		complete.data_channel = eof_channel;
+		complete.data = data;
+		complete.data_len = len;
+	}
+
+	if (eof_channel >= 0)
+		complete.eof[complete.neof++] = eof_channel;
+
+	if (trans->report_stats && !trans->stats_sent) {
+		gettimeofday(&now, NULL);
+		complete.have_stats = true;
+		complete.stats.server_spawn_time = twopence_transaction_usec_between(&trans->stats.created, &trans->stats.spawned);
+		complete.stats.server_run_time = twopence_transaction_usec_between(&trans->stats.created, &now);
+	}
+
+	if ((bp = twopence_protocol_build_complete_packet(&trans->ps, &complete)) != NULL)
+		twopence_transaction_send_client(trans, bp);
+	trans->major_sent = true;
+	trans->minor_sent = true;
+	trans->stats_sent = true;
+}
+
+void
+twopence_transaction_send_complete(twopence_transaction_t *trans, int major, int minor, int eof_channel)
+{
+	__twopence_transaction_send_complete(trans, major, minor, eof_channel, NULL, 0);
+}
+
+/*
+ * Same as above, but the final chunk of data on the channel goes out
+ * along with the EOF. Used for extracting small files inline.
+ */
+void
+twopence_transaction_send_complete_data(twopence_transaction_t *trans, int major, int minor, uint16_t channel,
+				const void *data, unsigned int len)
+{
+	__twopence_transaction_send_complete(trans, major, minor, channel, data, len);
+}
+
 /* XXX obsolete */
 void
 twopence_transaction_send_status(twopence_transaction_t *trans, twopence_status_t *st)
@@ -824,8 +1550,7 @@ twopence_transaction_fail(twopence_transaction_t *trans, int code)
 void
 twopence_transaction_fail2(twopence_transaction_t *trans, int major, int minor)
 {
-	twopence_transaction_send_major(trans, major);
-	twopence_transaction_send_minor(trans, minor);
+	twopence_transaction_send_complete(trans, major, minor, -1);
 	trans->done = 1;
 }
 
@@ -876,10 +1601,16 @@ twopence_transaction_find_source(twopence_transaction_t *trans, uint16_t id)
 /*
  * Transaction list primitives
  */
+static inline twopence_transaction_t **
+__twopence_transaction_list_bucket(const twopence_transaction_list_t *list, unsigned int xid)
+{
+	return (twopence_transaction_t **) &list->hash[xid & (TWOPENCE_TRANSACTION_HASH_SIZE - 1)];
+}
+
 void
 twopence_transaction_list_insert(twopence_transaction_list_t *list, twopence_transaction_t *trans)
 {
-	twopence_transaction_t *next;
+	twopence_transaction_t *next, **bucket;
 
 	assert(trans->prev == NULL);
 
@@ -888,6 +1619,13 @@ twopence_transaction_list_insert(twopence_transaction_list_t *list, twopence_tra
 	trans->next = next;
 	trans->prev = &list->head;
 	list->head = trans;
+
+	bucket = __twopence_transaction_list_bucket(list, trans->id);
+	if ((next = *bucket) != NULL)
+		next->hash_prev = &trans->hash_next;
+	trans->hash_next = next;
+	trans->hash_prev = bucket;
+	*bucket = trans;
 }
 
 void
@@ -899,4 +1637,23 @@ twopence_transaction_unlink(twopence_transaction_t *trans)
 		trans->next->prev = trans->prev;
 	trans->prev = NULL;
 	trans->next = NULL;
+
+	if (trans->hash_prev)
+		*(trans->hash_prev) = trans->hash_next;
+	if (trans->hash_next)
+		trans->hash_next->hash_prev = trans->hash_prev;
+	trans->hash_prev = NULL;
+	trans->hash_next = NULL;
+}
+
+twopence_transaction_t *
+twopence_transaction_list_find(const twopence_transaction_list_t *list, unsigned int xid)
+{
+	twopence_transaction_t *trans;
+
+	for (trans = *__twopence_transaction_list_bucket(list, xid); trans; trans = trans->hash_next) {
+		if (trans->id == xid)
+			return trans;
+	}
+	return NULL;
 }
@@ -27,11 +27,25 @@
 
 typedef struct twopence_transaction twopence_transaction_t;
 typedef struct twopence_trans_channel twopence_trans_channel_t;
+typedef struct twopence_trans_packet twopence_trans_packet_t;
+
+/* Send scheduling classes. Interactive transactions get a larger
+ * share of the link than bulk file transfers. */
+enum {
+	TWOPENCE_TRANSACTION_PRIO_BULK = 0,
+	TWOPENCE_TRANSACTION_PRIO_INTERACTIVE,
+
+	__TWOPENCE_TRANSACTION_PRIO_MAX
+};
 
 struct twopence_transaction {
 	twopence_transaction_t **prev;
 	twopence_transaction_t *next;
 
+	/* Chaining in the xid hash of the list we're on */
+	twopence_transaction_t **hash_prev;
+	twopence_transaction_t *hash_next;
+
 	unsigned int		type;
 	unsigned int		id;
 
@@ -51,9 +65,35 @@ struct twopence_transaction {
 	pid_t			pid;
 	int			status;
 
+	/* A pidfd referring to the child process, if the kernel supports it.
+	 * It becomes readable when the child exits, so that we need to
+	 * call waitpid() only then */
+	int			pidfd;
+	struct pollfd *		pidfd_poll;
+
 	twopence_trans_channel_t *local_sink;
 	twopence_trans_channel_t *local_source;
 
+	/* Packets waiting for the connection's scheduler to move them
+	 * to the transport socket */
+	struct {
+		twopence_trans_packet_t *head;
+		twopence_trans_packet_t **tail;
+		unsigned int	bytes;
+
+		int		prio;
+		unsigned int	deficit;
+	} xmit;
+
+	/* Coalescing of output from source channels (server side) */
+	struct {
+		unsigned int	max_bytes;
+		unsigned int	max_delay;	/* in usec */
+	} batch;
+
+	/* Per-channel flow control, if negotiated with the peer */
+	bool			flow_control;
+
 	struct {
 		struct timeval		deadline;
 		const struct timeval *	chat_deadline;
@@ -68,19 +108,63 @@ struct twopence_transaction {
 	struct {
 		unsigned int	nbytes_received;
 		unsigned int	nbytes_sent;
+		unsigned int	npackets_sent;
+		unsigned int	max_bytes_queued;
+
+		/* Payload bytes per channel */
+		unsigned long	channel_bytes_sent[TWOPENCE_STATS_MAX_CHANNELS];
+		unsigned long	channel_bytes_received[TWOPENCE_STATS_MAX_CHANNELS];
+
+		struct timeval	created;
+		struct timeval	request_sent;	/* client */
+		struct timeval	first_reply;	/* client */
+		struct timeval	spawned;	/* server */
+		struct timeval	completed;
+
+		/* As reported by the server */
+		unsigned long	server_spawn_time;
+		unsigned long	server_run_time;
 	} stats;
+
+	/* Server side: send a STATS packet before the final status */
+	bool			report_stats;
+	bool			stats_sent;
+
+	/* Server side: finish with a single COMPLETE packet */
+	bool			send_complete;
+
+	/* Small files may travel inside the request or the COMPLETE packet */
+	bool			inline_xfer;
+
+	/* Client side: inject data may go out before the server has opened the file */
+	bool			early_data;
+
+	/* Channels and other objects that live as long as the transaction
+	 * are allocated from here, and freed in one go */
+	twopence_arena_t	arena;
+	twopence_trans_channel_t *free_channels;
 };
 
+/* Must be a power of 2 */
+#define TWOPENCE_TRANSACTION_HASH_SIZE	256
+
 typedef struct twopence_transaction_list {
 	twopence_transaction_t *head;
+
+	/* With many concurrent transactions, we do not want to walk the
+	 * list for every packet we receive. */
+	twopence_transaction_t *hash[TWOPENCE_TRANSACTION_HASH_SIZE];
 } twopence_transaction_list_t;
 
 extern twopence_transaction_t *	twopence_transaction_new(twopence_sock_t *client, unsigned int type, const twopence_protocol_state_t *ps);
 extern void			twopence_transaction_free(twopence_transaction_t *trans);
 extern const char *		twopence_transaction_describe(const twopence_transaction_t *);
+extern unsigned long		twopence_transaction_usec_between(const struct timeval *from, const struct timeval *to);
 extern int			twopence_transaction_send_extract(twopence_transaction_t *, const twopence_file_xfer_t *);
 extern int			twopence_transaction_send_inject(twopence_transaction_t *, const twopence_file_xfer_t *);
+extern int			twopence_transaction_send_inject_inline(twopence_transaction_t *, const twopence_file_xfer_t *);
 extern int			twopence_transaction_send_command(twopence_transaction_t *, const twopence_command_t *);
+extern int			twopence_transaction_send_metrics(twopence_transaction_t *);
 extern int			twopence_transaction_send_interrupt(twopence_transaction_t *);
 extern twopence_trans_channel_t *twopence_transaction_attach_local_sink(twopence_transaction_t *trans, uint16_t id, int fd);
 extern twopence_trans_channel_t *twopence_transaction_attach_local_source(twopence_transaction_t *trans, uint16_t id, int fd);
@@ -89,15 +173,27 @@ extern twopence_trans_channel_t *twopence_transaction_attach_local_source_stream
 extern void			twopence_transaction_close_sink(twopence_transaction_t *trans, uint16_t id);
 extern void			twopence_transaction_close_source(twopence_transaction_t *trans, uint16_t id);
 extern unsigned int		twopence_transaction_num_channels(const twopence_transaction_t *trans);
+extern unsigned int		twopence_transaction_buffered_bytes(const twopence_transaction_t *trans);
 extern int			twopence_transaction_fill_poll(twopence_transaction_t *trans, twopence_pollinfo_t *);
+extern bool			twopence_transaction_child_exited(const twopence_transaction_t *trans);
 extern void			twopence_transaction_doio(twopence_transaction_t *trans);
 extern void			twopence_transaction_recv_packet(twopence_transaction_t *trans, const twopence_hdr_t *hdr, twopence_buf_t *payload);
 extern inline void		twopence_transaction_send_client(twopence_transaction_t *trans, twopence_buf_t *bp);
+extern bool			twopence_transaction_xmit_allowed(const twopence_transaction_t *trans);
+extern unsigned int		twopence_transaction_xmit_head_bytes(const twopence_transaction_t *trans);
+extern twopence_buf_t *		twopence_transaction_xmit_dequeue(twopence_transaction_t *trans);
 extern void			twopence_transaction_send_status(twopence_transaction_t *trans, twopence_status_t *st);
+extern void			twopence_transaction_set_batching(twopence_transaction_t *, unsigned int max_bytes, unsigned int max_delay);
+extern void			twopence_transaction_enable_flow_control(twopence_transaction_t *);
+extern void			twopence_transaction_send_stats(twopence_transaction_t *);
+extern void			twopence_transaction_get_stats(const twopence_transaction_t *, twopence_stats_t *);
 extern void			twopence_transaction_fail(twopence_transaction_t *, int);
 extern void			twopence_transaction_fail2(twopence_transaction_t *trans, int major, int minor);
 extern void			twopence_transaction_send_major(twopence_transaction_t *trans, unsigned int code);
 extern void			twopence_transaction_send_minor(twopence_transaction_t *trans, unsigned int code);
+extern void			twopence_transaction_send_complete(twopence_transaction_t *trans, int major, int minor, int eof_channel);
+extern void			twopence_transaction_send_complete_data(twopence_transaction_t *trans, int major, int minor, uint16_t channel,
+						const void *data, unsigned int len);
 extern void			twopence_transaction_send_timeout(twopence_transaction_t *trans);
 extern twopence_trans_channel_t *twopence_transaction_find_sink(twopence_transaction_t *trans, uint16_t channel);
 extern twopence_trans_channel_t *twopence_transaction_find_source(twopence_transaction_t *trans, uint16_t channel);
@@ -109,10 +205,22 @@ extern bool			twopence_transaction_update_timeout(const twopence_transaction_t *
 
 #define TWOPENCE_TRANSACTION_CHANNEL_ID_ALL	0xFFFF
 
+/* How much data a transaction may have queued before we stop
+ * reading from its sources */
+#define TWOPENCE_TRANSACTION_MAX_QUEUED		(4 * 65536)
+
+/* How much file data the client sends optimistically, before the
+ * server has confirmed that it was able to open the destination file */
+#define TWOPENCE_TRANSACTION_INJECT_WINDOW	(2 * TWOPENCE_PROTO_MAX_PACKET)
+
+/* Upper limit for the output batching delay, in usec */
+#define TWOPENCE_TRANSACTION_MAX_BATCH_DELAY	1000000
+
 extern bool			twopence_transaction_channel_is_read_eof(const twopence_trans_channel_t *);
 extern void			twopence_transaction_channel_set_callback_read_eof(twopence_trans_channel_t *, void (*fn)(twopence_transaction_t *, twopence_trans_channel_t *));
 extern void			twopence_transaction_channel_set_callback_write_eof(twopence_trans_channel_t *, void (*fn)(twopence_transaction_t *, twopence_trans_channel_t *));
 extern void			twopence_transaction_channel_set_plugged(twopence_trans_channel_t *, bool);
+extern void			twopence_transaction_channel_set_plug_window(twopence_trans_channel_t *, unsigned int);
 extern int			twopence_transaction_channel_flush(twopence_trans_channel_t *);
 extern uint16_t			twopence_transaction_channel_id(const twopence_trans_channel_t *);
 extern void			twopence_transaction_channel_set_name(twopence_trans_channel_t *, const char *);
@@ -120,6 +228,7 @@ extern const char *		twopence_transaction_channel_name(const twopence_trans_chan
 
 extern void			twopence_transaction_list_insert(twopence_transaction_list_t *, twopence_transaction_t *);
 extern void			twopence_transaction_unlink(twopence_transaction_t *);
+extern twopence_transaction_t *	twopence_transaction_list_find(const twopence_transaction_list_t *, unsigned int xid);
 
 static inline bool
 twopence_transaction_list_empty(const twopence_transaction_list_t *list)
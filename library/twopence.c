@@ -25,6 +25,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <errno.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <alloca.h>
 
 #include "twopence.h"
 #include "utils.h"
@@ -153,6 +154,8 @@ twopence_target_new(const char *target_spec, struct twopence_target **ret)
   char *spec_copy;
   int rv;
 
+  twopence_trace_ring_enable_from_env();
+
   spec_copy = twopence_strdup(target_spec);
   rv = __twopence_target_new(spec_copy, ret);
   free(spec_copy);
@@ -237,6 +240,81 @@ twopence_wait(struct twopence_target *target, int pid, twopence_status_t *status
   return target->ops->wait(target, pid, status);
 }
 
+int
+twopence_wait_output(struct twopence_target *target, int pid, const struct timeval *deadline)
+{
+  if (target->ops->chat_recv == NULL)
+    return TWOPENCE_UNSUPPORTED_FUNCTION_ERROR;
+
+  return target->ops->chat_recv(target, pid, deadline);
+}
+
+/*
+ * Event loop integration
+ */
+int
+twopence_count_pollfds(twopence_target_t *target)
+{
+  if (target->ops->count_pollfds == NULL)
+    return TWOPENCE_UNSUPPORTED_FUNCTION_ERROR;
+
+  return target->ops->count_pollfds(target);
+}
+
+int
+twopence_fill_poll(twopence_target_t *target, struct pollfd *pfd, unsigned int max_fds, struct timeval *deadline)
+{
+  twopence_pollinfo_t poll_info;
+
+  if (target->ops->fill_poll == NULL)
+    return TWOPENCE_UNSUPPORTED_FUNCTION_ERROR;
+
+  twopence_pollinfo_init(&poll_info, pfd, max_fds);
+  twopence_timers_update_timeout(&poll_info.timeout);
+  target->ops->fill_poll(target, &poll_info);
+
+  if (deadline)
+    *deadline = poll_info.timeout.until;
+  return poll_info.num_fds;
+}
+
+int
+twopence_doio(twopence_target_t *target)
+{
+  twopence_pollinfo_t poll_info;
+  unsigned int maxfds;
+  int rc;
+
+  if (target->ops->doio == NULL)
+    return TWOPENCE_UNSUPPORTED_FUNCTION_ERROR;
+
+  // The plugin's doio function looks at the poll results of the
+  // preceding fill_poll call, so we have to do a (non-blocking) poll
+  // of our own here.
+  maxfds = target->ops->count_pollfds(target);
+  twopence_pollinfo_init(&poll_info, alloca(maxfds * sizeof(struct pollfd)), maxfds);
+  target->ops->fill_poll(target, &poll_info);
+
+  if (poll(poll_info.pfd, poll_info.num_fds, 0) < 0 && errno != EINTR)
+    return TWOPENCE_INTERNAL_ERROR;
+
+  rc = target->ops->doio(target);
+
+  twopence_timers_run();
+  return rc;
+}
+
+int
+twopence_reap(twopence_target_t *target, int pid, twopence_status_t *status)
+{
+  memset(status, 0, sizeof(*status));
+
+  if (target->ops->reap == NULL)
+    return TWOPENCE_UNSUPPORTED_FUNCTION_ERROR;
+
+  return target->ops->reap(target, pid, status);
+}
+
 /*
  * Chat script support
  */
@@ -671,6 +749,15 @@ twopence_disconnect(twopence_target_t *target)
   return target->ops->disconnect(target);
 }
 
+int
+twopence_get_server_metrics(twopence_target_t *target, twopence_buf_t *report)
+{
+  if (target->ops->get_server_metrics == NULL)
+    return TWOPENCE_UNSUPPORTED_FUNCTION_ERROR;
+
+  return target->ops->get_server_metrics(target, report);
+}
+
 int
 twopence_interrupt_command(struct twopence_target *target)
 {
@@ -815,6 +902,45 @@ twopence_command_ostream_capture(twopence_command_t *cmd, twopence_iofd_t dst, t
     twopence_iostream_add_substream(stream, twopence_substream_new_buffer(bp, false));
 }
 
+/*
+ * Same as above, but grow the buffer as needed rather than truncating
+ * the output at the buffer's current size.
+ */
+void
+twopence_command_ostream_capture_resizable(twopence_command_t *cmd, twopence_iofd_t dst, twopence_buf_t *bp)
+{
+  twopence_iostream_t *stream;
+
+  if ((stream = __twopence_command_ostream(cmd, dst)) != NULL)
+    twopence_iostream_add_substream(stream, twopence_substream_new_buffer(bp, true));
+}
+
+/*
+ * Capture output into a segmented buffer. This is preferable to the
+ * resizable variant when the output may be large, as the data captured
+ * so far never gets copied around.
+ */
+void
+twopence_command_ostream_capture_rope(twopence_command_t *cmd, twopence_iofd_t dst, twopence_rope_t *rope)
+{
+  twopence_iostream_t *stream;
+
+  if ((stream = __twopence_command_ostream(cmd, dst)) != NULL)
+    twopence_iostream_add_substream(stream, twopence_substream_new_rope(rope));
+}
+
+/*
+ * Hand output to a callback as it arrives, rather than capturing it
+ */
+void
+twopence_command_ostream_callback(twopence_command_t *cmd, twopence_iofd_t dst, twopence_output_fn_t *callback, void *user_data)
+{
+  twopence_iostream_t *stream;
+
+  if ((stream = __twopence_command_ostream(cmd, dst)) != NULL)
+    twopence_iostream_add_substream(stream, twopence_substream_new_callback(callback, user_data));
+}
+
 void
 twopence_command_iostream_redirect(twopence_command_t *cmd, twopence_iofd_t dst, int fd, bool closeit)
 {
@@ -864,13 +990,33 @@ twopence_env_init(twopence_env_t *env)
 }
 
 static void
-__twopence_env_append(twopence_env_t *env, const char *var)
+__twopence_env_append_ref(twopence_env_t *env, twopence_arena_env_t *aenv, char *var)
 {
-	env->array = twopence_realloc(env->array, (env->count + 2) * sizeof(env->array[0]));
-	env->array[env->count++] = twopence_strdup(var);
+	if (aenv == NULL) {
+		env->array = twopence_realloc(env->array, (env->count + 2) * sizeof(env->array[0]));
+	} else if (env->count + 2 > aenv->size) {
+		unsigned int new_size = aenv->size? 2 * aenv->size : 16;
+		char **new_array;
+
+		new_array = twopence_arena_alloc(aenv->arena, new_size * sizeof(env->array[0]));
+		if (env->count)
+			memcpy(new_array, env->array, env->count * sizeof(env->array[0]));
+		env->array = new_array;
+		aenv->size = new_size;
+	}
+	env->array[env->count++] = var;
 	env->array[env->count] = NULL;
 }
 
+static void
+__twopence_env_append(twopence_env_t *env, twopence_arena_env_t *aenv, const char *var)
+{
+	if (aenv)
+		__twopence_env_append_ref(env, aenv, twopence_arena_strdup(aenv->arena, var));
+	else
+		__twopence_env_append_ref(env, NULL, twopence_strdup(var));
+}
+
 static char *
 __twopence_env_get(const twopence_env_t *env, const char *name, unsigned int *pos)
 {
@@ -893,33 +1039,66 @@ __twopence_env_get(const twopence_env_t *env, const char *name, unsigned int *po
 	return NULL;
 }
 
-void
-twopence_env_set(twopence_env_t *env, const char *name, const char *value)
+static void
+__twopence_env_unset(twopence_env_t *env, twopence_arena_env_t *aenv, const char *name)
+{
+	unsigned int pos, i;
+
+	while (__twopence_env_get(env, name, &pos) != NULL) {
+		if (aenv == NULL)
+			free(env->array[pos]);
+		for (i = pos + 1; i < env->count; )
+			env->array[pos++] = env->array[i++];
+		env->array[pos] = NULL;
+		env->count = pos;
+	}
+}
+
+static void
+__twopence_env_set(twopence_env_t *env, twopence_arena_env_t *aenv, const char *name, const char *value)
 {
 	if (value == NULL) {
-		twopence_env_unset(env, name);
+		__twopence_env_unset(env, aenv, name);
 	} else {
 		char buffer[1024];
 
 		snprintf(buffer, sizeof(buffer), "%s=%s", name, value);
-		__twopence_env_append(env, buffer);
+		__twopence_env_append(env, aenv, buffer);
 	}
 }
 
-void
-twopence_env_unset(twopence_env_t *env, const char *name)
+static void
+__twopence_env_merge_inferior(twopence_env_t *env, twopence_arena_env_t *aenv, const twopence_env_t *def_env)
 {
-	unsigned int pos, i;
+	unsigned int i, j;
 
-	while (__twopence_env_get(env, name, &pos) != NULL) {
-		free(env->array[pos]);
-		for (i = pos + 1; i < env->count; )
-			env->array[pos++] = env->array[i++];
-		env->array[pos] = NULL;
-		env->count = pos;
+	for (i = 0; i < def_env->count; ++i) {
+		char *var = def_env->array[i];
+		unsigned int len;
+		bool found = false;
+
+		len = strcspn(var, "=") + 1;
+		for (j = 0; j < env->count && !found; ++j) {
+			if (!strncmp(env->array[j], var, len))
+				found = true;
+		}
+		if (!found)
+			__twopence_env_append(env, aenv, var);
 	}
 }
 
+void
+twopence_env_set(twopence_env_t *env, const char *name, const char *value)
+{
+	__twopence_env_set(env, NULL, name, value);
+}
+
+void
+twopence_env_unset(twopence_env_t *env, const char *name)
+{
+	__twopence_env_unset(env, NULL, name);
+}
+
 void
 twopence_env_pass(twopence_env_t *env, const char *name)
 {
@@ -936,7 +1115,7 @@ twopence_env_copy(twopence_env_t *env, const twopence_env_t *src_env)
 
 	twopence_env_destroy(env);
 	for (i = 0; i < src_env->count; ++i)
-		__twopence_env_append(env, src_env->array[i]);
+		__twopence_env_append(env, NULL, src_env->array[i]);
 }
 
 /*
@@ -945,21 +1124,7 @@ twopence_env_copy(twopence_env_t *env, const twopence_env_t *src_env)
 void
 twopence_env_merge_inferior(twopence_env_t *env, const twopence_env_t *def_env)
 {
-	unsigned int i, j;
-
-	for (i = 0; i < def_env->count; ++i) {
-		char *var = def_env->array[i];
-		unsigned int len;
-		bool found = false;
-
-		len = strcspn(var, "=") + 1;
-		for (j = 0; j < env->count && !found; ++j) {
-			if (!strncmp(env->array[j], var, len))
-				found = true;
-		}
-		if (!found)
-			__twopence_env_append(env, var);
-	}
+	__twopence_env_merge_inferior(env, NULL, def_env);
 }
 
 void
@@ -973,6 +1138,61 @@ twopence_env_destroy(twopence_env_t *env)
 	memset(env, 0, sizeof(*env));
 }
 
+/*
+ * Arena backed environments.
+ * Variables are never freed individually, which also allows us to refer
+ * to strings we do not own.
+ */
+void
+twopence_arena_env_init(twopence_arena_env_t *aenv, twopence_env_t *env, twopence_arena_t *arena)
+{
+	memset(env, 0, sizeof(*env));
+	aenv->env = env;
+	aenv->arena = arena;
+	aenv->size = 0;
+}
+
+/*
+ * Add a NAME=VALUE string without copying it, replacing any earlier
+ * definition. The caller must make sure that it stays around as long as
+ * the environment is being used.
+ */
+void
+twopence_arena_env_set_ref(twopence_arena_env_t *aenv, char *var)
+{
+	char *value;
+
+	if ((value = strchr(var, '=')) == NULL)
+		return;
+
+	*value = '\0';
+	__twopence_env_unset(aenv->env, aenv, var);
+	*value = '=';
+	__twopence_env_append_ref(aenv->env, aenv, var);
+}
+
+void
+twopence_arena_env_set(twopence_arena_env_t *aenv, const char *name, const char *value)
+{
+	__twopence_env_set(aenv->env, aenv, name, value);
+}
+
+void
+twopence_arena_env_merge_inferior(twopence_arena_env_t *aenv, const twopence_env_t *def_env)
+{
+	__twopence_env_merge_inferior(aenv->env, aenv, def_env);
+}
+
+/*
+ * Arena memory is released along with the arena; just forget about it
+ */
+void
+twopence_arena_env_destroy(twopence_arena_env_t *aenv)
+{
+	memset(aenv->env, 0, sizeof(*aenv->env));
+	aenv->size = 0;
+}
+
 /*
  * File transfer object
  */
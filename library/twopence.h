@@ -22,16 +22,18 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #define TWOPENCE_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <sys/time.h>
 #include "buffer.h"
 
 struct pollfd;
+struct twopence_pollinfo;
 
 /* API versioning. These values correspond directly to the
  * shared library version numbers */
 #define TWOPENCE_API_MAJOR_VERSION	0
-#define TWOPENCE_API_MINOR_VERSION	3
+#define TWOPENCE_API_MINOR_VERSION	4
 
 /*
  * Error codes.
@@ -63,6 +65,31 @@ struct pollfd;
 
 typedef struct twopence_target twopence_target_t;
 
+/*
+ * Statistics for a completed command or file transfer.
+ * Byte counts are per channel (stdin, stdout, stderr for commands;
+ * file transfers use channel 0 only), and count payload data only.
+ * All times are in microseconds. A value of 0 means the time is
+ * not known, eg because the plugin or the server does not report it.
+ */
+#define TWOPENCE_STATS_MAX_CHANNELS	3
+
+typedef struct twopence_stats {
+	unsigned long		bytes_sent[TWOPENCE_STATS_MAX_CHANNELS];
+	unsigned long		bytes_received[TWOPENCE_STATS_MAX_CHANNELS];
+
+	unsigned long		packets_sent;		/* including the request */
+	unsigned long		max_bytes_queued;	/* most data waiting to be sent at any time */
+
+	unsigned long		queue_time;		/* until the request was handed to the transport */
+	unsigned long		first_byte_time;	/* from sending the request until the first reply */
+	unsigned long		wall_time;		/* from submitting the request until completion */
+
+	/* These are reported by the server */
+	unsigned long		server_spawn_time;	/* from receiving the request until the command was started */
+	unsigned long		server_run_time;	/* from receiving the request until completion */
+} twopence_stats_t;
+
 /*
  * Executing commands on the SUT always returns two status words -
  * major:	this is the status of the twopence test server,
@@ -72,6 +99,7 @@ typedef struct twopence_target twopence_target_t;
  * pid:		the pid of the command. This is mostly useful
  *		when wait() returns an error, and you wish to
  *		know which command errored out.
+ * stats:	timing and byte counts, see above.
  *
  * FIXME: we should dissect the status code on the SUT rather than
  * the system running twopence, as the exit code, signal information
@@ -84,6 +112,8 @@ typedef struct twopence_status {
 	int			major;
 	int			minor;
 	int			pid;
+
+	twopence_stats_t	stats;
 } twopence_status_t;
 
 /* Forward decls for the plugin functions */
@@ -111,7 +141,18 @@ struct twopence_plugin {
 	int			(*interrupt_command)(struct twopence_target *);
 	int			(*cancel_transactions)(twopence_target_t *);
 	int			(*disconnect)(twopence_target_t *);
+	int			(*get_server_metrics)(twopence_target_t *, twopence_buf_t *);
+	int			(*serve_mux)(twopence_target_t *, const char *);
 	void			(*end)(struct twopence_target *);
+
+	/* Event loop integration. These are optional, and allow
+	 * the I/O of several targets to be driven from a single
+	 * poll loop (see twopence_group_run).
+	 * reap() is like wait(), except that it never blocks. */
+	unsigned int		(*count_pollfds)(twopence_target_t *);
+	int			(*fill_poll)(twopence_target_t *, struct twopence_pollinfo *);
+	int			(*doio)(twopence_target_t *);
+	int			(*reap)(twopence_target_t *, int, twopence_status_t *);
 };
 
 enum {
@@ -148,6 +189,9 @@ typedef enum {
 
 typedef struct twopence_substream twopence_substream_t;
 
+/* Callback for consuming command output as it arrives */
+typedef void		twopence_output_fn_t(const void *data, size_t len, void *user_data);
+
 
 #define TWOPENCE_IOSTREAM_MAX_SUBSTREAMS	4
 struct twopence_iostream {
@@ -200,6 +244,16 @@ struct twopence_command {
 	twopence_iostream_t	iostream[__TWOPENCE_IO_MAX];
 
 	twopence_buf_t		buffer[__TWOPENCE_IO_MAX];
+
+	/* Have the server coalesce the command's output into fewer,
+	 * larger packets. Output is held back until max_bytes have
+	 * accumulated, or max_delay microseconds have passed.
+	 * Zero disables batching; it is always off for tty commands.
+	 */
+	struct {
+		unsigned int	max_bytes;
+		unsigned int	max_delay;
+	} batch;
 };
 
 typedef struct twopence_remote_file twopence_remote_file_t;
@@ -310,16 +364,17 @@ extern int		twopence_target_new(const char *target_spec, struct twopence_target
 /*
  * Set target-specific options
  *
- * Currently, the only use we have for this is to tune the keepalive
- * values; and the only reason we want to do this is to test keepalive :-)
- * Not sure whether this warrant a first-class interface, but I had
- * no better idea.
+ * This is used to tune the keepalive values (mostly for testing them),
+ * and to have file transfers use a link of their own, so that they do not
+ * delay commands and chats running concurrently. The latter is supported
+ * by the tcp, chroot and local targets only.
  */
 extern int		twopence_target_set_option(struct twopence_target *,
 					int option, const void *value_p);
 
 enum {
 	TWOPENCE_TARGET_OPTION_KEEPALIVE = 0,	/* value_p is an int pointer */
+	TWOPENCE_TARGET_OPTION_BULK_LINK = 1,	/* value_p is an int pointer */
 };
 
 /*
@@ -360,6 +415,44 @@ extern int		twopence_run_test(struct twopence_target *, twopence_command_t *, tw
  */
 extern int		twopence_wait(struct twopence_target *, int, twopence_status_t *);
 
+/*
+ * Wait for a backgrounded command to produce more output, which is
+ * written to the command's output streams. Use this together with
+ * twopence_command_ostream_callback() to process the output of a command
+ * while it is running, rather than buffering all of it.
+ *
+ * While nobody waits, nothing is received from the target; the server
+ * stops reading the command's output once its send queue is full, and
+ * the command eventually blocks. This provides backpressure.
+ *
+ * Returns:
+ *  < 0:	an error occured (including a timeout when @deadline passes)
+ *  0:		the command has completed; use twopence_wait() to collect its status
+ *  > 0:	the number of bytes received
+ */
+extern int		twopence_wait_output(struct twopence_target *, int, const struct timeval *deadline);
+
+/*
+ * Integrate a target into an application's own event loop.
+ *
+ * twopence_count_pollfds() returns an upper bound on the number of
+ * file descriptors the target currently needs to watch.
+ *
+ * twopence_fill_poll() fills in the pollfd array, and returns the number
+ * of entries used. If the target or a timer created with twopence_timer_create()
+ * has a pending timeout, @deadline is set to the time when the application should
+ * call twopence_doio() even if no fd became ready; otherwise it is cleared.
+ *
+ * twopence_doio() processes all pending I/O without blocking.
+ *
+ * twopence_reap() is a non-blocking twopence_wait(). It returns 0 if
+ * no matching command has completed yet.
+ */
+extern int		twopence_count_pollfds(twopence_target_t *);
+extern int		twopence_fill_poll(twopence_target_t *, struct pollfd *, unsigned int max_fds, struct timeval *deadline);
+extern int		twopence_doio(twopence_target_t *);
+extern int		twopence_reap(twopence_target_t *, int, twopence_status_t *);
+
 /*
  * Initialize a chat object
  */
@@ -553,6 +646,51 @@ extern int		twopence_cancel_transactions(twopence_target_t *target);
  */
 extern int		twopence_disconnect(twopence_target_t *target);
 
+/*
+ * Ask the test server for its metrics: number of connections and
+ * transactions, packets and bytes per packet type, poll loop
+ * iterations, spawn latency, etc.
+ *
+ * Input:
+ *   handle: the handle returned by the initialization function
+ *   report: a buffer that receives the report. The report is
+ *     text, with one "name value" pair per line.
+ *
+ * Output:
+ *   Returns 0 if everything went fine, and
+ *   TWOPENCE_UNSUPPORTED_FUNCTION_ERROR if the target has no
+ *   test server, or the server is too old.
+ */
+extern int		twopence_get_server_metrics(twopence_target_t *target, twopence_buf_t *report);
+
+/*
+ * Connection multiplexing
+ *
+ * twopence_mux_serve() keeps a single connection to the target's test
+ * server open, and relays the transactions of any number of clients
+ * connecting to a UNIX domain socket over it. This saves short-lived
+ * clients (such as the shell tools) the cost of setting up a new
+ * link for every call.
+ *
+ * twopence_target_new_mux() is like twopence_target_new(), except that
+ * it connects through the multiplexer for target_spec if one is running.
+ *
+ * twopence_mux_socket_path() returns the default socket path for the
+ * given target (malloc'ed), or NULL if none can be built. The directory
+ * can be changed by setting TWOPENCE_MUX_DIR in the environment.
+ *
+ * twopence_mux_is_running() checks whether a multiplexer is accepting
+ * connections on the given socket.
+ *
+ * twopence_mux_serve() returns when the link to the server is closed;
+ * it returns TWOPENCE_UNSUPPORTED_FUNCTION_ERROR for targets that do
+ * not use the twopence protocol (such as ssh).
+ */
+extern char *		twopence_mux_socket_path(const char *target_spec);
+extern bool		twopence_mux_is_running(const char *socket_path);
+extern int		twopence_mux_serve(twopence_target_t *target, const char *socket_path);
+extern int		twopence_target_new_mux(const char *target_spec, twopence_target_t **ret);
+
 /*
  * Interrupt current command
  *
@@ -567,6 +705,49 @@ extern int		twopence_disconnect(twopence_target_t *target);
 extern int		twopence_interrupt_command(struct twopence_target *target);
 
 
+/*
+ * Target groups
+ *
+ * A group lets you run the same command on many targets at
+ * once. All targets are driven from a single event loop, so
+ * the command executes concurrently on all of them.
+ */
+typedef struct twopence_group twopence_group_t;
+typedef struct twopence_group_result twopence_group_result_t;
+
+struct twopence_group_result {
+	twopence_target_t *	target;
+
+	/* 0 if the command was executed, or a (negative) twopence
+	 * error code if it could not be started or completed */
+	int			rc;
+	twopence_status_t	status;
+
+	/* The command's standard output and standard error, indexed
+	 * by TWOPENCE_STDOUT and TWOPENCE_STDERR */
+	twopence_buf_t		buffer[__TWOPENCE_IO_MAX];
+};
+
+extern twopence_group_t *twopence_group_new(void);
+extern void		twopence_group_free(twopence_group_t *);
+extern int		twopence_group_add_target(twopence_group_t *, twopence_target_t *);
+extern unsigned int	twopence_group_count(const twopence_group_t *);
+
+/*
+ * Run the command on all targets of the group, and wait for all of
+ * them to complete.
+ * Only the command line, user, timeout, tty and environment settings
+ * of @cmd are used; the iostreams are ignored. Each target's output is
+ * captured in its result struct, which can be obtained via
+ * twopence_group_result().
+ *
+ * Returns the number of targets on which the command failed with a
+ * local error or a non-zero exit status, or a negative error code.
+ */
+extern int		twopence_group_run(twopence_group_t *, const twopence_command_t *cmd);
+extern const twopence_group_result_t *
+			twopence_group_result(const twopence_group_t *, unsigned int index);
+
 /*
  * Create a global timer.
  */
@@ -598,6 +779,9 @@ extern twopence_buf_t *	twopence_command_alloc_buffer(twopence_command_t *, twop
 extern void		twopence_command_ostreams_reset(twopence_command_t *);
 extern void		twopence_command_ostream_reset(twopence_command_t *, twopence_iofd_t);
 extern void		twopence_command_ostream_capture(twopence_command_t *, twopence_iofd_t, twopence_buf_t *);
+extern void		twopence_command_ostream_capture_resizable(twopence_command_t *, twopence_iofd_t, twopence_buf_t *);
+extern void		twopence_command_ostream_capture_rope(twopence_command_t *, twopence_iofd_t, twopence_rope_t *);
+extern void		twopence_command_ostream_callback(twopence_command_t *, twopence_iofd_t, twopence_output_fn_t *, void *user_data);
 extern void		twopence_command_iostream_redirect(twopence_command_t *, twopence_iofd_t, int, bool closeit);
 
 extern void		twopence_env_init(twopence_env_t *env);
@@ -618,9 +802,11 @@ extern void		twopence_file_xfer_destroy(twopence_file_xfer_t *xfer);
  * Output handling functions
  */
 extern int		twopence_iostream_open_file(const char *filename, twopence_iostream_t **ret);
+extern int		twopence_iostream_open_mapped(const char *filename, twopence_iostream_t **ret);
 extern int		twopence_iostream_create_file(const char *filename, unsigned int permissions, twopence_iostream_t **ret);
 extern int		twopence_iostream_wrap_fd(int fd, bool closeit, twopence_iostream_t **ret);
 extern int		twopence_iostream_wrap_buffer(twopence_buf_t *bp, bool resizable, twopence_iostream_t **ret);
+extern int		twopence_iostream_wrap_rope(twopence_rope_t *rope, twopence_iostream_t **ret);
 extern void		twopence_iostream_free(twopence_iostream_t *);
 extern void		twopence_iostream_add_substream(twopence_iostream_t *, twopence_substream_t *);
 extern void		twopence_iostream_destroy(twopence_iostream_t *);
@@ -636,7 +822,10 @@ extern long		twopence_iostream_filesize(twopence_iostream_t *);
 extern int		twopence_iostream_getfd(twopence_iostream_t *);
 
 extern twopence_substream_t *twopence_substream_new_buffer(twopence_buf_t *, bool resizable);
+extern twopence_substream_t *twopence_substream_new_rope(twopence_rope_t *);
+extern twopence_substream_t *twopence_substream_new_mmap(int fd);
 extern twopence_substream_t *twopence_substream_new_fd(int fd, bool closeit);
+extern twopence_substream_t *twopence_substream_new_callback(twopence_output_fn_t *, void *user_data);
 extern void		twopence_substream_close(twopence_substream_t *);
 
 /*
@@ -670,4 +859,63 @@ extern unsigned int	twopence_debug_level;
 #define twopence_debug(fmt...)   __twopence_debug(1, fmt)
 #define twopence_debug2(fmt...)  __twopence_debug(2, fmt)
 
+/*
+ * Binary trace ring.
+ *
+ * This records compact trace events into a per-process ring buffer,
+ * without any formatting or locking, so that it can stay enabled
+ * without changing the timing much. The ring is written to a file
+ * at exit, or whenever the process receives the signal passed to
+ * twopence_trace_ring_dump_on_signal(). Use twopence_tracedump(1)
+ * to decode it.
+ *
+ * Clients of the library can enable the ring by setting the
+ * environment variable TWOPENCE_TRACE_RING to the path of the
+ * dump file.
+ */
+#define TWOPENCE_TRACE_RING_MAGIC	"2pcTRACE"
+#define TWOPENCE_TRACE_RING_VERSION	1
+#define TWOPENCE_TRACE_RING_DEFAULT_SIZE 65536
+
+enum {
+	TWOPENCE_TRACE_PACKET_IN = 1,	/* arg0: packet type, arg1: length */
+	TWOPENCE_TRACE_PACKET_OUT,	/* arg0: packet type, arg1: length */
+	TWOPENCE_TRACE_TRANS_NEW,	/* arg0: transaction type */
+	TWOPENCE_TRACE_TRANS_ERROR,	/* arg0: negated error code */
+	TWOPENCE_TRACE_TRANS_FREE,	/* arg0: major, arg1: minor status */
+	TWOPENCE_TRACE_POLL_WAKEUP,	/* arg0: ppoll return value, arg1: nfds */
+	TWOPENCE_TRACE_TIMER_FIRE,	/* arg0: timer id */
+};
+
+typedef struct twopence_trace_event {
+	uint64_t		timestamp;	/* CLOCK_MONOTONIC, in nsec */
+	uint32_t		seq;		/* 0 if the slot is unused or being written */
+	uint16_t		type;
+	uint16_t		xid;
+	uint32_t		arg[2];
+} twopence_trace_event_t;
+
+typedef struct twopence_trace_ring_header {
+	char			magic[8];
+	uint32_t		version;
+	uint32_t		pid;
+	uint32_t		size;		/* number of events following the header */
+	uint32_t		head;		/* sequence number of the next event */
+} twopence_trace_ring_header_t;
+
+extern bool		twopence_trace_ring_enable(const char *dump_path, unsigned int size);
+extern bool		twopence_trace_ring_enable_from_env(void);
+extern void		twopence_trace_ring_dump_on_signal(int signo);
+extern int		twopence_trace_ring_dump(int fd);
+extern const char *	twopence_trace_ring_describe(const twopence_trace_event_t *, char *buf, size_t size);
+extern void		__twopence_trace_ring_event(unsigned int type, unsigned int xid, unsigned int arg0, unsigned int arg1);
+
+extern bool		twopence_trace_ring_active;
+
+#define twopence_trace_event(type, xid, arg0, arg1) \
+			do { \
+				if (twopence_trace_ring_active) \
+					__twopence_trace_ring_event(type, xid, arg0, arg1); \
+			} while (0)
+
 #endif /* TWOPENCE_H */
@@ -64,7 +64,7 @@ twopence_timeout_msec(const twopence_timeout_t *tmo)
 struct timespec *
 twopence_timeout_timespec(const twopence_timeout_t *tmo)
 {
-	static struct timespec value;
+	static __thread struct timespec value;
 	struct timeval delta;
 
 	if (!timerisset(&tmo->until))
@@ -117,9 +117,13 @@ twopence_pollinfo_poll(const twopence_pollinfo_t *pinfo)
 int
 twopence_pollinfo_ppoll(const twopence_pollinfo_t *pinfo, const sigset_t *mask)
 {
+	int nready;
+
 	if (pinfo->num_fds == 0)
 		twopence_debug("No events to wait for?!\n");
-	return ppoll(pinfo->pfd, pinfo->num_fds, twopence_timeout_timespec(&pinfo->timeout), mask);
+	nready = ppoll(pinfo->pfd, pinfo->num_fds, twopence_timeout_timespec(&pinfo->timeout), mask);
+	twopence_trace_event(TWOPENCE_TRACE_POLL_WAKEUP, 0, nready, pinfo->num_fds);
+	return nready;
 }
 
 /*
@@ -238,3 +242,72 @@ twopence_strfree(char **sp)
 	  *sp = NULL;
   }
 }
+
+/*
+ * Arena allocation
+ */
+struct twopence_arena_chunk {
+	struct twopence_arena_chunk *next;
+	max_align_t		data[];
+};
+
+void
+twopence_arena_init(twopence_arena_t *arena)
+{
+	arena->chunks = NULL;
+	arena->next = (char *) arena->initial;
+	arena->left = sizeof(arena->initial);
+}
+
+void
+twopence_arena_destroy(twopence_arena_t *arena)
+{
+	struct twopence_arena_chunk *chunk;
+
+	while ((chunk = arena->chunks) != NULL) {
+		arena->chunks = chunk->next;
+		free(chunk);
+	}
+	twopence_arena_init(arena);
+}
+
+/*
+ * Allocate zeroed memory that is released by twopence_arena_destroy()
+ */
+void *
+twopence_arena_alloc(twopence_arena_t *arena, size_t size)
+{
+	struct twopence_arena_chunk *chunk;
+	void *p;
+
+	size = (size + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+	if (size > arena->left) {
+		/* Large objects get a chunk of their own, so that we do not
+		 * throw away what's left of the current one */
+		if (size > TWOPENCE_ARENA_CHUNK_SIZE / 4) {
+			chunk = twopence_calloc(1, sizeof(*chunk) + size);
+			chunk->next = arena->chunks;
+			arena->chunks = chunk;
+			return chunk->data;
+		}
+
+		chunk = twopence_malloc(sizeof(*chunk) + TWOPENCE_ARENA_CHUNK_SIZE);
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+		arena->next = (char *) chunk->data;
+		arena->left = TWOPENCE_ARENA_CHUNK_SIZE;
+	}
+
+	p = arena->next;
+	arena->next += size;
+	arena->left -= size;
+	return memset(p, 0, size);
+}
+
+char *
+twopence_arena_strdup(twopence_arena_t *arena, const char *s)
+{
+	size_t len = strlen(s) + 1;
+
+	return memcpy(twopence_arena_alloc(arena, len), s, len);
+}
@@ -22,8 +22,13 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include <sys/types.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <poll.h>
 
+struct twopence_buf;
+struct twopence_iostream;
+struct twopence_env;
+
 typedef struct twopence_timeout {
 	struct timeval		now;
 	struct timeval		until;
@@ -36,6 +41,32 @@ typedef struct twopence_pollinfo {
 	twopence_timeout_t	timeout;
 } twopence_pollinfo_t;
 
+/*
+ * Simple bump allocator for objects that all go away at the same time.
+ * The first few allocations are served from the arena struct itself.
+ */
+#define TWOPENCE_ARENA_INITIAL_SIZE	512
+#define TWOPENCE_ARENA_CHUNK_SIZE	4096
+
+typedef struct twopence_arena {
+	struct twopence_arena_chunk *chunks;
+	char *			next;
+	size_t			left;
+
+	max_align_t		initial[TWOPENCE_ARENA_INITIAL_SIZE / sizeof(max_align_t)];
+} twopence_arena_t;
+
+/*
+ * An environment whose array and variables come from an arena. It wraps
+ * a regular twopence_env_t, so that the public struct does not change;
+ * only use the twopence_arena_env functions on it.
+ */
+typedef struct twopence_arena_env {
+	struct twopence_env *	env;
+	twopence_arena_t *	arena;
+	unsigned int		size;
+} twopence_arena_env_t;
+
 typedef struct twopence_timer_list {
 	struct twopence_timer *		head;
 } twopence_timer_list_t;
@@ -57,6 +88,17 @@ extern void *		twopence_calloc(size_t nmemb, size_t size);
 extern char *		twopence_strdup(const char *s);
 extern void		twopence_strfree(char **sp);
 
+extern void		twopence_arena_init(twopence_arena_t *);
+extern void		twopence_arena_destroy(twopence_arena_t *);
+extern void *		twopence_arena_alloc(twopence_arena_t *, size_t size);
+extern char *		twopence_arena_strdup(twopence_arena_t *, const char *s);
+
+extern void		twopence_arena_env_init(twopence_arena_env_t *, struct twopence_env *, twopence_arena_t *);
+extern void		twopence_arena_env_set_ref(twopence_arena_env_t *, char *var);
+extern void		twopence_arena_env_set(twopence_arena_env_t *, const char *name, const char *value);
+extern void		twopence_arena_env_merge_inferior(twopence_arena_env_t *, const struct twopence_env *);
+extern void		twopence_arena_env_destroy(twopence_arena_env_t *);
+
 extern void		twopence_timer_list_insert(twopence_timer_list_t *list, struct twopence_timer *timer);
 extern void		twopence_timer_list_update_timeout(twopence_timer_list_t *, twopence_timeout_t *);
 extern void		twopence_timer_list_expire(twopence_timer_list_t *list);
@@ -64,6 +106,20 @@ extern void		twopence_timer_list_reap(twopence_timer_list_t *list, twopence_time
 extern void		twopence_timer_list_invoke(twopence_timer_list_t *list);
 extern void		twopence_timer_list_destroy(twopence_timer_list_t *list);
 
+/*
+ * Buffers carrying data by reference. These are internal to the library;
+ * the public twopence_buf_t only has a flag telling whether a buffer is one.
+ */
+extern struct twopence_buf *twopence_buf_new_ref(size_t size);
+extern unsigned int	twopence_buf_count_total(const struct twopence_buf *);
+extern void		twopence_buf_attach_ref(struct twopence_buf *, const void *data, unsigned int len,
+					void (*release)(void *), void *cookie);
+extern const void *	twopence_buf_ref_data(const struct twopence_buf *, unsigned int *lenp);
+extern void		twopence_buf_advance_ref(struct twopence_buf *, unsigned int len);
+extern bool		twopence_iostream_can_read_ref(const struct twopence_iostream *);
+extern int		twopence_iostream_read_ref(struct twopence_iostream *, struct twopence_buf *, size_t);
+extern int		twopence_iostream_unread(struct twopence_iostream *, struct twopence_buf *);
+
 extern void		twopence_timers_update_timeout(twopence_timeout_t *tmo);
 extern void		twopence_timers_run(void);
 
@@ -137,5 +137,11 @@ const struct twopence_plugin twopence_virtio_ops = {
 	.interrupt_command = twopence_pipe_interrupt_command,
 	.cancel_transactions = twopence_pipe_cancel_transactions,
 	.disconnect = twopence_pipe_disconnect,
+	.get_server_metrics = twopence_pipe_get_server_metrics,
+	.serve_mux = twopence_pipe_serve_mux,
 	.end = twopence_pipe_end,
+	.count_pollfds = twopence_pipe_count_pollfds,
+	.fill_poll = twopence_pipe_fill_poll,
+	.doio = twopence_pipe_doio,
+	.reap = twopence_pipe_reap,
 };
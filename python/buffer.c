@@ -0,0 +1,287 @@
+/*
+Twopence python bindings - class Buffer
+
+Copyright (C) 2016 SUSE
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 2.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include "extension.h"
+
+#include <limits.h>
+
+#include "twopence.h"
+
+/*
+ * Output buffers whose expected size is at least this big are backed by
+ * an anonymous mapping rather than the heap.
+ */
+#define BUFFER_MAP_THRESHOLD	(1024 * 1024)
+
+static void		Buffer_dealloc(twopence_Buffer *self);
+static PyObject *	Buffer_new(PyTypeObject *type, PyObject *args, PyObject *kwds);
+static int		Buffer_init(twopence_Buffer *self, PyObject *args, PyObject *kwds);
+static PyObject *	Buffer_getattr(twopence_Buffer *self, char *name);
+static PyObject *	Buffer_str(twopence_Buffer *self);
+static Py_ssize_t	Buffer_length(twopence_Buffer *self);
+static PyObject *	Buffer_clear(twopence_Buffer *, PyObject *, PyObject *);
+
+/*
+ * Define the python bindings of class "Buffer"
+ *
+ * A Buffer holds the captured output of a command, and exposes it
+ * through the buffer protocol, so that it can be wrapped in a
+ * memoryview or written to a file without copying it.
+ */
+static PyMethodDef twopence_bufferMethods[] = {
+      {	"clear", (PyCFunction) Buffer_clear, METH_VARARGS | METH_KEYWORDS,
+	"Discard the buffer's content"
+      },
+      {	NULL }
+};
+
+static Py_ssize_t
+Buffer_getreadbuffer(twopence_Buffer *self, Py_ssize_t segment, void **ptr)
+{
+	if (segment != 0) {
+		PyErr_SetString(PyExc_SystemError, "accessing non-existent twopence.Buffer segment");
+		return -1;
+	}
+	*ptr = (void *) twopence_buf_head(&self->buf);
+	return twopence_buf_count(&self->buf);
+}
+
+static Py_ssize_t
+Buffer_getsegcount(twopence_Buffer *self, Py_ssize_t *lenp)
+{
+	if (lenp)
+		*lenp = twopence_buf_count(&self->buf);
+	return 1;
+}
+
+static int
+Buffer_getbuffer(twopence_Buffer *self, Py_buffer *view, int flags)
+{
+	void *data = (void *) twopence_buf_head(&self->buf);
+
+	if (PyBuffer_FillInfo(view, (PyObject *) self, data, twopence_buf_count(&self->buf), 1, flags) < 0)
+		return -1;
+
+	self->exports++;
+	return 0;
+}
+
+static void
+Buffer_releasebuffer(twopence_Buffer *self, Py_buffer *view)
+{
+	self->exports--;
+}
+
+static PyBufferProcs twopence_bufferProcs = {
+	.bf_getreadbuffer	= (readbufferproc) Buffer_getreadbuffer,
+	.bf_getsegcount		= (segcountproc) Buffer_getsegcount,
+	.bf_getcharbuffer	= (charbufferproc) Buffer_getreadbuffer,
+	.bf_getbuffer		= (getbufferproc) Buffer_getbuffer,
+	.bf_releasebuffer	= (releasebufferproc) Buffer_releasebuffer,
+};
+
+static PySequenceMethods twopence_bufferSequence = {
+	.sq_length		= (lenfunc) Buffer_length,
+};
+
+PyTypeObject twopence_BufferType = {
+	PyObject_HEAD_INIT(NULL)
+
+	.tp_name	= "twopence.Buffer",
+	.tp_basicsize	= sizeof(twopence_Buffer),
+	.tp_flags	= Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_NEWBUFFER,
+	.tp_doc		= "Twopence output buffer",
+
+	.tp_methods	= twopence_bufferMethods,
+	.tp_init	= (initproc) Buffer_init,
+	.tp_new		= Buffer_new,
+	.tp_dealloc	= (destructor) Buffer_dealloc,
+
+	.tp_getattr	= (getattrfunc) Buffer_getattr,
+	.tp_str		= (reprfunc) Buffer_str,
+	.tp_as_sequence	= &twopence_bufferSequence,
+	.tp_as_buffer	= &twopence_bufferProcs,
+};
+
+/*
+ * Constructor: allocate empty Buffer object, and set its members.
+ */
+static PyObject *
+Buffer_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+	twopence_Buffer *self;
+
+	self = (twopence_Buffer *) type->tp_alloc(type, 0);
+	if (self == NULL)
+		return NULL;
+
+	/* init members */
+	twopence_buf_init(&self->buf);
+	self->expectedSize = 0;
+	self->exports = 0;
+
+	return (PyObject *)self;
+}
+
+/*
+ * Initialize the buffer object
+ *
+ * Buffer(size = 0)
+ *
+ * The size is the amount of output expected, which is used to
+ * preallocate the capture buffer.
+ */
+static int
+Buffer_init(twopence_Buffer *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {
+		"size",
+		NULL
+	};
+	unsigned long size = 0;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|k", kwlist, &size))
+		return -1;
+
+	if (size > UINT_MAX) {
+		PyErr_SetString(PyExc_ValueError, "twopence.Buffer: size too large");
+		return -1;
+	}
+
+	self->expectedSize = size;
+	return 0;
+}
+
+/*
+ * Destructor: clean any state inside the Buffer object
+ */
+static void
+Buffer_dealloc(twopence_Buffer *self)
+{
+	twopence_buf_destroy(&self->buf);
+}
+
+int
+Buffer_Check(PyObject *self)
+{
+	return PyType_IsSubtype(Py_TYPE(self), &twopence_BufferType);
+}
+
+static Py_ssize_t
+Buffer_length(twopence_Buffer *self)
+{
+	return twopence_buf_count(&self->buf);
+}
+
+static PyObject *
+Buffer_str(twopence_Buffer *self)
+{
+	return PyString_FromStringAndSize(twopence_buf_head(&self->buf), twopence_buf_count(&self->buf));
+}
+
+static PyObject *
+Buffer_getattr(twopence_Buffer *self, char *name)
+{
+	if (!strcmp(name, "size"))
+		return PyLong_FromUnsignedLong(self->expectedSize);
+	if (!strcmp(name, "mapped"))
+		return return_bool(self->buf.mapped);
+
+	return Py_FindMethod(twopence_bufferMethods, (PyObject *) self, name);
+}
+
+bool
+Buffer_modifiable(twopence_Buffer *self)
+{
+	if (self->exports) {
+		PyErr_SetString(PyExc_BufferError, "twopence.Buffer is in use by a memoryview");
+		return false;
+	}
+	return true;
+}
+
+static PyObject *
+Buffer_clear(twopence_Buffer *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {
+		NULL
+	};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "", kwlist))
+		return NULL;
+
+	if (!Buffer_modifiable(self))
+		return NULL;
+
+	twopence_buf_destroy(&self->buf);
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+/*
+ * Prepare the command's capture buffer for output that will end up
+ * in this Buffer object.
+ */
+twopence_buf_t *
+Buffer_prepareCapture(twopence_Buffer *self, twopence_command_t *cmd, twopence_iofd_t dst)
+{
+	twopence_buf_t *bp;
+
+	if (self->expectedSize < BUFFER_MAP_THRESHOLD)
+		return twopence_command_alloc_buffer(cmd, dst, self->expectedSize? self->expectedSize : 65536);
+
+	bp = twopence_command_alloc_buffer(cmd, dst, 0);
+	if (!twopence_buf_init_mapped(bp, self->expectedSize))
+		twopence_buf_resize(bp, self->expectedSize);
+	return bp;
+}
+
+/*
+ * Hand captured output over to the Buffer object.
+ * If the Buffer is empty, we simply take ownership of the memory holding
+ * the data; otherwise, the data is appended.
+ */
+int
+Buffer_absorb(twopence_Buffer *self, twopence_buf_t *bp)
+{
+	unsigned int count = twopence_buf_count(bp);
+
+	if (count == 0)
+		return 0;
+
+	if (!Buffer_modifiable(self))
+		return -1;
+
+	if (twopence_buf_count(&self->buf) == 0 && (bp->dynamic || bp->mapped)) {
+		twopence_buf_destroy(&self->buf);
+		self->buf = *bp;
+		twopence_buf_init(bp);
+		return 0;
+	}
+
+	twopence_buf_ensure_tailroom(&self->buf, count);
+	if (!twopence_buf_append(&self->buf, twopence_buf_head(bp), count)) {
+		PyErr_NoMemory();
+		return -1;
+	}
+	twopence_buf_advance_head(bp, count);
+	return 0;
+}
@@ -141,6 +141,19 @@ Chat_getattr(twopence_Chat *self, char *name)
 		return self->command->ob_type->tp_getattr((PyObject *) self->command, name);
 	}
 
+	if (!strcmp(name, "target") || !strcmp(name, "command")) {
+		PyObject *result;
+
+		if (!strcmp(name, "target"))
+			result = (PyObject *) self->target;
+		else
+			result = (PyObject *) self->command;
+		if (result == NULL)
+			result = Py_None;
+		Py_INCREF(result);
+		return result;
+	}
+
 	if (!strcmp(name, "consumed")) {
 		PyObject *buffer = twopence_callType(&PyByteArray_Type, NULL, NULL);
 
@@ -243,7 +256,13 @@ Chat_expect(PyObject *self, PyObject *args, PyObject *kwds)
 	if (!Chat_expect_set_strings(&expect, expectObj))
 		return NULL;
 
+	if (!Target_claim(chatObject->target))
+		return NULL;
+	Py_BEGIN_ALLOW_THREADS
 	rv = twopence_chat_expect(chatObject->target->handle, &chatObject->chat, &expect);
+	Py_END_ALLOW_THREADS
+	Target_unclaim(chatObject->target);
+
 	if (rv <= 0) {
 		/* There are a number of reasons for getting here:
 		 *  - command exited without producing further output (nbytes is 0 in this case)
@@ -278,7 +297,12 @@ Chat_send(PyObject *self, PyObject *args, PyObject *kwds)
 		return NULL;
 	}
 
+	if (!Target_claim(chatObject->target))
+		return NULL;
+	Py_BEGIN_ALLOW_THREADS
 	twopence_chat_puts(chatObject->target->handle, &chatObject->chat, string);
+	Py_END_ALLOW_THREADS
+	Target_unclaim(chatObject->target);
 
 	Py_INCREF(Py_None);
 	return Py_None;
@@ -293,7 +317,7 @@ Chat_recvline(PyObject *self, PyObject *args, PyObject *kwds)
 		NULL
 	};
 	int timeout = -1;
-	char buffer[512];
+	char buffer[512], *line;
 
 	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|i", kwlist, &timeout))
 		return NULL;
@@ -303,7 +327,14 @@ Chat_recvline(PyObject *self, PyObject *args, PyObject *kwds)
 		return NULL;
 	}
 
-	if (!twopence_chat_gets(chatObject->target->handle, &chatObject->chat, buffer, sizeof(buffer), timeout)) {
+	if (!Target_claim(chatObject->target))
+		return NULL;
+	Py_BEGIN_ALLOW_THREADS
+	line = twopence_chat_gets(chatObject->target->handle, &chatObject->chat, buffer, sizeof(buffer), timeout);
+	Py_END_ALLOW_THREADS
+	Target_unclaim(chatObject->target);
+
+	if (line == NULL) {
 		Py_INCREF(Py_None);
 		return Py_None;
 	}
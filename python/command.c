@@ -21,6 +21,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "extension.h"
 
 #include <fcntl.h>
+#include <limits.h>
 
 #include "twopence.h"
 #include "utils.h"
@@ -59,6 +60,8 @@ static PyObject *	Command_unsetenv(twopence_Command *, PyObject *, PyObject *);
  *	Pass the None object to suppress output.
  *	If you just specify stdout but not stderr, the two output streams
  *	are combined into one and buffered together.
+ *	Besides bytearray objects, you can pass a twopence.Buffer, which
+ *	takes over the captured data without copying it.
  *
  * To run this command on the SUT, use
  *   target.run(cmd)
@@ -117,6 +120,8 @@ Command_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 	self->useTty = 0;
 	self->background = false;
 	self->softfail = false;
+	self->batchSize = 0;
+	self->batchDelay = 0;
 	self->pid = 0;
 
 	twopence_env_init(&self->environ);
@@ -245,6 +250,19 @@ Command_redirect_iostream(twopence_command_t *cmd, twopence_iofd_t dst, PyObject
 		if (buf_ret)
 			*buf_ret = buffer;
 	} else
+	if (dst != TWOPENCE_STDIN && Buffer_Check(object)) {
+		twopence_buf_t *buffer;
+
+		if (!Buffer_modifiable((twopence_Buffer *) object))
+			return false;
+
+		/* Capture into a buffer that can grow, and hand it to the
+		 * Buffer object when the command is done */
+		buffer = Buffer_prepareCapture((twopence_Buffer *) object, cmd, dst);
+		twopence_command_ostream_capture_resizable(cmd, dst, buffer);
+		if (buf_ret)
+			*buf_ret = buffer;
+	} else
 	if (PyFile_Check(object)) {
 		int fd = PyObject_AsFileDescriptor(object);
 
@@ -281,6 +299,8 @@ Command_build(twopence_Command *self, twopence_command_t *cmd)
 	cmd->timeout = self->timeout;
 	cmd->request_tty = self->useTty;
 	cmd->background = self->background;
+	cmd->batch.max_bytes = self->batchSize;
+	cmd->batch.max_delay = self->batchDelay;
 
 	twopence_command_ostreams_reset(cmd);
 	if (self->quiet || self->stdout == Py_None) {
@@ -303,7 +323,10 @@ Command_build(twopence_Command *self, twopence_command_t *cmd)
 	/* If cmd.stdout and cmd.stderr are both NULL, or both refer to the same
 	 * bytearray object, send the remote stdout and stderr to a shared buffer */
 	if (buffer && self->stderr == self->stdout) {
-		twopence_command_ostream_capture(cmd, TWOPENCE_STDERR, buffer);
+		if (Buffer_Check(self->stdout))
+			twopence_command_ostream_capture_resizable(cmd, TWOPENCE_STDERR, buffer);
+		else
+			twopence_command_ostream_capture(cmd, TWOPENCE_STDERR, buffer);
 	} else
 	if (!Command_redirect_iostream(cmd, TWOPENCE_STDERR, self->stderr, NULL)) {
 		return -1;
@@ -447,6 +470,10 @@ Command_getattr(twopence_Command *self, char *name)
 		return return_bool(self->background);
 	if (!strcmp(name, "softfail"))
 		return return_bool(self->softfail);
+	if (!strcmp(name, "batchSize"))
+		return PyInt_FromLong(self->batchSize);
+	if (!strcmp(name, "batchDelay"))
+		return PyInt_FromLong(self->batchDelay);
 	if (!strcmp(name, "environ")) {
 		twopence_env_t *env = &self->environ;
 		PyObject *rv = PyTuple_New(env->count);
@@ -478,13 +505,13 @@ static int
 Command_setattr(twopence_Command *self, char *name, PyObject *v)
 {
 	if (!strcmp(name, "stdout")) {
-		if (v != Py_None && !PyByteArray_Check(v))
+		if (v != Py_None && !PyByteArray_Check(v) && !Buffer_Check(v))
 			goto bad_attr;
 		assign_object(&self->stdout, v);
 		return 0;
 	}
 	if (!strcmp(name, "stderr")) {
-		if (v != Py_None && !PyByteArray_Check(v))
+		if (v != Py_None && !PyByteArray_Check(v) && !Buffer_Check(v))
 			goto bad_attr;
 		assign_object(&self->stderr, v);
 		return 0;
@@ -522,6 +549,24 @@ Command_setattr(twopence_Command *self, char *name, PyObject *v)
 		self->softfail = !!(PyObject_IsTrue(v));
 		return 0;
 	}
+	if (!strcmp(name, "batchSize") || !strcmp(name, "batchDelay")) {
+		long value;
+
+		if (PyInt_Check(v))
+			value = PyInt_AsLong(v);
+		else if (PyLong_Check(v))
+			value = PyLong_AsLong(v);
+		else
+			goto bad_attr;
+		if (value < 0 || value > UINT_MAX)
+			goto bad_attr;
+
+		if (!strcmp(name, "batchSize"))
+			self->batchSize = value;
+		else
+			self->batchDelay = value;
+		return 0;
+	}
 
 	(void) PyErr_Format(PyExc_AttributeError, "Unknown attribute: %s", name);
 	return -1;
@@ -150,6 +150,9 @@ inittwopence(void)
 {
 	PyObject* m;
 
+	/* Make sure the GIL exists; we release it around blocking calls */
+	PyEval_InitThreads();
+
 	m = Py_InitModule3("twopence", twopence_methods, "Module for twopence based testing");
 
 	twopence_registerType(m, "Target", &twopence_TargetType);
@@ -158,6 +161,9 @@ inittwopence(void)
 	twopence_registerType(m, "Status", &twopence_StatusType);
 	twopence_registerType(m, "Chat", &twopence_ChatType);
 	twopence_registerType(m, "Timer", &twopence_TimerType);
+	twopence_registerType(m, "Group", &twopence_GroupType);
+	twopence_registerType(m, "Buffer", &twopence_BufferType);
+	twopence_registerType(m, "Stream", &twopence_StreamType);
 
 	twopence_registerErrorConstants(m);
 }
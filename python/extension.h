@@ -35,6 +35,10 @@ typedef struct {
 	PyObject *	attrs;
 
 	struct backgroundedCommand *backgrounded;
+
+	/* The thread currently blocking in a call on this target */
+	PyThreadState *	owner;
+	unsigned int	nclaims;
 } twopence_Target;
 
 typedef struct {
@@ -51,6 +55,8 @@ typedef struct {
 	bool		useTty;
 	bool		background;
 	bool		softfail;
+	unsigned int	batchSize;
+	unsigned int	batchDelay;
 
 	twopence_env_t	environ;
 
@@ -92,6 +98,9 @@ typedef struct {
 
 	/* for xfer operations */
 	PyObject *	buffer;
+
+	/* timing and byte counts of the transaction */
+	twopence_stats_t stats;
 } twopence_Status;
 
 typedef struct {
@@ -110,6 +119,31 @@ typedef struct {
 	PyObject *	callback;
 } twopence_Timer;
 
+typedef struct {
+	PyObject_HEAD
+
+	twopence_group_t *handle;
+	PyObject *	targets;
+} twopence_Group;
+
+typedef struct {
+	PyObject_HEAD
+
+	twopence_Target *target;
+	twopence_Command *command;
+	PyObject *	status;
+	unsigned int	pid;
+	bool		done;
+} twopence_Stream;
+
+typedef struct {
+	PyObject_HEAD
+
+	twopence_buf_t	buf;
+	unsigned long	expectedSize;
+	unsigned int	exports;
+} twopence_Buffer;
+
 
 
 extern PyTypeObject	twopence_TargetType;
@@ -118,11 +152,15 @@ extern PyTypeObject	twopence_TransferType;
 extern PyTypeObject	twopence_StatusType;
 extern PyTypeObject	twopence_ChatType;
 extern PyTypeObject	twopence_TimerType;
+extern PyTypeObject	twopence_GroupType;
+extern PyTypeObject	twopence_BufferType;
+extern PyTypeObject	twopence_StreamType;
 
 extern int		Command_init(twopence_Command *self, PyObject *args, PyObject *kwds);
 extern int		Command_Check(PyObject *);
 extern int		Command_build(twopence_Command *, twopence_command_t *);
 extern PyObject *	Target_wait_common(twopence_Target *tgtObject, int pid);
+extern twopence_buf_t *	Target_pendingOutput(twopence_Target *tgtObject, int pid);
 extern int		Transfer_init(twopence_Transfer *self, PyObject *args, PyObject *kwds);
 extern int		Transfer_Check(PyObject *);
 extern int		Transfer_build_send(twopence_Transfer *, twopence_file_xfer_t *);
@@ -131,6 +169,38 @@ extern PyObject *	twopence_Exception(const char *msg, int rc);
 extern PyObject *	twopence_callObject(PyObject *callable, PyObject *args, PyObject *kwds);
 extern PyObject *	twopence_callType(PyTypeObject *typeObject, PyObject *args, PyObject *kwds);
 extern int		twopence_AppendBuffer(PyObject *buffer, const twopence_buf_t *buf);
+extern int		twopence_MoveBuffer(PyObject *buffer, twopence_buf_t *buf);
+extern int		Buffer_Check(PyObject *);
+extern bool		Buffer_modifiable(twopence_Buffer *);
+extern twopence_buf_t *	Buffer_prepareCapture(twopence_Buffer *, twopence_command_t *, twopence_iofd_t);
+extern int		Buffer_absorb(twopence_Buffer *, twopence_buf_t *);
+
+/*
+ * Blocking library calls are made with the GIL released, so that
+ * different targets can be driven from different python threads.
+ * A single target must not be used by two threads at the same time,
+ * though, so callers claim the target before dropping the GIL.
+ */
+static inline bool
+Target_claim(twopence_Target *self)
+{
+	PyThreadState *ts = PyThreadState_Get();
+
+	if (self->owner != NULL && self->owner != ts) {
+		PyErr_SetString(PyExc_RuntimeError, "twopence.Target is in use by another thread");
+		return false;
+	}
+	self->owner = ts;
+	self->nclaims++;
+	return true;
+}
+
+static inline void
+Target_unclaim(twopence_Target *self)
+{
+	if (--(self->nclaims) == 0)
+		self->owner = NULL;
+}
 
 static inline void
 assign_string(char **var, char *str)
@@ -0,0 +1,310 @@
+/*
+Twopence python bindings - class Group
+
+Copyright (C) 2016 SUSE
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 2.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include "extension.h"
+
+#include "twopence.h"
+
+static void		Group_dealloc(twopence_Group *self);
+static PyObject *	Group_new(PyTypeObject *type, PyObject *args, PyObject *kwds);
+static int		Group_init(twopence_Group *self, PyObject *args, PyObject *kwds);
+static PyObject *	Group_getattr(twopence_Group *self, char *name);
+static PyObject *	Group_add(twopence_Group *, PyObject *, PyObject *);
+static PyObject *	Group_run(twopence_Group *, PyObject *, PyObject *);
+
+/*
+ * Define the python bindings of class "Group"
+ */
+static PyMethodDef twopence_groupMethods[] = {
+      {	"add", (PyCFunction) Group_add, METH_VARARGS | METH_KEYWORDS,
+	"Add a target to the group"
+      },
+      {	"run", (PyCFunction) Group_run, METH_VARARGS | METH_KEYWORDS,
+	"Run a command on all targets of the group"
+      },
+      {	NULL }
+};
+
+PyTypeObject twopence_GroupType = {
+	PyObject_HEAD_INIT(NULL)
+
+	.tp_name	= "twopence.Group",
+	.tp_basicsize	= sizeof(twopence_Group),
+	.tp_flags	= Py_TPFLAGS_DEFAULT,
+	.tp_doc		= "Twopence target group",
+
+	.tp_methods	= twopence_groupMethods,
+	.tp_init	= (initproc) Group_init,
+	.tp_new		= Group_new,
+	.tp_dealloc	= (destructor) Group_dealloc,
+
+	.tp_getattr	= (getattrfunc) Group_getattr,
+};
+
+/*
+ * Constructor: allocate empty Group object, and set its members.
+ */
+static PyObject *
+Group_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+	twopence_Group *self;
+
+	self = (twopence_Group *) type->tp_alloc(type, 0);
+	if (self == NULL)
+		return NULL;
+
+	/* init members */
+	self->handle = NULL;
+	self->targets = NULL;
+
+	return (PyObject *)self;
+}
+
+/*
+ * Initialize the group object
+ *
+ * Group(target, ...)
+ */
+static int
+Group_init(twopence_Group *self, PyObject *args, PyObject *kwds)
+{
+	Py_ssize_t i, n;
+
+	/* __init__ may be called again on an existing object;
+	 * release the group and targets it set up before. */
+	if (self->handle)
+		twopence_group_free(self->handle);
+	drop_object(&self->targets);
+
+	self->handle = twopence_group_new();
+	self->targets = PyList_New(0);
+
+	n = PyTuple_Size(args);
+	for (i = 0; i < n; ++i) {
+		PyObject *addArgs, *v;
+
+		addArgs = PyTuple_GetSlice(args, i, i + 1);
+		v = Group_add(self, addArgs, NULL);
+		Py_DECREF(addArgs);
+
+		if (v == NULL)
+			return -1;
+		Py_DECREF(v);
+	}
+
+	return 0;
+}
+
+/*
+ * Destructor: clean any state inside the Group object
+ */
+static void
+Group_dealloc(twopence_Group *self)
+{
+	/* Free the group before dropping our references to the targets */
+	if (self->handle)
+		twopence_group_free(self->handle);
+	self->handle = NULL;
+
+	drop_object(&self->targets);
+}
+
+static PyObject *
+Group_getattr(twopence_Group *self, char *name)
+{
+	if (!strcmp(name, "targets")) {
+		if (self->targets == NULL)
+			return PyList_New(0);
+		return PySequence_List(self->targets);
+	}
+
+	return Py_FindMethod(twopence_groupMethods, (PyObject *) self, name);
+}
+
+static PyObject *
+Group_add(twopence_Group *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {
+		"target",
+		NULL
+	};
+	twopence_Target *tgtObject;
+	int rc;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!", kwlist, &twopence_TargetType, &tgtObject))
+		return NULL;
+
+	if (self->handle == NULL || tgtObject->handle == NULL) {
+		PyErr_SetString(PyExc_ValueError, "Group.add(): object without handle");
+		return NULL;
+	}
+
+	if ((rc = twopence_group_add_target(self->handle, tgtObject->handle)) < 0)
+		return twopence_Exception("Group.add()", rc);
+
+	/* The group does not own the C target, so we need to hold on to it */
+	if (PyList_Append(self->targets, (PyObject *) tgtObject) < 0)
+		return NULL;
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+/*
+ * Build the status object for one group member
+ */
+static PyObject *
+Group_buildStatus(twopence_Command *cmdObject, const twopence_group_result_t *res)
+{
+	twopence_Status *statusObject;
+
+	statusObject = (twopence_Status *) twopence_callType(&twopence_StatusType, NULL, NULL);
+	if (statusObject == NULL)
+		return NULL;
+
+	if (res->rc < 0) {
+		statusObject->localError = res->rc;
+	} else
+	if (res->status.major == EFAULT) {
+		statusObject->exitSignal = res->status.minor;
+	} else {
+		statusObject->remoteStatus = res->status.minor;
+	}
+	statusObject->stats = res->status.stats;
+
+	statusObject->stdout = PyByteArray_FromStringAndSize(NULL, 0);
+	statusObject->stderr = PyByteArray_FromStringAndSize(NULL, 0);
+	if (twopence_AppendBuffer(statusObject->stdout, &res->buffer[TWOPENCE_STDOUT]) < 0
+	 || twopence_AppendBuffer(statusObject->stderr, &res->buffer[TWOPENCE_STDERR]) < 0) {
+		Py_DECREF(statusObject);
+		return NULL;
+	}
+
+	statusObject->command = (PyObject *) cmdObject;
+	Py_INCREF(cmdObject);
+
+	return (PyObject *) statusObject;
+}
+
+static void
+Group_unclaimTargets(twopence_Group *self, Py_ssize_t count)
+{
+	Py_ssize_t i;
+
+	for (i = 0; i < count; ++i)
+		Target_unclaim((twopence_Target *) PyList_GET_ITEM(self->targets, i));
+}
+
+static bool
+Group_claimTargets(twopence_Group *self)
+{
+	Py_ssize_t i, count = PyList_GET_SIZE(self->targets);
+
+	for (i = 0; i < count; ++i) {
+		if (!Target_claim((twopence_Target *) PyList_GET_ITEM(self->targets, i))) {
+			Group_unclaimTargets(self, i);
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Run a command on all targets in the group.
+ * Returns a list of Status objects, one per target, in the order in
+ * which the targets were added.
+ */
+static PyObject *
+Group_run(twopence_Group *self, PyObject *args, PyObject *kwds)
+{
+	twopence_Command *cmdObject = NULL;
+	twopence_command_t cmd;
+	PyObject *result = NULL;
+	unsigned int i, count;
+	int rc;
+
+	memset(&cmd, 0, sizeof(cmd));
+
+	if (self->handle == NULL) {
+		PyErr_SetString(PyExc_ValueError, "Group object without handle");
+		return NULL;
+	}
+
+	if (PySequence_Check(args)
+	 && PySequence_Fast_GET_SIZE(args) == 1) {
+		/* Single argument can be an object of type Command or a string */
+		PyObject *object = PySequence_Fast_GET_ITEM(args, 0);
+
+		if (Command_Check(object)) {
+			cmdObject = (twopence_Command *) object;
+			Py_INCREF(cmdObject);
+		}
+	}
+
+	if (cmdObject == NULL) {
+		cmdObject = (twopence_Command *) twopence_callType(&twopence_CommandType, args, kwds);
+		if (cmdObject == NULL)
+			goto out;
+	}
+
+	if (Command_build(cmdObject, &cmd) < 0)
+		goto out;
+
+	if (!Group_claimTargets(self))
+		goto out;
+	Py_BEGIN_ALLOW_THREADS
+	rc = twopence_group_run(self->handle, &cmd);
+	Py_END_ALLOW_THREADS
+	Group_unclaimTargets(self, PyList_GET_SIZE(self->targets));
+
+	if (rc < 0) {
+		twopence_Exception("Group.run()", rc);
+		goto out;
+	}
+
+	count = twopence_group_count(self->handle);
+	result = PyList_New(count);
+	for (i = 0; i < count; ++i) {
+		const twopence_group_result_t *res = twopence_group_result(self->handle, i);
+		PyObject *statusObject;
+
+		if (res->rc < 0 && !cmdObject->softfail) {
+			twopence_Exception("command execution failed", res->rc);
+			goto failed;
+		}
+
+		if ((statusObject = Group_buildStatus(cmdObject, res)) == NULL)
+			goto failed;
+		PyList_SET_ITEM(result, i, statusObject);
+	}
+
+out:
+	if (cmdObject) {
+		Py_DECREF(cmdObject);
+	}
+
+	twopence_command_destroy(&cmd);
+	return result;
+
+failed:
+	Py_DECREF(result);
+	result = NULL;
+	goto out;
+}
@@ -86,6 +86,8 @@ Status_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 	self->command = NULL;
 	self->buffer = NULL;
 
+	memset(&self->stats, 0, sizeof(self->stats));
+
 	return (PyObject *)self;
 }
 
@@ -189,6 +191,29 @@ Status_message(twopence_Status *self)
 	return PyString_FromString(message);
 }
 
+/*
+ * Return the transaction statistics as a dict.
+ * All times are in microseconds.
+ */
+static PyObject *
+Status_stats(twopence_Status *self)
+{
+	const twopence_stats_t *st = &self->stats;
+
+	return Py_BuildValue("{s:(kkk),s:(kkk),s:k,s:k,s:k,s:k,s:k,s:k,s:k}",
+			"bytesSent",
+				st->bytes_sent[0], st->bytes_sent[1], st->bytes_sent[2],
+			"bytesReceived",
+				st->bytes_received[0], st->bytes_received[1], st->bytes_received[2],
+			"packetsSent", st->packets_sent,
+			"maxBytesQueued", st->max_bytes_queued,
+			"queueTime", st->queue_time,
+			"firstByteTime", st->first_byte_time,
+			"wallTime", st->wall_time,
+			"serverSpawnTime", st->server_spawn_time,
+			"serverRunTime", st->server_run_time);
+}
+
 static PyObject *
 Status_getattr(twopence_Status *self, char *name)
 {
@@ -221,6 +246,8 @@ Status_getattr(twopence_Status *self, char *name)
 	}
 	if (!strcmp(name, "message"))
 		return Status_message(self);
+	if (!strcmp(name, "stats"))
+		return Status_stats(self);
 
 	PyErr_Format(PyExc_AttributeError, "%s", name);
 	return NULL;
@@ -0,0 +1,190 @@
+/*
+Twopence python bindings - class Stream
+
+Copyright (C) 2016 SUSE
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 2.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include "extension.h"
+
+#include "twopence.h"
+
+static void		Stream_dealloc(twopence_Stream *self);
+static PyObject *	Stream_new(PyTypeObject *type, PyObject *args, PyObject *kwds);
+static int		Stream_init(twopence_Stream *self, PyObject *args, PyObject *kwds);
+static PyObject *	Stream_getattr(twopence_Stream *self, char *name);
+static PyObject *	Stream_iter(twopence_Stream *self);
+static PyObject *	Stream_next(twopence_Stream *self);
+
+/*
+ * Define the python bindings of class "Stream"
+ * Normally, you do not create Stream objects yourself;
+ * they are created as the return value of Target.stream()
+ */
+static PyMethodDef twopence_streamMethods[] = {
+      {	NULL }
+};
+
+PyTypeObject twopence_StreamType = {
+	PyObject_HEAD_INIT(NULL)
+
+	.tp_name	= "twopence.Stream",
+	.tp_basicsize	= sizeof(twopence_Stream),
+	.tp_flags	= Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_ITER,
+	.tp_doc		= "Twopence output stream",
+
+	.tp_methods	= twopence_streamMethods,
+	.tp_init	= (initproc) Stream_init,
+	.tp_new		= Stream_new,
+	.tp_dealloc	= (destructor) Stream_dealloc,
+
+	.tp_getattr	= (getattrfunc) Stream_getattr,
+	.tp_iter	= (getiterfunc) Stream_iter,
+	.tp_iternext	= (iternextfunc) Stream_next,
+};
+
+/*
+ * Constructor: allocate empty Stream object, and set its members.
+ */
+static PyObject *
+Stream_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+	twopence_Stream *self;
+
+	self = (twopence_Stream *) type->tp_alloc(type, 0);
+	if (self == NULL)
+		return NULL;
+
+	/* init members */
+	self->target = NULL;
+	self->command = NULL;
+	self->status = NULL;
+	self->pid = 0;
+	self->done = false;
+
+	return (PyObject *)self;
+}
+
+static int
+Stream_init(twopence_Stream *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {
+		NULL
+	};
+
+	if (args == Py_None)
+		return 0;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "", kwlist))
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Destructor: clean any state inside the Stream object
+ * If the command is still running, it stays on the target's list of
+ * backgrounded commands, and can be reaped using Target.wait()
+ */
+static void
+Stream_dealloc(twopence_Stream *self)
+{
+	drop_object((PyObject **) &self->target);
+	drop_object((PyObject **) &self->command);
+	drop_object(&self->status);
+}
+
+static PyObject *
+Stream_getattr(twopence_Stream *self, char *name)
+{
+	if (!strcmp(name, "target") || !strcmp(name, "command") || !strcmp(name, "status")) {
+		PyObject *result;
+
+		if (!strcmp(name, "target"))
+			result = (PyObject *) self->target;
+		else if (!strcmp(name, "command"))
+			result = (PyObject *) self->command;
+		else
+			result = self->status;
+		if (result == NULL)
+			result = Py_None;
+		Py_INCREF(result);
+		return result;
+	}
+
+	return Py_FindMethod(twopence_streamMethods, (PyObject *) self, name);
+}
+
+static PyObject *
+Stream_iter(twopence_Stream *self)
+{
+	Py_INCREF(self);
+	return (PyObject *) self;
+}
+
+/*
+ * Return the next chunk of output.
+ * If there is nothing buffered, wait for the command to produce more
+ * output. Once the command has completed, reap it, record its status
+ * and stop the iteration.
+ */
+static PyObject *
+Stream_next(twopence_Stream *self)
+{
+	twopence_Target *tgtObject = self->target;
+
+	if (tgtObject == NULL || self->pid == 0)
+		return NULL;
+
+	while (true) {
+		twopence_buf_t *bp;
+		int rc;
+
+		if ((bp = Target_pendingOutput(tgtObject, self->pid)) == NULL) {
+			/* Someone else reaped the command */
+			self->pid = 0;
+			return NULL;
+		}
+
+		if (twopence_buf_count(bp)) {
+			PyObject *chunk;
+
+			chunk = PyString_FromStringAndSize(twopence_buf_head(bp), twopence_buf_count(bp));
+			twopence_buf_advance_head(bp, twopence_buf_count(bp));
+			twopence_buf_reset(bp);
+			return chunk;
+		}
+
+		if (self->done)
+			break;
+
+		if (!Target_claim(tgtObject))
+			return NULL;
+		Py_BEGIN_ALLOW_THREADS
+		rc = twopence_wait_output(tgtObject->handle, self->pid, NULL);
+		Py_END_ALLOW_THREADS
+		Target_unclaim(tgtObject);
+
+		if (rc < 0)
+			return twopence_Exception("stream", rc);
+		if (rc == 0)
+			self->done = true;
+	}
+
+	self->status = Target_wait_common(tgtObject, self->pid);
+	self->pid = 0;
+	return NULL;
+}
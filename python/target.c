@@ -21,6 +21,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "extension.h"
 
 #include <fcntl.h>
+#include <alloca.h>
 #include <sys/wait.h>
 
 #include "twopence.h"
@@ -42,7 +43,11 @@ static PyObject *	Target_setenv(twopence_Target *, PyObject *, PyObject *);
 static PyObject *	Target_unsetenv(twopence_Target *, PyObject *, PyObject *);
 static PyObject *	Target_disconnect(twopence_Target *, PyObject *, PyObject *);
 static PyObject *	Target_cancel_transactions(twopence_Target *, PyObject *, PyObject *);
+static PyObject *	Target_serverMetrics(twopence_Target *, PyObject *, PyObject *);
 static PyObject *	Target_chat(twopence_Target *, PyObject *, PyObject *);
+static PyObject *	Target_stream(twopence_Target *, PyObject *, PyObject *);
+static PyObject *	Target_pollfds(twopence_Target *, PyObject *, PyObject *);
+static PyObject *	Target_process(twopence_Target *, PyObject *, PyObject *);
 
 /*
  * Define the python bindings of class "Target"
@@ -90,12 +95,24 @@ static PyMethodDef twopence_targetMethods[] = {
       {	"chat", (PyCFunction) Target_chat, METH_VARARGS | METH_KEYWORDS,
 	"Create a Chat object for the given command"
       },
+      {	"stream", (PyCFunction) Target_stream, METH_VARARGS | METH_KEYWORDS,
+	"Run a command in the background, and iterate over its output"
+      },
       {	"disconnect", (PyCFunction) Target_disconnect, METH_VARARGS | METH_KEYWORDS,
 	"Close the connection to the target"
       },
       {	"cancel_transactions", (PyCFunction) Target_cancel_transactions, METH_VARARGS | METH_KEYWORDS,
 	"Cancel all pending transactions"
       },
+      {	"serverMetrics", (PyCFunction) Target_serverMetrics, METH_VARARGS | METH_KEYWORDS,
+	"Return the metrics of the remote test server as a dict"
+      },
+      {	"pollfds", (PyCFunction) Target_pollfds, METH_VARARGS | METH_KEYWORDS,
+	"Return the file descriptors and timeout to wait for"
+      },
+      {	"process", (PyCFunction) Target_process, METH_VARARGS | METH_KEYWORDS,
+	"Process pending I/O without blocking, and return completed commands"
+      },
 
       {	NULL }
 };
@@ -132,6 +149,8 @@ Target_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 	self->handle = NULL;
 	self->attrs = NULL;
 	self->name = NULL;
+	self->owner = NULL;
+	self->nclaims = 0;
 
 	return (PyObject *)self;
 }
@@ -139,12 +158,13 @@ Target_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 static int
 Target_init(twopence_Target *self, PyObject *args, PyObject *kwds)
 {
-	static char *kwlist[] = {"target", "attrs", "name", NULL};
+	static char *kwlist[] = {"target", "attrs", "name", "bulkLink", NULL};
 	PyObject *attrDict = NULL;
 	char *targetSpec, *name = NULL;
+	int bulkLink = 0;
 	int rc;
 
-	if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|Os", kwlist, &targetSpec, &attrDict, &name))
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|Osi", kwlist, &targetSpec, &attrDict, &name, &bulkLink))
 		return -1; 
 
 	rc = twopence_target_new(targetSpec, &self->handle);
@@ -153,6 +173,14 @@ Target_init(twopence_Target *self, PyObject *args, PyObject *kwds)
 		return -1;
 	}
 
+	if (bulkLink) {
+		rc = twopence_target_set_option(self->handle, TWOPENCE_TARGET_OPTION_BULK_LINK, &bulkLink);
+		if (rc < 0) {
+			twopence_Exception("Target initialization", rc);
+			return -1;
+		}
+	}
+
 	if (attrDict) {
 		self->attrs = attrDict;
 		Py_INCREF(attrDict);
@@ -234,7 +262,17 @@ twopence_AppendBuffer(PyObject *buffer, const twopence_buf_t *buf)
 	int rv = 0;
 
 	count = twopence_buf_count(buf);
-	if (buffer != NULL && buffer != Py_None && count != 0) {
+	if (buffer == NULL || buffer == Py_None || count == 0)
+		return 0;
+
+	if (PyByteArray_Check(buffer)) {
+		/* Copy straight into the bytearray, without a temporary string */
+		Py_ssize_t len = PyByteArray_GET_SIZE(buffer);
+
+		if (PyByteArray_Resize(buffer, len + count) < 0)
+			return -1;
+		memcpy(PyByteArray_AS_STRING(buffer) + len, twopence_buf_head(buf), count);
+	} else {
 		PyObject *temp = PyString_FromStringAndSize(twopence_buf_head(buf), count);
 
 		if (temp == NULL)
@@ -246,6 +284,18 @@ twopence_AppendBuffer(PyObject *buffer, const twopence_buf_t *buf)
 	return rv;
 }
 
+/*
+ * Same as above, but if the destination is a twopence.Buffer object,
+ * hand it the captured data rather than copying it.
+ */
+int
+twopence_MoveBuffer(PyObject *buffer, twopence_buf_t *buf)
+{
+	if (buffer != NULL && Buffer_Check(buffer))
+		return Buffer_absorb((twopence_Buffer *) buffer, buf);
+	return twopence_AppendBuffer(buffer, buf);
+}
+
 /*
  * Backgrounding commands
  */
@@ -297,20 +347,36 @@ Target_findBackgrounded(twopence_Target *tgtObject, pid_t pid)
 }
 
 /*
- * Given a command and its status, build a status object
+ * Return the output a streamed command has produced so far
+ */
+twopence_buf_t *
+Target_pendingOutput(twopence_Target *tgtObject, int pid)
+{
+	struct backgroundedCommand *bg;
+
+	for (bg = tgtObject->backgrounded; bg; bg = bg->next) {
+		if (bg->pid == pid)
+			return &bg->cmd.buffer[TWOPENCE_STDOUT];
+	}
+	return NULL;
+}
+
+/*
+ * Given a command and its status, build a status object.
+ * Unless softfail is set, local errors are raised as exceptions.
  */
 static PyObject *
-Target_buildCommandStatus(twopence_Command *cmdObject, twopence_command_t *cmd, twopence_status_t *status, int rc)
+Target_buildCommandStatus(twopence_Command *cmdObject, twopence_command_t *cmd, twopence_status_t *status, int rc, bool softfail)
 {
 	twopence_Status *statusObject;
 
-	if (rc < 0 && !cmdObject->softfail)
+	if (rc < 0 && !softfail)
 		return twopence_Exception("command execution failed", rc);
 
 	/* Now funnel the captured data to the respective buffer objects */
-	if (twopence_AppendBuffer(cmdObject->stdout, &cmd->buffer[TWOPENCE_STDOUT]) < 0)
+	if (twopence_MoveBuffer(cmdObject->stdout, &cmd->buffer[TWOPENCE_STDOUT]) < 0)
 		return NULL;
-	if (twopence_AppendBuffer(cmdObject->stderr, &cmd->buffer[TWOPENCE_STDERR]) < 0)
+	if (twopence_MoveBuffer(cmdObject->stderr, &cmd->buffer[TWOPENCE_STDERR]) < 0)
 		return NULL;
 
 	statusObject = (twopence_Status *) twopence_callType(&twopence_StatusType, NULL, NULL);
@@ -325,6 +391,7 @@ Target_buildCommandStatus(twopence_Command *cmdObject, twopence_command_t *cmd,
 		/* Regular command exit */
 		statusObject->remoteStatus = status->minor;
 	}
+	statusObject->stats = status->stats;
 	if (cmdObject->stdout) {
 		statusObject->stdout = cmdObject->stdout;
 		Py_INCREF(statusObject->stdout);
@@ -345,9 +412,9 @@ Target_buildCommandStatusShort(twopence_Command *cmdObject, twopence_command_t *
 	twopence_Status *statusObject;
 
 	/* Now funnel the captured data to the respective buffer objects */
-	if (twopence_AppendBuffer(cmdObject->stdout, &cmd->buffer[TWOPENCE_STDOUT]) < 0)
+	if (twopence_MoveBuffer(cmdObject->stdout, &cmd->buffer[TWOPENCE_STDOUT]) < 0)
 		return NULL;
-	if (twopence_AppendBuffer(cmdObject->stderr, &cmd->buffer[TWOPENCE_STDERR]) < 0)
+	if (twopence_MoveBuffer(cmdObject->stderr, &cmd->buffer[TWOPENCE_STDERR]) < 0)
 		return NULL;
 
 	statusObject = (twopence_Status *) twopence_callType(&twopence_StatusType, NULL, NULL);
@@ -413,7 +480,15 @@ Target_run(twopence_Target *self, PyObject *args, PyObject *kwds)
 			goto out;
 		}
 
+		if (!Target_claim(self)) {
+			backgroundedCommandFree(bg);
+			goto out;
+		}
+		Py_BEGIN_ALLOW_THREADS
 		rc = twopence_run_test(handle, &bg->cmd, &status);
+		Py_END_ALLOW_THREADS
+		Target_unclaim(self);
+
 		if (rc < 0) {
 			twopence_Exception("run(background)", rc);
 			backgroundedCommandFree(bg);
@@ -436,8 +511,14 @@ Target_run(twopence_Target *self, PyObject *args, PyObject *kwds)
 		if (Command_build(cmdObject, &cmd) < 0)
 			goto out;
 
+		if (!Target_claim(self))
+			goto out;
+		Py_BEGIN_ALLOW_THREADS
 		rc = twopence_run_test(handle, &cmd, &status);
-		result = Target_buildCommandStatus(cmdObject, &cmd, &status, rc);
+		Py_END_ALLOW_THREADS
+		Target_unclaim(self);
+
+		result = Target_buildCommandStatus(cmdObject, &cmd, &status, rc, cmdObject->softfail);
 	}
 
 out:
@@ -449,6 +530,35 @@ out:
 	return result;
 }
 
+/*
+ * A backgrounded command completed. Build its status object
+ * and forget about it.
+ */
+static PyObject *
+Target_completeBackgrounded(twopence_Target *tgtObject, int pid, twopence_status_t *status, bool softfail)
+{
+	struct backgroundedCommand *bg;
+	PyObject *result;
+
+	if (pid < 0) {
+		if (status->pid <= 0)
+			return twopence_Exception("wait", pid);
+		bg = Target_findBackgrounded(tgtObject, status->pid);
+	} else {
+		bg = Target_findBackgrounded(tgtObject, pid);
+	}
+
+	if (bg == NULL) {
+		PyErr_SetString(PyExc_SystemError, "Target.wait(): No record of PID returned by target");
+		return NULL;
+	}
+
+	result = Target_buildCommandStatus(bg->object, &bg->cmd, status, pid, softfail || bg->object->softfail);
+	backgroundedCommandFree(bg);
+
+	return result;
+}
+
 /*
  * Wait for command(s) to complete
  */
@@ -456,39 +566,25 @@ PyObject *
 Target_wait_common(twopence_Target *tgtObject, int want_pid)
 {
 	struct twopence_target *handle;
-	struct backgroundedCommand *bg;
-	PyObject *result;
 	twopence_status_t status;
 	int pid;
 
 	if ((handle = tgtObject->handle) == NULL)
 		return NULL;
 
+	if (!Target_claim(tgtObject))
+		return NULL;
+	Py_BEGIN_ALLOW_THREADS
 	pid = twopence_wait(handle, want_pid, &status);
-	if (pid < 0) {
-		if (status.pid > 0) {
-			bg = Target_findBackgrounded(tgtObject, status.pid);
-			goto build_status;
-		}
-		return twopence_Exception("wait", pid);
-	}
+	Py_END_ALLOW_THREADS
+	Target_unclaim(tgtObject);
 
 	if (pid == 0) {
 		Py_INCREF(Py_None);
 		return Py_None;
 	}
 
-	bg = Target_findBackgrounded(tgtObject, pid);
-	if (bg == NULL) {
-		PyErr_SetString(PyExc_SystemError, "Target.wait(): No record of PID returned by target");
-		return NULL;
-	}
-
-build_status:
-	result = Target_buildCommandStatus(bg->object, &bg->cmd, &status, pid);
-	backgroundedCommandFree(bg);
-
-	return result;
+	return Target_completeBackgrounded(tgtObject, pid, &status, false);
 }
 
 static PyObject *
@@ -551,7 +647,15 @@ Target_waitAll(twopence_Target *self, PyObject *args, PyObject *kwds)
 		twopence_status_t status;
 		int pid = 0;
 
+		if (!Target_claim(self)) {
+			Py_XDECREF(result);
+			return NULL;
+		}
+		Py_BEGIN_ALLOW_THREADS
 		pid = twopence_wait(handle, 0, &status);
+		Py_END_ALLOW_THREADS
+		Target_unclaim(self);
+
 		if (pid < 0) {
 			if (ndots)
 				printf("\n");
@@ -587,6 +691,7 @@ Target_waitAll(twopence_Target *self, PyObject *args, PyObject *kwds)
 			if (result->remoteStatus == 0)
 				result->remoteStatus = status.minor;
 		}
+		result->stats = status.stats;
 
 		backgroundedCommandFree(bg);
 		if (print_dots) {
@@ -651,7 +756,13 @@ Target_chat(twopence_Target *self, PyObject *args, PyObject *kwds)
 			twopence_command_alloc_buffer(&bg->cmd, TWOPENCE_STDIN, 65536),
 			twopence_command_alloc_buffer(&bg->cmd, TWOPENCE_STDOUT, 65536));
 
+	if (!Target_claim(tgtObject))
+		goto failed;
+	Py_BEGIN_ALLOW_THREADS
 	rc = twopence_chat_begin(tgtObject->handle, &bg->cmd, &chatObject->chat);
+	Py_END_ALLOW_THREADS
+	Target_unclaim(tgtObject);
+
 	if (rc < 0) {
 		twopence_Exception("chat()", rc);
 		goto failed;
@@ -688,6 +799,106 @@ failed:
 	goto out;
 }
 
+/*
+ * Run a command in the background, and return a Stream object
+ * that iterates over the command's output as it arrives.
+ */
+static PyObject *
+Target_stream(twopence_Target *self, PyObject *args, PyObject *kwds)
+{
+	twopence_Command *cmdObject = NULL;
+	twopence_Stream *streamObject = NULL;
+	struct backgroundedCommand *bg = NULL;
+	twopence_buf_t *bp;
+	twopence_status_t status;
+	PyObject *result = NULL;
+	int rc;
+
+	if (PySequence_Check(args)
+	 && PySequence_Fast_GET_SIZE(args) == 1) {
+		/* Single argument can be an object of type Command or a string */
+		PyObject *object = PySequence_Fast_GET_ITEM(args, 0);
+
+		if (Command_Check(object)) {
+			cmdObject = (twopence_Command *) object;
+			Py_INCREF(cmdObject);
+		}
+	}
+
+	if (cmdObject == NULL) {
+		cmdObject = (twopence_Command *) twopence_callType(&twopence_CommandType, args, kwds);
+		if (cmdObject == NULL)
+			goto out;
+	}
+
+	if (cmdObject->pid != 0) {
+		PyErr_SetString(PyExc_SystemError, "Command already executing");
+		goto out;
+	}
+
+	cmdObject->background = true;
+
+	bg = backgroundedCommandNew(cmdObject);
+	if (Command_build(cmdObject, &bg->cmd) < 0)
+		goto failed;
+
+	/* Rather than the command's stdout and stderr attributes, both
+	 * output streams go to a buffer that we drain as we iterate. */
+	twopence_command_ostream_reset(&bg->cmd, TWOPENCE_STDOUT);
+	twopence_command_ostream_reset(&bg->cmd, TWOPENCE_STDERR);
+	bp = twopence_command_alloc_buffer(&bg->cmd, TWOPENCE_STDOUT, 0);
+	twopence_command_ostream_capture_resizable(&bg->cmd, TWOPENCE_STDOUT, bp);
+	twopence_command_ostream_capture_resizable(&bg->cmd, TWOPENCE_STDERR, bp);
+
+	streamObject = (twopence_Stream *) twopence_callType(&twopence_StreamType, NULL, NULL);
+	if (streamObject == NULL)
+		goto failed;
+
+	if (!Target_claim(self))
+		goto failed;
+	Py_BEGIN_ALLOW_THREADS
+	rc = twopence_run_test(self->handle, &bg->cmd, &status);
+	Py_END_ALLOW_THREADS
+	Target_unclaim(self);
+
+	if (rc < 0) {
+		twopence_Exception("stream()", rc);
+		goto failed;
+	}
+	if (rc == 0) {
+		PyErr_SetString(PyExc_SystemError, "Target.stream() of a backgrounded command returns pid 0");
+		goto failed;
+	}
+
+	Target_recordBackgrounded(self, bg);
+	bg->pid = rc;
+
+	cmdObject->pid = bg->pid;
+	streamObject->pid = bg->pid;
+
+	streamObject->target = self;
+	Py_INCREF(self);
+	streamObject->command = cmdObject;
+	Py_INCREF(cmdObject);
+
+	result = (PyObject *) streamObject;
+
+out:
+	if (cmdObject) {
+		Py_DECREF(cmdObject);
+	}
+
+	return result;
+
+failed:
+	if (bg)
+		backgroundedCommandFree(bg);
+	if (streamObject) {
+		Py_DECREF(streamObject);
+	}
+	goto out;
+}
+
 /*
  * inject file into SUT
  */
@@ -711,7 +922,13 @@ Target_inject(twopence_Target *self, PyObject *args, PyObject *kwds)
 		return NULL;
 
 	/* printf("inject %s -> %s (user %s, mode 0%o)\n", sourceFile, destFile, user, omode); */
+	if (!Target_claim(self))
+		return NULL;
+	Py_BEGIN_ALLOW_THREADS
 	rc = twopence_inject_file(handle, user, sourceFile, destFile, &remoteRc, 0);
+	Py_END_ALLOW_THREADS
+	Target_unclaim(self);
+
 	if (rc < 0)
 		return twopence_Exception("inject", rc);
 
@@ -741,7 +958,13 @@ Target_extract(twopence_Target *self, PyObject *args, PyObject *kwds)
 		return NULL;
 
 	/* printf("extract %s -> %s (user %s, mode 0%o)\n", sourceFile, destFile, user, omode); */
+	if (!Target_claim(self))
+		return NULL;
+	Py_BEGIN_ALLOW_THREADS
 	rc = twopence_extract_file(handle, user, sourceFile, destFile, &remoteRc, 0);
+	Py_END_ALLOW_THREADS
+	Target_unclaim(self);
+
 	if (rc < 0)
 		return twopence_Exception("extract", rc);
 
@@ -796,7 +1019,13 @@ Target_sendfile(twopence_Target *self, PyObject *args, PyObject *kwds)
 	if (Transfer_build_send(xferObject, &xfer) < 0)
 		goto out;
 
+	if (!Target_claim(self))
+		goto out;
+	Py_BEGIN_ALLOW_THREADS
 	rc = twopence_send_file(handle, &xfer, &status);
+	Py_END_ALLOW_THREADS
+	Target_unclaim(self);
+
 	if (rc < 0) {
 		twopence_Exception("sendfile", rc);
 		goto out;
@@ -804,6 +1033,7 @@ Target_sendfile(twopence_Target *self, PyObject *args, PyObject *kwds)
 
 	statusObject = (twopence_Status *) twopence_callType(&twopence_StatusType, NULL, NULL);
 	statusObject->remoteStatus = status.major ?: status.minor;
+	statusObject->stats = status.stats;
 	result = (PyObject *) statusObject;
 
 out:
@@ -838,7 +1068,13 @@ Target_recvfile(twopence_Target *self, PyObject *args, PyObject *kwds)
 	if (Transfer_build_recv(xferObject, &xfer) < 0)
 		goto out;
 
+	if (!Target_claim(self))
+		goto out;
+	Py_BEGIN_ALLOW_THREADS
 	rc = twopence_recv_file(handle, &xfer, &status);
+	Py_END_ALLOW_THREADS
+	Target_unclaim(self);
+
 	if (rc < 0) {
 		twopence_Exception("recvfile", rc);
 		goto out;
@@ -846,6 +1082,7 @@ Target_recvfile(twopence_Target *self, PyObject *args, PyObject *kwds)
 
 	statusObject = (twopence_Status *) twopence_callType(&twopence_StatusType, NULL, NULL);
 	statusObject->remoteStatus = status.major ?: status.minor;
+	statusObject->stats = status.stats;
 
 	/* If we didn't write to a local file, we sent our data to self->databuf.
 	 * copy that back to the data buffer, and return it in the status object */
@@ -939,3 +1176,194 @@ Target_cancel_transactions(twopence_Target *self, PyObject *args, PyObject *kwds
 	Py_INCREF(Py_None);
 	return Py_None;
 }
+
+/*
+ * Convert the server's metrics report to a dict.
+ * Each line consists of a name and a numeric value.
+ */
+static PyObject *
+Target_parseMetrics(twopence_buf_t *bp)
+{
+	PyObject *result;
+	char *line, *pos = NULL;
+
+	if ((result = PyDict_New()) == NULL)
+		return NULL;
+
+	/* Make sure the report is NUL terminated */
+	twopence_buf_ensure_tailroom(bp, 1);
+	twopence_buf_append(bp, "", 1);
+
+	for (line = strtok_r((char *) twopence_buf_head(bp), "\n", &pos); line; line = strtok_r(NULL, "\n", &pos)) {
+		char name[128], value[64];
+		PyObject *valueObject;
+
+		if (sscanf(line, "%127s %63s", name, value) != 2)
+			continue;
+
+		if (strchr(value, '.'))
+			valueObject = PyFloat_FromDouble(strtod(value, NULL));
+		else
+			valueObject = PyLong_FromUnsignedLong(strtoul(value, NULL, 10));
+		if (valueObject == NULL || PyDict_SetItemString(result, name, valueObject) < 0) {
+			Py_XDECREF(valueObject);
+			Py_DECREF(result);
+			return NULL;
+		}
+		Py_DECREF(valueObject);
+	}
+
+	return result;
+}
+
+static PyObject *
+Target_serverMetrics(twopence_Target *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {
+		NULL
+	};
+	twopence_buf_t report;
+	PyObject *result = NULL;
+	int rc;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "", kwlist))
+		return NULL;
+
+	if (self->handle == NULL)
+		return NULL;
+
+	if (!Target_claim(self))
+		return NULL;
+
+	twopence_buf_init(&report);
+	twopence_buf_resize(&report, 4096);
+
+	Py_BEGIN_ALLOW_THREADS
+	rc = twopence_get_server_metrics(self->handle, &report);
+	Py_END_ALLOW_THREADS
+	Target_unclaim(self);
+
+	if (rc < 0)
+		twopence_Exception("serverMetrics", rc);
+	else
+		result = Target_parseMetrics(&report);
+
+	twopence_buf_destroy(&report);
+	return result;
+}
+
+/*
+ * Event loop integration.
+ *
+ * pollfds() returns a tuple ([(fd, events), ...], timeout), where timeout
+ * is the number of seconds after which process() should be called even if
+ * none of the fds became ready, or None.
+ */
+static PyObject *
+Target_pollfds(twopence_Target *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {
+		NULL
+	};
+	struct pollfd *pfd;
+	struct timeval deadline;
+	PyObject *fdList, *timeoutObj;
+	int i, nfds;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "", kwlist))
+		return NULL;
+
+	if (self->handle == NULL) {
+		PyErr_SetString(PyExc_ValueError, "Target object without handle");
+		return NULL;
+	}
+
+	if ((nfds = twopence_count_pollfds(self->handle)) < 0)
+		return twopence_Exception("pollfds", nfds);
+
+	pfd = alloca(nfds * sizeof(*pfd));
+	if ((nfds = twopence_fill_poll(self->handle, pfd, nfds, &deadline)) < 0)
+		return twopence_Exception("pollfds", nfds);
+
+	fdList = PyList_New(nfds);
+	for (i = 0; i < nfds; ++i)
+		PyList_SET_ITEM(fdList, i, Py_BuildValue("(ii)", pfd[i].fd, pfd[i].events));
+
+	if (timerisset(&deadline)) {
+		struct timeval now, delta;
+
+		gettimeofday(&now, NULL);
+		if (timercmp(&deadline, &now, >))
+			timersub(&deadline, &now, &delta);
+		else
+			timerclear(&delta);
+		timeoutObj = PyFloat_FromDouble(delta.tv_sec + 1e-6 * delta.tv_usec);
+	} else {
+		timeoutObj = Py_None;
+		Py_INCREF(timeoutObj);
+	}
+
+	return Py_BuildValue("(NN)", fdList, timeoutObj);
+}
+
+/*
+ * Process whatever I/O is pending on the target, without blocking.
+ * Returns a list of status objects for all backgrounded commands that
+ * completed.
+ */
+static PyObject *
+Target_process(twopence_Target *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {
+		NULL
+	};
+	PyObject *result;
+	int rc, pid;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "", kwlist))
+		return NULL;
+
+	if (self->handle == NULL) {
+		PyErr_SetString(PyExc_ValueError, "Target object without handle");
+		return NULL;
+	}
+
+	if (!Target_claim(self))
+		return NULL;
+
+	rc = twopence_doio(self->handle);
+
+	result = PyList_New(0);
+	while (true) {
+		twopence_status_t status;
+		PyObject *statusObj;
+
+		if ((pid = twopence_reap(self->handle, 0, &status)) == 0)
+			break;
+
+		/* Local errors are reported through the status object's
+		 * localError attribute, so that one failed command does
+		 * not hide the others. */
+		statusObj = Target_completeBackgrounded(self, pid, &status, true);
+		if (statusObj == NULL)
+			goto failed;
+
+		PyList_Append(result, statusObj);
+		Py_DECREF(statusObj);
+	}
+	Target_unclaim(self);
+
+	/* If the target failed, but we still have transactions to report,
+	 * report those first. */
+	if (rc < 0 && PyList_GET_SIZE(result) == 0) {
+		Py_DECREF(result);
+		return twopence_Exception("process", rc);
+	}
+
+	return result;
+
+failed:
+	Target_unclaim(self);
+	Py_DECREF(result);
+	return NULL;
+}
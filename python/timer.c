@@ -143,11 +143,16 @@ static void
 __Timer_callback(twopence_timer_t *t, void *user_data)
 {
 	twopence_Timer *timerObj = (twopence_Timer *) user_data;
+	PyGILState_STATE gstate;
 	PyObject *v;
 
+	/* We are usually called from a blocking library call, which
+	 * has released the GIL */
+	gstate = PyGILState_Ensure();
+
 	if (timerObj->callback == NULL || timerObj->callback == Py_None) {
 		twopence_debug("Timer %u fired; no python callback set", t->id);
-		return;
+		goto out;
 	}
 
 	twopence_debug("Timer %u fired; invoking python callback", t->id);
@@ -158,6 +163,9 @@ __Timer_callback(twopence_timer_t *t, void *user_data)
 		/* We don't care what it returned, we just need to dispose of it */
 		Py_DECREF(v);
 	}
+
+out:
+	PyGILState_Release(gstate);
 }
 
 /*
@@ -0,0 +1,214 @@
+#
+# Twopence python bindings - asyncio integration
+#
+# Copyright (C) 2016 SUSE
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, version 2.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+#
+#
+# Background commands are multiplexed on the event loop using
+# Target.pollfds() and Target.process(); no threads are involved.
+# Transfers and chat operations are blocking in the library, so they are
+# executed on one worker thread per target, while the target's fds are
+# taken off the event loop.
+#
+# All functions return futures, which can be awaited from asyncio
+# coroutines, or yielded from trollius coroutines.
+
+import functools
+import select
+
+try:
+	import asyncio
+except ImportError:
+	import trollius as asyncio
+
+import twopence
+
+class _TargetDriver(object):
+	def __init__(self, target, loop):
+		self.target = target
+		self.loop = loop
+		self.pending = {}
+		self.completed = {}
+		self.readers = set()
+		self.writers = set()
+		self.timer = None
+		self.executor = None
+		self.blocking = 0
+
+	def watch(self, command, future):
+		key = id(command)
+		if key in self.completed:
+			self._resolve(future, self.completed.pop(key))
+		else:
+			self.pending[key] = (command, future)
+
+		# The command may have completed already, while we were
+		# not watching
+		self.process()
+
+	def update(self):
+		fds = {}
+		timeout = None
+		if not self.blocking and self.pending:
+			pollfds, timeout = self.target.pollfds()
+			for fd, events in pollfds:
+				fds[fd] = fds.get(fd, 0) | events
+
+		readers = set(fd for fd, ev in fds.items() if ev & (select.POLLIN | select.POLLPRI))
+		writers = set(fd for fd, ev in fds.items() if ev & select.POLLOUT)
+
+		for fd in self.readers - readers:
+			self.loop.remove_reader(fd)
+		for fd in readers - self.readers:
+			self.loop.add_reader(fd, self.process)
+		for fd in self.writers - writers:
+			self.loop.remove_writer(fd)
+		for fd in writers - self.writers:
+			self.loop.add_writer(fd, self.process)
+		self.readers = readers
+		self.writers = writers
+
+		if self.timer:
+			self.timer.cancel()
+			self.timer = None
+		if timeout is not None:
+			self.timer = self.loop.call_later(timeout, self.process)
+
+	def process(self):
+		if self.blocking:
+			return
+
+		try:
+			completed = self.target.process()
+		except Exception as e:
+			# The target is dead; fail everything that's still pending
+			for command, future in self.pending.values():
+				if not future.done():
+					future.set_exception(e)
+			self.pending = {}
+			completed = []
+
+		for status in completed:
+			key = id(status.command)
+			if key in self.pending:
+				command, future = self.pending.pop(key)
+				self._resolve(future, status)
+			else:
+				self.completed[key] = status
+
+		self.update()
+
+		if not (self.pending or self.completed or self.blocking):
+			_drivers.pop((id(self.target), id(self.loop)), None)
+
+	def _resolve(self, future, status):
+		if future.done():
+			return
+		if status.localError and not status.command.softfail:
+			future.set_exception(SystemError("command execution failed: %s" % status.message))
+		else:
+			future.set_result(status)
+
+	def call_blocking(self, func, *args, **kwargs):
+		if self.executor is None:
+			from concurrent.futures import ThreadPoolExecutor
+
+			self.executor = ThreadPoolExecutor(max_workers = 1)
+
+		self.blocking += 1
+		self.update()
+
+		future = self.loop.run_in_executor(self.executor, functools.partial(func, *args, **kwargs))
+		future.add_done_callback(self._blocking_done)
+		return future
+
+	def _blocking_done(self, future):
+		self.blocking -= 1
+		self.process()
+
+_drivers = {}
+
+def _driver(target, loop):
+	if loop is None:
+		loop = asyncio.get_event_loop()
+
+	key = (id(target), id(loop))
+	driver = _drivers.get(key)
+	if driver is None or driver.target is not target:
+		driver = _TargetDriver(target, loop)
+		_drivers[key] = driver
+	return driver
+
+def run(target, command, loop = None, **kwargs):
+	'''Run a command in the background; returns a future yielding its Status'''
+	if not isinstance(command, twopence.Command):
+		command = twopence.Command(command, **kwargs)
+	command.background = True
+
+	driver = _driver(target, loop)
+	future = asyncio.Future(loop = driver.loop)
+
+	def start(ignored = None):
+		try:
+			target.run(command)
+		except Exception as e:
+			future.set_exception(e)
+			return
+		driver.watch(command, future)
+
+	if driver.blocking:
+		started = driver.call_blocking(lambda: None)
+		started.add_done_callback(start)
+	else:
+		start()
+
+	return future
+
+def chat(target, command, loop = None, **kwargs):
+	'''Start a chat; returns a future yielding the Chat object'''
+	return _driver(target, loop).call_blocking(target.chat, command, **kwargs)
+
+def expect(chat, expect, timeout = -1, loop = None):
+	return _driver(chat.target, loop).call_blocking(chat.expect, expect, timeout = timeout)
+
+def send(chat, string, loop = None):
+	return _driver(chat.target, loop).call_blocking(chat.send, string)
+
+def recvline(chat, timeout = -1, loop = None):
+	return _driver(chat.target, loop).call_blocking(chat.recvline, timeout = timeout)
+
+def wait(chat, loop = None):
+	'''Wait for a chat command to complete; returns a future yielding its Status'''
+	driver = _driver(chat.target, loop)
+	future = asyncio.Future(loop = driver.loop)
+	driver.watch(chat.command, future)
+	return future
+
+def sendfile(target, *args, **kwargs):
+	loop = kwargs.pop('loop', None)
+	return _driver(target, loop).call_blocking(target.sendfile, *args, **kwargs)
+
+def recvfile(target, *args, **kwargs):
+	loop = kwargs.pop('loop', None)
+	return _driver(target, loop).call_blocking(target.recvfile, *args, **kwargs)
+
+def inject(target, *args, **kwargs):
+	loop = kwargs.pop('loop', None)
+	return _driver(target, loop).call_blocking(target.inject, *args, **kwargs)
+
+def extract(target, *args, **kwargs):
+	loop = kwargs.pop('loop', None)
+	return _driver(target, loop).call_blocking(target.extract, *args, **kwargs)
@@ -42,6 +42,7 @@ void Init_twopence()
   rb_define_method(ruby_target_class, "test_and_drop_results", method_test_and_drop_results, -2);
   rb_define_method(ruby_target_class, "test_and_store_results_separately", method_test_and_store_results_separately, -2);
   rb_define_method(ruby_target_class, "test_and_store_results_together", method_test_and_store_results_together, -2);
+  rb_define_method(ruby_target_class, "test_and_stream_results", method_test_and_stream_results, -2);
   rb_define_method(ruby_target_class, "inject_file", method_inject_file, -2);
   rb_define_method(ruby_target_class, "extract_file", method_extract_file, -2);
   rb_define_method(ruby_target_class, "interrupt_command", method_interrupt_command, 0);
@@ -26,16 +26,43 @@ void deallocate_target(void *);
 
 // ************************* Helper method ***********************************
 
-// Get a copy of the contents of twopence buffer, then free it
-VALUE buffer_value(twopence_buf_t *bp)
+// Get a copy of the contents of a twopence rope, then free it
+VALUE rope_value(twopence_rope_t *rope)
 {
   VALUE result;
 
-  result = rb_str_new(twopence_buf_head(bp), twopence_buf_count(bp));
-  twopence_buf_destroy(bp);
+  result = rb_str_new(NULL, twopence_rope_count(rope));
+  twopence_rope_copy(rope, RSTRING_PTR(result));
+  twopence_rope_destroy(rope);
   return result;
 }
 
+// Run a command and capture its output. The output is collected in
+// ropes, so that it is neither truncated nor copied around as it grows.
+// If stderr_rope is NULL, stderr goes to stdout_rope as well.
+static int run_and_capture(struct twopence_target *target,
+                           const char *command, const char *user, long timeout,
+                           twopence_rope_t *stdout_rope, twopence_rope_t *stderr_rope,
+                           twopence_status_t *status)
+{
+  twopence_command_t cmd;
+  int rc;
+
+  twopence_command_init(&cmd, command);
+  cmd.user = user;
+  cmd.timeout = timeout;
+
+  twopence_command_ostreams_reset(&cmd);
+  twopence_command_iostream_redirect(&cmd, TWOPENCE_STDIN, 0, false);
+  twopence_command_ostream_capture_rope(&cmd, TWOPENCE_STDOUT, stdout_rope);
+  twopence_command_ostream_capture_rope(&cmd, TWOPENCE_STDERR,
+                                        stderr_rope? stderr_rope : stdout_rope);
+
+  rc = twopence_run_test(target, &cmd, status);
+  twopence_command_destroy(&cmd);
+  return rc;
+}
+
 // ******************* Methods of module Twopence ****************************
 
 // Create a test target
@@ -205,7 +232,7 @@ VALUE method_test_and_store_results_together(VALUE self, VALUE ruby_args)
         ruby_user,
         ruby_timeout;
   struct twopence_target *target;
-  twopence_buf_t stdout_buf;
+  twopence_rope_t stdout_rope;
   twopence_status_t status;
   int rc;
 
@@ -228,15 +255,14 @@ VALUE method_test_and_store_results_together(VALUE self, VALUE ruby_args)
   else ruby_timeout = LONG2NUM(60L);
   Data_Get_Struct(self, struct twopence_target, target);
 
-  twopence_buf_init(&stdout_buf);
-  twopence_buf_resize(&stdout_buf, 65536);
+  twopence_rope_init(&stdout_rope);
 
-  rc = twopence_test_and_store_results_together(target,
-         StringValueCStr(ruby_user), NUM2LONG(ruby_timeout), StringValueCStr(ruby_command),
-         &stdout_buf, &status);
+  rc = run_and_capture(target,
+         StringValueCStr(ruby_command), StringValueCStr(ruby_user), NUM2LONG(ruby_timeout),
+         &stdout_rope, NULL, &status);
 
   return rb_ary_new3(4,
-                     buffer_value(&stdout_buf),
+                     rope_value(&stdout_rope),
                      INT2NUM(rc), INT2NUM(status.major), INT2NUM(status.minor));
 }
 
@@ -263,7 +289,7 @@ VALUE method_test_and_store_results_separately(VALUE self, VALUE ruby_args)
         ruby_user,
         ruby_timeout;
   struct twopence_target *target;
-  twopence_buf_t stdout_buf, stderr_buf;
+  twopence_rope_t stdout_rope, stderr_rope;
   twopence_status_t status;
   int rc;
 
@@ -286,18 +312,107 @@ VALUE method_test_and_store_results_separately(VALUE self, VALUE ruby_args)
   else ruby_timeout = LONG2NUM(60L);
   Data_Get_Struct(self, struct twopence_target, target);
 
-  twopence_buf_init(&stdout_buf);
-  twopence_buf_init(&stderr_buf);
-  twopence_buf_resize(&stdout_buf, 65536);
-  twopence_buf_resize(&stderr_buf, 65536);
+  twopence_rope_init(&stdout_rope);
+  twopence_rope_init(&stderr_rope);
 
-  rc = twopence_test_and_store_results_separately(target,
-         StringValueCStr(ruby_user), NUM2LONG(ruby_timeout), StringValueCStr(ruby_command),
-         &stdout_buf, &stderr_buf, &status);
+  rc = run_and_capture(target,
+         StringValueCStr(ruby_command), StringValueCStr(ruby_user), NUM2LONG(ruby_timeout),
+         &stdout_rope, &stderr_rope, &status);
 
   return rb_ary_new3(5,
-                     buffer_value(&stdout_buf),
-                     buffer_value(&stderr_buf),
+                     rope_value(&stdout_rope),
+                     rope_value(&stderr_rope),
+                     INT2NUM(rc), INT2NUM(status.major), INT2NUM(status.minor));
+}
+
+// Hand each chunk of output to the block given to test_and_stream_results
+struct stream_state
+{
+  int exception;
+};
+
+static VALUE stream_yield(VALUE chunk)
+{
+  return rb_yield(chunk);
+}
+
+static void stream_callback(const void *data, size_t len, void *user_data)
+{
+  struct stream_state *state = (struct stream_state *) user_data;
+
+  // Once the block raised an exception, discard the remaining output
+  if (state->exception)
+    return;
+
+  rb_protect(stream_yield, rb_str_new(data, len), &state->exception);
+}
+
+// Run a test command, and pass its output to a block as it arrives,
+// rather than storing all of it
+//
+// Example:
+//   rc, major, minor = target.test_and_stream_results("journalctl") { |chunk| log.write(chunk) }
+// Input:
+//   command: the command to run
+//   user: the user under which to run the command
+//         (optional, defaults to "root")
+//   timeout: the time in seconds after which the command is aborted 
+//            (optional, defaults to 60L)
+// Output:
+//   rc: the return code of the testing platform
+//   major: the return code of the system under test
+//   minor: the return code of the command
+VALUE method_test_and_stream_results(VALUE self, VALUE ruby_args)
+{
+  long len;
+  VALUE ruby_command,
+        ruby_user,
+        ruby_timeout;
+  struct twopence_target *target;
+  struct stream_state state;
+  twopence_command_t cmd;
+  twopence_status_t status;
+  int rc;
+
+  rb_need_block();
+
+  Check_Type(ruby_args, T_ARRAY);
+  len = RARRAY_LEN(ruby_args);
+  if (len < 1 || len > 3)
+    rb_raise(rb_eArgError, "wrong number of arguments");
+  ruby_command = rb_ary_entry(ruby_args, 0);
+  if (len >= 2)
+  {
+    ruby_user = rb_ary_entry(ruby_args, 1);
+    Check_Type(ruby_user, T_STRING);
+  }
+  else ruby_user = rb_str_new2("root");
+  if (len >= 3)
+  {
+    ruby_timeout = rb_ary_entry(ruby_args, 2);
+    Check_Type(ruby_timeout, T_FIXNUM);
+  }
+  else ruby_timeout = LONG2NUM(60L);
+  Data_Get_Struct(self, struct twopence_target, target);
+
+  state.exception = 0;
+
+  twopence_command_init(&cmd, StringValueCStr(ruby_command));
+  cmd.user = StringValueCStr(ruby_user);
+  cmd.timeout = NUM2LONG(ruby_timeout);
+
+  twopence_command_ostreams_reset(&cmd);
+  twopence_command_ostream_callback(&cmd, TWOPENCE_STDOUT, stream_callback, &state);
+  twopence_command_ostream_callback(&cmd, TWOPENCE_STDERR, stream_callback, &state);
+
+  rc = twopence_run_test(target, &cmd, &status);
+  twopence_command_destroy(&cmd);
+
+  // Re-raise whatever the block raised
+  if (state.exception)
+    rb_jump_tag(state.exception);
+
+  return rb_ary_new3(3,
                      INT2NUM(rc), INT2NUM(status.major), INT2NUM(status.minor));
 }
 
@@ -25,6 +25,7 @@ VALUE method_test_and_print_results(VALUE self, VALUE ruby_args);            //
 VALUE method_test_and_drop_results(VALUE self, VALUE ruby_args);             // command, user = "root", timeout = 60
 VALUE method_test_and_store_results_together(VALUE self, VALUE ruby_args);   // command, user = "root", timeout = 60
 VALUE method_test_and_store_results_separately(VALUE self, VALUE ruby_args); // command, user = "root", timeout = 60
+VALUE method_test_and_stream_results(VALUE self, VALUE ruby_args);            // command, user = "root", timeout = 60
 VALUE method_inject_file(VALUE self, VALUE ruby_args);                       // local_file, remote_file, user = "root", dots = true
 VALUE method_extract_file(VALUE self, VALUE ruby_args);                      // remote_file, local_file, user = "root", dots = true
 VALUE method_interrupt_command(VALUE self);
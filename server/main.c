@@ -275,7 +275,7 @@ server_set_port(struct server_port *port, const char *type, const char *name)
 //////////////////////////////////////////////////////////////////
 int main(int argc, char *argv[])
 {
-  enum { OPT_ONESHOT, OPT_AUDIT, OPT_NOAUDIT, OPT_PORT_STDIO, OPT_ROOT_DIRECTORY };
+  enum { OPT_ONESHOT, OPT_AUDIT, OPT_NOAUDIT, OPT_PORT_STDIO, OPT_ROOT_DIRECTORY, OPT_TRACE_RING };
   static struct option long_opts[] = {
     { "one-shot", no_argument, NULL, OPT_ONESHOT },
     { "port-serial", required_argument, NULL, 'S' },
@@ -288,12 +288,14 @@ int main(int argc, char *argv[])
     { "audit", no_argument, NULL, OPT_AUDIT },
     { "no-audit", no_argument, NULL, OPT_NOAUDIT },
     { "root-directory", required_argument, NULL, OPT_ROOT_DIRECTORY },
+    { "trace-ring", required_argument, NULL, OPT_TRACE_RING },
     { NULL }
   };
   int opt_oneshot = 0;
   struct server_port opt_port;
   bool opt_daemon = false;
   char *opt_root_directory = NULL;
+  char *opt_trace_ring = NULL;
   int c;
 
   // Welcome message, check arguments
@@ -354,6 +356,10 @@ int main(int argc, char *argv[])
       opt_root_directory = optarg;
       break;
 
+    case OPT_TRACE_RING:
+      opt_trace_ring = optarg;
+      break;
+
     default:
     usage:
 	fprintf(stderr,
@@ -391,6 +397,9 @@ int main(int argc, char *argv[])
 		"--root-directory path\n"
 		"    Perform a chroot operation to the specified directory before\n"
 		"    starting to service requests.\n"
+		"--trace-ring path\n"
+		"    Record binary trace events, and write them to the given file\n"
+		"    on exit and on SIGUSR1. Use twopence_tracedump to decode them.\n"
 		"\n"
 		"The default serial port is %s\n"
 		, argv[0], TWOPENCE_SERIAL_PORT_DEFAULT);
@@ -409,6 +418,12 @@ int main(int argc, char *argv[])
     goto usage;
   }
 
+  if (opt_trace_ring) {
+    if (!twopence_trace_ring_enable(opt_trace_ring, 0))
+      exit(TWOPENCE_SERVER_PARAMETER_ERROR);
+    twopence_trace_ring_dump_on_signal(SIGUSR1);
+  }
+
   if (opt_root_directory) {
     if (chroot(opt_root_directory) < 0) {
       fprintf(stderr, "Unable to change root directory to \"%s\": chroot failed: %m\n", opt_root_directory);
@@ -24,6 +24,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/syscall.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <netinet/in.h> /* for htons */
@@ -47,6 +48,7 @@
 #include <assert.h>
 #include <ctype.h>
 #include <limits.h>
+#include <stdarg.h>
 
 #include "server.h"
 #include "utils.h"
@@ -54,6 +56,19 @@
 
 static twopence_conn_t *	server_new_connection(twopence_sock_t *, twopence_conn_semantics_t *);
 
+/*
+ * Metrics that are not tracked by the connection pool.
+ * Spawn latency is kept as a histogram with decimal buckets,
+ * the first one covering everything up to 100usec.
+ */
+#define SERVER_SPAWN_BUCKETS	6
+
+static twopence_conn_pool_t *	server_pool;
+static unsigned long		server_spawn_latency[SERVER_SPAWN_BUCKETS];
+static const char *		server_spawn_bucket_names[SERVER_SPAWN_BUCKETS] = {
+	"100us", "1ms", "10ms", "100ms", "1s", "inf",
+};
+
 static struct passwd *
 server_get_user(const char *username, int *status)
 {
@@ -295,22 +310,22 @@ server_build_shell_argv(const char *cmdline)
 }
 
 static char **
-server_build_shell_env(twopence_env_t *env, const struct passwd *pw)
+server_build_shell_env(twopence_arena_env_t *env, const struct passwd *pw)
 {
 	static twopence_env_t def_env = { .count = 0 };
 
 	if (def_env.count == 0) {
 		twopence_env_pass(&def_env, "PATH");
 	}
-	twopence_env_merge_inferior(env, &def_env);
-	twopence_env_set(env, "HOME", pw->pw_dir? : "/none");
-	twopence_env_set(env, "USER", pw->pw_name);
+	twopence_arena_env_merge_inferior(env, &def_env);
+	twopence_arena_env_set(env, "HOME", pw->pw_dir? : "/none");
+	twopence_arena_env_set(env, "USER", pw->pw_name);
 
-	return env->array;
+	return env->env->array;
 }
 
 int
-server_run_command_as(twopence_command_t *cmd, int *parent_fds, int *status)
+server_run_command_as(twopence_command_t *cmd, twopence_arena_env_t *cmd_env, int *parent_fds, int *status)
 {
 	int pipefds[6], child_fds[3];
 	int pty_master = -1;
@@ -354,7 +369,7 @@ server_run_command_as(twopence_command_t *cmd, int *parent_fds, int *status)
 		goto failed;
 	}
 
-	env = server_build_shell_env(&cmd->env, user);
+	env = server_build_shell_env(cmd_env, user);
 
 	{
 		int n;
@@ -452,12 +467,60 @@ server_inject_file_write_eof(twopence_transaction_t *trans, twopence_trans_chann
 	/* The channel may have data queued to it. For now, just flush it synchronously */
 	twopence_transaction_channel_flush(channel);
 
-	twopence_transaction_send_minor(trans, 0);
+	twopence_transaction_send_complete(trans, -1, 0, -1);
 	trans->done = true;
 }
 
+/*
+ * The only packet we expect from the client during a file transfer
+ * (apart from data and EOF) is an interrupt, when it went away.
+ */
+static bool
+server_file_xfer_recv(twopence_transaction_t *trans, const twopence_hdr_t *hdr, twopence_buf_t *payload)
+{
+	switch (hdr->type) {
+	case TWOPENCE_PROTO_TYPE_INTR:
+		twopence_debug("%s: transfer interrupted by client", twopence_transaction_describe(trans));
+		twopence_transaction_close_sink(trans, 0);
+		twopence_transaction_close_source(trans, 0);
+		if (!trans->done)
+			twopence_transaction_fail(trans, EINTR);
+		break;
+
+	default:
+		twopence_log_error("Unknown command code '%c' in transaction context\n", hdr->type);
+		twopence_transaction_fail(trans, EPROTO);
+		break;
+	}
+
+	return true;
+}
+
+static bool
+server_write_all(int fd, const void *data, size_t len, int *status)
+{
+	while (len) {
+		ssize_t n;
+
+		n = write(fd, data, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			*status = errno;
+			return false;
+		}
+		data += n;
+		len -= n;
+	}
+	return true;
+}
+
+/*
+ * If inline_data is given, the client sent the entire file along with
+ * the request. Otherwise, the data follows on channel 0.
+ */
 bool
-server_inject_file(twopence_transaction_t *trans, const twopence_file_xfer_t *xfer)
+server_inject_file(twopence_transaction_t *trans, const twopence_file_xfer_t *xfer, twopence_buf_t *inline_data)
 {
 	twopence_trans_channel_t *sink;
 	const char *filename = xfer->remote.name;
@@ -472,6 +535,19 @@ server_inject_file(twopence_transaction_t *trans, const twopence_file_xfer_t *xf
 		return false;
 	}
 
+	if (inline_data != NULL) {
+		if (!server_write_all(fd, twopence_buf_head(inline_data), twopence_buf_count(inline_data), &status)) {
+			close(fd);
+			twopence_transaction_fail(trans, status);
+			return false;
+		}
+		close(fd);
+
+		twopence_transaction_send_complete(trans, 0, 0, -1);
+		trans->done = true;
+		return true;
+	}
+
 	sink = twopence_transaction_attach_local_sink(trans, 0, fd);
 	if (sink == NULL) {
 		/* Something is wrong */
@@ -480,6 +556,7 @@ server_inject_file(twopence_transaction_t *trans, const twopence_file_xfer_t *xf
 	}
 
 	twopence_transaction_channel_set_callback_write_eof(sink, server_inject_file_write_eof);
+	trans->recv = server_file_xfer_recv;
 
 	/* Tell the client a success status right after we open the file -
 	 * this will start the actual transfer */
@@ -493,11 +570,52 @@ server_extract_file_source_read_eof(twopence_transaction_t *trans, twopence_tran
 {
 	uint16_t channel_id = twopence_transaction_channel_id(channel);
 
-	twopence_transaction_send_client(trans, twopence_protocol_build_eof_packet(&trans->ps, channel_id));
-	twopence_transaction_send_minor(trans, 0);
+	twopence_transaction_send_complete(trans, -1, 0, channel_id);
 	trans->done = true;
 }
 
+/*
+ * Send a small file in the packet that completes the transaction.
+ * Returns false if the file is not a regular file or turns out to be
+ * too big, in which case the caller falls back to the regular transfer.
+ * Anything else, such as a FIFO, could block us while reading.
+ */
+static bool
+server_extract_file_inline(twopence_transaction_t *trans, int fd)
+{
+	char buffer[TWOPENCE_PROTO_INLINE_MAX + 1];
+	struct stat stb;
+	size_t count = 0;
+	ssize_t n;
+
+	if (fstat(fd, &stb) < 0 || !S_ISREG(stb.st_mode)
+	 || stb.st_size > TWOPENCE_PROTO_INLINE_MAX)
+		return false;
+
+	/* Read one byte more than we can send; the file may have grown
+	 * since we looked */
+	do {
+		n = read(fd, buffer + count, sizeof(buffer) - count);
+		if (n > 0)
+			count += n;
+	} while (count < sizeof(buffer) && (n > 0 || (n < 0 && errno == EINTR)));
+
+	if (n != 0) {
+		if (lseek(fd, 0, SEEK_SET) == 0)
+			return false;
+
+		/* We cannot start over; the file is gone as far as we are concerned */
+		twopence_transaction_fail(trans, errno);
+		close(fd);
+		return true;
+	}
+
+	close(fd);
+	twopence_transaction_send_complete_data(trans, -1, 0, 0, buffer, count);
+	trans->done = true;
+	return true;
+}
+
 bool
 server_extract_file(twopence_transaction_t *trans, const twopence_file_xfer_t *xfer)
 {
@@ -513,6 +631,9 @@ server_extract_file(twopence_transaction_t *trans, const twopence_file_xfer_t *x
 		return false;
 	}
 
+	if (trans->inline_xfer && server_extract_file_inline(trans, fd))
+		return true;
+
 	source = twopence_transaction_attach_local_source(trans, 0, fd);
 	if (source == NULL) {
 		/* Something is wrong */
@@ -522,11 +643,26 @@ server_extract_file(twopence_transaction_t *trans, const twopence_file_xfer_t *x
 	}
 
 	twopence_transaction_channel_set_callback_read_eof(source, server_extract_file_source_read_eof);
+	trans->recv = server_file_xfer_recv;
 
 	/* We don't expect to receive any packets; sending is taken care of at the channel level */
 	return true;
 }
 
+/*
+ * Obtain a pidfd for the child process, so that it can be watched in
+ * the poll loop. Returns -1 if the kernel does not support pidfds.
+ */
+static int
+server_pidfd_open(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+	return syscall(SYS_pidfd_open, pid, 0);
+#else
+	return -1;
+#endif
+}
+
 bool
 server_run_command_send(twopence_transaction_t *trans)
 {
@@ -543,13 +679,20 @@ server_run_command_send(twopence_transaction_t *trans)
 	 && !twopence_transaction_channel_is_read_eof(channel))
 		pending_output = true;
 
-	if (trans->pid) {
+	/* If we have a pidfd for the child, we only need to reap it
+	 * once the pidfd has become readable. */
+	if (trans->pid && twopence_transaction_child_exited(trans)) {
 		pid = waitpid(trans->pid, &status, WNOHANG);
 		if (pid > 0) {
 			twopence_debug("%s: process exited, status=%u\n", twopence_transaction_describe(trans), status);
 			twopence_transaction_close_sink(trans, 0);
 			trans->status = status;
 			trans->pid = 0;
+
+			if (trans->pidfd >= 0) {
+				close(trans->pidfd);
+				trans->pidfd = -1;
+			}
 		}
 	}
 
@@ -557,8 +700,7 @@ server_run_command_send(twopence_transaction_t *trans)
 		int st = trans->status;
 
 		if (WIFEXITED(st)) {
-			twopence_transaction_send_major(trans, 0);
-			twopence_transaction_send_minor(trans, WEXITSTATUS(st));
+			twopence_transaction_send_complete(trans, 0, WEXITSTATUS(st), -1);
 		} else
 		if (WIFSIGNALED(st)) {
 			if (WTERMSIG(st) == SIGALRM) {
@@ -600,8 +742,23 @@ server_run_command_recv(twopence_transaction_t *trans, const twopence_hdr_t *hdr
 	return true;
 }
 
+static void
+server_metrics_record_spawn(const twopence_transaction_t *trans)
+{
+	unsigned long usec, limit = 100;
+	unsigned int bucket = 0;
+
+	usec = twopence_transaction_usec_between(&trans->stats.created, &trans->stats.spawned);
+
+	while (bucket < SERVER_SPAWN_BUCKETS - 1 && usec >= limit) {
+		limit *= 10;
+		bucket++;
+	}
+	server_spawn_latency[bucket]++;
+}
+
 bool
-server_run_command(twopence_transaction_t *trans, twopence_command_t *cmd)
+server_run_command(twopence_transaction_t *trans, twopence_command_t *cmd, twopence_arena_env_t *env)
 {
 	twopence_trans_channel_t *channel;
 	int status;
@@ -611,10 +768,12 @@ server_run_command(twopence_transaction_t *trans, twopence_command_t *cmd)
 
 	AUDIT("run \"%s\"; user=%s timeout=%u%s\n", cmd->command, cmd->user, cmd->timeout,
 				cmd->request_tty? ", use a tty" : "");
-	if ((pid = server_run_command_as(cmd, command_fds, &status)) < 0) {
+	if ((pid = server_run_command_as(cmd, env, command_fds, &status)) < 0) {
 		twopence_transaction_fail2(trans, status, 0);
 		return false;
 	}
+	gettimeofday(&trans->stats.spawned, NULL);
+	server_metrics_record_spawn(trans);
 
 	channel = twopence_transaction_attach_local_sink(trans, TWOPENCE_STDIN, command_fds[0]);
 	if (channel == NULL)
@@ -643,6 +802,11 @@ server_run_command(twopence_transaction_t *trans, twopence_command_t *cmd)
 	trans->recv = server_run_command_recv;
 	trans->send = server_run_command_send;
 	trans->pid = pid;
+	trans->pidfd = server_pidfd_open(pid);
+
+	/* Interactive commands want their output right away */
+	if (!cmd->request_tty)
+		twopence_transaction_set_batching(trans, cmd->batch.max_bytes, cmd->batch.max_delay);
 
 	return true;
 
@@ -662,19 +826,110 @@ server_request_quit(void)
 	exit(0);
 }
 
+/*
+ * The report easily fits into a single packet. Should it ever outgrow
+ * that, we truncate it at the first line that does not fit; all later
+ * lines are dropped as well, even if they are short enough.
+ */
+static bool	server_metrics_truncated;
+
+static void
+server_metrics_printf(twopence_buf_t *bp, const char *fmt, ...)
+{
+	unsigned int room = twopence_buf_tailroom(bp);
+	va_list ap;
+	int n;
+
+	if (server_metrics_truncated)
+		return;
+
+	va_start(ap, fmt);
+	n = vsnprintf(twopence_buf_tail(bp), room, fmt, ap);
+	va_end(ap);
+
+	if (n > 0 && n < room)
+		twopence_buf_advance_tail(bp, n);
+	else
+		server_metrics_truncated = true;
+}
+
+static void
+server_metrics_print_packets(twopence_buf_t *bp, const char *dir, const twopence_packet_counters_t *counters)
+{
+	unsigned int type;
+
+	for (type = 0; type < TWOPENCE_PROTO_TYPE_MAX; ++type) {
+		const char *name;
+
+		if (counters->packets[type] == 0)
+			continue;
+
+		name = twopence_protocol_packet_type_to_string(type);
+		server_metrics_printf(bp, "packets-%s.%s %lu\n", dir, name, counters->packets[type]);
+		server_metrics_printf(bp, "bytes-%s.%s %lu\n", dir, name, counters->bytes[type]);
+	}
+}
+
+/*
+ * Report server wide metrics to the client, as a text document
+ * with one "name value" pair per line.
+ */
+static void
+server_report_metrics(twopence_transaction_t *trans)
+{
+	twopence_conn_metrics_t metrics;
+	struct timeval now, uptime;
+	twopence_buf_t *bp;
+	unsigned int i;
+
+	AUDIT("report metrics\n");
+
+	memset(&metrics, 0, sizeof(metrics));
+	if (server_pool)
+		twopence_conn_pool_get_metrics(server_pool, &metrics);
+
+	gettimeofday(&now, NULL);
+	timersub(&now, &metrics.started, &uptime);
+
+	bp = twopence_buf_new(TWOPENCE_PROTO_MAX_PACKET);
+	twopence_buf_reserve_head(bp, TWOPENCE_PROTO_HEADER_SIZE + 2);
+	server_metrics_truncated = false;
+
+	server_metrics_printf(bp, "uptime %lu.%06lu\n", (unsigned long) uptime.tv_sec, (unsigned long) uptime.tv_usec);
+	server_metrics_printf(bp, "connections %u\n", metrics.connections);
+	server_metrics_printf(bp, "connections-total %lu\n", metrics.connections_total);
+	server_metrics_printf(bp, "transactions %u\n", metrics.transactions);
+	server_metrics_printf(bp, "transactions-total %lu\n", metrics.transactions_total);
+	server_metrics_printf(bp, "xmit-queue-hiwat %u\n", metrics.xmit_queue_hiwat);
+	server_metrics_printf(bp, "buffered-bytes %lu\n", metrics.buffered_bytes);
+	server_metrics_printf(bp, "poll-iterations %lu\n", metrics.poll_iterations);
+	server_metrics_printf(bp, "poll-idle-wakeups %lu\n", metrics.poll_idle_wakeups);
+	for (i = 0; i < SERVER_SPAWN_BUCKETS; ++i)
+		server_metrics_printf(bp, "spawn-latency.%s %lu\n", server_spawn_bucket_names[i], server_spawn_latency[i]);
+	server_metrics_print_packets(bp, "in", &metrics.packets_in);
+	server_metrics_print_packets(bp, "out", &metrics.packets_out);
+
+	twopence_protocol_build_data_header(bp, &trans->ps, 0);
+	twopence_transaction_send_client(trans, bp);
+	twopence_transaction_send_complete(trans, -1, 0, 0);
+	trans->done = true;
+}
+
 bool
 server_process_request(twopence_transaction_t *trans, twopence_buf_t *payload)
 {
 	twopence_file_xfer_t xfer;
 	twopence_command_t cmd;
+	twopence_arena_env_t env;
+	bool inline_data;
 
 	switch (trans->type) {
 	case TWOPENCE_PROTO_TYPE_INJECT:
 		twopence_file_xfer_init(&xfer);
-		if (!twopence_protocol_dissect_inject_packet(payload, &xfer))
+		if (!twopence_protocol_dissect_inject_packet(payload, &xfer, &inline_data))
 			goto bad_packet;
 
-		server_inject_file(trans, &xfer);
+		server_inject_file(trans, &xfer, inline_data? payload : NULL);
 		twopence_file_xfer_destroy(&xfer);
 		break;
 
@@ -689,14 +944,22 @@ server_process_request(twopence_transaction_t *trans, twopence_buf_t *payload)
 
 	case TWOPENCE_PROTO_TYPE_COMMAND:
 		memset(&cmd, 0, sizeof(cmd));
-		if (!twopence_protocol_dissect_command_packet(payload, &cmd)
-		 || cmd.command[0] == '\0')
+		twopence_arena_env_init(&env, &cmd.env, &trans->arena);
+		if (!twopence_protocol_dissect_command_packet(payload, &cmd, &env)
+		 || cmd.command[0] == '\0') {
+			twopence_arena_env_destroy(&env);
 			goto bad_packet;
+		}
 
-		server_run_command(trans, &cmd);
+		server_run_command(trans, &cmd, &env);
+		twopence_arena_env_destroy(&env);
 		twopence_command_destroy(&cmd);
 		break;
 
+	case TWOPENCE_PROTO_TYPE_METRICS:
+		server_report_metrics(trans);
+		break;
+
 	case TWOPENCE_PROTO_TYPE_QUIT:
 		server_request_quit();
 		/* we should not get here */
@@ -776,6 +1039,7 @@ __server_run(twopence_conn_t *conn)
 	signal(SIGPIPE, SIG_IGN);
 
 	pool = twopence_conn_pool_new();
+	server_pool = pool;
 
 	twopence_conn_pool_add_connection(pool, conn);
 	while (twopence_conn_pool_poll(pool))
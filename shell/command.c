@@ -254,7 +254,7 @@ int main(int argc, char *argv[])
   }
 
   // Create target object
-  rc = twopence_target_new(opt_target, &target);
+  rc = twopence_target_new_mux(opt_target, &target);
   if (rc < 0)
   {
     twopence_perror("Error while initializing library", rc);
@@ -59,7 +59,7 @@ int main(int argc, const char *argv[])
     exit(RC_INVALID_PARAMETERS);
   }
 
-  rc = twopence_target_new(argv[1], &target);
+  rc = twopence_target_new_mux(argv[1], &target);
   if (rc < 0)
   {
     twopence_perror("Error while initializing library", rc);
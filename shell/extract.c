@@ -99,7 +99,7 @@ int main(int argc, char *argv[])
   opt_remote = argv[optind++];
   opt_local = argv[optind++];
 
-  rc = twopence_target_new(opt_target, &target);
+  rc = twopence_target_new_mux(opt_target, &target);
   if (rc < 0)
   {
     twopence_perror("Error while initializing library", rc);
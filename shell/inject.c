@@ -56,6 +56,8 @@ int main(int argc, char *argv[])
   const char *opt_user,
              *opt_target, *opt_local, *opt_remote;
   struct twopence_target *target;
+  twopence_file_xfer_t xfer;
+  twopence_status_t status;
   int rc, remote_error;
 
   // Parse options
@@ -85,17 +87,30 @@ int main(int argc, char *argv[])
   opt_local = argv[optind++];
   opt_remote = argv[optind++];
 
-  rc = twopence_target_new(opt_target, &target);
+  rc = twopence_target_new_mux(opt_target, &target);
   if (rc < 0)
   {
     twopence_perror("Error while initializing library", rc);
     exit(RC_LIBRARY_INIT_ERROR);
   }
 
-  // Inject file
-  rc = twopence_inject_file
-         (target, opt_user, opt_local, opt_remote,
-          &remote_error, true);
+  // Inject file. Large files are mapped rather than read, which saves
+  // copying them; the transfer fails if the file is truncated meanwhile.
+  twopence_file_xfer_init(&xfer);
+  xfer.user = opt_user;
+  xfer.remote.name = opt_remote;
+  xfer.remote.mode = 0660;
+  xfer.print_dots = true;
+
+  remote_error = 0;
+  rc = twopence_iostream_open_mapped(opt_local, &xfer.local_stream);
+  if (rc == 0)
+  {
+    rc = twopence_send_file(target, &xfer, &status);
+    remote_error = status.major;
+  }
+  twopence_file_xfer_destroy(&xfer);
+
   if (rc == 0)
     printf("File successfully injected\n");
   else
@@ -0,0 +1,191 @@
+/*
+Multiplexer command. It keeps a connection to the test server open,
+so that the other shell commands do not have to set up a new link
+each time they are called.
+
+
+Copyright (C) 2014-2016 SUSE
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 2.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "shell.h"
+#include "twopence.h"
+#include "version.h"
+
+static const char *socket_path;
+
+char *short_options = "s:fdvh";
+struct option long_options[] = {
+  { "socket", 1, NULL, 's' },
+  { "foreground", 0, NULL, 'f' },
+  { "debug", 0, NULL, 'd' },
+  { "version", 0, NULL, 'v' },
+  { "help", 0, NULL, 'h' },
+  { NULL, 0, NULL, 0 }
+};
+
+// Display a message about the command usage
+void usage(const char *program_name)
+{
+    fprintf(stderr, "Usage: %s [<options>] <target>\n\
+Options: -s|--socket <path>: listen on this socket (default: derived from target)\n\
+         -f|--foreground: do not detach from the terminal\n\
+         -d|--debug: print debug information\n\
+         -v|--version: print version information\n\
+         -h|--help: print this help message\n\
+Target: serial:<character device>\n\
+        tcp:<address and port>\n\
+        virtio:<socket file>\n", program_name);
+}
+
+// Remove the socket when we're told to go away
+void signal_handler(int signum)
+{
+  unlink(socket_path);
+  _exit(RC_OK);
+}
+
+// Detach from the terminal. The parent returns once the child
+// accepts connections, so that commands run right after us
+// already use the multiplexer.
+//
+// Returns in the child only
+void daemonize(pid_t *child)
+{
+  int i, status, fd;
+
+  if ((*child = fork()) < 0)
+  {
+    perror("fork");
+    exit(RC_LIBRARY_INIT_ERROR);
+  }
+
+  if (*child == 0)
+  {
+    setsid();
+    if ((fd = open("/dev/null", O_RDWR)) >= 0)
+    {
+      dup2(fd, 0);
+      if (!twopence_debug_level)
+      {
+        dup2(fd, 1);
+        dup2(fd, 2);
+      }
+      if (fd > 2)
+        close(fd);
+    }
+    return;
+  }
+
+  for (i = 0; i < 300; ++i)
+  {
+    if (twopence_mux_is_running(socket_path))
+    {
+      printf("%d\n", (int) *child);
+      exit(RC_OK);
+    }
+    if (waitpid(*child, &status, WNOHANG) == *child)
+    {
+      fprintf(stderr, "Multiplexer failed to start\n");
+      exit(RC_LIBRARY_INIT_ERROR);
+    }
+    usleep(100000);
+  }
+
+  fprintf(stderr, "Timed out waiting for the multiplexer to start\n");
+  kill(*child, SIGTERM);
+  exit(RC_LIBRARY_INIT_ERROR);
+}
+
+// Main program
+int main(int argc, char *argv[])
+{
+  int option;
+  bool opt_foreground = false;
+  const char *opt_target;
+  struct twopence_target *target;
+  pid_t child;
+  int rc;
+
+  while ((option = getopt_long(argc, argv, short_options, long_options, NULL))
+         != -1) switch(option)         // parse individual options
+  {
+    case 's': socket_path = optarg;
+              break;
+    case 'f': opt_foreground = true;
+              break;
+    case 'd': twopence_debug_level++;
+              break;
+    case 'v': printf("%s version %s\n", argv[0], TWOPENCE_VERSION);
+              exit(RC_OK);
+    case 'h': usage(argv[0]);
+              exit(RC_OK);
+    invalid_options:
+    default: usage(argv[0]);
+             exit(RC_INVALID_PARAMETERS);
+  }
+
+  if (argc != optind + 1)              // mandatory argument: target
+    goto invalid_options;
+
+  opt_target = argv[optind++];
+
+  if (socket_path == NULL && (socket_path = twopence_mux_socket_path(opt_target)) == NULL)
+  {
+    fprintf(stderr, "Unable to build socket path for %s, please use --socket\n", opt_target);
+    exit(RC_INVALID_PARAMETERS);
+  }
+
+  if (twopence_mux_is_running(socket_path))
+  {
+    fprintf(stderr, "A multiplexer is already running on %s\n", socket_path);
+    exit(RC_LIBRARY_INIT_ERROR);
+  }
+
+  rc = twopence_target_new(opt_target, &target);
+  if (rc < 0)
+  {
+    twopence_perror("Error while initializing library", rc);
+    exit(RC_LIBRARY_INIT_ERROR);
+  }
+
+  if (!opt_foreground)
+    daemonize(&child);
+
+  signal(SIGTERM, signal_handler);
+  signal(SIGINT, signal_handler);
+  signal(SIGPIPE, SIG_IGN);
+
+  // Relay transactions until the server closes the link
+  rc = twopence_mux_serve(target, socket_path);
+  if (rc < 0)
+  {
+    twopence_perror("Multiplexer failed", rc);
+    rc = RC_LIBRARY_INIT_ERROR;
+  }
+
+  twopence_target_free(target);
+  return rc;
+}
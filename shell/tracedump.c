@@ -0,0 +1,114 @@
+/*
+Trace dump command. It decodes the binary trace ring written by
+the twopence library and the test server.
+
+
+Copyright (C) 2014-2015 SUSE
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 2.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shell.h"
+#include "twopence.h"
+
+// Display a message about the command usage
+void usage(const char *program_name)
+{
+  fprintf(stderr, "Usage: %s <trace file>\n", program_name);
+}
+
+// Order events by sequence number
+static int compare_events(const void *a, const void *b)
+{
+  const twopence_trace_event_t *ea = a, *eb = b;
+
+  if (ea->seq < eb->seq)
+    return -1;
+  return ea->seq > eb->seq;
+}
+
+// Main program
+int main(int argc, const char *argv[])
+{
+  twopence_trace_ring_header_t hdr;
+  twopence_trace_event_t *events;
+  unsigned int i, count = 0;
+  uint64_t start = 0, prev = 0;
+  FILE *fp;
+
+  // Check arguments
+  if (argc != 2)
+  {
+    usage(argv[0]);
+    exit(RC_INVALID_PARAMETERS);
+  }
+
+  if ((fp = fopen(argv[1], "r")) == NULL)
+  {
+    perror(argv[1]);
+    exit(RC_INVALID_PARAMETERS);
+  }
+
+  if (fread(&hdr, sizeof(hdr), 1, fp) != 1
+   || memcmp(hdr.magic, TWOPENCE_TRACE_RING_MAGIC, sizeof(hdr.magic))
+   || hdr.version != TWOPENCE_TRACE_RING_VERSION)
+  {
+    fprintf(stderr, "%s: not a twopence trace file\n", argv[1]);
+    exit(RC_INVALID_PARAMETERS);
+  }
+
+  events = calloc(hdr.size, sizeof(*events));
+  if (events == NULL || fread(events, sizeof(*events), hdr.size, fp) != hdr.size)
+  {
+    fprintf(stderr, "%s: truncated trace file\n", argv[1]);
+    exit(RC_INVALID_PARAMETERS);
+  }
+  fclose(fp);
+
+  // Drop empty slots, and slots that were being written while we dumped
+  for (i = 0; i < hdr.size; ++i)
+  {
+    if (events[i].seq != 0 && events[i].seq <= hdr.head)
+      events[count++] = events[i];
+  }
+  qsort(events, count, sizeof(*events), compare_events);
+
+  printf("# pid %u, %u events recorded, %u in trace\n", hdr.pid, hdr.head, count);
+  if (count && events[0].seq > 1)
+    printf("# %u older events were overwritten\n", events[0].seq - 1);
+
+  // Print timestamps relative to the first event, along with the delta
+  for (i = 0; i < count; ++i)
+  {
+    const twopence_trace_event_t *ev = &events[i];
+    char desc[256];
+
+    if (i == 0)
+      start = prev = ev->timestamp;
+
+    printf("%8u %12.6f %+10.6f  %s\n",
+		ev->seq,
+		(ev->timestamp - start) / 1e9,
+		(ev->timestamp - prev) / 1e9,
+		twopence_trace_ring_describe(ev, desc, sizeof(desc)));
+    prev = ev->timestamp;
+  }
+
+  free(events);
+  return RC_OK;
+}
@@ -14,8 +14,8 @@
 # If we ever bump the major version number, more manual work is
 # required.
 #
-VERSION=0.3.8
-DATE="November 2016"
+VERSION=0.4.0
+DATE="October 2026"
 
 # Special case
 if [ $# -eq 1 -a "$1" = "--version" ]; then
@@ -0,0 +1,289 @@
+#!/usr/bin/env python
+#
+# Benchmark protocol throughput and latency.
+#
+# This is meant to be run against a target that does not need a VM,
+# such as the local or chroot plugin:
+#   bench.py local
+#   bench.py chroot:/path/to/jail
+#
+# Results are written as JSON to the file given as second argument
+# (default: bench.json), so that runs can be compared with each other.
+#
+# The following environment variables can be used to tweak the run:
+#   TWOPENCE_BENCH_ITERATIONS	number of round trips to time (default 200)
+#   TWOPENCE_BENCH_CONCURRENCY	commands to keep in flight (default 1,4,16)
+#   TWOPENCE_BENCH_MAX_SIZE	largest file to transfer, in bytes (default 1 GiB)
+#   TWOPENCE_BENCH_REMOTE_DIR	scratch directory on the target (default /tmp)
+##########################################################
+
+import twopence
+import sys
+import os
+import time
+import json
+import platform
+
+twopence.setDebugLevel(0)
+
+targetSpec = None
+if len(sys.argv) > 1:
+	targetSpec = sys.argv[1]
+if not targetSpec:
+	print "Expected twopence target as argument"
+	sys.exit(1)
+
+outputFile = "bench.json"
+if len(sys.argv) > 2:
+	outputFile = sys.argv[2]
+
+iterations = int(os.getenv("TWOPENCE_BENCH_ITERATIONS", "200"))
+concurrencyLevels = [int(n) for n in os.getenv("TWOPENCE_BENCH_CONCURRENCY", "1,4,16").split(",")]
+maxSize = int(os.getenv("TWOPENCE_BENCH_MAX_SIZE", str(1024 * 1024 * 1024)))
+remoteDir = os.getenv("TWOPENCE_BENCH_REMOTE_DIR", "/tmp")
+
+transferSizes = [1024, 64 * 1024, 1024 * 1024, 16 * 1024 * 1024, 256 * 1024 * 1024, 1024 * 1024 * 1024]
+
+target = twopence.Target(targetSpec);
+
+##########################################################
+# Helper functions
+##########################################################
+def timeSummary(samples):
+	samples = sorted(samples)
+	count = len(samples)
+	if count == 0:
+		return None
+
+	def percentile(p):
+		return samples[min(count - 1, int(p * count / 100))]
+
+	return {
+		"count":	count,
+		"min_usec":	int(samples[0] * 1e6),
+		"median_usec":	int(percentile(50) * 1e6),
+		"p95_usec":	int(percentile(95) * 1e6),
+		"max_usec":	int(samples[-1] * 1e6),
+		"mean_usec":	int(sum(samples) / count * 1e6),
+	}
+
+# With the local and chroot plugins, the server is a child process of
+# ours. Look it up so that we can tell how much CPU it is using.
+def findServerPids():
+	result = []
+	for entry in os.listdir("/proc"):
+		if not entry.isdigit():
+			continue
+		try:
+			stat = open("/proc/%s/stat" % entry).read()
+		except:
+			continue
+
+		comm = stat[stat.index("(") + 1:stat.rindex(")")]
+		fields = stat[stat.rindex(")") + 2:].split()
+		if comm.startswith("twopence_test") and int(fields[1]) == os.getpid():
+			result.append(int(entry))
+	return result
+
+def serverCpuTime():
+	total = 0.0
+	pids = findServerPids()
+	if not pids:
+		return None
+
+	for pid in pids:
+		try:
+			stat = open("/proc/%d/stat" % pid).read()
+		except:
+			continue
+		fields = stat[stat.rindex(")") + 2:].split()
+		total += int(fields[11]) + int(fields[12])
+	return total / os.sysconf("SC_CLK_TCK")
+
+def clientCpuTime():
+	t = os.times()
+	return t[0] + t[1]
+
+def cpuPerMB(cpu, nbytes):
+	if cpu is None or nbytes == 0:
+		return None
+	return cpu / (nbytes / (1024.0 * 1024.0))
+
+def sizeName(size):
+	for unit in ["", "K", "M", "G"]:
+		if size < 1024 or size % 1024:
+			return "%u%s" % (size, unit)
+		size /= 1024
+	return "%uT" % size
+
+def checkStatus(status, what):
+	if status.localError or status.code:
+		raise Exception("%s failed (local error %d, exit code %d)" % (what, status.localError, status.code))
+
+##########################################################
+# The actual benchmarks
+##########################################################
+def benchCommandLatency():
+	samples = []
+
+	# Warm up the connection first
+	checkStatus(target.run(twopence.Command("true", stdout = None, stderr = None)), "true")
+
+	for i in range(iterations):
+		cmd = twopence.Command("true", stdout = None, stderr = None)
+
+		t0 = time.time()
+		status = target.run(cmd)
+		samples.append(time.time() - t0)
+
+		checkStatus(status, "true")
+
+	return timeSummary(samples)
+
+def benchCommandRate(concurrency):
+	total = max(iterations, concurrency)
+	started = 0
+	completed = 0
+
+	t0 = time.time()
+	while completed < total:
+		while started < total and started - completed < concurrency:
+			cmd = twopence.Command("true", stdout = None, stderr = None, background = True)
+			target.run(cmd)
+			started += 1
+
+		status = target.wait()
+		if status is None:
+			raise Exception("no command to wait for")
+		checkStatus(status, "true")
+		completed += 1
+	elapsed = time.time() - t0
+
+	return {
+		"concurrency":		concurrency,
+		"commands":		total,
+		"elapsed_sec":		elapsed,
+		"commands_per_sec":	total / elapsed,
+	}
+
+def benchTransfer(size):
+	localFile = "bench-%u.data" % os.getpid()
+	copyFile = "bench-%u.copy" % os.getpid()
+	remoteFile = "%s/twopence-bench-%u.data" % (remoteDir, os.getpid())
+
+	f = open(localFile, "w")
+	chunk = os.urandom(min(size, 1024 * 1024))
+	written = 0
+	while written < size:
+		n = min(len(chunk), size - written)
+		f.write(chunk[:n])
+		written += n
+	f.close()
+
+	result = { "size": size }
+	try:
+		for op in ("inject", "extract"):
+			server0 = serverCpuTime()
+			client0 = clientCpuTime()
+			t0 = time.time()
+
+			# These raise an exception on failure
+			if op == "inject":
+				target.inject(localFile, remoteFile)
+			else:
+				target.extract(remoteFile, copyFile)
+
+			elapsed = time.time() - t0
+			client1 = clientCpuTime()
+			server1 = serverCpuTime()
+
+			serverCpu = None
+			if server0 is not None and server1 is not None:
+				serverCpu = server1 - server0
+
+			result[op] = {
+				"elapsed_sec":		elapsed,
+				"mbytes_per_sec":	size / (1024.0 * 1024.0) / max(elapsed, 1e-6),
+				"server_cpu_sec_per_mb": cpuPerMB(serverCpu, size),
+				"client_cpu_sec_per_mb": cpuPerMB(client1 - client0, size),
+			}
+
+		if os.path.getsize(copyFile) != size:
+			raise Exception("extracted file has size %u, expected %u" % (os.path.getsize(copyFile), size))
+	finally:
+		target.run(twopence.Command("rm -f %s" % remoteFile, stdout = None, stderr = None))
+		for name in (localFile, copyFile):
+			if os.path.exists(name):
+				os.unlink(name)
+
+	return result
+
+def benchChatLatency():
+	samples = []
+
+	# The pipe based plugins send an EOF on stdin once the chat's send
+	# buffer has been drained, so we use a new chat for each sample, and
+	# only time the exchange itself.
+	for i in range(iterations):
+		line = "ping%u" % i
+
+		chat = target.chat("read LINE; echo \"got $LINE\"")
+
+		t0 = time.time()
+		chat.send(line + "\n")
+		if not chat.expect("got " + line, timeout = 10):
+			raise Exception("did not receive \"got %s\" in chat" % line)
+		samples.append(time.time() - t0)
+
+		if not chat.wait():
+			raise Exception("chat command failed")
+
+	return timeSummary(samples)
+
+##########################################################
+# Run them all
+##########################################################
+results = {
+	"target":	targetSpec,
+	"timestamp":	int(time.time()),
+	"host":		platform.node(),
+	"iterations":	iterations,
+}
+errors = []
+
+def runBench(name, func, *args):
+	print "### BENCH: %s" % name
+	try:
+		value = func(*args)
+	except Exception as e:
+		print "### ERROR: %s" % e
+		errors.append("%s: %s" % (name, e))
+		value = None
+
+	print json.dumps(value, indent = 1, sort_keys = True)
+	return value
+
+results["command_latency"] = runBench("command round trip latency", benchCommandLatency)
+
+results["command_rate"] = []
+for n in concurrencyLevels:
+	results["command_rate"].append(runBench("commands/sec at concurrency %u" % n, benchCommandRate, n))
+
+results["transfer"] = []
+for size in transferSizes:
+	if size <= maxSize:
+		results["transfer"].append(runBench("inject/extract %s" % sizeName(size), benchTransfer, size))
+
+results["chat_latency"] = runBench("chat expect latency", benchChatLatency)
+
+results["errors"] = errors
+
+f = open(outputFile, "w")
+json.dump(results, f, indent = 1, sort_keys = True)
+f.write("\n")
+f.close()
+
+print
+print "Results written to %s" % outputFile
+if errors:
+	sys.exit(1)
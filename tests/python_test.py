@@ -261,6 +261,56 @@ except:
 	print "Good, command threw an exception as expected"
 testCaseReport()
 
+testCaseBegin("inject and extract files at the inline transfer limit")
+try:
+	# 16K is the largest file sent inline; one byte more must take the regular path
+	for size in (16384, 16385):
+		f = open("inline_orig", "wb")
+		f.write(os.urandom(size))
+		f.close()
+
+		target.inject("inline_orig", "/tmp/injected")
+		target.extract("/tmp/injected", "inline_copy")
+		rc = os.system("cmp inline_orig inline_copy")
+		if rc == 0:
+			print "Good, %u byte file survived the round trip" % size
+		else:
+			testCaseFail("%u byte file changed in transfer" % size)
+		os.remove("inline_copy")
+except:
+	testCaseException()
+if os.path.exists("inline_orig"):
+	os.remove("inline_orig")
+testCaseReport()
+
+testCaseBegin("transfer files that are larger than their size suggests")
+try:
+	# Files in /proc claim to be empty. Sending or receiving one that
+	# exceeds the inline limit must fall back to a regular transfer.
+	if not os.access("/proc/kallsyms", os.R_OK):
+		print "/proc/kallsyms not available, skipping"
+	else:
+		target.inject("/proc/kallsyms", "/tmp/injected")
+		target.extract("/tmp/injected", "kallsyms_copy")
+		rc = os.system("cmp /proc/kallsyms kallsyms_copy")
+		if rc != 0:
+			testCaseFail("injected /proc/kallsyms differs from the original")
+		os.remove("kallsyms_copy")
+
+		import hashlib
+
+		status = target.run("md5sum /proc/kallsyms", quiet = True)
+		if testCaseCheckStatus(status):
+			xfer = twopence.Transfer("/proc/kallsyms")
+			xstatus = target.recvfile(xfer)
+			if len(xstatus.buffer) <= 16384:
+				testCaseFail("extracted only %u bytes of /proc/kallsyms" % len(xstatus.buffer))
+			elif hashlib.md5(str(xstatus.buffer)).hexdigest() != str(status.stdout).split()[0]:
+				testCaseFail("extracted /proc/kallsyms differs from its contents")
+except:
+	testCaseException()
+testCaseReport()
+
 testCaseBegin("Verify twopence.Command attributes")
 try:
 	outbuf = bytearray();
@@ -486,6 +536,19 @@ except:
 	testCaseException()
 testCaseReport()
 
+testCaseBegin("command with large stdin and a slow reader")
+try:
+	# With flow control, the data is throttled while the command is sleeping
+	cmd = twopence.Command("sleep 2; wc -c", stdin = bytearray(8 * 1024 * 1024))
+	status = target.run(cmd)
+	if testCaseCheckStatus(status):
+		word = str(status.stdout).split()[0]
+		if int(word) != 8 * 1024 * 1024:
+			testCaseFail("command received wrong number of bytes (got %s, expected %u)" % (word, 8 * 1024 * 1024))
+except:
+	testCaseException()
+testCaseReport()
+
 testCaseBegin("command='/usr/bin/wc' with stdin connected to the output of a local command")
 try:
 	import subprocess
@@ -1128,5 +1191,187 @@ except:
 
 testCaseReport()
 
+testCaseBegin("Check streaming of command output")
+try:
+	stream = target.stream("echo one; sleep 1; echo two >&2")
+	chunks = []
+	for chunk in stream:
+		chunks.append(chunk)
+
+	output = "".join(chunks)
+	if output != "one\ntwo\n":
+		testCaseFail("unexpected output %s" % repr(output))
+	elif len(chunks) < 2:
+		testCaseFail("output was not streamed (got %d chunk(s))" % len(chunks))
+	testCaseCheckStatus(stream.status)
+except:
+	testCaseException()
+testCaseReport()
+
+testCaseBegin("Check batching of command output")
+try:
+	cmd = twopence.Command("seq 1 5000", quiet = True)
+	cmd.batchSize = 16384
+	cmd.batchDelay = 100000
+	status = target.run(cmd)
+
+	expect = "".join("%d\n" % i for i in range(1, 5001))
+	if str(status.stdout) != expect:
+		testCaseFail("batched output was garbled")
+	testCaseCheckStatus(status)
+except:
+	testCaseException()
+testCaseReport()
+
+
+testCaseBegin("Check file transfers on a separate bulk link")
+try:
+	bulkTarget = None
+	try:
+		bulkTarget = twopence.Target(targetSpec, bulkLink = True)
+	except:
+		print "Target does not support a bulk link, skipping"
+
+	if bulkTarget:
+		cmd = twopence.Command("sleep 1; echo done", background = True, quiet = True)
+		bulkTarget.run(cmd)
+
+		data = "x" * (4 * 1024 * 1024)
+		xfer = twopence.Transfer("/tmp/twopence-bulk", data = bytearray(data))
+		bulkTarget.sendfile(xfer)
+
+		xfer = twopence.Transfer("/tmp/twopence-bulk")
+		status = bulkTarget.recvfile(xfer)
+		if str(status.buffer) != data:
+			testCaseFail("file contents changed in transfer")
+
+		status = bulkTarget.wait(cmd)
+		testCaseCheckStatus(status)
+		if str(status.stdout) != "done\n":
+			testCaseFail("unexpected command output %s" % repr(str(status.stdout)))
+		bulkTarget.run("rm -f /tmp/twopence-bulk", quiet = True)
+except:
+	testCaseException()
+testCaseReport()
+
+testCaseBegin("Check transaction statistics")
+try:
+	status = target.run("echo hello; sleep 0.2", quiet = True)
+	testCaseCheckStatus(status)
+
+	stats = status.stats
+	for key in ("bytesSent", "bytesReceived", "packetsSent", "maxBytesQueued",
+		    "queueTime", "firstByteTime", "wallTime", "serverSpawnTime", "serverRunTime"):
+		if key not in stats:
+			testCaseFail("status.stats does not have %s" % key)
+
+	# Backends that do not collect statistics leave everything at 0
+	if stats["wallTime"] == 0:
+		print "Target does not report transaction statistics, skipping"
+	else:
+		if stats["bytesReceived"][1] != 6:
+			testCaseFail("expected 6 bytes on stdout, stats say %u" % stats["bytesReceived"][1])
+		if stats["wallTime"] < 200000:
+			testCaseFail("wall time of %u usec is too short" % stats["wallTime"])
+		if stats["serverRunTime"] > stats["wallTime"]:
+			testCaseFail("server run time exceeds wall time")
+		if stats["packetsSent"] == 0:
+			testCaseFail("stats do not count the request packet")
+except:
+	testCaseException()
+testCaseReport()
+
+testCaseBegin("Check server metrics")
+try:
+	metrics = None
+	try:
+		metrics = target.serverMetrics()
+	except:
+		print "Target does not report server metrics, skipping"
+
+	if metrics is not None:
+		for key in ("connections", "transactions-total", "packets-in.command", "poll-iterations"):
+			if key not in metrics:
+				testCaseFail("server metrics do not include %s" % key)
+		if metrics.get("connections", 0) < 1:
+			testCaseFail("server reports no active connections")
+except:
+	testCaseException()
+testCaseReport()
+
+testCaseBegin("Run a command and a file transfer through the multiplexer")
+try:
+	import subprocess, tempfile, time
+
+	muxPath = os.environ.get("TWOPENCE_MUX_PATH")
+	if not muxPath:
+		for dir in os.environ.get("PATH", "").split(":") + ["../shell"]:
+			for name in ("twopence_mux", "mux"):
+				if os.access(os.path.join(dir, name), os.X_OK) and not muxPath:
+					muxPath = os.path.join(dir, name)
+
+	if not muxPath or targetSpec.startswith("ssh:"):
+		print "Multiplexer not available for this target, skipping"
+	else:
+		muxDir = tempfile.mkdtemp()
+		muxSocket = os.path.join(muxDir, "mux.sock")
+		mux = subprocess.Popen([muxPath, "--foreground", "--socket", muxSocket, targetSpec])
+		try:
+			for i in range(50):
+				if os.path.exists(muxSocket):
+					break
+				time.sleep(0.1)
+
+			muxTarget = twopence.Target("virtio:" + muxSocket)
+
+			status = muxTarget.run("echo relayed", quiet = True)
+			testCaseCheckStatus(status)
+			if str(status.stdout) != "relayed\n":
+				testCaseFail("unexpected command output %s" % repr(str(status.stdout)))
+
+			data = "y" * 100000
+			muxTarget.sendfile(twopence.Transfer("/tmp/twopence-mux", data = bytearray(data)))
+			status = muxTarget.recvfile(twopence.Transfer("/tmp/twopence-mux"))
+			if str(status.buffer) != data:
+				testCaseFail("file contents changed in transfer")
+
+			# A failed transfer must not leave the multiplexer in a bad state
+			try:
+				muxTarget.sendfile(twopence.Transfer("/nonexistent/dir/file", data = bytearray("z")))
+				testCaseFail("upload to non-existent directory did not fail")
+			except:
+				pass
+
+			status = muxTarget.run("rm -f /tmp/twopence-mux", quiet = True)
+			testCaseCheckStatus(status)
+
+			# A client that does not support all the protocol features
+			# used on the server link must be turned away
+			import socket, struct
+
+			for features, expectReply in ((0xffffffff, True), (0, False)):
+				sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+				sock.settimeout(10)
+				sock.connect(muxSocket)
+				sock.sendall(struct.pack("!BBHHHBBHI", ord('h'), 0, 0, 0, 16, 3, 0, 0, features))
+				reply = sock.recv(8)
+				sock.close()
+				if expectReply and reply[:1] != 'h':
+					testCaseFail("multiplexer did not answer a client with features 0x%x" % features)
+				if not expectReply and reply != "":
+					testCaseFail("multiplexer accepted a client with features 0x%x" % features)
+
+			# ... and the multiplexer keeps serving everyone else
+			status = muxTarget.run("echo still here", quiet = True)
+			testCaseCheckStatus(status)
+		finally:
+			mux.terminate()
+			mux.wait()
+			if os.path.exists(muxSocket):
+				os.remove(muxSocket)
+			os.rmdir(muxDir)
+except:
+	testCaseException()
+testCaseReport()
 
 testSuiteExit()
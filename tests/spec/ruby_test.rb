@@ -56,6 +56,16 @@ describe Twopence::Target do
     end
   end
 
+  describe "#test_and_stream_results" do
+    it "passes output to the block as it arrives" do
+      chunks = []
+      rc, major, minor = @target.test_and_stream_results('echo one; sleep 1; echo two >&2') { |chunk| chunks << chunk }
+      expect(rc).to eq(0); expect(major).to eq(0); expect(minor).to eq(0)
+      expect(chunks.join).to eq("one\ntwo\n")
+      expect(chunks.length).to be >= 2
+    end
+  end
+
   describe "#test_and_store_results_separately" do
     it "stores stdout and stderr in different buffers" do
       out, err, rc, major, minor = @target.test_and_store_results_separately('echo good; echo bad >&2; echo good again')